@@ -6,8 +6,8 @@
 #include "camera.h"
 #include "shader.h"
 #include "mesh.h"
-
-#include <sys/stat.h>
+
+#include <sys/stat.h>
 
 Skeleton::Skeleton()
 {
@@ -307,23 +307,16 @@ bool Animation::writeABIN(const char* filename)
 
 bool Animation::loadABIN(const char* filename)
 {
-	FILE *f;
 	assert(filename);
 
-	struct stat stbuffer;
-
-	stat(filename, &stbuffer);
-	f = fopen(filename, "rb");
-	if (f == NULL)
+	//it could be prefetched already (see file_io.h)
+	std::vector<unsigned char> buffer;
+	if (!readFileBin(filename, buffer))
 		return false;
-
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data, size, 1, f);
-	fclose(f);
+	char* data = (char*)buffer.data();
 
 	//watermark
-	if (memcmp(data, "ABIN", 4) != 0)
+	if (buffer.size() < 4 + sizeof(sAnimHeader) || memcmp(data, "ABIN", 4) != 0)
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
 		return false;
@@ -362,7 +355,6 @@ bool Animation::loadABIN(const char* filename)
 	for (int i = 0; i < skeleton.num_bones; ++i)
 		skeleton.bones_by_name[ skeleton.bones[i].name ] = i;
 
-	delete[] data;
 	return true;
 }
 
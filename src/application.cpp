@@ -9,6 +9,12 @@
 #include "includes.h"
 #include "prefab.h"
 #include "gltf_loader.h"
+#include "mipmaps.h"
+#include "texture_streaming.h"
+#include "texture_arrays.h"
+#include "jobs.h"
+#include "file_io.h"
+#include "uniform_blocks.h"
 #include "renderer.h"
 
 #include <cmath>
@@ -16,6 +22,7 @@
 #include <cstdio>
 
 #include "shadowAtlas.h"
+#include "bvh.h"
 
 
 Application* Application::instance = nullptr;
@@ -310,12 +317,90 @@ void Application::renderDebugGUI(void)
 			ImGui::Checkbox("Use Emissive Texture", &renderer->useEmissive);
 			ImGui::Checkbox("Use Occlusion", &renderer->useOcclusion);
 			ImGui::Checkbox("Use Normalmap", &renderer->useNormalMap);
+			ImGui::Checkbox("Use Cluster Culling", &renderer->useClusterCulling);
 		}
 		ImGui::Separator();
 		
 		
 	}
 
+	if (ImGui::CollapsingHeader("Memory")) {
+		size_t mesh_ram = 0, mesh_vram = 0;
+		Mesh::getTotalMemory(mesh_ram, mesh_vram);
+		ImGui::Text("Meshes RAM: %d KB VRAM: %d KB", (int)(mesh_ram / 1024), (int)(mesh_vram / 1024));
+		int budget_mb = (int)(Mesh::memory_budget / (1024 * 1024));
+		if (ImGui::SliderInt("Mesh budget (MB)", &budget_mb, 0, 4096))
+			Mesh::memory_budget = (size_t)budget_mb * 1024 * 1024;
+		ImGui::Checkbox("Release mesh RAM", &Mesh::release_cpu_data);
+		ImGui::Checkbox("Keep quantized streams", &Mesh::keep_quantized_streams);
+		if (ImGui::Button("Mesh memory report"))
+			Mesh::printMemoryReport();
+
+		size_t texture_ram = 0, texture_vram = 0;
+		Texture::getTotalMemory(texture_ram, texture_vram);
+		ImGui::Text("Textures RAM: %d KB VRAM: %d KB", (int)(texture_ram / 1024), (int)(texture_vram / 1024));
+		int texture_budget_mb = (int)(Texture::memory_budget / (1024 * 1024));
+		if (ImGui::SliderInt("Texture budget (MB)", &texture_budget_mb, 0, 4096))
+			Texture::memory_budget = (size_t)texture_budget_mb * 1024 * 1024;
+		if (ImGui::Button("Texture memory report"))
+			Texture::printMemoryReport();
+	}
+
+	if (ImGui::CollapsingHeader("Loading")) {
+		ImGui::Checkbox("Use cooked prefabs", &GTR::Prefab::use_cooked);
+		ImGui::Checkbox("Compress textures (BCn)", &Texture::use_compression);
+		ImGui::Text("Textures pending decode: %d", TextureDecodePool::getNumPending());
+		TaskManager& foreground = TaskManager::foreground;
+		ImGui::SliderFloat("Main thread tasks (ms)", &foreground.budget_ms, 0.0f, 16.0f);
+		ImGui::Text("Main thread tasks: %d in %.2f ms, pending: %d high, %d normal, %d low", foreground.last_executed, foreground.last_time_ms,
+			foreground.getNumPending(TASK_PRIORITY_HIGH), foreground.getNumPending(TASK_PRIORITY_NORMAL), foreground.getNumPending(TASK_PRIORITY_LOW));
+		if (ImGui::Button("glTF accessors benchmark"))
+			benchmarkGLTFAccessors();
+		if (ImGui::Button("Mipmaps benchmark"))
+			benchmarkMipmaps();
+		if (ImGui::TreeNode("Texture streaming"))
+		{
+			TextureStreamer::renderInMenu();
+			ImGui::TreePop();
+		}
+		if (ImGui::TreeNode("Jobs"))
+		{
+			JobSystem::renderInMenu();
+			ImGui::TreePop();
+		}
+		if (ImGui::TreeNode("File reads"))
+		{
+			FileIO::renderInMenu();
+			ImGui::TreePop();
+		}
+		if (ImGui::TreeNode("Texture arrays"))
+		{
+			TextureArrayPacker::renderInMenu();
+			ImGui::TreePop();
+		}
+		if (ImGui::TreeNode("Deduplication"))
+		{
+			scene->dedup.renderInMenu();
+			ImGui::TreePop();
+		}
+	}
+
+	if (ImGui::CollapsingHeader("Frame stages")) {
+		renderer->frame_graph.renderInMenu();
+		ImGui::Checkbox("Skip unchanged uniforms", &Shader::use_uniform_cache);
+		ImGui::Text("Uniforms last frame: %d uploaded (%d set)", Shader::last_frame_uniform_uploads, Shader::last_frame_uniform_requests);
+		UniformBlocks::renderInMenu();
+		if (ImGui::Button("Uniforms benchmark"))
+			benchmarkUniforms();
+	}
+
+	if (ImGui::CollapsingHeader("Collisions")) {
+		ImGui::Checkbox("Use coldet", &Mesh::use_coldet);
+		if (ImGui::Button("Picking benchmark"))
+			for (auto it : Mesh::sMeshesLoaded)
+				benchmarkPicking(it.second);
+	}
+
 	ImGui::Checkbox("Wireframe", &render_wireframe);
 	ImGui::Checkbox("Show Atlas", &renderer->showAtlas);
 	ImGui::Checkbox("Use PBR", &renderer->usePBR);
@@ -0,0 +1,717 @@
+#include "bvh.h"
+#include "mesh.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+
+#ifdef BVH_USE_SSE
+	#include <emmintrin.h>
+#endif
+
+#define BVH_NUM_BINS 12
+#define BVH_MAX_DEPTH 128
+
+MeshBVH::MeshBVH()
+{
+	build_time = 0;
+}
+
+static float surfaceArea(const Vector3& min, const Vector3& max)
+{
+	Vector3 size = max - min;
+	if (size.x < 0) //empty
+		return 0;
+	return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+static float axisValue(const Vector3& v, int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+bool MeshBVH::build(const std::vector<Vector3>& triangles)
+{
+	nodes.clear();
+	packets.clear();
+	triangle_packet.clear();
+
+	int num_triangles = (int)triangles.size() / 3;
+	if (!num_triangles)
+		return false;
+
+	long time = getTime();
+
+	std::vector<int> ids(num_triangles);
+	std::vector<Vector3> centroids(num_triangles);
+	for (int i = 0; i < num_triangles; ++i)
+	{
+		ids[i] = i;
+		centroids[i] = (triangles[i * 3] + triangles[i * 3 + 1] + triangles[i * 3 + 2]) * (1.0f / 3.0f);
+	}
+
+	nodes.reserve(num_triangles / 2 + 1);
+	packets.reserve(num_triangles / 2 + 1);
+	triangle_packet.resize(num_triangles);
+	buildNode(ids, 0, num_triangles, triangles, centroids, 0);
+
+	build_time = getTime() - time;
+	return true;
+}
+
+int MeshBVH::buildNode(std::vector<int>& ids, int start, int end, const std::vector<Vector3>& triangles, const std::vector<Vector3>& centroids, int depth)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(sBVHNode());
+
+	//bounds of the triangles and of their centroids
+	Vector3 min_pos(3.4e+38F, 3.4e+38F, 3.4e+38F);
+	Vector3 max_pos(-3.4e+38F, -3.4e+38F, -3.4e+38F);
+	Vector3 min_centroid = min_pos;
+	Vector3 max_centroid = max_pos;
+	for (int i = start; i < end; ++i)
+	{
+		int id = ids[i];
+		for (int k = 0; k < 3; ++k)
+		{
+			min_pos.setMin(triangles[id * 3 + k]);
+			max_pos.setMax(triangles[id * 3 + k]);
+		}
+		min_centroid.setMin(centroids[id]);
+		max_centroid.setMax(centroids[id]);
+	}
+	memcpy(nodes[index].min, min_pos.v, sizeof(float) * 3);
+	memcpy(nodes[index].max, max_pos.v, sizeof(float) * 3);
+
+	int count = end - start;
+	if (count <= BVH_LEAF_SIZE)
+	{
+		sBVHPacket packet;
+		memset(&packet, 0, sizeof(packet));
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			packet.triangles[lane] = -1;
+			if (lane >= count)
+				continue; //degenerated, never hit
+			int id = ids[start + lane];
+			const Vector3& a = triangles[id * 3];
+			Vector3 e1 = triangles[id * 3 + 1] - a;
+			Vector3 e2 = triangles[id * 3 + 2] - a;
+			for (int k = 0; k < 3; ++k)
+			{
+				packet.v0[k][lane] = a.v[k];
+				packet.e1[k][lane] = e1.v[k];
+				packet.e2[k][lane] = e2.v[k];
+			}
+			packet.triangles[lane] = id;
+			triangle_packet[id] = (int)packets.size() * 4 + lane;
+		}
+		nodes[index].first = (int)packets.size();
+		nodes[index].count = count;
+		packets.push_back(packet);
+		return index;
+	}
+
+	//binned SAH, test every axis
+	int best_axis = -1;
+	int best_split = 0;
+	float best_cost = 3.4e+38F;
+	Vector3 extent = max_centroid - min_centroid;
+	if (depth < BVH_MAX_DEPTH / 2)
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float axis_extent = axisValue(extent, axis);
+			if (axis_extent <= 0)
+				continue;
+			float scale = BVH_NUM_BINS / axis_extent;
+			float axis_min = axisValue(min_centroid, axis);
+
+			int bin_count[BVH_NUM_BINS] = {};
+			Vector3 bin_min[BVH_NUM_BINS];
+			Vector3 bin_max[BVH_NUM_BINS];
+			for (int b = 0; b < BVH_NUM_BINS; ++b)
+			{
+				bin_min[b].set(3.4e+38F, 3.4e+38F, 3.4e+38F);
+				bin_max[b].set(-3.4e+38F, -3.4e+38F, -3.4e+38F);
+			}
+			for (int i = start; i < end; ++i)
+			{
+				int id = ids[i];
+				int b = std::min(BVH_NUM_BINS - 1, (int)((axisValue(centroids[id], axis) - axis_min) * scale));
+				bin_count[b]++;
+				for (int k = 0; k < 3; ++k)
+				{
+					bin_min[b].setMin(triangles[id * 3 + k]);
+					bin_max[b].setMax(triangles[id * 3 + k]);
+				}
+			}
+
+			//sweep from the right to know the area of every right side
+			float right_area[BVH_NUM_BINS];
+			int right_count[BVH_NUM_BINS];
+			Vector3 acc_min(3.4e+38F, 3.4e+38F, 3.4e+38F);
+			Vector3 acc_max(-3.4e+38F, -3.4e+38F, -3.4e+38F);
+			int acc_count = 0;
+			for (int b = BVH_NUM_BINS - 1; b > 0; --b)
+			{
+				acc_min.setMin(bin_min[b]);
+				acc_max.setMax(bin_max[b]);
+				acc_count += bin_count[b];
+				right_area[b] = surfaceArea(acc_min, acc_max);
+				right_count[b] = acc_count;
+			}
+
+			acc_min.set(3.4e+38F, 3.4e+38F, 3.4e+38F);
+			acc_max.set(-3.4e+38F, -3.4e+38F, -3.4e+38F);
+			acc_count = 0;
+			for (int b = 0; b < BVH_NUM_BINS - 1; ++b)
+			{
+				acc_min.setMin(bin_min[b]);
+				acc_max.setMax(bin_max[b]);
+				acc_count += bin_count[b];
+				if (!acc_count || !right_count[b + 1])
+					continue;
+				float cost = surfaceArea(acc_min, acc_max) * acc_count + right_area[b + 1] * right_count[b + 1];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = b + 1;
+				}
+			}
+		}
+
+	int mid = start;
+	int axis = 0;
+	if (best_axis != -1)
+	{
+		axis = best_axis;
+		float scale = BVH_NUM_BINS / axisValue(extent, axis);
+		float axis_min = axisValue(min_centroid, axis);
+		int split = best_split;
+		mid = (int)(std::partition(ids.begin() + start, ids.begin() + end, [&](int id) {
+			return std::min(BVH_NUM_BINS - 1, (int)((axisValue(centroids[id], axis) - axis_min) * scale)) < split;
+		}) - ids.begin());
+	}
+
+	//all centroids together (or too deep), split by the median of the largest axis
+	if (mid == start || mid == end)
+	{
+		axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		mid = (start + end) / 2;
+		std::nth_element(ids.begin() + start, ids.begin() + mid, ids.begin() + end, [&](int a, int b) {
+			return axisValue(centroids[a], axis) < axisValue(centroids[b], axis);
+		});
+	}
+
+	buildNode(ids, start, mid, triangles, centroids, depth + 1);
+	int right = buildNode(ids, mid, end, triangles, centroids, depth + 1);
+	nodes[index].first = right;
+	nodes[index].count = -(axis + 1);
+	return index;
+}
+
+//returns the entry distance or -1 if the box is missed (or farther than max_dist)
+#ifdef BVH_USE_SSE
+static inline float rayBox(const sBVHNode& node, const __m128& origin, const __m128& inv_dir, float max_dist)
+{
+	static const __m128 xyz_mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+	static const __m128 neg_inf = _mm_set1_ps(-3.4e+38F);
+	static const __m128 pos_inf = _mm_set1_ps(3.4e+38F);
+
+	__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.min), origin), inv_dir);
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.max), origin), inv_dir);
+	__m128 tmin = _mm_min_ps(t0, t1);
+	__m128 tmax = _mm_max_ps(t0, t1);
+	//the fourth lane is not a coordinate
+	tmin = _mm_or_ps(_mm_and_ps(xyz_mask, tmin), _mm_andnot_ps(xyz_mask, neg_inf));
+	tmax = _mm_or_ps(_mm_and_ps(xyz_mask, tmax), _mm_andnot_ps(xyz_mask, pos_inf));
+	tmin = _mm_max_ps(tmin, _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(2, 1, 0, 3)));
+	tmin = _mm_max_ps(tmin, _mm_shuffle_ps(tmin, tmin, _MM_SHUFFLE(1, 0, 3, 2)));
+	tmax = _mm_min_ps(tmax, _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(2, 1, 0, 3)));
+	tmax = _mm_min_ps(tmax, _mm_shuffle_ps(tmax, tmax, _MM_SHUFFLE(1, 0, 3, 2)));
+	float near_dist = std::max(_mm_cvtss_f32(tmin), 0.0f);
+	float far_dist = _mm_cvtss_f32(tmax);
+	if (far_dist < near_dist || near_dist > max_dist)
+		return -1;
+	return near_dist;
+}
+#else
+static inline float rayBox(const sBVHNode& node, const float* origin, const float* inv_dir, float max_dist)
+{
+	float near_dist = 0;
+	float far_dist = 3.4e+38F;
+	for (int k = 0; k < 3; ++k)
+	{
+		float t0 = (node.min[k] - origin[k]) * inv_dir[k];
+		float t1 = (node.max[k] - origin[k]) * inv_dir[k];
+		near_dist = std::max(near_dist, std::min(t0, t1));
+		far_dist = std::min(far_dist, std::max(t0, t1));
+	}
+	if (far_dist < near_dist || near_dist > max_dist)
+		return -1;
+	return near_dist;
+}
+#endif
+
+//Moller-Trumbore against the four triangles of the packet, returns the lane of the closest hit or -1
+static inline int rayPacket(const sBVHPacket& p, const Vector3& o, const Vector3& d, float max_dist, float& out_t, float& out_u, float& out_v)
+{
+	float t[4], u[4], v[4];
+	int mask = 0;
+#ifdef BVH_USE_SSE
+	__m128 ox = _mm_set1_ps(o.x), oy = _mm_set1_ps(o.y), oz = _mm_set1_ps(o.z);
+	__m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+	__m128 e1x = _mm_loadu_ps(p.e1[0]), e1y = _mm_loadu_ps(p.e1[1]), e1z = _mm_loadu_ps(p.e1[2]);
+	__m128 e2x = _mm_loadu_ps(p.e2[0]), e2y = _mm_loadu_ps(p.e2[1]), e2z = _mm_loadu_ps(p.e2[2]);
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	__m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(p.v0[0]));
+	__m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(p.v0[1]));
+	__m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(p.v0[2]));
+	__m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+	__m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+	__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 valid = _mm_cmpneq_ps(det, zero);
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(uu, zero));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(vv, zero));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.0f)));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(tt, zero));
+	valid = _mm_and_ps(valid, _mm_cmplt_ps(tt, _mm_set1_ps(max_dist)));
+	mask = _mm_movemask_ps(valid);
+	if (!mask)
+		return -1;
+	_mm_storeu_ps(t, tt);
+	_mm_storeu_ps(u, uu);
+	_mm_storeu_ps(v, vv);
+#else
+	for (int lane = 0; lane < 4; ++lane)
+	{
+		Vector3 e1(p.e1[0][lane], p.e1[1][lane], p.e1[2][lane]);
+		Vector3 e2(p.e2[0][lane], p.e2[1][lane], p.e2[2][lane]);
+		Vector3 pvec = d.cross(e2);
+		float det = e1.dot(pvec);
+		if (det == 0.0f)
+			continue;
+		float inv_det = 1.0f / det;
+		Vector3 tvec = o - Vector3(p.v0[0][lane], p.v0[1][lane], p.v0[2][lane]);
+		u[lane] = tvec.dot(pvec) * inv_det;
+		Vector3 qvec = tvec.cross(e1);
+		v[lane] = d.dot(qvec) * inv_det;
+		t[lane] = e2.dot(qvec) * inv_det;
+		if (u[lane] >= 0 && v[lane] >= 0 && u[lane] + v[lane] <= 1 && t[lane] >= 0 && t[lane] < max_dist)
+			mask |= 1 << lane;
+	}
+	if (!mask)
+		return -1;
+#endif
+
+	int best = -1;
+	for (int lane = 0; lane < 4; ++lane)
+		if ((mask & (1 << lane)) && (best == -1 || t[lane] < t[best]))
+			best = lane;
+	out_t = t[best];
+	out_u = u[best];
+	out_v = v[best];
+	return best;
+}
+
+bool MeshBVH::testRay(const Vector3& origin, const Vector3& direction, sBVHHit& hit, float max_dist, bool any_hit) const
+{
+	if (nodes.empty())
+		return false;
+
+	//avoid divisions by zero keeping the sign
+	float inv[3];
+	for (int k = 0; k < 3; ++k)
+		inv[k] = fabs(direction.v[k]) > 1e-30f ? 1.0f / direction.v[k] : (direction.v[k] < 0 ? -1e30f : 1e30f);
+
+#ifdef BVH_USE_SSE
+	__m128 o4 = _mm_setr_ps(origin.x, origin.y, origin.z, 0);
+	__m128 inv4 = _mm_setr_ps(inv[0], inv[1], inv[2], 0);
+#else
+	const float* o4 = origin.v;
+	const float* inv4 = inv;
+#endif
+
+	float closest = max_dist;
+	bool found = false;
+	int stack[BVH_MAX_DEPTH];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size)
+	{
+		int index = stack[--stack_size];
+		const sBVHNode& node = nodes[index];
+		if (rayBox(node, o4, inv4, closest) < 0)
+			continue;
+
+		if (node.count > 0) //leaf
+		{
+			const sBVHPacket& packet = packets[node.first];
+			float t, u, v;
+			int lane = rayPacket(packet, origin, direction, closest, t, u, v);
+			if (lane == -1)
+				continue;
+			closest = t;
+			found = true;
+			hit.distance = t;
+			hit.triangle = packet.triangles[lane];
+			hit.u = u;
+			hit.v = v;
+			if (any_hit)
+				return true;
+			continue;
+		}
+
+		//visit first the child closer to the origin
+		int axis = -node.count - 1;
+		if (direction.v[axis] > 0)
+		{
+			stack[stack_size++] = node.first;
+			stack[stack_size++] = index + 1;
+		}
+		else
+		{
+			stack[stack_size++] = index + 1;
+			stack[stack_size++] = node.first;
+		}
+	}
+
+	return found;
+}
+
+int MeshBVH::testRayPacket(sBVHRayPacket& packet, bool any_hit) const
+{
+	if (nodes.empty() || !packet.count)
+		return 0;
+	assert(packet.count <= BVH_RAY_PACKET_SIZE);
+
+#ifdef BVH_USE_SSE
+	__m128 o4[BVH_RAY_PACKET_SIZE];
+	__m128 inv4[BVH_RAY_PACKET_SIZE];
+#else
+	float inv4[BVH_RAY_PACKET_SIZE][3];
+#endif
+	for (int r = 0; r < packet.count; ++r)
+	{
+		const Vector3& d = packet.direction[r];
+		float inv[3];
+		for (int k = 0; k < 3; ++k)
+			inv[k] = fabs(d.v[k]) > 1e-30f ? 1.0f / d.v[k] : (d.v[k] < 0 ? -1e30f : 1e30f);
+#ifdef BVH_USE_SSE
+		o4[r] = _mm_setr_ps(packet.origin[r].x, packet.origin[r].y, packet.origin[r].z, 0);
+		inv4[r] = _mm_setr_ps(inv[0], inv[1], inv[2], 0);
+#else
+		memcpy(inv4[r], inv, sizeof(inv));
+#endif
+		packet.found[r] = false;
+	}
+
+	unsigned int active = (1u << packet.count) - 1;
+	int stack[BVH_MAX_DEPTH];
+	unsigned int stack_mask[BVH_MAX_DEPTH];
+	int stack_size = 0;
+	stack[stack_size] = 0;
+	stack_mask[stack_size++] = active;
+
+	while (stack_size)
+	{
+		--stack_size;
+		int index = stack[stack_size];
+		unsigned int mask = stack_mask[stack_size] & active;
+		if (!mask)
+			continue;
+		const sBVHNode& node = nodes[index];
+
+		//which rays reach this node
+		unsigned int node_mask = 0;
+		for (int r = 0; r < packet.count; ++r)
+			if ((mask & (1u << r)))
+			{
+#ifdef BVH_USE_SSE
+				if (rayBox(node, o4[r], inv4[r], packet.max_dist[r]) >= 0)
+#else
+				if (rayBox(node, packet.origin[r].v, inv4[r], packet.max_dist[r]) >= 0)
+#endif
+					node_mask |= 1u << r;
+			}
+		if (!node_mask)
+			continue;
+
+		if (node.count > 0)
+		{
+			const sBVHPacket& triangles = packets[node.first];
+			for (int r = 0; r < packet.count; ++r)
+			{
+				if (!(node_mask & (1u << r)))
+					continue;
+				float t, u, v;
+				int lane = rayPacket(triangles, packet.origin[r], packet.direction[r], packet.max_dist[r], t, u, v);
+				if (lane == -1)
+					continue;
+				packet.max_dist[r] = t;
+				packet.found[r] = true;
+				packet.hit[r].distance = t;
+				packet.hit[r].triangle = triangles.triangles[lane];
+				packet.hit[r].u = u;
+				packet.hit[r].v = v;
+				if (any_hit)
+					active &= ~(1u << r); //this ray is done
+			}
+			continue;
+		}
+
+		//near child first, using the direction of the first ray as they should be coherent
+		int first_ray = 0;
+		while (!(node_mask & (1u << first_ray)))
+			first_ray++;
+		int axis = -node.count - 1;
+		bool left_first = packet.direction[first_ray].v[axis] > 0;
+		stack[stack_size] = left_first ? node.first : index + 1;
+		stack_mask[stack_size++] = node_mask;
+		stack[stack_size] = left_first ? index + 1 : node.first;
+		stack_mask[stack_size++] = node_mask;
+	}
+
+	int num_hits = 0;
+	for (int r = 0; r < packet.count; ++r)
+		num_hits += packet.found[r] ? 1 : 0;
+	return num_hits;
+}
+
+//from Real-Time Collision Detection (Ericson)
+static Vector3 closestPointOnTriangle(const Vector3& p, const Vector3& a, const Vector3& b, const Vector3& c)
+{
+	Vector3 ab = b - a;
+	Vector3 ac = c - a;
+	Vector3 ap = p - a;
+	float d1 = ab.dot(ap);
+	float d2 = ac.dot(ap);
+	if (d1 <= 0 && d2 <= 0)
+		return a;
+
+	Vector3 bp = p - b;
+	float d3 = ab.dot(bp);
+	float d4 = ac.dot(bp);
+	if (d3 >= 0 && d4 <= d3)
+		return b;
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0)
+		return a + ab * (d1 / (d1 - d3));
+
+	Vector3 cp = p - c;
+	float d5 = ab.dot(cp);
+	float d6 = ac.dot(cp);
+	if (d6 >= 0 && d5 <= d6)
+		return c;
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0)
+		return a + ac * (d2 / (d2 - d6));
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+	float denom = 1.0f / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+bool MeshBVH::testSphere(const Vector3& center, float radius, Vector3& collision, int& triangle) const
+{
+	if (nodes.empty())
+		return false;
+
+	float best_dist2 = radius * radius;
+	bool found = false;
+	int stack[BVH_MAX_DEPTH];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size)
+	{
+		int index = stack[--stack_size];
+		const sBVHNode& node = nodes[index];
+
+		//distance from the center to the box
+		float dist2 = 0;
+		for (int k = 0; k < 3; ++k)
+		{
+			float v = center.v[k];
+			if (v < node.min[k])
+				dist2 += (node.min[k] - v) * (node.min[k] - v);
+			else if (v > node.max[k])
+				dist2 += (v - node.max[k]) * (v - node.max[k]);
+		}
+		if (dist2 > best_dist2)
+			continue;
+
+		if (node.count > 0)
+		{
+			const sBVHPacket& packet = packets[node.first];
+			for (int lane = 0; lane < node.count; ++lane)
+			{
+				Vector3 a(packet.v0[0][lane], packet.v0[1][lane], packet.v0[2][lane]);
+				Vector3 b = a + Vector3(packet.e1[0][lane], packet.e1[1][lane], packet.e1[2][lane]);
+				Vector3 c = a + Vector3(packet.e2[0][lane], packet.e2[1][lane], packet.e2[2][lane]);
+				Vector3 point = closestPointOnTriangle(center, a, b, c);
+				Vector3 diff = point - center;
+				float d2 = diff.dot(diff);
+				if (d2 > best_dist2)
+					continue;
+				best_dist2 = d2;
+				collision = point;
+				triangle = packet.triangles[lane];
+				found = true;
+			}
+			continue;
+		}
+
+		stack[stack_size++] = node.first;
+		stack[stack_size++] = index + 1;
+	}
+
+	return found;
+}
+
+void MeshBVH::getTriangle(int triangle, Vector3& a, Vector3& b, Vector3& c) const
+{
+	assert(triangle >= 0 && triangle < triangle_packet.size());
+	int packet_lane = triangle_packet[triangle];
+	const sBVHPacket& packet = packets[packet_lane / 4];
+	int lane = packet_lane % 4;
+	a.set(packet.v0[0][lane], packet.v0[1][lane], packet.v0[2][lane]);
+	b = a + Vector3(packet.e1[0][lane], packet.e1[1][lane], packet.e1[2][lane]);
+	c = a + Vector3(packet.e2[0][lane], packet.e2[1][lane], packet.e2[2][lane]);
+}
+
+size_t MeshBVH::getMemory() const
+{
+	return nodes.capacity() * sizeof(sBVHNode) + packets.capacity() * sizeof(sBVHPacket) + triangle_packet.capacity() * sizeof(int);
+}
+
+MeshBVH* MeshBVH::fromMesh(Mesh* mesh)
+{
+	if (!mesh->requireCPUData())
+		return NULL;
+
+	std::vector<Vector3> triangles;
+	bool indexed = mesh->m_indices.size() > 0;
+	int num = indexed ? (int)mesh->m_indices.size() : (int)(mesh->interleaved.size() ? mesh->interleaved.size() : mesh->vertices.size());
+	num -= num % 3;
+	triangles.resize(num);
+	for (int i = 0; i < num; ++i)
+	{
+		unsigned int index = indexed ? mesh->m_indices[i] : i;
+		triangles[i] = mesh->interleaved.size() ? mesh->interleaved[index].vertex : mesh->vertices[index];
+	}
+
+	MeshBVH* bvh = new MeshBVH();
+	if (!bvh->build(triangles))
+	{
+		delete bvh;
+		return NULL;
+	}
+	return bvh;
+}
+
+static float randomFloat()
+{
+	return rand() / (float)RAND_MAX;
+}
+
+void benchmarkPicking(Mesh* mesh, int num_rays)
+{
+	if (!mesh || !mesh->requireCPUData())
+		return;
+
+	//rays from a sphere around the mesh to random points of its bounding box
+	std::vector<Vector3> origins(num_rays);
+	std::vector<Vector3> directions(num_rays);
+	srand(1234);
+	float radius = (float)mesh->box.halfsize.length() * 2.0f + 0.001f;
+	for (int i = 0; i < num_rays; ++i)
+	{
+		Vector3 dir(randomFloat() * 2 - 1, randomFloat() * 2 - 1, randomFloat() * 2 - 1);
+		if (dir.length() < 0.001f)
+			dir.set(0, 1, 0);
+		dir.normalize();
+		origins[i] = mesh->box.center + dir * radius;
+		Vector3 target = mesh->box.center + Vector3((randomFloat() * 2 - 1) * mesh->box.halfsize.x, (randomFloat() * 2 - 1) * mesh->box.halfsize.y, (randomFloat() * 2 - 1) * mesh->box.halfsize.z);
+		directions[i] = target - origins[i];
+		directions[i].normalize();
+	}
+
+	Matrix44 model;
+	Vector3 collision, normal;
+	bool use_coldet = Mesh::use_coldet;
+
+	//coldet
+	Mesh::use_coldet = true;
+	long time = getTime();
+	mesh->createCollisionModel();
+	long coldet_build = getTime() - time;
+	std::vector<Vector3> coldet_hits(num_rays);
+	std::vector<bool> coldet_hit(num_rays);
+	time = getTime();
+	for (int i = 0; i < num_rays; ++i)
+	{
+		coldet_hit[i] = mesh->testRayCollision(model, origins[i], directions[i], collision, normal);
+		coldet_hits[i] = collision;
+	}
+	long coldet_time = getTime() - time;
+
+	//bvh
+	Mesh::use_coldet = false;
+	time = getTime();
+	bool has_bvh = mesh->createBVH();
+	long bvh_build = getTime() - time;
+	if (!has_bvh) //empty mesh or still building in background
+	{
+		Mesh::use_coldet = use_coldet;
+		std::cout << "Picking benchmark: " << mesh->name << " has no BVH yet" << std::endl;
+		return;
+	}
+	int num_hits = 0;
+	int mismatches = 0;
+	time = getTime();
+	for (int i = 0; i < num_rays; ++i)
+	{
+		bool hit = mesh->testRayCollision(model, origins[i], directions[i], collision, normal);
+		num_hits += hit ? 1 : 0;
+		if (hit != coldet_hit[i] || (hit && collision.distance(coldet_hits[i]) > radius * 0.001f))
+			mismatches++;
+	}
+	long bvh_time = getTime() - time;
+
+	//any hit
+	time = getTime();
+	sBVHHit bvh_hit;
+	for (int i = 0; i < num_rays; ++i)
+		mesh->bvh->testRay(origins[i], directions[i], bvh_hit, 3.4e+38F, true);
+	long any_time = getTime() - time;
+
+	Mesh::use_coldet = use_coldet;
+
+	std::cout << "Picking benchmark: " << mesh->name << " (" << mesh->getNumIndices() / 3 + (mesh->getNumIndices() ? 0 : mesh->getNumVertices() / 3) << " tris, " << num_rays << " rays, " << num_hits << " hits)" << std::endl;
+	std::cout << "\t coldet: build " << coldet_build << "ms, rays " << coldet_time << "ms" << std::endl;
+	std::cout << "\t BVH: build " << bvh_build << "ms, rays " << bvh_time << "ms, any hit " << any_time << "ms, " << mesh->bvh->nodes.size() << " nodes" << std::endl;
+	std::cout << "\t results different from coldet: " << mismatches << std::endl;
+}
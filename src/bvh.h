@@ -0,0 +1,87 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "framework.h"
+#include <vector>
+
+//use SSE when the compiler targets it (always on x64)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define BVH_USE_SSE
+#endif
+
+#define BVH_LEAF_SIZE 4 //max triangles per leaf, they are tested together
+#define BVH_RAY_PACKET_SIZE 8 //rays traversed together by testRayPacket
+
+class Mesh;
+
+//node of the tree, stored flattened in depth first order so the left child is always the next node
+struct sBVHNode
+{
+	float min[3];
+	int first; //leaf: index of its packet, inner: index of the right child
+	float max[3];
+	int count; //leaf: number of triangles, inner: -(split axis + 1)
+};
+
+//up to four triangles stored as SoA to test them at once
+struct sBVHPacket
+{
+	float v0[3][4]; //first vertex
+	float e1[3][4]; //v1 - v0
+	float e2[3][4]; //v2 - v0
+	int triangles[4]; //triangle index in the mesh (primitive / 3), -1 if unused
+};
+
+struct sBVHHit
+{
+	float distance; //in units of the ray direction
+	int triangle; //triangle index in the mesh (primitive / 3)
+	float u, v; //barycentric coordinates
+};
+
+//rays (in object space) that traverse the tree together, they should be coherent
+struct sBVHRayPacket
+{
+	int count;
+	Vector3 origin[BVH_RAY_PACKET_SIZE];
+	Vector3 direction[BVH_RAY_PACKET_SIZE];
+	float max_dist[BVH_RAY_PACKET_SIZE]; //reduced to the hit distance when something is found
+	bool found[BVH_RAY_PACKET_SIZE];
+	sBVHHit hit[BVH_RAY_PACKET_SIZE];
+};
+
+//Bounding volume hierarchy built with the surface area heuristic
+class MeshBVH
+{
+public:
+	std::vector<sBVHNode> nodes;
+	std::vector<sBVHPacket> packets;
+	long build_time; //in ms
+
+	MeshBVH();
+
+	//triangles has 3 vertices per triangle
+	bool build(const std::vector<Vector3>& triangles);
+
+	//closest hit, or any hit if any_hit is true (faster, for shadows/visibility)
+	bool testRay(const Vector3& origin, const Vector3& direction, sBVHHit& hit, float max_dist = 3.4e+38F, bool any_hit = false) const;
+	//tests all the rays of the packet, a node is visited if any of them reaches it. Returns the number of rays that hit
+	int testRayPacket(sBVHRayPacket& packet, bool any_hit = false) const;
+	//finds the closest point to the center of the triangles inside the sphere
+	bool testSphere(const Vector3& center, float radius, Vector3& collision, int& triangle) const;
+
+	void getTriangle(int triangle, Vector3& a, Vector3& b, Vector3& c) const;
+	size_t getMemory() const;
+
+	static MeshBVH* fromMesh(Mesh* mesh);
+
+private:
+	std::vector<int> triangle_packet; //packet*4+lane of every triangle of the mesh
+
+	int buildNode(std::vector<int>& ids, int start, int end, const std::vector<Vector3>& triangles, const std::vector<Vector3>& centroids, int depth);
+};
+
+//casts random rays against the mesh using coldet and the BVH and prints the timings
+void benchmarkPicking(Mesh* mesh, int num_rays = 10000);
+
+#endif
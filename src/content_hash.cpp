@@ -0,0 +1,58 @@
+#include "content_hash.h"
+
+#include "includes.h"
+
+#include <cstring>
+#include <iostream>
+
+sDedupStats dedup_stats;
+
+static inline uint64_t mixHash(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+//eats 8 bytes per step, it is memory bound so hashing is cheap compared with decoding
+ContentHash hashMemory(const void* data, size_t size, ContentHash seed)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	uint64_t h = seed ^ (size * 0x9E3779B97F4A7C15ULL);
+	size_t num_words = size / 8;
+	for (size_t i = 0; i < num_words; ++i)
+	{
+		uint64_t word;
+		memcpy(&word, bytes + i * 8, 8); //unaligned safe
+		h = (h ^ mixHash(word)) * 0x9E3779B97F4A7C15ULL;
+		h = (h << 27) | (h >> 37);
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, bytes + num_words * 8, size - num_words * 8);
+	h = mixHash(h ^ tail);
+	return h ? h : 1;
+}
+
+void sDedupStats::reset()
+{
+	meshes = materials = textures = 0;
+	mesh_bytes = texture_bytes = 0;
+}
+
+void sDedupStats::print(const char* title) const
+{
+	std::cout << " + Deduplication " << title << ": " << meshes << " meshes (" << (mesh_bytes / 1024) << " KB), "
+		<< materials << " materials, " << textures << " textures (" << (texture_bytes / 1024) << " KB encoded) shared" << std::endl;
+}
+
+void sDedupStats::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("Shared meshes: %d (%d KB)", meshes, (int)(mesh_bytes / 1024));
+	ImGui::Text("Shared materials: %d", materials);
+	ImGui::Text("Shared textures: %d (%d KB encoded)", textures, (int)(texture_bytes / 1024));
+#endif
+}
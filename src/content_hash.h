@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+//Content addressed resources: meshes, materials and textures are hashed when imported and the ones with the
+//same content share a single instance (in RAM and VRAM), no matter the file or the name they came from
+
+typedef uint64_t ContentHash;
+
+//64 bits hash of a block of memory, never returns 0 (0 means not hashed)
+ContentHash hashMemory(const void* data, size_t size, ContentHash seed = 0);
+
+//hashes the size too, so consecutive streams with different sizes dont collide
+template<typename T>
+ContentHash hashVector(const std::vector<T>& v, ContentHash seed = 0)
+{
+	size_t size = v.size();
+	seed = hashMemory(&size, sizeof(size), seed);
+	return hashMemory(v.data(), v.size() * sizeof(T), seed);
+}
+
+//what the deduplication saved, the scene resets it when it starts loading
+struct sDedupStats
+{
+	int meshes; //imported resources replaced by an existing one
+	int materials;
+	int textures;
+	size_t mesh_bytes; //geometry that was not stored nor uploaded
+	size_t texture_bytes; //encoded images that were not decoded nor uploaded
+
+	sDedupStats() { reset(); }
+	void reset();
+	void print(const char* title) const;
+	void renderInMenu();
+};
+
+extern sDedupStats dedup_stats;
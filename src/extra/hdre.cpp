@@ -3,6 +3,7 @@
 #include <cmath>
 #include <cassert>
 #include <algorithm>
+#include <cstring>
 
 #include "../utils.h"
 #include "hdre.h"
@@ -26,6 +27,9 @@ void HDRE::init()
     data = nullptr;
     width = height = 0;
     levels = N_MAX_LEVELS;
+	stored_levels = 0;
+	memset(&header, 0, sizeof(header));
+	memset(level_sizes, 0, sizeof(level_sizes));
 
     for (int j = 0; j < N_FACES; j++)
     {
@@ -70,7 +74,7 @@ HDRE::~HDRE()
 
 float* HDRE::getData()
 {
-	return this->data;
+	return this->header.type == HDRE_TYPE_FLOAT ? (float*)this->data : nullptr;
 }
 
 float** HDRE::getFacesf(int level)
@@ -104,59 +108,41 @@ short* HDRE::getFaceh(int level, int face)
 bool HDRE::load(const char* filename)
 {
 	assert(filename);
+	clean();
 
-	FILE *f = fopen(filename,"rb");
-	if (f == nullptr)
+	if (!file.open(filename))
 		return false;
 
-	sHDREHeader HDREHeader;
-
-	fread(&HDREHeader, sizeof(sHDREHeader), 1, f);
-
-	if (HDREHeader.type != 3) {
-        printf("HDRE Header has wrong type: %d\n", HDREHeader.type);
-        throw ("ArrayType not supported. Please export in Float32Array.");
-    }
-
-    this->header = HDREHeader;
-
-	int width = HDREHeader.width;
-	int height = HDREHeader.height;
-
-	this->width = width;
-	this->height = height;
-
-	int dataSize = 0;
-	int w = width;
-
-	// Get number of floats inside the HDRE
-	// Per channel & Per face
-	for (int i = 0; i < N_LEVELS; i++)
+	if (file.size < sizeof(sHDREHeader))
 	{
-		int mip_level = i + 1;
-		dataSize += w * w * N_FACES * HDREHeader.numChannels;
-
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
-		w = fmax(8, (int)(width / pow(2.0, mip_level)));
-
-		if (this->header.version > 2.0)
-			w = (int)(width / pow(2.0, mip_level));
+		std::cout << "HDRE file too small: " << filename << std::endl;
+		file.close();
+		return false;
+	}
+	memcpy(&this->header, file.data, sizeof(sHDREHeader));
+
+	int element_size = 0;
+	if (header.type == HDRE_TYPE_FLOAT)
+		element_size = 4;
+	else if (header.type == HDRE_TYPE_HALF_FLOAT)
+		element_size = 2;
+	else if (header.type == HDRE_TYPE_BYTE)
+		element_size = 1;
+	if (!element_size)
+	{
+		printf("HDRE Header has wrong type: %d\n", header.type);
+		file.close();
+		return false;
 	}
 
-	this->data = new float[dataSize];
-
-	fseek(f, HDREHeader.headerSize, SEEK_SET);
-
-	fread(this->data, sizeof(float) * dataSize, 1, f);
-	fclose(f);
-
-	// get separated levels
+	int width = header.width;
+	int height = header.height;
 
-	w = width;
-	int mapOffset = 0;
-    int mapPrevOffset = 0;
+	this->width = width;
+	this->height = height;
 
 	int nFullMips = 0;
+	int w = width;
 	while (w)
     {
 	    nFullMips++;
@@ -164,86 +150,83 @@ bool HDRE::load(const char* filename)
     }
 	assert(nFullMips <= N_MAX_LEVELS);
 	levels = nFullMips;
-	w = width;
-    printf("Load %d mips of HDRE texture\n", nFullMips);
 
-    int i;
-    for (i = 0; i < N_LEVELS; i++)
+	// only the pointers to every level and face, the pixels are read when used
+	const unsigned char* pixels = file.data + header.headerSize;
+	size_t offset = 0;
+	w = width;
+	stored_levels = std::min(N_LEVELS, nFullMips);
+	for (int i = 0; i < stored_levels; i++)
 	{
 		int mip_level = i + 1;
-		int faceSize = w * w * HDREHeader.numChannels;
-		int mapSize = faceSize * N_FACES;
-
-		int faceOffset = 0;
+		size_t faceSize = (size_t)w * w * header.numChannels * element_size;
+		if (header.headerSize + offset + faceSize * N_FACES > file.size)
+		{
+			std::cout << "HDRE file truncated: " << filename << std::endl;
+			stored_levels = i;
+			break;
+		}
 
+		level_sizes[i] = w;
 		for (int j = 0; j < N_FACES; j++)
 		{
-			// allocate memory
-			this->pixels_f[i][j] = new float[faceSize];
-
-			// set data
-			for (int k = 0; k < faceSize; k++) {
-
-				float value = this->data[mapOffset + faceOffset + k];
-
-				this->pixels_f[i][j][k] = value;
-			}
-
-			// update face offset
-			faceOffset += faceSize;
+			void* face = (void*)(pixels + offset + faceSize * j);
+			if (header.type == HDRE_TYPE_FLOAT)
+				this->pixels_f[i][j] = (float*)face;
+			else if (header.type == HDRE_TYPE_HALF_FLOAT)
+				this->pixels_h[i][j] = (short*)face;
+			else
+				this->pixels_b[i][j] = (byte*)face;
 		}
+		offset += faceSize * N_FACES;
 
-		// update level offset
-		mapPrevOffset = mapOffset;
-		mapOffset += mapSize;
 		// reassign width for next level
-		//w = std::max(8, (int)(width / pow(2.0, mip_level)));
 		w = fmax(8, (int)(width / pow(2.0, mip_level)));
 
 		if (this->header.version > 2.0)
 			w = (int)(width / pow(2.0, mip_level));
 	}
-	std::cout << std::endl << " + '" << filename << "' (v" << this->header.version << ") loaded successfully" << std::endl;
+	if (!stored_levels)
+	{
+		clean();
+		return false;
+	}
+	data = pixels;
+
+	std::cout << " + '" << filename << "' (v" << this->header.version << ") mapped, " << stored_levels << " of " << nFullMips << " mips" << std::endl;
 	return true;
 }
 
 bool HDRE::clean()
 {
-	try
-	{
-		if (data)
-			delete data;
-
-        for (int j = 0; j < N_FACES; j++)
-        {
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-				delete pixels_h[i][j];
-				pixels_h[i][j] = nullptr;
-			}
-            for (int i = 0; i < N_LEVELS; i++)
-            {
-                delete pixels_f[i][j];
-                pixels_f[i][j] = nullptr;
-            }
+	//nothing was allocated, the faces point to the mapping
+	for (int j = 0; j < N_FACES; j++)
+		for (int i = 0; i < N_MAX_LEVELS; i++)
+		{
+			pixels_h[i][j] = nullptr;
+			pixels_f[i][j] = nullptr;
+			pixels_b[i][j] = nullptr;
 		}
+	data = nullptr;
+	file.close();
+	return true;
+}
 
-		return true;
-	}
-	catch (const std::exception&)
-	{
-		std::cout << std::endl << "Error cleaning" << std::endl;
-		return false;
-	}
-
-	return false;
+void HDRE::release()
+{
+	clean();
 }
 
 HDRE* HDRE::Get(const char* filename)
 {
 	auto it = s_loaded_hdres.find(filename);
 	if (it != s_loaded_hdres.end())
-		return it->second;
+	{
+		HDRE* hdre = it->second;
+		if (!hdre->isLoaded() && !hdre->load(filename)) //released after uploading it
+			return nullptr;
+		return hdre;
+	}
 
 	HDRE* hdre = new HDRE();
 	if (!hdre->load(filename))
@@ -6,6 +6,12 @@
 
 #include <string>
 #include <map>
+#include "../utils.h"
+
+//values of sHDREHeader::type
+#define HDRE_TYPE_BYTE 1
+#define HDRE_TYPE_HALF_FLOAT 2
+#define HDRE_TYPE_FLOAT 3
 
 typedef unsigned char byte;
 
@@ -45,12 +51,15 @@ typedef struct {
 
 } sHDRELevel;
 
+//The file is mapped in memory, the faces point inside the mapping so the pixels are only read from disk when they are
+//accessed (usually by glTexImage2D, in the type stored in the file). Once uploaded call release to unmap it
 class HDRE {
 
 private:
 
     std::string filename;
-	float* data; // only f32 now
+	MappedFile file;
+	const void* data; // inside the mapping, in the type of the file
 
     float* pixels_f[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
     short* pixels_h[N_MAX_LEVELS][N_FACES]; // Xpos, Xneg, Ypos, Yneg, Zpos, Zneg
@@ -65,7 +74,9 @@ public:
 	sHDREHeader header;
 	int width;
 	int height;
-    int levels = N_MAX_LEVELS;
+    int levels = N_MAX_LEVELS; //of a full chain
+	int stored_levels; //levels in the file
+	int level_sizes[N_MAX_LEVELS]; //width (and height) of every stored level
 
 	HDRE();
 	HDRE(const char* filename);
@@ -73,6 +84,8 @@ public:
 
 	bool load(const char* filename);
 	//bool load(void* data, int size);
+	void release(); //unmaps the pixels, the header (luminance, SH) is kept. Get maps it again if needed
+	bool isLoaded() { return data != nullptr; }
 
 	// useful methods
 	float getMaxLuminance() { return this->header.maxLuminance; };
@@ -83,7 +96,7 @@ public:
 		return nullptr;
 	}
 
-	float* getData(); // All pixel data
+	float* getData(); // All pixel data (only for float files)
 
 	float* getFacef(int level, int face);	// Specific level and face
 	float** getFacesf(int level = 0);		// [[]]: Array per face with all level data
@@ -0,0 +1,246 @@
+#include "file_io.h"
+
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <unistd.h>
+	#include <fcntl.h>
+#endif
+#include <sys/stat.h>
+
+#include "includes.h"
+
+#include <iostream>
+#include <cassert>
+
+int FileIO::num_threads = 2;
+int FileIO::max_prefetched_mb = 512;
+std::atomic<long> FileIO::num_reads(0);
+std::atomic<long> FileIO::bytes_read(0);
+std::atomic<long> FileIO::num_hits(0);
+std::atomic<long> FileIO::num_waits(0);
+std::mutex FileIO::mutex;
+std::condition_variable FileIO::condition;
+std::condition_variable FileIO::finished;
+std::deque<std::shared_ptr<sIORequest>> FileIO::pending;
+std::map<std::string, std::shared_ptr<sIORequest>> FileIO::prefetched;
+size_t FileIO::prefetched_bytes = 0;
+std::vector<std::thread*> FileIO::threads;
+bool FileIO::must_loop = false;
+
+bool IORequest::wait() const
+{
+	if (!request)
+		return false;
+	if (request->state == IO_PENDING)
+	{
+		std::unique_lock<std::mutex> lock(FileIO::mutex);
+		FileIO::finished.wait(lock, [this] { return request->state != IO_PENDING; });
+	}
+	return request->state == IO_DONE;
+}
+
+void FileIO::startThreads()
+{
+	assert(threads.empty() && "FileIO already started");
+	std::cout << "Starting " << num_threads << " file reading threads" << std::endl;
+	must_loop = true;
+	for (int i = 0; i < num_threads; ++i)
+		threads.push_back(new std::thread(threadLoop));
+}
+
+void FileIO::stopThreads()
+{
+	std::deque<std::shared_ptr<sIORequest>> cancelled;
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		must_loop = false;
+		cancelled.swap(pending);
+		for (int i = 0; i < cancelled.size(); ++i)
+			cancelled[i]->state = IO_FAILED;
+	}
+	condition.notify_all();
+	finished.notify_all();
+	for (int i = 0; i < threads.size(); ++i)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	threads.clear();
+	releasePrefetched();
+}
+
+IORequest FileIO::read(const std::string& filename)
+{
+	std::shared_ptr<sIORequest> request(new sIORequest());
+	request->filename = filename;
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		if (must_loop)
+		{
+			pending.push_back(request);
+			condition.notify_one();
+			return IORequest(request);
+		}
+	}
+	execute(request);
+	return IORequest(request);
+}
+
+void FileIO::prefetch(const std::string& filename)
+{
+	std::shared_ptr<sIORequest> request;
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		//without threads it would block, that is what the loader will do anyway
+		if (!must_loop || prefetched.find(filename) != prefetched.end() || prefetched_bytes >= (size_t)max_prefetched_mb * 1024 * 1024)
+			return;
+		request.reset(new sIORequest());
+		request->filename = filename;
+		request->prefetched = true;
+		prefetched[filename] = request;
+		pending.push_back(request);
+	}
+	condition.notify_one();
+}
+
+bool FileIO::take(const std::string& filename, std::vector<unsigned char>& buffer)
+{
+	std::shared_ptr<sIORequest> request;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		auto it = prefetched.find(filename);
+		if (it == prefetched.end())
+			return false;
+		request = it->second;
+		prefetched.erase(it);
+		request->prefetched = false;
+		if (request->state == IO_PENDING)
+		{
+			num_waits++;
+			finished.wait(lock, [&request] { return request->state != IO_PENDING; });
+		}
+		if (request->counted)
+			prefetched_bytes -= request->data.size();
+		request->counted = false;
+	}
+	//if it failed the loader reads it again, to report the error as always
+	if (request->state != IO_DONE)
+		return false;
+	num_hits++;
+	buffer.swap(request->data);
+	return true;
+}
+
+void FileIO::releasePrefetched()
+{
+	const std::lock_guard<std::mutex> lock(mutex);
+	for (auto it = prefetched.begin(); it != prefetched.end(); ++it)
+		it->second->prefetched = false; //the pending ones are discarded when read
+	prefetched.clear();
+	prefetched_bytes = 0;
+}
+
+bool FileIO::readWholeFile(const char* filename, std::vector<unsigned char>& buffer)
+{
+	buffer.clear();
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	GetFileSizeEx(file, &file_size);
+	buffer.resize((size_t)file_size.QuadPart);
+	size_t total = 0;
+	while (total < buffer.size())
+	{
+		size_t remaining = buffer.size() - total;
+		DWORD chunk = (DWORD)(remaining < ((size_t)1 << 30) ? remaining : ((size_t)1 << 30));
+		DWORD count = 0;
+		if (!ReadFile(file, &buffer[total], chunk, &count, NULL) || !count)
+			break;
+		total += count;
+	}
+	CloseHandle(file);
+#else
+	int fd = ::open(filename, O_RDONLY);
+	if (fd == -1)
+		return false;
+	struct stat stbuffer;
+	if (fstat(fd, &stbuffer) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+	buffer.resize((size_t)stbuffer.st_size);
+	size_t total = 0;
+	while (total < buffer.size())
+	{
+		ssize_t count = pread(fd, &buffer[total], buffer.size() - total, (off_t)total);
+		if (count <= 0)
+			break;
+		total += count;
+	}
+	::close(fd);
+#endif
+	buffer.resize(total); //in case it was truncated meanwhile
+	return true;
+}
+
+void FileIO::execute(const std::shared_ptr<sIORequest>& request)
+{
+	bool ok = readWholeFile(request->filename.c_str(), request->data);
+	num_reads++;
+	bytes_read += (long)request->data.size();
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		if (request->prefetched)
+		{
+			prefetched_bytes += request->data.size();
+			request->counted = true;
+		}
+		request->state = ok ? IO_DONE : IO_FAILED;
+	}
+	finished.notify_all();
+}
+
+void FileIO::threadLoop()
+{
+	while (true)
+	{
+		std::shared_ptr<sIORequest> request;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [] { return !pending.empty() || !must_loop; });
+			if (!must_loop)
+				break;
+			request = pending.front();
+			pending.pop_front();
+			//a prefetch released before being read
+			if (request.use_count() == 1)
+				continue;
+		}
+		execute(request);
+	}
+}
+
+void FileIO::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::SliderInt("Prefetch budget (MB)", &max_prefetched_mb, 0, 4096);
+	int num_pending = 0, num_prefetched = 0;
+	size_t bytes = 0;
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		num_pending = (int)pending.size();
+		num_prefetched = (int)prefetched.size();
+		bytes = prefetched_bytes;
+	}
+	ImGui::Text("Threads: %d, pending reads: %d", (int)threads.size(), num_pending);
+	ImGui::Text("Reads: %d (%d MB)", (int)num_reads, (int)(bytes_read / (1024 * 1024)));
+	ImGui::Text("Prefetched not used yet: %d (%d MB)", num_prefetched, (int)(bytes / (1024 * 1024)));
+	ImGui::Text("Prefetch hits: %d (%d had to wait)", (int)num_hits, (int)num_waits);
+	if (ImGui::Button("Release prefetched"))
+		releasePrefetched();
+#endif
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+//Whole file reads in their own threads, so the job workers (see jobs.h) and the decoders never block on the disk.
+//The loaders read the files as always (readFile, readFileBin, MappedFile) but if the file was prefetched they get
+//the data already in memory, so a scene can ask for all the files it references as soon as it is parsed and
+//decode the first ones while the rest are still being read. Reads use pread (ReadFile in windows)
+
+enum eIOState {
+	IO_PENDING,
+	IO_DONE,
+	IO_FAILED
+};
+
+struct sIORequest {
+	std::string filename;
+	std::vector<unsigned char> data;
+	std::atomic<int> state;
+	bool prefetched; //waiting in the prefetched files to be taken
+	bool counted; //its size is in the prefetched bytes
+
+	sIORequest() { state = IO_PENDING; prefetched = counted = false; }
+};
+
+class IORequest {
+public:
+	std::shared_ptr<sIORequest> request;
+
+	IORequest() {}
+	IORequest(const std::shared_ptr<sIORequest>& request) { this->request = request; }
+
+	bool isValid() const { return request != nullptr; }
+	bool isFinished() const { return !request || request->state != IO_PENDING; }
+	bool wait() const; //returns false if the file could not be read
+	std::vector<unsigned char>& getData() const { return request->data; } //once finished
+};
+
+class FileIO {
+public:
+	static int num_threads;
+	static int max_prefetched_mb; //prefetches are skipped while the files not taken yet use more
+
+	//stats
+	static std::atomic<long> num_reads;
+	static std::atomic<long> bytes_read;
+	static std::atomic<long> num_hits; //loads that found the file prefetched
+	static std::atomic<long> num_waits; //hits that still had to wait for the read
+
+	static void startThreads(); //before that the reads are done when requested
+	static void stopThreads(); //the pending reads fail
+
+	static IORequest read(const std::string& filename);
+	static void prefetch(const std::string& filename); //it is kept until a loader takes it
+	//if the file was prefetched moves its content to buffer (waiting for the read if needed), returns false otherwise
+	static bool take(const std::string& filename, std::vector<unsigned char>& buffer);
+	static void releasePrefetched(); //the files not taken yet
+	static bool readWholeFile(const char* filename, std::vector<unsigned char>& buffer); //blocking
+
+	static void renderInMenu();
+
+private:
+	static std::mutex mutex;
+	static std::condition_variable condition; //for the threads
+	static std::condition_variable finished; //for the ones waiting a read
+	static std::deque<std::shared_ptr<sIORequest>> pending;
+	static std::map<std::string, std::shared_ptr<sIORequest>> prefetched;
+	static size_t prefetched_bytes;
+	static std::vector<std::thread*> threads;
+	static bool must_loop;
+
+	static void execute(const std::shared_ptr<sIORequest>& request);
+	static void threadLoop();
+
+	friend class IORequest;
+};
@@ -0,0 +1,92 @@
+#include "frame_graph.h"
+
+#include "includes.h"
+
+#include <chrono>
+#include <cassert>
+
+int FrameGraph::addStage(const char* name, std::function<void()> func, const std::vector<int>& dependencies, bool main_thread)
+{
+	sStage stage;
+	stage.name = name;
+	stage.func = std::move(func);
+	stage.dependencies = dependencies;
+	stage.main_thread = main_thread;
+	stage.start_ms = stage.time_ms = 0.0f;
+	for (int i = 0; i < dependencies.size(); ++i)
+		assert(dependencies[i] >= 0 && dependencies[i] < (int)stages.size() && "stages can only depend on the previous ones");
+	stages.push_back(stage);
+	return (int)stages.size() - 1;
+}
+
+void FrameGraph::execute()
+{
+	typedef std::chrono::high_resolution_clock clock;
+	clock::time_point start = clock::now();
+
+	for (int i = 0; i < stages.size(); ++i)
+	{
+		sStage& stage = stages[i];
+		std::vector<JobHandle> dependencies;
+		for (int j = 0; j < stage.dependencies.size(); ++j)
+			dependencies.push_back(stages[stage.dependencies[j]].job);
+
+		//the stages vector is not modified while executing
+		auto timed = [this, i, start]() {
+			sStage& stage = stages[i];
+			stage.start_ms = std::chrono::duration<float, std::milli>(clock::now() - start).count();
+			stage.func();
+			stage.time_ms = std::chrono::duration<float, std::milli>(clock::now() - start).count() - stage.start_ms;
+		};
+
+		if (stage.main_thread)
+		{
+			JobSystem::waitAll(dependencies);
+			timed();
+		}
+		else
+			stage.job = JobSystem::run(timed, dependencies);
+	}
+
+	//the last jobs could have no main thread stage after them
+	for (int i = 0; i < stages.size(); ++i)
+		stages[i].job.wait();
+	total_ms = std::chrono::duration<float, std::milli>(clock::now() - start).count();
+
+	for (int i = 0; i < stages.size(); ++i)
+	{
+		auto it = average_ms.find(stages[i].name);
+		if (it == average_ms.end())
+			average_ms[stages[i].name] = stages[i].time_ms;
+		else
+			it->second = it->second * 0.95f + stages[i].time_ms * 0.05f;
+	}
+	auto it = average_ms.find("total");
+	average_ms["total"] = it == average_ms.end() ? total_ms : it->second * 0.95f + total_ms * 0.05f;
+}
+
+void FrameGraph::clear()
+{
+	stages.clear();
+}
+
+void FrameGraph::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("Total: %.2f ms (avg %.2f ms)", total_ms, average_ms["total"]);
+	ImGui::Columns(4);
+	ImGui::Text("Stage"); ImGui::NextColumn();
+	ImGui::Text("Start (ms)"); ImGui::NextColumn();
+	ImGui::Text("Time (ms)"); ImGui::NextColumn();
+	ImGui::Text("Avg (ms)"); ImGui::NextColumn();
+	for (int i = 0; i < stages.size(); ++i)
+	{
+		sStage& stage = stages[i];
+		ImGui::Text("%s%s", stage.name.c_str(), stage.main_thread ? " (main)" : ""); ImGui::NextColumn();
+		ImGui::Text("%.2f", stage.start_ms); ImGui::NextColumn();
+		ImGui::Text("%.2f", stage.time_ms); ImGui::NextColumn();
+		ImGui::Text("%.2f", average_ms[stage.name]); ImGui::NextColumn();
+	}
+	ImGui::Columns(1);
+#endif
+}
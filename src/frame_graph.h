@@ -0,0 +1,38 @@
+#pragma once
+
+#include "jobs.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <functional>
+
+//The CPU work of a frame as stages with dependencies. The stages that dont use GL run as jobs (see jobs.h) as soon as
+//their dependencies finish, so the independent ones run at the same time. The ones marked as main thread (GL submission)
+//run in the calling thread in the order they were added, once their dependencies finish. Every stage is timed
+
+class FrameGraph {
+public:
+	struct sStage {
+		std::string name;
+		std::function<void()> func;
+		std::vector<int> dependencies; //indices of previous stages
+		bool main_thread;
+		JobHandle job;
+		float start_ms; //since the execution started
+		float time_ms;
+	};
+
+	std::vector<sStage> stages;
+	float total_ms; //of the last execution
+	std::map<std::string, float> average_ms; //smoothed timings by stage name, they are kept when cleared
+
+	FrameGraph() { total_ms = 0.0f; }
+
+	//returns the index of the stage, to be used as a dependency
+	int addStage(const char* name, std::function<void()> func, const std::vector<int>& dependencies = std::vector<int>(), bool main_thread = false);
+	void execute(); //returns when all the stages have finished
+	void clear(); //removes the stages
+
+	void renderInMenu();
+};
@@ -10,8 +10,21 @@
 #include "material.h"
 #include "prefab.h"
 #include "utils.h"
+#include "prefab_cache.h"
+#include "file_io.h"
 
 #include <iostream>
+#include <map>
+#include <set>
+
+//use SSE to convert quantized streams when the compiler targets it (always on x64)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define GLTF_USE_SSE
+#endif
+#if defined(__AVX2__)
+	#include <immintrin.h>
+#endif
 
 //** PARSING GLTF IS UGLY
 std::string base_folder;
@@ -22,140 +35,581 @@ std::string base_folder;
 	bool load_textures = true; //must textures be loadead?
 #endif
 
-void parseGLTFBufferVector3(std::vector<Vector3>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+//filled by the decode stage of loadGLTF so the node parsing only has to pick them
+std::map<cgltf_mesh*, std::vector<Mesh*>> decoded_meshes;
+std::map<std::pair<cgltf_image*, bool>, Texture*> image_textures; //embedded images already sent to decode, by image and srgb
+std::map<Texture*, cgltf_image*> embedded_textures; //to store the encoded images in the cooked prefab
+//buffers with embedded images being decoded in the background, loadGLTF takes them from cgltf so they outlive it
+std::map<cgltf_buffer*, std::shared_ptr<void>> buffer_owners;
+cgltf_data* current_data = NULL;
+
+//** ACCESSOR DECODING
+//the component type and the number of components are resolved once per accessor so the inner loops have no branches
+
+//glTF rules to convert normalized integers to float (multiplying as the SSE path does, divisions are much slower)
+template<typename T> struct sGLTFComponent;
+template<> struct sGLTFComponent<signed char> { static float normalize(signed char v) { return std::max(v * (1.0f / 127.0f), -1.0f); } };
+template<> struct sGLTFComponent<unsigned char> { static float normalize(unsigned char v) { return v * (1.0f / 255.0f); } };
+template<> struct sGLTFComponent<short> { static float normalize(short v) { return std::max(v * (1.0f / 32767.0f), -1.0f); } };
+template<> struct sGLTFComponent<unsigned short> { static float normalize(unsigned short v) { return v * (1.0f / 65535.0f); } };
+template<> struct sGLTFComponent<unsigned int> { static float normalize(unsigned int v) { return (float)(v / 4294967295.0); } };
+template<> struct sGLTFComponent<float> { static float normalize(float v) { return v; } };
+
+//N components per element, any stride
+template<typename T, int N, bool NORMALIZED>
+static void decodeGLTFElements(const unsigned char* src, size_t stride, size_t count, float* dst)
+{
+	for (size_t i = 0; i < count; ++i, src += stride, dst += N)
+	{
+		const T* element = (const T*)src;
+		for (int k = 0; k < N; ++k)
+			dst[k] = NORMALIZED ? sGLTFComponent<T>::normalize(element[k]) : (float)element[k];
+	}
+}
+
+template<typename T, int N>
+static void decodeGLTFElements(const unsigned char* src, size_t stride, size_t count, bool normalized, float* dst)
 {
-	int i = 0;
+	if (normalized)
+		decodeGLTFElements<T, N, true>(src, stride, count, dst);
+	else
+		decodeGLTFElements<T, N, false>(src, stride, count, dst);
+}
 
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->buffer_view->offset + acc->offset;
-	if (acc->normalized)
+#ifdef GLTF_USE_SSE
+//converts 8 integers (already widened to 16 bits) to floats
+static inline void convert8(__m128i v, bool is_signed, float scale, bool clamp, float* dst)
+{
+	__m128i lo, hi;
+	if (is_signed)
 	{
-		//denormalize
-		assert(!"TO DO");
+		lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
 	}
-	int num_elements = acc->count;
-	std::vector<Vector3> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec3);
-	if (acc->stride == sizeof(Vector3))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector3));
 	else
 	{
-		for (int i = 0; i < num_elements; ++i)
+		lo = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+		hi = _mm_unpackhi_epi16(v, _mm_setzero_si128());
+	}
+	__m128 s = _mm_set1_ps(scale);
+	__m128 flo = _mm_mul_ps(_mm_cvtepi32_ps(lo), s);
+	__m128 fhi = _mm_mul_ps(_mm_cvtepi32_ps(hi), s);
+	if (clamp) //the most negative value would be less than -1
+	{
+		__m128 minus_one = _mm_set1_ps(-1.0f);
+		flo = _mm_max_ps(flo, minus_one);
+		fhi = _mm_max_ps(fhi, minus_one);
+	}
+	_mm_storeu_ps(dst, flo);
+	_mm_storeu_ps(dst + 4, fhi);
+}
+
+//converts tightly packed 8 or 16 bits components, returns how many were converted (the rest must be done scalar)
+static size_t convertPackedSSE(const unsigned char* src, cgltf_component_type type, bool normalized, size_t count, float* dst)
+{
+	float scale = 1.0f;
+	if (normalized)
+	{
+		switch (type)
+		{
+		case cgltf_component_type_r_8: scale = 1.0f / 127.0f; break;
+		case cgltf_component_type_r_8u: scale = 1.0f / 255.0f; break;
+		case cgltf_component_type_r_16: scale = 1.0f / 32767.0f; break;
+		case cgltf_component_type_r_16u: scale = 1.0f / 65535.0f; break;
+		default: break;
+		}
+	}
+	bool is_signed = type == cgltf_component_type_r_8 || type == cgltf_component_type_r_16;
+	bool clamp = normalized && is_signed;
+	size_t i = 0;
+	if (type == cgltf_component_type_r_16 || type == cgltf_component_type_r_16u)
+	{
+		for (; i + 8 <= count; i += 8)
+			convert8(_mm_loadu_si128((const __m128i*)(src + i * 2)), is_signed, scale, clamp, dst + i);
+	}
+	else if (type == cgltf_component_type_r_8 || type == cgltf_component_type_r_8u)
+	{
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128i v = _mm_loadl_epi64((const __m128i*)(src + i));
+			//widen to 16 bits, keeping the sign
+			v = is_signed ? _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8) : _mm_unpacklo_epi8(v, _mm_setzero_si128());
+			convert8(v, is_signed, scale, clamp, dst + i);
+		}
+	}
+	return i;
+}
+#endif
+
+//decodes count elements of N components of any type and stride to floats
+template<int N>
+static void decodeGLTFData(const unsigned char* src, size_t stride, size_t count, cgltf_component_type type, bool normalized, float* dst)
+{
+	size_t component_size = cgltf_component_size(type);
+	if (stride == N * component_size) //tightly packed
+	{
+		if (type == cgltf_component_type_r_32f)
+		{
+			memcpy(dst, src, count * N * sizeof(float));
+			return;
+		}
+#ifdef GLTF_USE_SSE
+		//as they are packed the elements can be converted as a flat array of components
+		size_t done = convertPackedSSE(src, type, normalized, count * N, dst);
+		if (done % N == 0)
+		{
+			src += done * component_size;
+			dst += done;
+			count -= done / N;
+		}
+		else //elements split in the middle, do the remaining components one by one
+		{
+			switch (type)
+			{
+			case cgltf_component_type_r_8: decodeGLTFElements<signed char, 1>(src + done, 1, count * N - done, normalized, dst + done); break;
+			case cgltf_component_type_r_8u: decodeGLTFElements<unsigned char, 1>(src + done, 1, count * N - done, normalized, dst + done); break;
+			case cgltf_component_type_r_16: decodeGLTFElements<short, 1>(src + done * 2, 2, count * N - done, normalized, dst + done); break;
+			case cgltf_component_type_r_16u: decodeGLTFElements<unsigned short, 1>(src + done * 2, 2, count * N - done, normalized, dst + done); break;
+			default: break;
+			}
+			return;
+		}
+#endif
+	}
+#ifdef GLTF_USE_SSE
+	//quantized streams are usually padded to 4 bytes (like int16 vec3 in 8 bytes), convert the padding too and skip it
+	else if (component_size <= 2 && stride % component_size == 0 && stride / component_size <= 4)
+	{
+		const size_t chunk = 256;
+		size_t padded_components = stride / component_size;
+		float temp[chunk * 4];
+		while (count > chunk) //the last element is left to the scalar loop, its padding may be past the buffer
 		{
-			memcpy(&unindexed[i], data, sizeof(Vector3));
-			data += acc->stride;
+			if (convertPackedSSE(src, type, normalized, chunk * padded_components, temp) != chunk * padded_components)
+				break;
+			for (size_t i = 0; i < chunk; ++i)
+				for (int k = 0; k < N; ++k)
+					dst[i * N + k] = temp[i * padded_components + k];
+			src += chunk * stride;
+			dst += chunk * N;
+			count -= chunk;
 		}
 	}
+#endif
 
-	if (!indices_acc)
+	switch (type)
 	{
-		container = unindexed;
-		return;
+	case cgltf_component_type_r_8: decodeGLTFElements<signed char, N>(src, stride, count, normalized, dst); break;
+	case cgltf_component_type_r_8u: decodeGLTFElements<unsigned char, N>(src, stride, count, normalized, dst); break;
+	case cgltf_component_type_r_16: decodeGLTFElements<short, N>(src, stride, count, normalized, dst); break;
+	case cgltf_component_type_r_16u: decodeGLTFElements<unsigned short, N>(src, stride, count, normalized, dst); break;
+	case cgltf_component_type_r_32u: decodeGLTFElements<unsigned int, N>(src, stride, count, normalized, dst); break;
+	case cgltf_component_type_r_32f: decodeGLTFElements<float, N, false>(src, stride, count, dst); break;
+	default: memset(dst, 0, count * N * sizeof(float)); break;
 	}
+}
 
-	container.resize(indices_acc->count);
+template<typename T>
+static void decodeGLTFIndices(const unsigned char* src, size_t stride, size_t count, unsigned int* dst)
+{
+	for (size_t i = 0; i < count; ++i, src += stride)
+		dst[i] = *(const T*)src;
+}
 
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (int i = 0; i < indices_acc->count; ++i)
+static void decodeGLTFIndexData(const unsigned char* src, size_t stride, size_t count, cgltf_component_type type, unsigned int* dst)
+{
+	switch (type)
 	{
-		int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
+	case cgltf_component_type_r_8u: decodeGLTFIndices<unsigned char>(src, stride, count, dst); break;
+	case cgltf_component_type_r_16u: decodeGLTFIndices<unsigned short>(src, stride, count, dst); break;
+	case cgltf_component_type_r_32u:
+		if (stride == sizeof(unsigned int))
+			memcpy(dst, src, count * sizeof(unsigned int));
+		else
+			decodeGLTFIndices<unsigned int>(src, stride, count, dst);
+		break;
+	default: memset(dst, 0, count * sizeof(unsigned int)); break;
+	}
+}
+
+static const unsigned char* getGLTFBufferViewData(cgltf_buffer_view* view, size_t offset)
+{
+	assert(view->buffer->data);
+	return (const unsigned char*)view->buffer->data + view->offset + offset;
+}
+
+//reads the indices of the elements replaced by a sparse accessor
+static void readGLTFSparseIndices(cgltf_accessor* acc, std::vector<unsigned int>& indices)
+{
+	const cgltf_accessor_sparse& sparse = acc->sparse;
+	indices.resize(sparse.count);
+	decodeGLTFIndexData(getGLTFBufferViewData(sparse.indices_buffer_view, sparse.indices_byte_offset), cgltf_component_size(sparse.indices_component_type), sparse.count, sparse.indices_component_type, &indices[0]);
+}
+
+//reads an accessor (sparse ones too) as N floats per element
+template<int N>
+static void readGLTFAccessor(cgltf_accessor* acc, float* dst)
+{
+	assert(cgltf_num_components(acc->type) == N);
+	if (!acc->count)
+		return;
+
+	if (acc->buffer_view)
+		decodeGLTFData<N>(getGLTFBufferViewData(acc->buffer_view, acc->offset), acc->stride, acc->count, acc->component_type, acc->normalized != 0, dst);
+	else //sparse accessors can have no base data, it is all zeros
+		memset(dst, 0, acc->count * N * sizeof(float));
+
+	if (!acc->is_sparse || !acc->sparse.count)
+		return;
+
+	//replace the elements in the sparse list, values are tightly packed
+	const cgltf_accessor_sparse& sparse = acc->sparse;
+	std::vector<unsigned int> indices;
+	readGLTFSparseIndices(acc, indices);
+	std::vector<float> values(sparse.count * N);
+	decodeGLTFData<N>(getGLTFBufferViewData(sparse.values_buffer_view, sparse.values_byte_offset), N * cgltf_component_size(acc->component_type), sparse.count, acc->component_type, acc->normalized != 0, &values[0]);
+	for (size_t i = 0; i < sparse.count; ++i)
+		if (indices[i] < acc->count)
+			memcpy(dst + indices[i] * N, &values[i * N], N * sizeof(float));
+}
+
+#if defined(__AVX2__)
+//dst[i] = src[indices[i]] with elements of N floats, gathering 8 floats per instruction. Indices must be valid
+template<int N>
+static size_t gatherFloatsAVX2(const float* src, const unsigned int* indices, size_t count, float* dst)
+{
+	//every 8 elements are N vectors of 8 floats, which lane reads which element and component
+	__m256i lane_element[N];
+	__m256i lane_component[N];
+	for (int v = 0; v < N; ++v)
+	{
+		int element[8], component[8];
+		for (int l = 0; l < 8; ++l)
 		{
-		case cgltf_component_type_r_8u: index = (int)*pos; break;
-		case cgltf_component_type_r_16u: index = (int)*(unsigned short*)pos; break;
-		case cgltf_component_type_r_32u: index = (int)*(unsigned int*)pos; break;
+			element[l] = (v * 8 + l) / N;
+			component[l] = (v * 8 + l) % N;
+		}
+		lane_element[v] = _mm256_loadu_si256((const __m256i*)element);
+		lane_component[v] = _mm256_loadu_si256((const __m256i*)component);
+	}
+
+	const __m256i n = _mm256_set1_epi32(N);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i index = _mm256_loadu_si256((const __m256i*)(indices + i));
+		for (int v = 0; v < N; ++v)
+		{
+			__m256i float_index = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_permutevar8x32_epi32(index, lane_element[v]), n), lane_component[v]);
+			_mm256_storeu_ps(dst + i * N + v * 8, _mm256_i32gather_ps(src, float_index, 4));
 		}
-		if (index < unindexed.size()) //sometimes indices are out of bounds
-			container[i] = unindexed[index];
-		else
-			std::cout << "index out of bounds:" << index << std::endl;
 	}
+	return i;
 }
+#endif
 
-void parseGLTFBufferVector2(std::vector<Vector2>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+//de-indexes a stream: dst[i] = src[indices[i]]. Indices out of bounds (found in some files) give zeros
+template<int N, typename T>
+static void gatherGLTFElements(const std::vector<T>& src, const std::vector<unsigned int>& indices, std::vector<T>& dst)
 {
-	assert(acc->buffer_view->buffer->data);
-	unsigned char* data = (unsigned char*)(acc->buffer_view->buffer->data) + acc->offset + acc->buffer_view->offset;
-	if (acc->normalized)
+	static_assert(sizeof(T) == N * sizeof(float), "elements must be N floats");
+	dst.resize(indices.size());
+	if (indices.empty())
+		return;
+
+	unsigned int max_index = 0;
+	for (size_t i = 0; i < indices.size(); ++i)
+		max_index = std::max(max_index, indices[i]);
+
+	size_t i = 0;
+	if (max_index < src.size())
 	{
-		//denormalize
-		assert(!"TO DO");
+#if defined(__AVX2__)
+		i = gatherFloatsAVX2<N>((const float*)&src[0], &indices[0], indices.size(), (float*)&dst[0]);
+#endif
+		for (; i < indices.size(); ++i)
+			dst[i] = src[indices[i]];
+		return;
 	}
-	int num_elements = acc->count;
-	std::vector<Vector2> unindexed;
-	unindexed.resize(num_elements);
-	assert(acc->component_type == cgltf_component_type_r_32f && acc->type == cgltf_type_vec2);
-	if (acc->stride == sizeof(Vector2))
-		memcpy(&unindexed[0], data, num_elements * sizeof(Vector2));
-	else
+
+	int num_invalid = 0;
+	for (; i < indices.size(); ++i)
 	{
-		for (int i = 0; i < num_elements; ++i)
+		if (indices[i] < src.size())
+			dst[i] = src[indices[i]];
+		else
 		{
-			memcpy(&unindexed[i], data, sizeof(Vector2));
-			data += acc->stride;
+			dst[i] = T();
+			num_invalid++;
 		}
 	}
+	std::cout << "[WARN] " << num_invalid << " indices out of bounds" << std::endl;
+}
+
+//copies a quantized accessor as it is so it can be uploaded without expanding it, returns false if it is float
+bool packGLTFStream(cgltf_accessor* acc, sPackedStream& stream)
+{
+	if (!acc->buffer_view || acc->is_sparse) //only plain accessors can be used as they are
+	{
+		stream.clear();
+		return false;
+	}
+	switch (acc->component_type)
+	{
+	case cgltf_component_type_r_8: stream.type = GL_BYTE; break;
+	case cgltf_component_type_r_8u: stream.type = GL_UNSIGNED_BYTE; break;
+	case cgltf_component_type_r_16: stream.type = GL_SHORT; break;
+	case cgltf_component_type_r_16u: stream.type = GL_UNSIGNED_SHORT; break;
+	default: stream.clear(); return false;
+	}
+	stream.components = (int)cgltf_num_components(acc->type);
+	stream.normalized = acc->normalized != 0;
+	int element_size = (int)cgltf_component_size(acc->component_type) * stream.components;
+	stream.stride = (element_size + 3) & ~3; //GL wants attributes aligned to 4 bytes
+	stream.data.resize(acc->count * stream.stride, 0);
+	const unsigned char* data = getGLTFBufferViewData(acc->buffer_view, acc->offset);
+	for (int i = 0; i < acc->count; ++i)
+		memcpy(&stream.data[i * stream.stride], data + i * acc->stride, element_size);
+	return true;
+}
+
+void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor* acc)
+{
+	container.resize(acc->count);
+	if (!acc->count)
+		return;
+
+	if (acc->buffer_view)
+		decodeGLTFIndexData(getGLTFBufferViewData(acc->buffer_view, acc->offset), acc->stride, acc->count, acc->component_type, &container[0]);
+	else
+		memset(&container[0], 0, acc->count * sizeof(unsigned int));
+
+	if (!acc->is_sparse || !acc->sparse.count)
+		return;
+	std::vector<unsigned int> indices, values(acc->sparse.count);
+	readGLTFSparseIndices(acc, indices);
+	decodeGLTFIndexData(getGLTFBufferViewData(acc->sparse.values_buffer_view, acc->sparse.values_byte_offset), cgltf_component_size(acc->component_type), acc->sparse.count, acc->component_type, &values[0]);
+	for (size_t i = 0; i < indices.size(); ++i)
+		if (indices[i] < acc->count)
+			container[indices[i]] = values[i];
+}
+
+void parseGLTFBufferVector3(std::vector<Vector3>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+{
+	std::vector<Vector3> unindexed(acc->count);
+	readGLTFAccessor<3>(acc, (float*)unindexed.data());
 
 	if (!indices_acc)
 	{
-		container = unindexed;
+		container.swap(unindexed);
 		return;
 	}
 
-	container.resize(indices_acc->count);
+	std::vector<unsigned int> indices;
+	parseGLTFBufferIndices(indices, indices_acc);
+	gatherGLTFElements<3>(unindexed, indices, container);
+}
+
+void parseGLTFBufferVector2(std::vector<Vector2>& container, cgltf_accessor* acc, cgltf_accessor* indices_acc = NULL)
+{
+	std::vector<Vector2> unindexed(acc->count);
+	readGLTFAccessor<2>(acc, (float*)unindexed.data());
+
+	if (!indices_acc)
+	{
+		container.swap(unindexed);
+		return;
+	}
 
-	assert(indices_acc->sparse.count == 0); //sparse not supported yet
+	std::vector<unsigned int> indices;
+	parseGLTFBufferIndices(indices, indices_acc);
+	gatherGLTFElements<2>(unindexed, indices, container);
+}
 
-	unsigned char* indices = (unsigned char*)indices_acc->buffer_view->buffer->data + indices_acc->offset;
-	int stride = indices_acc->stride;
-	for (int i = 0; i < indices_acc->count; ++i)
+//decodes synthetic accessors with the loader and with the generic cgltf reader (one element at a time) and compares them
+void benchmarkGLTFAccessors(int num_elements)
+{
+	struct sCase {
+		const char* name;
+		cgltf_component_type type;
+		cgltf_type element_type;
+		bool normalized;
+		int stride; //0 for tightly packed
+		bool sparse;
+	};
+	const sCase cases[] = {
+		{ "vec3 float packed", cgltf_component_type_r_32f, cgltf_type_vec3, false, 0, false },
+		{ "vec3 float interleaved", cgltf_component_type_r_32f, cgltf_type_vec3, false, 32, false },
+		{ "vec3 int16 normalized", cgltf_component_type_r_16, cgltf_type_vec3, true, 8, false },
+		{ "vec3 int8 normalized", cgltf_component_type_r_8, cgltf_type_vec3, true, 4, false },
+		{ "vec2 uint16 normalized packed", cgltf_component_type_r_16u, cgltf_type_vec2, true, 0, false },
+		{ "vec2 uint8 packed", cgltf_component_type_r_8u, cgltf_type_vec2, false, 0, false },
+		{ "vec3 float sparse", cgltf_component_type_r_32f, cgltf_type_vec3, false, 0, true },
+	};
+
+	std::vector<unsigned char> data;
+	std::vector<float> result, reference;
+	std::cout << "glTF accessors benchmark (" << num_elements << " elements)" << std::endl;
+
+	for (int c = 0; c < sizeof(cases) / sizeof(sCase); ++c)
 	{
-		unsigned int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (indices_acc->component_type)
+		const sCase& test = cases[c];
+		int num_components = (int)cgltf_num_components(test.element_type);
+		int element_size = (int)cgltf_component_size(test.type) * num_components;
+		int stride = test.stride ? test.stride : element_size;
+		int num_sparse = test.sparse ? num_elements / 10 : 0;
+
+		//base data, then sparse indices and values
+		data.resize(num_elements * stride + num_sparse * (sizeof(unsigned int) + element_size));
+		for (size_t i = 0; i < data.size(); ++i)
+			data[i] = (unsigned char)(rand() & 255);
+		if (test.type == cgltf_component_type_r_32f) //avoid NaNs
+			for (int i = 0; i < num_elements; ++i)
+				for (int k = 0; k < num_components; ++k)
+					((float*)&data[i * stride])[k] = (rand() / (float)RAND_MAX) * 100.0f;
+		for (int i = 0; i < num_sparse; ++i)
+		{
+			((unsigned int*)&data[num_elements * stride])[i] = i * 10;
+			for (int k = 0; k < num_components; ++k)
+				((float*)&data[num_elements * stride + num_sparse * sizeof(unsigned int) + i * element_size])[k] = -1.0f;
+		}
+
+		cgltf_buffer buffer;
+		memset(&buffer, 0, sizeof(buffer));
+		buffer.size = data.size();
+		buffer.data = &data[0];
+		cgltf_buffer_view view;
+		memset(&view, 0, sizeof(view));
+		view.buffer = &buffer;
+		view.size = data.size();
+		view.stride = test.stride;
+		cgltf_accessor acc;
+		memset(&acc, 0, sizeof(acc));
+		acc.component_type = test.type;
+		acc.type = test.element_type;
+		acc.normalized = test.normalized;
+		acc.count = num_elements;
+		acc.stride = stride;
+		acc.buffer_view = &view;
+		if (num_sparse)
 		{
-		case cgltf_component_type_r_8u: index = static_cast<unsigned int>(*pos); break;
-		case cgltf_component_type_r_16u: index = static_cast<unsigned int>(*(unsigned short*)pos); break;
-		case cgltf_component_type_r_32u: index = static_cast<unsigned int>(*(unsigned int*)pos); break;
+			acc.is_sparse = true;
+			acc.sparse.count = num_sparse;
+			acc.sparse.indices_buffer_view = &view;
+			acc.sparse.indices_byte_offset = num_elements * stride;
+			acc.sparse.indices_component_type = cgltf_component_type_r_32u;
+			acc.sparse.values_buffer_view = &view;
+			acc.sparse.values_byte_offset = num_elements * stride + num_sparse * sizeof(unsigned int);
 		}
-		if (index < unindexed.size())  //sometimes indices are out of bounds
-			container[i] = unindexed[index];
+
+		result.resize(num_elements * num_components);
+		reference.resize(num_elements * num_components);
+
+		long start = getTime();
+		if (num_components == 3)
+			readGLTFAccessor<3>(&acc, &result[0]);
 		else
-			std::cout << "index out of bounds:" << index << std::endl;
+			readGLTFAccessor<2>(&acc, &result[0]);
+		long loader_time = getTime() - start;
+
+		//cgltf doesnt read sparse accessors element by element, so it is applied here
+		start = getTime();
+		acc.is_sparse = false;
+		for (int i = 0; i < num_elements; ++i)
+			cgltf_accessor_read_float(&acc, i, &reference[i * num_components], num_components);
+		for (int i = 0; i < num_sparse; ++i)
+			for (int k = 0; k < num_components; ++k)
+				reference[i * 10 * num_components + k] = -1.0f;
+		long reference_time = getTime() - start;
+
+		//cgltf doesnt clamp the most negative value to -1, so signed normalized cases can differ up to 1/127
+		float max_error = 0;
+		for (size_t i = 0; i < result.size(); ++i)
+			max_error = std::max(max_error, fabsf(result[i] - reference[i]));
+		std::cout << " * " << test.name << ": " << loader_time << "ms (per element: " << reference_time << "ms) max error: " << max_error << std::endl;
 	}
 
+	//de-indexing
+	std::vector<Vector3> unindexed(num_elements), gathered;
+	std::vector<unsigned int> indices(num_elements);
+	for (int i = 0; i < num_elements; ++i)
+	{
+		unindexed[i].set((float)rand(), (float)rand(), (float)rand());
+		indices[i] = rand() % num_elements;
+	}
+	long start = getTime();
+	gatherGLTFElements<3>(unindexed, indices, gathered);
+	long gather_time = getTime() - start;
+	int errors = 0;
+	for (int i = 0; i < num_elements; ++i)
+		errors += gathered[i].x != unindexed[indices[i]].x || gathered[i].z != unindexed[indices[i]].z;
+	std::cout << " * de-index vec3: " << gather_time << "ms errors: " << errors << std::endl;
 }
 
-void parseGLTFBufferIndices(std::vector<unsigned int>& container, cgltf_accessor* acc)
+//fills the mesh streams from the accessors, it doesnt touch GL so it can run in any thread
+void decodeGLTFPrimitive(cgltf_primitive* primitive, Mesh* mesh)
 {
-	container.resize(acc->count);
-	unsigned int *final_indices = (unsigned int*)&container[0];
-
-	assert(acc->sparse.count == 0); //sparse not supported yet
-
-	unsigned char* indices = (unsigned char*)acc->buffer_view->buffer->data + acc->buffer_view->offset + acc->offset;
-	int stride = acc->stride;
-	for (int i = 0; i < acc->count; ++i)
+	//streams
+	for (int j = 0; j < primitive->attributes_count; ++j)
 	{
-		unsigned int index = 0;
-		unsigned char* pos = indices + i * stride;
-		switch (acc->component_type)
+		cgltf_attribute* attr = &primitive->attributes[j];
+
+		//std::string attrname = attr->name;
+		if (attr->type == cgltf_attribute_type_position)
+		{
+			parseGLTFBufferVector3(mesh->vertices, attr->data);
+			if (attr->data->has_min && attr->data->has_max)
+			{
+				mesh->aabb_min = attr->data->min;
+				mesh->aabb_max = attr->data->max;
+				mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
+				mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
+			}
+			else
+				mesh->updateBoundingBox();
+		}
+		else
+		if (attr->type == cgltf_attribute_type_normal)
+		{
+			parseGLTFBufferVector3(mesh->normals, attr->data);
+			if (Mesh::keep_quantized_streams)
+				packGLTFStream(attr->data, mesh->packed_normals);
+		}
+		else
+		if (attr->type == cgltf_attribute_type_texcoord)
 		{
-		case cgltf_component_type_r_8u: index = static_cast<unsigned int>(*pos); break;
-		case cgltf_component_type_r_16u: index = static_cast<unsigned int>(*(unsigned short*)pos); break;
-		case cgltf_component_type_r_32u: index = static_cast<unsigned int>(*(unsigned int*)pos); break;
+			if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
+				parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
+			else
+			{
+				parseGLTFBufferVector2(mesh->uvs, attr->data);
+				if (Mesh::keep_quantized_streams)
+					packGLTFStream(attr->data, mesh->packed_uvs);
+			}
 		}
-		final_indices[i] = index;
 	}
+
+	if (primitive->indices && primitive->indices->count)
+		parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+
+	if (Mesh::build_clusters && primitive->type == cgltf_primitive_type_triangles)
+		mesh->createClusters();
+}
+
+std::string getGLTFSubmeshName(cgltf_mesh* meshdata, const char* basename, int index)
+{
+	return std::string(basename) + std::string("::") + std::string(meshdata->name) + std::string("::") + std::to_string(index);
 }
 
 std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 {
 	std::vector<Mesh*> result;
 
+	//already decoded by loadGLTF
+	auto it = decoded_meshes.find(meshdata);
+	if (it != decoded_meshes.end())
+		return it->second;
+
 	if (meshdata->name)
 		stdlog( std::string("\t<- MESH: ") + meshdata->name);
 
@@ -168,7 +622,7 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 		std::string submesh_name;
 		if (meshdata->name)
 		{
-			submesh_name = std::string(basename) + std::string("::") + std::string(meshdata->name) + std::string("::") + std::to_string(i);
+			submesh_name = getGLTFSubmeshName(meshdata, basename, i);
 			mesh = Mesh::Get(submesh_name.c_str(), true);
 			if (mesh)
 			{
@@ -178,40 +632,12 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 		}
 
 		mesh = new Mesh();
-
-        //streams
-		for (int j = 0; j < primitive->attributes_count; ++j)
+		decodeGLTFPrimitive(primitive, mesh);
+		Mesh* shared = Mesh::Share(mesh);
+		if (shared != mesh)
 		{
-			cgltf_attribute* attr = &primitive->attributes[j];
-
-            //std::string attrname = attr->name;
-			if (attr->type == cgltf_attribute_type_position)
-			{
-				parseGLTFBufferVector3(mesh->vertices, attr->data);
-				if (attr->data->has_min && attr->data->has_max)
-				{
-					mesh->aabb_min = attr->data->min;
-					mesh->aabb_max = attr->data->max;
-					mesh->box.center = (mesh->aabb_max + mesh->aabb_min) * 0.5f;
-					mesh->box.halfsize = mesh->aabb_max - mesh->box.center;
-				}
-				else
-					mesh->updateBoundingBox();
-			}
-			else
-			if (attr->type == cgltf_attribute_type_normal)
-				parseGLTFBufferVector3(mesh->normals, attr->data);
-			else
-			if (attr->type == cgltf_attribute_type_texcoord)
-			{
-				if (strcmp(attr->name,"TEXCOORD_1") == 0) //secondary UV set
-					parseGLTFBufferVector2(mesh->m_uvs1, attr->data);
-				else
-					parseGLTFBufferVector2(mesh->uvs, attr->data);
-			}
-
-			if (primitive->indices && primitive->indices->count)
-				parseGLTFBufferIndices(mesh->m_indices, primitive->indices);
+			result.push_back(shared);
+			continue;
 		}
 		mesh->uploadToVRAM();
 		if (meshdata->name)
@@ -224,7 +650,17 @@ std::vector<Mesh*> parseGLTFMesh(cgltf_mesh* meshdata, const char* basename)
 
 int GLTF_TEXTURE_LAST_ID = 1;
 
-Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
+//the buffer memory is released by whoever finishes last, cgltf_free or the decoding tasks
+std::shared_ptr<void> getGLTFBufferOwner(cgltf_buffer* buffer)
+{
+	std::shared_ptr<void>& owner = buffer_owners[buffer];
+	if (!owner) //the glb binary chunk is inside the file data
+		owner = std::shared_ptr<void>(buffer->data == current_data->bin ? current_data->file_data : buffer->data, free);
+	return owner;
+}
+
+//srgb for colors, so their mipmaps are filtered in linear space
+Texture* parseGLTFTexture(cgltf_image* image, const char* filename, bool srgb = false)
 {
 	if (!load_textures || !image )
 		return NULL;
@@ -232,14 +668,18 @@ Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 	std::string fullpath = filename ? filename : "";
 
 	if (image->uri)
-		return Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str());
+		return Texture::GetAsync((std::string(base_folder) + "/" + image->uri).c_str(), true, true, srgb);
 	else
 	if (filename)
 	{
 		fullpath = std::string(base_folder) + "/" + filename;
-		Texture* tex = Texture::Find(fullpath.c_str());
+		Texture* tex = Texture::Find(fullpath.c_str(), srgb);
 		if (tex)
+		{
+			if (image->buffer_view)
+				embedded_textures[tex] = image;
 			return tex;
+		}
 	}
 	else
 	{
@@ -250,34 +690,21 @@ Texture* parseGLTFTexture(cgltf_image* image, const char* filename)
 
 	if (image->buffer_view)
 	{
-		Image img;
-		std::vector<unsigned char> buffer;
-		buffer.resize(image->buffer_view->size);
-		memcpy(&buffer[0], (char*)image->buffer_view->buffer->data + image->buffer_view->offset, image->buffer_view->size);
-
-		if (!strcmp(image->mime_type, "image/png"))
-			img.loadPNG(buffer);
-		else if (!strcmp(image->mime_type, "image/jpeg"))
-			img.loadJPG(buffer);
-		else
-		{
-			stdlog(std::string("image format not supported: ") + image->mime_type);
-			return NULL;
-		}
-		if (!img.width)
-		{
-			stdlog(std::string("image encoding has error: ") + image->mime_type);
-			return NULL;
-		}
-		Texture* tex = new Texture();
-		tex->loadFromImage(&img);
+		//unnamed textures sharing the image use the same one
+		auto it = image_textures.find(std::make_pair(image, srgb));
+		if (it != image_textures.end())
+			return it->second;
+
+		//decoded in the background straight from the buffer, meanwhile it is a 1x1 texture
+		cgltf_buffer_view* view = image->buffer_view;
+		const unsigned char* data = (const unsigned char*)view->buffer->data + view->offset;
+		Texture* tex = Texture::GetAsyncFromMemory(filename ? fullpath.c_str() : NULL, getGLTFBufferOwner(view->buffer), data, view->size, image->mime_type, true, srgb);
+		image_textures[std::make_pair(image, srgb)] = tex;
+		embedded_textures[tex] = image;
 		if (filename)
-		{
-			tex->setName(fullpath.c_str());
 			stdlog(std::string("\t<- TEXTURE: ") + fullpath);
-		}
 		else
-			stdlog(std::string(" TEXTURE: UNNAMED ") + image->mime_type );
+			stdlog(std::string(" TEXTURE: UNNAMED ") + (image->mime_type ? image->mime_type : ""));
 
 		return tex;
 	}
@@ -318,7 +745,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	material->emissive_factor = matdata->emissive_factor;
 	if (matdata->emissive_texture.texture)
 	{
-		material->emissive_texture.texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name);
+		material->emissive_texture.texture = parseGLTFTexture(matdata->emissive_texture.texture->image, matdata->emissive_texture.texture->name, true);
 		material->emissive_texture.uv_channel = matdata->emissive_texture.texcoord;
 	}
 
@@ -327,7 +754,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 	if (matdata->has_pbr_specular_glossiness)
 	{
 		if (matdata->pbr_specular_glossiness.diffuse_texture.texture)
-			material->color_texture.texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name);
+			material->color_texture.texture = parseGLTFTexture(matdata->pbr_specular_glossiness.diffuse_texture.texture->image, matdata->pbr_specular_glossiness.diffuse_texture.texture->name, true);
 	}
 	if (matdata->has_pbr_metallic_roughness)
 	{
@@ -339,7 +766,7 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 		{
 			if (matdata->pbr_metallic_roughness.base_color_texture.texture)
 			{
-				material->color_texture.texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name);
+				material->color_texture.texture = parseGLTFTexture(matdata->pbr_metallic_roughness.base_color_texture.texture->image, matdata->pbr_metallic_roughness.base_color_texture.texture->name, true);
 				material->color_texture.uv_channel = matdata->pbr_metallic_roughness.base_color_texture.texcoord;
 			}
 			if (matdata->pbr_metallic_roughness.metallic_roughness_texture.texture)
@@ -356,7 +783,8 @@ GTR::Material* parseGLTFMaterial(cgltf_material* matdata, const char* basename)
 		material->occlusion_texture.uv_channel = matdata->occlusion_texture.texcoord;
 	}
 
-	return material;
+	//an identical material (same textures too) could come from another file
+	return GTR::Material::Share(material);
 }
 
 void parseGLTFTransform(cgltf_node* node, Matrix44 &model)
@@ -443,7 +871,7 @@ cgltf_result internalOpenFile(const struct cgltf_memory_options* memory_options,
     if (!readFileBin(path, buffer))
         return cgltf_result_file_not_found;
     *size = buffer.size();
-    char* file_data = new char[*size];
+    char* file_data = (char*)malloc(*size); //cgltf releases it with free
     memcpy(file_data, &buffer[0], *size);
     *data = file_data;
     return cgltf_result_success;
@@ -455,7 +883,7 @@ cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_option
 {
 	stdlog(std::string(" <- ") + path);
 	*size = g_buffer.size();
-	char* file_data = new char[*size];
+	char* file_data = (char*)malloc(*size); //cgltf releases it with free
 	memcpy(file_data, &g_buffer[0], *size);
 	*data = file_data;
 
@@ -464,6 +892,90 @@ cgltf_result internalOpenMemory(const struct cgltf_memory_options* memory_option
 	return cgltf_result_success;
 }
 
+//collects the meshes used by the nodes in the order they will be parsed
+void collectGLTFMeshes(cgltf_node* node, std::vector<cgltf_mesh*>& meshes, std::set<cgltf_mesh*>& visited)
+{
+	if (node->mesh && visited.find(node->mesh) == visited.end())
+	{
+		visited.insert(node->mesh);
+		meshes.push_back(node->mesh);
+	}
+	for (int i = 0; i < node->children_count; ++i)
+		collectGLTFMeshes(node->children[i], meshes, visited);
+}
+
+//decodes in parallel all the meshes that are not loaded yet and uploads them (embedded images are decoded
+//in the background when the textures are parsed), so parsing the nodes later is just assembling the tree in the same order as before
+void decodeGLTFData(cgltf_data* data, cgltf_scene* scene, const char* basename)
+{
+	long start_time = getTime();
+
+	struct sPrimitiveJob {
+		cgltf_primitive* primitive;
+		Mesh* mesh;
+		std::string name; //empty if the mesh has no name
+		std::vector<Mesh*>* result; //where the mesh goes, it can be replaced by a shared one
+		int index;
+	};
+	std::vector<sPrimitiveJob> primitive_jobs;
+
+	//stage 1: find what needs to be decoded (main thread)
+	std::vector<cgltf_mesh*> meshes;
+	std::set<cgltf_mesh*> visited_meshes;
+	for (int i = 0; i < scene->nodes_count; ++i)
+		collectGLTFMeshes(scene->nodes[i], meshes, visited_meshes);
+
+	for (int i = 0; i < meshes.size(); ++i)
+	{
+		cgltf_mesh* meshdata = meshes[i];
+		std::vector<Mesh*>& result = decoded_meshes[meshdata];
+		if (meshdata->name)
+			stdlog(std::string("\t<- MESH: ") + meshdata->name);
+		for (int j = 0; j < meshdata->primitives_count; ++j)
+		{
+			sPrimitiveJob job;
+			job.primitive = &meshdata->primitives[j];
+			job.mesh = NULL;
+			if (meshdata->name)
+			{
+				job.name = getGLTFSubmeshName(meshdata, basename, j);
+				job.mesh = Mesh::Get(job.name.c_str(), true);
+			}
+			if (!job.mesh)
+			{
+				job.mesh = new Mesh();
+				job.result = &result;
+				job.index = (int)result.size();
+				primitive_jobs.push_back(job);
+			}
+			result.push_back(job.mesh);
+		}
+	}
+
+	//stage 2: decode everything in parallel, no GL calls here
+	parallelFor((int)primitive_jobs.size(), [&](int i) {
+		decodeGLTFPrimitive(primitive_jobs[i].primitive, primitive_jobs[i].mesh);
+		primitive_jobs[i].mesh->content_hash = primitive_jobs[i].mesh->computeContentHash();
+	});
+
+	//stage 3: upload in the main thread, in the original order, unless the same geometry is already loaded
+	for (int i = 0; i < primitive_jobs.size(); ++i)
+	{
+		sPrimitiveJob& job = primitive_jobs[i];
+		Mesh* shared = Mesh::Share(job.mesh);
+		if (shared != job.mesh)
+		{
+			(*job.result)[job.index] = shared;
+			continue;
+		}
+		job.mesh->uploadToVRAM();
+		if (job.name.size())
+			job.mesh->registerMesh(job.name);
+	}
+
+	stdlog(std::string(" - Decoded ") + std::to_string(primitive_jobs.size()) + " primitives in " + std::to_string(getTime() - start_time) + "ms");
+}
+
 GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& options)
 {
 	cgltf_result result;
@@ -480,9 +992,27 @@ GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	char* name_start = strrchr(folder, '/');
 	*name_start = '\0';
 	base_folder = folder; //global
+	current_data = data;
 	const char* basename_start = strrchr(filename, '/');
 	strcpy(basename, basename_start+1);
 
+	//the external files are read while the first buffers are being parsed (see file_io.h)
+	if (options.file.read == internalOpenFile)
+	{
+		for (cgltf_size i = 0; i < data->buffers_count; ++i)
+		{
+			const char* uri = data->buffers[i].uri;
+			if (uri && strncmp(uri, "data:", 5) != 0 && !strstr(uri, "://"))
+				FileIO::prefetch(base_folder + "/" + uri);
+		}
+		for (cgltf_size i = 0; i < data->images_count && load_textures; ++i)
+		{
+			const char* uri = data->images[i].uri;
+			if (uri && strncmp(uri, "data:", 5) != 0 && !strstr(uri, "://"))
+				Texture::prefetch((base_folder + "/" + uri).c_str());
+		}
+	}
+
 	{
 		result = cgltf_load_buffers(&options, data, filename);
 		if (result != cgltf_result_success) {
@@ -491,6 +1021,8 @@ GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 		}
 	}
 
+	decodeGLTFData(data, scene, filename);
+
 	GTR::Prefab* prefab = new GTR::Prefab();
 
 	{
@@ -531,6 +1063,36 @@ GTR::Prefab* loadGLTF(const char *filename, cgltf_data *data, cgltf_options& opt
 	prefab->updateNodesByName();
 	prefab->updateBounding();
 
+	//store it cooked so next time the glTF doesnt have to be parsed
+	if (GTR::Prefab::use_cooked)
+	{
+		std::map<Texture*, sCookedImage> images;
+		for (auto it = embedded_textures.begin(); it != embedded_textures.end(); ++it)
+		{
+			sCookedImage& cooked = images[it->first];
+			cooked.mime_type = it->second->mime_type ? it->second->mime_type : "";
+			cooked.data = (const unsigned char*)it->second->buffer_view->buffer->data + it->second->buffer_view->offset;
+			cooked.size = it->second->buffer_view->size;
+		}
+		writeCookedPrefab(prefab, filename, images);
+	}
+
+	//the meshes are already in the prefab
+	decoded_meshes.clear();
+	image_textures.clear();
+	embedded_textures.clear();
+
+	//the buffers being decoded are owned now by the tasks, so cgltf must not free them
+	for (auto it = buffer_owners.begin(); it != buffer_owners.end(); ++it)
+	{
+		if (it->first->data == data->bin)
+			data->file_data = NULL;
+		else
+			it->first->data = NULL;
+	}
+	buffer_owners.clear();
+	current_data = NULL;
+
 	//frees all data, including bin
 	cgltf_free(data);
 
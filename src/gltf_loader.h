@@ -5,3 +5,6 @@
 GTR::Prefab* loadGLTF(const char* filename);
 //GTR::Prefab* loadGLTF(const char* filename, cgltf_data* data, cgltf_options& options);
 GTR::Prefab* loadGLTF(const std::vector<unsigned char>& data, const std::string& path);
+
+//compares the accessor decoding against cgltf on big synthetic accessors and prints the timings
+void benchmarkGLTFAccessors(int num_elements = 1000000);
@@ -0,0 +1,470 @@
+#include "jobs.h"
+
+#include "includes.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <iostream>
+#include <cassert>
+#include <cstdint>
+
+struct sJob
+{
+	std::function<void()> func;
+	std::atomic<int> unfinished_dependencies;
+	std::atomic<bool> finished;
+	std::mutex mutex; //protects continuations
+	std::vector<std::shared_ptr<sJob>> continuations; //jobs waiting for this one
+	std::shared_ptr<sJob> self; //keeps it alive while it is queued
+};
+
+//Chase-Lev deque with a fixed size: only the owner pushes and pops from the bottom, the rest steal from the top
+class JobDeque {
+public:
+	JobDeque(int size) { mask = size - 1; buffer = new std::atomic<sJob*>[size]; top = bottom = 0; }
+	~JobDeque() { delete[] buffer; }
+
+	bool push(sJob* job)
+	{
+		long b = bottom.load(std::memory_order_relaxed);
+		long t = top.load(std::memory_order_acquire);
+		if (b - t > mask) //full
+			return false;
+		buffer[b & mask].store(job, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	sJob* pop()
+	{
+		long b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		long t = top.load(std::memory_order_relaxed);
+		sJob* job = NULL;
+		if (t <= b)
+		{
+			job = buffer[b & mask].load(std::memory_order_relaxed);
+			if (t == b) //the last one, a thief could be taking it
+			{
+				if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					job = NULL;
+				bottom.store(b + 1, std::memory_order_relaxed);
+			}
+		}
+		else
+			bottom.store(b + 1, std::memory_order_relaxed);
+		return job;
+	}
+
+	sJob* steal()
+	{
+		long t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		long b = bottom.load(std::memory_order_acquire);
+		if (t >= b)
+			return NULL;
+		sJob* job = buffer[t & mask].load(std::memory_order_relaxed);
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return NULL; //another thief or the owner took it
+		return job;
+	}
+
+private:
+	std::atomic<sJob*>* buffer;
+	long mask;
+	std::atomic<long> top;
+	std::atomic<long> bottom;
+};
+
+//bounded lock-free queue for many producers and consumers (each cell knows in which turn it can be written or read)
+class JobQueue {
+public:
+	JobQueue(int size)
+	{
+		mask = size - 1;
+		cells = new sCell[size];
+		for (int i = 0; i < size; ++i)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		enqueue_pos = dequeue_pos = 0;
+	}
+	~JobQueue() { delete[] cells; }
+
+	bool push(sJob* job)
+	{
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		sCell* cell;
+		while (true)
+		{
+			cell = &cells[pos & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+			if (diff == 0)
+			{
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0) //full
+				return false;
+			else
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+		cell->job = job;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	sJob* pop()
+	{
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		sCell* cell;
+		while (true)
+		{
+			cell = &cells[pos & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+			if (diff == 0)
+			{
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0) //empty
+				return NULL;
+			else
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+		}
+		sJob* job = cell->job;
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+		return job;
+	}
+
+private:
+	struct sCell {
+		std::atomic<size_t> sequence;
+		sJob* job;
+	};
+	sCell* cells;
+	size_t mask;
+	std::atomic<size_t> enqueue_pos;
+	std::atomic<size_t> dequeue_pos;
+};
+
+#define JOB_DEQUE_SIZE 4096
+#define JOB_QUEUE_SIZE 16384
+
+int JobSystem::num_workers = 0;
+std::atomic<int> JobSystem::num_queued(0);
+std::atomic<long> JobSystem::num_executed(0);
+std::atomic<long> JobSystem::num_stolen(0);
+
+static std::vector<std::thread*> workers;
+static std::vector<JobDeque*> deques;
+static JobQueue submissions(JOB_QUEUE_SIZE); //from the threads that are not workers
+static std::atomic<bool> must_loop(false);
+static thread_local int worker_index = -1;
+
+//idle workers sleep until there is something queued
+static std::mutex sleep_mutex;
+static std::condition_variable sleep_condition;
+static std::atomic<int> num_sleeping(0);
+
+//threads that are not workers sleep while they wait for a job
+static std::mutex wait_mutex;
+static std::condition_variable wait_condition;
+static std::atomic<int> num_waiting(0);
+
+static void executeJob(sJob* job);
+
+static void scheduleJob(const std::shared_ptr<sJob>& job)
+{
+	//without workers (or when the queues are full) it is executed now
+	job->self = job;
+	bool queued = false;
+	if (!workers.empty())
+	{
+		if (worker_index != -1)
+			queued = deques[worker_index]->push(job.get());
+		if (!queued)
+			queued = submissions.push(job.get());
+	}
+	if (!queued)
+	{
+		executeJob(job.get());
+		return;
+	}
+
+	JobSystem::num_queued++;
+	if (num_sleeping > 0)
+	{
+		{ const std::lock_guard<std::mutex> lock(sleep_mutex); } //so it is not lost between the check and the wait of a worker
+		sleep_condition.notify_one();
+	}
+}
+
+static unsigned int randomIndex()
+{
+	static thread_local unsigned int state = 0x9E3779B9u ^ (unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id());
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+static sJob* findJob()
+{
+	sJob* job = NULL;
+	if (worker_index != -1)
+		job = deques[worker_index]->pop();
+	if (!job)
+		job = submissions.pop();
+	if (!job && !deques.empty())
+	{
+		int num = (int)deques.size();
+		int start = (int)(randomIndex() % num);
+		for (int i = 0; i < num && !job; ++i)
+		{
+			int victim = (start + i) % num;
+			if (victim == worker_index)
+				continue;
+			job = deques[victim]->steal();
+			if (job)
+				JobSystem::num_stolen++;
+		}
+	}
+	if (job)
+		JobSystem::num_queued--;
+	return job;
+}
+
+static void executeJob(sJob* job)
+{
+	std::shared_ptr<sJob> keep;
+	keep.swap(job->self);
+	if (job->func)
+		job->func();
+	job->func = nullptr; //releases what it captured
+
+	std::vector<std::shared_ptr<sJob>> next;
+	{
+		const std::lock_guard<std::mutex> lock(job->mutex);
+		job->finished = true;
+		next.swap(job->continuations);
+	}
+	for (int i = 0; i < next.size(); ++i)
+		if (--next[i]->unfinished_dependencies == 0)
+			scheduleJob(next[i]);
+	JobSystem::num_executed++;
+
+	if (num_waiting > 0)
+	{
+		{ const std::lock_guard<std::mutex> lock(wait_mutex); }
+		wait_condition.notify_all();
+	}
+}
+
+static void workerLoop(int index)
+{
+	worker_index = index;
+	while (must_loop)
+	{
+		sJob* job = findJob();
+		if (job)
+		{
+			executeJob(job);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		num_sleeping++;
+		sleep_condition.wait(lock, []() { return JobSystem::num_queued > 0 || !must_loop; });
+		num_sleeping--;
+	}
+}
+
+void JobSystem::startThreads()
+{
+	assert(workers.empty() && "JobSystem already started");
+	int num = num_workers;
+	if (num <= 0)
+		num = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+	std::cout << "Starting " << num << " job workers" << std::endl;
+	must_loop = true;
+	for (int i = 0; i < num; ++i)
+		deques.push_back(new JobDeque(JOB_DEQUE_SIZE));
+	for (int i = 0; i < num; ++i)
+		workers.push_back(new std::thread(workerLoop, i));
+}
+
+void JobSystem::stopThreads()
+{
+	{
+		const std::lock_guard<std::mutex> lock(sleep_mutex);
+		must_loop = false;
+	}
+	sleep_condition.notify_all();
+	for (int i = 0; i < workers.size(); ++i)
+	{
+		workers[i]->join();
+		delete workers[i];
+	}
+	workers.clear();
+	//the jobs left in the deques are not executed
+	for (int i = 0; i < deques.size(); ++i)
+		delete deques[i];
+	deques.clear();
+}
+
+int JobSystem::getNumWorkers()
+{
+	return (int)workers.size();
+}
+
+int JobSystem::getWorkerIndex()
+{
+	return worker_index;
+}
+
+JobHandle JobSystem::run(std::function<void()> func, const std::vector<JobHandle>& dependencies)
+{
+	std::shared_ptr<sJob> job = std::make_shared<sJob>();
+	job->func = std::move(func);
+	job->finished = false;
+	job->unfinished_dependencies = 1; //until all the dependencies are checked
+	for (int i = 0; i < dependencies.size(); ++i)
+	{
+		sJob* dependency = dependencies[i].job.get();
+		if (!dependency)
+			continue;
+		const std::lock_guard<std::mutex> lock(dependency->mutex);
+		if (dependency->finished)
+			continue;
+		job->unfinished_dependencies++;
+		dependency->continuations.push_back(job);
+	}
+	if (--job->unfinished_dependencies == 0)
+		scheduleJob(job);
+	return JobHandle(job);
+}
+
+void JobSystem::waitAll(const std::vector<JobHandle>& jobs)
+{
+	for (int i = 0; i < jobs.size(); ++i)
+		jobs[i].wait();
+}
+
+struct sParallelFor
+{
+	std::function<void(int)> async_func; //a copy when the caller doesnt wait
+	const std::function<void(int)>* func;
+	int count;
+	int grain_size;
+	int num_chunks;
+	std::atomic<int> next_chunk;
+	std::atomic<int> done_chunks;
+
+	void work()
+	{
+		//only the chunks taken touch func, so late helpers dont use it after the caller returned
+		int chunk;
+		while ((chunk = next_chunk.fetch_add(1)) < num_chunks)
+		{
+			int end = std::min((chunk + 1) * grain_size, count);
+			for (int i = chunk * grain_size; i < end; ++i)
+				(*func)(i);
+			done_chunks++;
+		}
+	}
+};
+
+void JobSystem::parallelFor(int count, const std::function<void(int)>& func, int grain_size, int max_threads)
+{
+	grain_size = std::max(grain_size, 1);
+	int num_chunks = (count + grain_size - 1) / grain_size;
+	int num_helpers = std::min(num_chunks - 1, (int)workers.size());
+	if (max_threads > 0)
+		num_helpers = std::min(num_helpers, max_threads - 1);
+	if (num_helpers <= 0)
+	{
+		for (int i = 0; i < count; ++i)
+			func(i);
+		return;
+	}
+
+	std::shared_ptr<sParallelFor> state = std::make_shared<sParallelFor>();
+	state->func = &func;
+	state->count = count;
+	state->grain_size = grain_size;
+	state->num_chunks = num_chunks;
+	state->next_chunk = 0;
+	state->done_chunks = 0;
+	for (int i = 0; i < num_helpers; ++i)
+		run([state]() { state->work(); });
+	state->work(); //this thread works too
+
+	//the last chunks are being done by the helpers
+	while (state->done_chunks < num_chunks)
+		std::this_thread::yield();
+}
+
+JobHandle JobSystem::parallelForAsync(int count, std::function<void(int)> func, int grain_size, const std::vector<JobHandle>& dependencies)
+{
+	std::shared_ptr<sParallelFor> state = std::make_shared<sParallelFor>();
+	state->async_func = std::move(func);
+	state->func = &state->async_func;
+	state->count = count;
+	state->grain_size = std::max(grain_size, 1);
+	state->num_chunks = (count + state->grain_size - 1) / state->grain_size;
+	state->next_chunk = 0;
+	state->done_chunks = 0;
+
+	int num_jobs = std::min(state->num_chunks, std::max((int)workers.size(), 1));
+	std::vector<JobHandle> jobs;
+	for (int i = 0; i < num_jobs; ++i)
+		jobs.push_back(run([state]() { state->work(); }, dependencies));
+	return run([state]() {}, jobs.size() ? jobs : dependencies);
+}
+
+bool JobHandle::isFinished() const
+{
+	return !job || job->finished;
+}
+
+void JobHandle::wait() const
+{
+	if (!job || job->finished)
+		return;
+
+	if (worker_index != -1)
+	{
+		//a worker keeps working, it could be the one that has to run it
+		while (!job->finished)
+		{
+			sJob* other = findJob();
+			if (other)
+				executeJob(other);
+			else
+				std::this_thread::yield();
+		}
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(wait_mutex);
+	num_waiting++;
+	wait_condition.wait(lock, [this]() { return job->finished.load(); });
+	num_waiting--;
+}
+
+JobHandle JobHandle::then(std::function<void()> func) const
+{
+	return JobSystem::run(std::move(func), std::vector<JobHandle>(1, *this));
+}
+
+void JobSystem::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("Workers: %d (%d sleeping)", (int)workers.size(), (int)num_sleeping);
+	ImGui::Text("Queued: %d, executed: %d, stolen: %d", (int)num_queued, (int)num_executed, (int)num_stolen);
+#endif
+}
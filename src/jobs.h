@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+
+//Work-stealing job system: every worker has its own deque, the jobs it creates go to the back and it takes them from the
+//back too (the newest, still in cache), when it runs out it steals the oldest ones from the front of the other deques.
+//Jobs created from other threads (like the main one) go to a lock-free queue shared by all the workers.
+//A job can depend on other jobs (it is scheduled when the last one finishes) and can be waited.
+//TaskManager::background runs its tasks here, TaskManager::foreground is still the queue of the main thread (GL work)
+
+struct sJob;
+
+class JobHandle {
+public:
+	std::shared_ptr<sJob> job;
+
+	JobHandle() {}
+	JobHandle(const std::shared_ptr<sJob>& job) { this->job = job; }
+
+	bool isValid() const { return job != nullptr; }
+	bool isFinished() const; //an invalid handle is finished
+	void wait() const; //workers run other jobs meanwhile, other threads sleep
+	JobHandle then(std::function<void()> func) const; //runs func once this one has finished
+};
+
+class JobSystem {
+public:
+	static int num_workers; //0 means one per core except the main thread
+
+	//stats
+	static std::atomic<int> num_queued;
+	static std::atomic<long> num_executed;
+	static std::atomic<long> num_stolen;
+
+	static void startThreads(); //before that the jobs are executed when created
+	static void stopThreads(); //waits for the running jobs, the pending ones are left
+	static int getNumWorkers();
+	static int getWorkerIndex(); //-1 if the current thread is not a worker
+
+	//func is executed once all the dependencies have finished
+	static JobHandle run(std::function<void()> func, const std::vector<JobHandle>& dependencies = std::vector<JobHandle>());
+	static void waitAll(const std::vector<JobHandle>& jobs);
+
+	//calls func(i) for every i in [0,count) in chunks of grain_size, the calling thread works too and it returns when all
+	//are done. max_threads 0 means all the workers
+	static void parallelFor(int count, const std::function<void(int)>& func, int grain_size = 1, int max_threads = 0);
+	//the same without blocking, the handle finishes when all of them are done
+	static JobHandle parallelForAsync(int count, std::function<void(int)> func, int grain_size = 1, const std::vector<JobHandle>& dependencies = std::vector<JobHandle>());
+
+	static void renderInMenu();
+};
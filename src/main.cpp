@@ -16,6 +16,9 @@
 #include "input.h"
 #include "application.h"
 #include "task.h"
+#include "jobs.h"
+#include "file_io.h"
+#include "texture.h"
 
 #include <iostream> //to output
 
@@ -127,7 +130,7 @@ void mainLoop(SDL_Window* window)
 	long now = start_time;
 	long frames_this_second = 0;
 
-	TaskManager::background.startThread();
+	TextureDecodePool::startThreads();
 
 	while (!app->must_exit)
 	{
@@ -201,8 +204,8 @@ void mainLoop(SDL_Window* window)
 		//update app logic
 		app->update(elapsed_time);
 
-		//execute a task in the main task manager (blocking)
-		TaskManager::foreground.fetchTask();
+		//execute the tasks of the main task manager until its time budget is used (blocking)
+		TaskManager::foreground.fetchTasks();
 
 		//check errors in opengl only when working in debug
 		#ifdef _DEBUG
@@ -251,11 +254,18 @@ int main(int argc, char **argv)
 
 	Input::init(window);
 
+	//before the app, loading the scene already creates jobs
+	JobSystem::startThreads();
+	FileIO::startThreads();
+
 	//launch the application (app is a global variable)
 	app = new Application(window_width, window_height, window);
 
 	//main loop, application gets inside here till user closes it
 	mainLoop(window);
+	TextureDecodePool::stopThreads();
+	JobSystem::stopThreads();
+	FileIO::stopThreads(); //after the jobs, they could be waiting for a read
 
 	//save state and free memory
 	// Cleanup
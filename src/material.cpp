@@ -3,10 +3,14 @@
 
 #include "includes.h"
 #include "texture.h"
+#include "content_hash.h"
+
+#include <algorithm>
 
 using namespace GTR;
 
 std::map<std::string, Material*> Material::sMaterials;
+std::map<uint64_t, Material*> Material::sMaterialsByContent;
 
 Material* Material::Get(const char* name)
 {
@@ -30,13 +34,64 @@ void Material::registerMaterial(const char* name)
 	}
 }
 
+uint64_t Material::computeContentHash()
+{
+	//field by field, the struct has padding
+	ContentHash hash = hashMemory(&alpha_mode, sizeof(alpha_mode));
+	hash = hashMemory(&alpha_cutoff, sizeof(alpha_cutoff), hash);
+	hash = hashMemory(&two_sided, sizeof(two_sided), hash);
+	hash = hashMemory(&_zMin, sizeof(_zMin), hash);
+	hash = hashMemory(&_zMax, sizeof(_zMax), hash);
+	hash = hashMemory(&color, sizeof(color), hash);
+	hash = hashMemory(&roughness_factor, sizeof(roughness_factor), hash);
+	hash = hashMemory(&metallic_factor, sizeof(metallic_factor), hash);
+	hash = hashMemory(&emissive_factor, sizeof(emissive_factor), hash);
+	Sampler* samplers[] = { &color_texture, &emissive_texture, &opacity_texture, &metallic_roughness_texture, &occlusion_texture, &normal_texture };
+	for (int i = 0; i < 6; ++i)
+	{
+		hash = hashMemory(&samplers[i]->texture, sizeof(Texture*), hash);
+		hash = hashMemory(&samplers[i]->uv_channel, sizeof(int), hash);
+	}
+	return hash;
+}
+
+Material* Material::Share(Material* material)
+{
+	if (!material->content_hash)
+		material->content_hash = material->computeContentHash();
+
+	auto it = sMaterialsByContent.find(material->content_hash);
+	if (it != sMaterialsByContent.end() && it->second != material)
+	{
+		dedup_stats.materials++;
+		Material* shared = it->second;
+		//the name keeps working, it gets the shared one
+		if (material->name.size())
+			sMaterials[material->name] = shared;
+		material->content_hash = 0; //so it doesnt unregister the shared one
+		delete material;
+		return shared;
+	}
+
+	sMaterialsByContent[material->content_hash] = material;
+	return material;
+}
+
 Material::~Material()
 {
-	if (name.size())
+	if (content_hash)
+	{
+		auto it = sMaterialsByContent.find(content_hash);
+		if (it != sMaterialsByContent.end() && it->second == this)
+			sMaterialsByContent.erase(it);
+	}
+	//its own name and the ones of the duplicates it replaced (see Share)
+	for (auto it = sMaterials.begin(); it != sMaterials.end();)
 	{
-		auto it = sMaterials.find(name);
-		if (it != sMaterials.end())
-			sMaterials.erase(it);
+		if (it->second == this)
+			it = sMaterials.erase(it);
+		else
+			++it;
 	}
 }
 
@@ -49,6 +104,9 @@ void Material::Release()
 		Material *m = mp.second;
 		mats.push_back(m);
 	}
+	//a shared material can be under several names
+	std::sort(mats.begin(), mats.end());
+	mats.erase(std::unique(mats.begin(), mats.end()), mats.end());
 
 	for (Material *m : mats)
 	{
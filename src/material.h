@@ -42,6 +42,11 @@ namespace GTR {
 		static Material* Get(const char* name);
 		std::string name;
 		void registerMaterial(const char* name);
+		static std::map<uint64_t, Material*> sMaterialsByContent; //imported materials by content hash (see content_hash.h)
+		uint64_t content_hash; //0 if it is not registered by content
+		uint64_t computeContentHash(); //parameters and texture instances, so share the textures first
+		//returns the material with the same content if there is one (deleting this one), otherwise registers it by content
+		static Material* Share(Material* material);
 
 		//parameters to control transparency
 		eAlphaMode alpha_mode;	//could be NO_ALPHA, MASK (alpha cut) or BLEND (alpha blend)
@@ -65,7 +70,7 @@ namespace GTR {
 		Sampler normal_texture;	//normalmap
 
 		//ctors
-		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
+		Material() : content_hash(0), alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), _zMin(0.0f), _zMax(1.0f), two_sided(false), roughness_factor(1), metallic_factor(0) {
 			//color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
 		}
 		Material(Texture* texture) : Material() { color_texture.texture = texture; }
@@ -8,12 +8,16 @@
 #include <cassert>
 #include <iostream>
 #include <limits>
+#include <algorithm>
 #include <sys/stat.h>
 
 #include "camera.h"
 #include "texture.h"
 //#include "animation.h"
 #include "extra/coldet/coldet.h"
+#include "bvh.h"
+#include "content_hash.h"
+#include "file_io.h"
 
 //#include "engine/application.h"
 
@@ -22,8 +26,17 @@ bool Mesh::auto_upload_to_vram = true;	//uploads the mesh to the GPU VRAM to spe
 bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved array
 
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
+std::map<uint64_t, Mesh*> Mesh::sMeshesByContent;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+bool Mesh::build_clusters = true;		//splits the meshes in clusters of triangles to cull them separately
+long Mesh::num_clusters_tested = 0;
+long Mesh::num_clusters_culled = 0;
+bool Mesh::release_cpu_data = true;		//frees the RAM copy of the meshes that are already in VRAM
+size_t Mesh::memory_budget = 1024 * 1024 * 1024; //1GB between RAM and VRAM
+bool Mesh::keep_quantized_streams = true;	//uploads quantized glTF streams in their compact format
+long Mesh::frame = 0;
+bool Mesh::use_coldet = false;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -33,19 +46,61 @@ long Mesh::num_triangles_rendered = 0;
 Mesh::Mesh()
 {
 	radius = 0;
+	loading = false;
+	keep_cpu_data = false;
+	evicted = false;
+	last_used_frame = 0;
+	num_vertices = num_indices = 0;
+	gpu_memory = 0;
+	uv_density = 0;
 	vertices_vbo_id = uvs_vbo_id = uvs1_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
 	collision_model = NULL;
+	bvh = NULL;
+	bvh_pending = false;
+	content_hash = 0;
 
 	clear();
 }
 
 Mesh::~Mesh()
 {
+	if (content_hash)
+	{
+		auto it = sMeshesByContent.find(content_hash);
+		if (it != sMeshesByContent.end() && it->second == this)
+			sMeshesByContent.erase(it);
+	}
 	clear();
 }
 
 
 void Mesh::clear()
+{
+	releaseGPUData();
+
+	//buffers
+	vertices.clear();
+	normals.clear();
+	uvs.clear();
+	colors.clear();
+	interleaved.clear();
+	m_indices.clear();
+	bones.clear();
+	weights.clear();
+	m_uvs1.clear();
+	packed_normals.clear();
+	packed_uvs.clear();
+	clusters.clear();
+
+	if (collision_model)
+		delete (CollisionModel3D*)collision_model;
+	collision_model = NULL;
+	if (bvh)
+		delete bvh;
+	bvh = NULL;
+}
+
+void Mesh::releaseGPUData()
 {
 	//Free VBOs
 	#ifdef USE_OPENGL_EXT
@@ -91,20 +146,7 @@ void Mesh::clear()
 
 	//VBOs ids
 	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
-
-	//buffers
-	vertices.clear();
-	normals.clear();
-	uvs.clear();
-	colors.clear();
-	interleaved.clear();
-	m_indices.clear();
-	bones.clear();
-	weights.clear();
-	m_uvs1.clear();
-
-	if (collision_model)
-		delete (CollisionModel3D*)collision_model;
+	gpu_memory = 0;
 }
 
 int vertex_location = -1;
@@ -128,7 +170,7 @@ void Mesh::enableBuffers(Shader* sh)
 	int offset_normal = 0;
 	int offset_uv = 0;
 
-	if (interleaved.size())
+	if (interleaved.size() || interleaved_vbo_id)
 	{
 		spacing = sizeof(tInterleaved);
 		offset_normal = sizeof(Vector3);
@@ -149,13 +191,18 @@ void Mesh::enableBuffers(Shader* sh)
 	}
 
 	normal_location = -1;
-	if (normals.size() || spacing)
+	if (normals.size() || normals_vbo_id || spacing)
 	{
 		normal_location = sh->getAttribLocation("a_normal");
 		if (normal_location != -1)
 		{
 			glEnableVertexAttribArray(normal_location);
-			if (normals_vbo_id || interleaved_vbo_id)
+			if (normals_vbo_id && packed_normals.type)
+			{
+				glBindBuffer(GL_ARRAY_BUFFER, normals_vbo_id);
+				glVertexAttribPointer(normal_location, 3, packed_normals.type, packed_normals.normalized, packed_normals.stride, 0);
+			}
+			else if (normals_vbo_id || interleaved_vbo_id)
 			{
 				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
 				glVertexAttribPointer(normal_location, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
@@ -167,13 +214,18 @@ void Mesh::enableBuffers(Shader* sh)
 	}
 
 	uv_location = -1;
-	if (uvs.size() || spacing)
+	if (uvs.size() || uvs_vbo_id || spacing)
 	{
 		uv_location = sh->getAttribLocation("a_coord");
 		if (uv_location != -1)
 		{
 			glEnableVertexAttribArray(uv_location);
-			if (uvs_vbo_id || interleaved_vbo_id)
+			if (uvs_vbo_id && packed_uvs.type)
+			{
+				glBindBuffer(GL_ARRAY_BUFFER, uvs_vbo_id);
+				glVertexAttribPointer(uv_location, 2, packed_uvs.type, packed_uvs.normalized, packed_uvs.stride, 0);
+			}
+			else if (uvs_vbo_id || interleaved_vbo_id)
 			{
 				glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
 				glVertexAttribPointer(uv_location, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
@@ -185,7 +237,7 @@ void Mesh::enableBuffers(Shader* sh)
 	}
 
 	uv1_location = -1;
-	if (m_uvs1.size())
+	if (m_uvs1.size() || uvs1_vbo_id)
 	{
 		uv1_location = sh->getAttribLocation("a_coord1");
 		if (uv1_location != -1)
@@ -203,7 +255,7 @@ void Mesh::enableBuffers(Shader* sh)
 	}
 
 	color_location = -1;
-	if (colors.size())
+	if (colors.size() || colors_vbo_id)
 	{
 		color_location = sh->getAttribLocation("a_color");
 		if (color_location != -1)
@@ -221,7 +273,7 @@ void Mesh::enableBuffers(Shader* sh)
 	}
 
 	bones_location = -1;
-	if (bones.size())
+	if (bones.size() || bones_vbo_id)
 	{
 		bones_location = sh->getAttribLocation("a_bones");
 		if (bones_location != -1)
@@ -237,7 +289,7 @@ void Mesh::enableBuffers(Shader* sh)
 		}
 	}
 	weights_location = -1;
-	if (weights.size())
+	if (weights.size() || weights_vbo_id)
 	{
 		weights_location = sh->getAttribLocation("a_weights");
 		if (weights_location != -1)
@@ -265,7 +317,10 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 		assert(0 && "no shader or shader not compiled or enabled");
 		return;
 	}
-	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
+	if (evicted && !makeResident())
+		return;
+	assert(getNumVertices() && "No vertices in this mesh");
+	last_used_frame = frame;
 
 	//bind buffers to attribute locations
 	enableBuffers(shader);
@@ -283,30 +338,30 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 {
 	int start = 0; //in primitives
-	int size = (int)vertices.size();
-	if (m_indices.size())
-		size = (int)m_indices.size();
-	else
-	if (interleaved.size())
-		size = (int)interleaved.size();
+	int size = getNumIndices() ? (int)getNumIndices() : (int)getNumVertices();
 
 	if (submesh_id > -1)
 	{
 		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
 		sSubmeshInfo& submesh = submeshes[submesh_id];
 		start = submesh.start;
-		size = submesh.start + submesh.length;
+		size = submesh.length;
 	}
 
+	drawRange(primitive, start, size, num_instances);
+}
+
+void Mesh::drawRange(unsigned int primitive, int start, int size, int num_instances)
+{
 	//DRAW
-	if (m_indices.size())
+	if (getNumIndices())
 	{
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
 			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
 			#ifdef OPENGL_ES3
-				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3u)), num_instances);
+				glDrawElementsInstanced(primitive, size, GL_UNSIGNED_INT, (void*)(start * sizeof(unsigned int)), num_instances);
             #else
 				assert(0 && "not supported in OpenGL ES2");
             #endif
@@ -316,15 +371,13 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		{
 			if (indices_vbo_id)
 			{
-				/*if (size != 90)*/ {
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-					glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(Vector3u)));
-					glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-				}
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+				glDrawElements(primitive, size, GL_UNSIGNED_INT,(void *) (start * sizeof(unsigned int)));
+				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 				checkGLErrors();
 			}
 			else
-				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its a vector3u pointer)
+				glDrawElements(primitive, size, GL_UNSIGNED_INT, (void*)(&m_indices[0] + start)); //no multiply, its an unsigned int pointer
 		}
 	}
 	else
@@ -345,6 +398,31 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 	num_meshes_rendered++;
 }
 
+//renders only some parts of the mesh (p.e. the visible clusters)
+void Mesh::renderRanges(unsigned int primitive, const std::vector<sDrawRange>& ranges)
+{
+	Shader* shader = Shader::current;
+	if (!shader || !shader->compiled)
+	{
+		assert(0 && "no shader or shader not compiled or enabled");
+		return;
+	}
+	if (evicted && !makeResident())
+		return;
+	assert(getNumVertices() && "No vertices in this mesh");
+	last_used_frame = frame;
+
+	enableBuffers(shader);
+	checkGLErrors();
+
+	for (int i = 0; i < ranges.size(); ++i)
+		drawRange(primitive, ranges[i].start, ranges[i].length);
+	checkGLErrors();
+
+	disableBuffers(shader);
+	checkGLErrors();
+}
+
 void Mesh::disableBuffers(Shader* shader)
 {
 	if (vertex_location != -1) glDisableVertexAttribArray(vertex_location);
@@ -501,8 +579,27 @@ void Mesh::renderAnimated( unsigned int primitive, Skeleton* skeleton )
 
 void Mesh::uploadToVRAM()
 {
+	if (!requireCPUData())
+		return;
 	assert(vertices.size() || interleaved.size());
 
+	num_vertices = getNumVertices();
+	num_indices = (unsigned int)m_indices.size();
+	if (!uv_density)
+		computeUVDensity();
+
+	//packed streams are only used when not interleaved, reloaded data (from the cache) is always float
+	if (interleaved.size() || packed_normals.data.empty())
+		packed_normals.clear();
+	if (interleaved.size() || packed_uvs.data.empty())
+		packed_uvs.clear();
+	size_t normals_size = packed_normals.type ? packed_normals.data.size() : normals.size() * sizeof(Vector3);
+	size_t uvs_size = packed_uvs.type ? packed_uvs.data.size() : uvs.size() * sizeof(Vector2);
+
+	gpu_memory = interleaved.size() * sizeof(tInterleaved) + vertices.size() * sizeof(Vector3) + normals_size + uvs_size +
+		m_uvs1.size() * sizeof(Vector2) + colors.size() * sizeof(Vector4) + bones.size() * sizeof(Vector4ub) + weights.size() * sizeof(Vector4) + m_indices.size() * sizeof(unsigned int);
+	evicted = false;
+
 	if (glGenBuffersARB == nullptr)
 	{
 		std::cout << "Error: your graphics cards dont support VBOs. Sorry." << std::endl;
@@ -531,7 +628,10 @@ void Mesh::uploadToVRAM()
 			if (uvs_vbo_id == 0)
 				glGenBuffersARB(1, &uvs_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, uvs_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(Vector2), &uvs[0], GL_STATIC_DRAW_ARB);
+			if (packed_uvs.type)
+				glBufferDataARB(GL_ARRAY_BUFFER_ARB, packed_uvs.data.size(), &packed_uvs.data[0], GL_STATIC_DRAW_ARB);
+			else
+				glBufferDataARB(GL_ARRAY_BUFFER_ARB, uvs.size() * sizeof(Vector2), &uvs[0], GL_STATIC_DRAW_ARB);
 		}
 
 		// Normals
@@ -540,7 +640,10 @@ void Mesh::uploadToVRAM()
 			if (normals_vbo_id == 0)
 				glGenBuffersARB(1, &normals_vbo_id);
 			glBindBufferARB(GL_ARRAY_BUFFER_ARB, normals_vbo_id);
-			glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3), &normals[0], GL_STATIC_DRAW_ARB);
+			if (packed_normals.type)
+				glBufferDataARB(GL_ARRAY_BUFFER_ARB, packed_normals.data.size(), &packed_normals.data[0], GL_STATIC_DRAW_ARB);
+			else
+				glBufferDataARB(GL_ARRAY_BUFFER_ARB, normals.size() * sizeof(Vector3), &normals[0], GL_STATIC_DRAW_ARB);
 		}
 	}
 
@@ -597,6 +700,8 @@ bool Mesh::createCollisionModel(bool is_static)
 {
 	if (collision_model)
 		return true;
+	if (!requireCPUData())
+		return false;
 
 	CollisionModel3D* collision_model = newCollisionModel3D(is_static);
 
@@ -653,9 +758,106 @@ bool Mesh::createCollisionModel(bool is_static)
 	return true;
 }
 
+bool Mesh::createBVH()
+{
+	if (bvh)
+		return true;
+	if (bvh_pending)
+		return false; //not ready yet
+	bvh = MeshBVH::fromMesh(this);
+	return bvh != NULL;
+}
+
+class BuildBVHTask : public Task {
+public:
+	Mesh* mesh;
+	std::vector<Vector3> triangles;
+	MeshBVH* bvh;
+	bool background;
+
+	BuildBVHTask(Mesh* mesh) { this->mesh = mesh; bvh = NULL; background = true; }
+	void onExecute() {
+		if (background) //build in the worker, then go back to the main thread to assign it
+		{
+			bvh = new MeshBVH();
+			if (!bvh->build(triangles))
+			{
+				delete bvh;
+				bvh = NULL;
+			}
+			triangles.clear();
+			BuildBVHTask* task = new BuildBVHTask(mesh);
+			task->bvh = bvh;
+			task->background = false;
+			TaskManager::foreground.addTask(task, TASK_PRIORITY_LOW); //the mesh works without it
+			return;
+		}
+		mesh->bvh_pending = false;
+		if (mesh->bvh)
+			delete bvh;
+		else
+			mesh->bvh = bvh;
+	}
+};
+
+void Mesh::createBVHAsync()
+{
+	if (bvh || bvh_pending || !requireCPUData())
+		return;
+
+	//the triangles are copied as the mesh RAM could be released while building
+	BuildBVHTask* task = new BuildBVHTask(this);
+	int num = m_indices.size() ? (int)m_indices.size() : (int)getNumVertices();
+	num -= num % 3;
+	task->triangles.resize(num);
+	for (int i = 0; i < num; ++i)
+	{
+		unsigned int index = m_indices.size() ? m_indices[i] : i;
+		task->triangles[i] = interleaved.size() ? interleaved[index].vertex : vertices[index];
+	}
+	bvh_pending = true;
+	TaskManager::background.addTask(task);
+}
+
 //help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
 bool Mesh::testRayCollision(Matrix44 model, Vector3 start, Vector3 front, Vector3& collision, Vector3& normal, float max_ray_dist, bool in_object_space )
 {
+	if (loading)
+		return false;
+
+	if (!use_coldet)
+	{
+		if (!createBVH())
+			return false;
+
+		//test in object space, the distance along the direction is the same in both spaces
+		Matrix44 inv = model;
+		inv.inverse();
+		Vector3 local_start = inv * start;
+		Vector3 local_front = inv.rotateVector(front);
+
+		sBVHHit hit;
+		if (!bvh->testRay(local_start, local_front, hit, max_ray_dist))
+			return false;
+
+		Vector3 a, b, c;
+		bvh->getTriangle(hit.triangle, a, b, c);
+		collision = local_start + local_front * hit.distance;
+		if (!in_object_space)
+		{
+			collision = model * collision;
+			a = model * a;
+			b = model * b;
+			c = model * c;
+		}
+		Vector3 v1 = b - a;
+		Vector3 v2 = c - a;
+		v1.normalize();
+		v2.normalize();
+		normal = v1.cross(v2);
+		return true;
+	}
+
 	if (!this->collision_model)
 		if (!createCollisionModel())
 			return false;
@@ -683,8 +885,56 @@ bool Mesh::testRayCollision(Matrix44 model, Vector3 start, Vector3 front, Vector
 	return true;
 }
 
+bool Mesh::testRayAnyHit(Matrix44 model, Vector3 start, Vector3 front, float max_ray_dist)
+{
+	if (loading)
+		return false;
+
+	if (use_coldet)
+	{
+		Vector3 collision, normal;
+		return testRayCollision(model, start, front, collision, normal, max_ray_dist);
+	}
+
+	if (!createBVH())
+		return false;
+
+	Matrix44 inv = model;
+	inv.inverse();
+	sBVHHit hit;
+	return bvh->testRay(inv * start, inv.rotateVector(front), hit, max_ray_dist, true);
+}
+
 bool Mesh::testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal)
 {
+	if (loading)
+		return false;
+
+	if (!use_coldet)
+	{
+		if (!createBVH())
+			return false;
+
+		//the radius is scaled by the largest inverse scale so scaled models are never missed
+		Matrix44 inv = model;
+		inv.inverse();
+		float inv_scale = (float)std::max(Vector3(inv.m[0], inv.m[1], inv.m[2]).length(), std::max(Vector3(inv.m[4], inv.m[5], inv.m[6]).length(), Vector3(inv.m[8], inv.m[9], inv.m[10]).length()));
+
+		int triangle = -1;
+		if (!bvh->testSphere(inv * center, radius * inv_scale, collision, triangle))
+			return false;
+
+		Vector3 a, b, c;
+		bvh->getTriangle(triangle, a, b, c);
+		collision = model * collision;
+		Vector3 v1 = model * b - model * a;
+		Vector3 v2 = model * c - model * a;
+		v1.normalize();
+		v2.normalize();
+		normal = v1.cross(v2);
+		return true;
+	}
+
 	if (!this->collision_model)
 		if (!createCollisionModel())
 			return false;
@@ -735,6 +985,234 @@ bool Mesh::interleaveBuffers()
 	return true;
 }
 
+//spreads the lower 10 bits of a value so there are two zeros between every bit
+static unsigned int spreadBits(unsigned int v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+//morton code of a point with coordinates between 0 and 1
+static unsigned int mortonCode(const Vector3& p)
+{
+	unsigned int x = (unsigned int)clamp(p.x * 1023.0f, 0.0f, 1023.0f);
+	unsigned int y = (unsigned int)clamp(p.y * 1023.0f, 0.0f, 1023.0f);
+	unsigned int z = (unsigned int)clamp(p.z * 1023.0f, 0.0f, 1023.0f);
+	return (spreadBits(x) << 2) | (spreadBits(y) << 1) | spreadBits(z);
+}
+
+typedef std::vector< std::pair<unsigned int, int> > tTriangleOrder; //sort key and triangle index
+
+//moves the triangles of a range of the stream to follow the given order
+template<typename T>
+static void reorderTriangles(std::vector<T>& stream, int start, const tTriangleOrder& order)
+{
+	if (stream.empty())
+		return;
+	std::vector<T> old(stream.begin() + start, stream.begin() + start + order.size() * 3);
+	for (int i = 0; i < order.size(); ++i)
+		for (int k = 0; k < 3; ++k)
+			stream[start + i * 3 + k] = old[order[i].second * 3 + k];
+}
+
+//same for the quantized streams, one vertex every stride bytes
+static void reorderTriangles(sPackedStream& stream, int start, const tTriangleOrder& order)
+{
+	if (stream.data.empty() || !stream.stride)
+		return;
+	size_t triangle_bytes = stream.stride * 3;
+	unsigned char* first = &stream.data[0] + start * stream.stride;
+	std::vector<unsigned char> old(first, first + order.size() * triangle_bytes);
+	for (int i = 0; i < order.size(); ++i)
+		memcpy(first + i * triangle_bytes, &old[order[i].second * triangle_bytes], triangle_bytes);
+}
+
+bool Mesh::createClusters(int triangles_per_cluster)
+{
+	clusters.clear();
+
+	int num_primitives = m_indices.size() ? (int)m_indices.size() : (int)getNumVertices();
+	if (num_primitives < 3 || num_primitives % 3 != 0 || triangles_per_cluster < 1)
+		return false;
+
+	auto position = [&](int primitive) -> const Vector3& {
+		unsigned int index = m_indices.size() ? m_indices[primitive] : primitive;
+		return interleaved.size() ? interleaved[index].vertex : vertices[index];
+	};
+
+	//clusters never cross a submesh so they can be culled using the submesh material
+	std::vector<sDrawRange> parts;
+	for (int i = 0; i < submeshes.size(); ++i)
+		parts.push_back({ submeshes[i].start, submeshes[i].length });
+	if (parts.empty())
+		parts.push_back({ 0, num_primitives });
+
+	Vector3 min_pos = position(0);
+	Vector3 max_pos = min_pos;
+	for (int i = 1; i < num_primitives; ++i)
+	{
+		min_pos.setMin(position(i));
+		max_pos.setMax(position(i));
+	}
+	Vector3 extent = max_pos - min_pos;
+	Vector3 inv_extent(extent.x > 0 ? 1.0f / extent.x : 0, extent.y > 0 ? 1.0f / extent.y : 0, extent.z > 0 ? 1.0f / extent.z : 0);
+
+	tTriangleOrder order;
+	std::vector<Vector3> face_normals;
+	for (int p = 0; p < parts.size(); ++p)
+	{
+		int start = parts[p].start;
+		int num_triangles = parts[p].length / 3;
+		if (start < 0 || (start + num_triangles * 3) > num_primitives)
+			continue;
+
+		//sort the triangles along a space filling curve so close triangles end in the same cluster
+		order.resize(num_triangles);
+		for (int i = 0; i < num_triangles; ++i)
+		{
+			int first = start + i * 3;
+			Vector3 centroid = (position(first) + position(first + 1) + position(first + 2)) * (1.0f / 3.0f);
+			order[i].first = mortonCode((centroid - min_pos) * inv_extent);
+			order[i].second = i;
+		}
+		std::sort(order.begin(), order.end());
+
+		if (m_indices.size())
+			reorderTriangles(m_indices, start, order);
+		else
+		{
+			reorderTriangles(interleaved, start, order);
+			reorderTriangles(vertices, start, order);
+			reorderTriangles(normals, start, order);
+			reorderTriangles(packed_normals, start, order);
+			reorderTriangles(uvs, start, order);
+			reorderTriangles(packed_uvs, start, order);
+			reorderTriangles(m_uvs1, start, order);
+			reorderTriangles(colors, start, order);
+			reorderTriangles(bones, start, order);
+			reorderTriangles(weights, start, order);
+		}
+
+		//group them
+		for (int first_tri = 0; first_tri < num_triangles; first_tri += triangles_per_cluster)
+		{
+			sMeshCluster cluster;
+			cluster.start = start + first_tri * 3;
+			cluster.length = std::min(triangles_per_cluster, num_triangles - first_tri) * 3;
+
+			Vector3 cmin = position(cluster.start);
+			Vector3 cmax = cmin;
+			Vector3 normal_sum;
+			face_normals.clear();
+			for (int i = cluster.start; i < cluster.start + cluster.length; i += 3)
+			{
+				const Vector3& a = position(i);
+				const Vector3& b = position(i + 1);
+				const Vector3& c = position(i + 2);
+				cmin.setMin(a); cmin.setMin(b); cmin.setMin(c);
+				cmax.setMax(a); cmax.setMax(b); cmax.setMax(c);
+				Vector3 n = (b - a).cross(c - a);
+				float area = (float)n.length();
+				if (area <= 0.0f)
+					continue; //degenerated triangles are never visible
+				n = n * (1.0f / area);
+				face_normals.push_back(n);
+				normal_sum = normal_sum + n;
+			}
+
+			cluster.center = (cmin + cmax) * 0.5f;
+			cluster.radius = 0;
+			for (int i = cluster.start; i < cluster.start + cluster.length; ++i)
+				cluster.radius = std::max(cluster.radius, cluster.center.distance(position(i)));
+
+			//normal cone, only if all the triangles face more or less the same way
+			cluster.cone_axis.set(0, 0, 1);
+			cluster.cone_cutoff = 1.0f;
+			float sum_length = (float)normal_sum.length();
+			if (face_normals.size() && sum_length > 0.0001f)
+			{
+				cluster.cone_axis = normal_sum * (1.0f / sum_length);
+				float min_dot = 1.0f;
+				for (int i = 0; i < face_normals.size(); ++i)
+					min_dot = std::min(min_dot, face_normals[i].dot(cluster.cone_axis));
+				if (min_dot > 0.1f)
+					cluster.cone_cutoff = sqrt(1.0f - min_dot * min_dot);
+			}
+			clusters.push_back(cluster);
+		}
+	}
+
+	return clusters.size() > 0;
+}
+
+int Mesh::cullClusters(const Matrix44& model, Camera* camera, std::vector<sDrawRange>& ranges, bool backface_culling, int submesh_id)
+{
+	ranges.clear();
+
+	//only the clusters of one submesh (clusters never cross submeshes)
+	int first = 0;
+	int last = 0x7FFFFFFF;
+	if (submesh_id > -1)
+	{
+		assert(submesh_id < submeshes.size() && "this mesh doesnt have as many submeshes");
+		first = submeshes[submesh_id].start;
+		last = first + submeshes[submesh_id].length;
+	}
+
+	//scale of the model to scale the spheres
+	Vector3 axis_x(model.m[0], model.m[1], model.m[2]);
+	Vector3 axis_y(model.m[4], model.m[5], model.m[6]);
+	Vector3 axis_z(model.m[8], model.m[9], model.m[10]);
+	float scale_x = (float)axis_x.length();
+	float scale_y = (float)axis_y.length();
+	float scale_z = (float)axis_z.length();
+	float max_scale = std::max(scale_x, std::max(scale_y, scale_z));
+	float min_scale = std::min(scale_x, std::min(scale_y, scale_z));
+
+	//non uniform scales bend the normal cones and mirrored models flip the winding
+	if (min_scale < max_scale * 0.99f || axis_x.cross(axis_y).dot(axis_z) < 0.0f)
+		backface_culling = false;
+
+	int num_triangles = 0;
+	long num_tested = 0;
+	for (int i = 0; i < clusters.size(); ++i)
+	{
+		sMeshCluster& cluster = clusters[i];
+		if (cluster.start < first || cluster.start >= last)
+			continue;
+		num_tested++;
+		Vector3 center = model * cluster.center;
+		float radius = cluster.radius * max_scale;
+
+		bool visible = camera->testSphereInFrustum(center, radius) != CLIP_OUTSIDE;
+		if (visible && backface_culling && cluster.cone_cutoff < 1.0f)
+		{
+			Vector3 axis = model.rotateVector(cluster.cone_axis) * (1.0f / max_scale);
+			Vector3 to_center = center - camera->eye;
+			if (to_center.dot(axis) >= cluster.cone_cutoff * (float)to_center.length() + radius)
+				visible = false;
+		}
+
+		if (!visible)
+		{
+			num_clusters_culled++;
+			continue;
+		}
+
+		num_triangles += cluster.length / 3;
+		if (ranges.size() && ranges.back().start + ranges.back().length == cluster.start)
+			ranges.back().length += cluster.length;
+		else
+			ranges.push_back({ cluster.start, cluster.length });
+	}
+	num_clusters_tested += num_tested;
+
+	return num_triangles;
+}
+
 typedef struct 
 {
 	int version;
@@ -750,34 +1228,32 @@ typedef struct
 	int num_submeshes;
 	Matrix44 bind_matrix;
 	char streams[8]; //Vertex/Interlaved|Normal|Uvs|Color|Indices|Bones|Weights|Extra|Uvs1
-	char extra[32]; //unused
+	int num_clusters;
+	char extra[28]; //unused
 } sMeshInfo;
 
 bool Mesh::readBin(const char* filename)
 {
-	FILE *f;
 	assert(filename);
 
-	struct stat stbuffer;
-
-	stat(filename,&stbuffer);
-	f = fopen(filename,"rb");
-	if (f == NULL)
+	//it could be prefetched already (see file_io.h)
+	std::vector<unsigned char> data;
+	if (!readFileBin(filename, data) || data.empty())
 		return false;
 
-	unsigned int size = (unsigned int)stbuffer.st_size;
-	char* data = new char[size];
-	fread(data,size,1,f);
-	fclose(f);
+	return readBinFromMemory(&data[0], data.size(), filename);
+}
 
+bool Mesh::readBinFromMemory(const unsigned char* data, size_t size, const char* filename)
+{
 	//watermark
-	if ( memcmp(data,"MBIN",4) != 0 )
+	if ( size < 4 + sizeof(sMeshInfo) || memcmp(data,"MBIN",4) != 0 )
 	{
 		std::cout << "[ERROR] loading BIN: invalid content: " << filename << std::endl;
 		return false;
 	}
 
-	char* pos = data + 4;
+	const unsigned char* pos = data + 4;
 	sMeshInfo info;
 	memcpy(&info,pos,sizeof(sMeshInfo));
 	pos += sizeof(sMeshInfo);
@@ -826,7 +1302,7 @@ bool Mesh::readBin(const char* filename)
 	{
 		m_indices.resize(info.num_indices);
 		memcpy((void*)&m_indices[0], pos, sizeof(unsigned int) * info.num_indices);
-		pos += sizeof(Vector3u) * info.num_indices;
+		pos += sizeof(unsigned int) * info.num_indices;
 	}
 
 	if (info.streams[5] == 'B')
@@ -865,16 +1341,23 @@ bool Mesh::readBin(const char* filename)
 	bind_matrix = info.bind_matrix;
 
 	submeshes.resize(info.num_submeshes);
-	memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
+	if (info.num_submeshes)
+		memcpy(&submeshes[0], pos, sizeof(sSubmeshInfo) * info.num_submeshes);
 	pos += sizeof(sSubmeshInfo) * info.num_submeshes;
 
-	createCollisionModel();
+	clusters.resize(info.num_clusters);
+	if (info.num_clusters)
+		memcpy(&clusters[0], pos, sizeof(sMeshCluster) * info.num_clusters);
+	pos += sizeof(sMeshCluster) * info.num_clusters;
+
 	return true;
 }
 
 bool Mesh::writeBin(const char* filename)
 {
-	assert( vertices.size() || interleaved.size() );
+	std::vector<unsigned char> buffer;
+	if (!writeBinToMemory(buffer))
+		return false;
 	std::string s_filename = filename;
 	s_filename += ".mbin";
 
@@ -884,9 +1367,29 @@ bool Mesh::writeBin(const char* filename)
 		std::cout << "[ERROR] cannot write mesh BIN: " << s_filename.c_str() << std::endl;
 		return false;
 	}
+	fwrite(&buffer[0], buffer.size(), 1, f);
+	fclose(f);
+	return true;
+}
+
+static void appendBytes(std::vector<unsigned char>& buffer, const void* data, size_t size)
+{
+	if (!size)
+		return;
+	size_t pos = buffer.size();
+	buffer.resize(pos + size);
+	memcpy(&buffer[pos], data, size);
+}
+
+bool Mesh::writeBinToMemory(std::vector<unsigned char>& buffer)
+{
+	if (!requireCPUData())
+		return false;
+	assert( vertices.size() || interleaved.size() );
+	buffer.clear();
 
 	//watermark
-	fwrite("MBIN",sizeof(char),4,f);
+	appendBytes(buffer, "MBIN", 4);
 
 	sMeshInfo info;
 	memset(&info, 0, sizeof(info));
@@ -902,6 +1405,7 @@ bool Mesh::writeBin(const char* filename)
 	info.num_bones = bones_info.size();
 	info.bind_matrix = bind_matrix;
 	info.num_submeshes = submeshes.size();
+	info.num_clusters = clusters.size();
 
 	info.streams[0] = interleaved.size() ? 'I' : 'V';
 	info.streams[1] = normals.size() ? 'N' : ' ';
@@ -913,38 +1417,40 @@ bool Mesh::writeBin(const char* filename)
 	info.streams[7] = m_uvs1.size() ? 'u' : ' '; //uv second set
 
 	//write info
-	fwrite((void*)&info, sizeof(sMeshInfo),1, f);
+	appendBytes(buffer, &info, sizeof(sMeshInfo));
 
 	//write streams
 	if (interleaved.size())
-		fwrite((void*)&interleaved[0], interleaved.size() * sizeof(tInterleaved), 1, f);
+		appendBytes(buffer, &interleaved[0], interleaved.size() * sizeof(tInterleaved));
 	else
 	{
-		fwrite((void*)&vertices[0], vertices.size() * sizeof(Vector3), 1, f);
+		appendBytes(buffer, &vertices[0], vertices.size() * sizeof(Vector3));
 		if (normals.size())
-			fwrite((void*)&normals[0], normals.size() * sizeof(Vector3), 1, f);
+			appendBytes(buffer, &normals[0], normals.size() * sizeof(Vector3));
 		if (uvs.size())
-			fwrite((void*)&uvs[0], uvs.size() * sizeof(Vector2), 1, f);
+			appendBytes(buffer, &uvs[0], uvs.size() * sizeof(Vector2));
 	}
 
 	if (colors.size())
-		fwrite((void*)&colors[0], colors.size() * sizeof(Vector4), 1, f);
+		appendBytes(buffer, &colors[0], colors.size() * sizeof(Vector4));
 
 	if (m_indices.size())
-		fwrite((void*)&m_indices[0], m_indices.size() * sizeof(unsigned int), 1, f);
+		appendBytes(buffer, &m_indices[0], m_indices.size() * sizeof(unsigned int));
 
 	if (bones.size())
-		fwrite((void*)&bones[0], bones.size() * sizeof(Vector4ub), 1, f);
+		appendBytes(buffer, &bones[0], bones.size() * sizeof(Vector4ub));
 	if (weights.size())
-		fwrite((void*)&weights[0], weights.size() * sizeof(Vector4), 1, f);
-	if (bones_info.size())
-		fwrite((void*)&bones_info[0], bones_info.size() * sizeof(BoneInfo), 1, f);
+		appendBytes(buffer, &weights[0], weights.size() * sizeof(Vector4));
 	if (m_uvs1.size())
-		fwrite((void*)&m_uvs1[0], m_uvs1.size() * sizeof(Vector2), 1, f);
+		appendBytes(buffer, &m_uvs1[0], m_uvs1.size() * sizeof(Vector2));
+	if (bones_info.size())
+		appendBytes(buffer, &bones_info[0], bones_info.size() * sizeof(BoneInfo));
 
-	fwrite((void*)&submeshes[0], submeshes.size() * sizeof(sSubmeshInfo), 1, f);
+	if (submeshes.size())
+		appendBytes(buffer, &submeshes[0], submeshes.size() * sizeof(sSubmeshInfo));
+	if (clusters.size())
+		appendBytes(buffer, &clusters[0], clusters.size() * sizeof(sMeshCluster));
 
-	fclose(f);
 	return true;
 }
 
@@ -996,7 +1502,7 @@ bool Mesh::loadASE(const char* filename)
 	int prev_mat = 0;
 
 	sSubmeshInfo submesh;
-	memset(&submesh, 0, sizeof(submesh));
+	submesh = sSubmeshInfo();
 
 	//load faces
 	for(count=0;count<nFcs;count++)
@@ -1018,7 +1524,7 @@ bool Mesh::loadASE(const char* filename)
 		{
 			submesh.length = count * 3 - submesh.start;
 			submeshes.push_back( submesh );
-			memset(&submesh, 0, sizeof(submesh));
+			submesh = sSubmeshInfo();
 			submesh.start = count * 3;
 			prev_mat = current_mat;
 		}
@@ -1100,7 +1606,7 @@ bool Mesh::loadOBJ(const char* filename)
 
 	sSubmeshInfo submesh_info;
 	int last_submesh_vertex = 0;
-	memset(&submesh_info, 0, sizeof(submesh_info));
+	submesh_info = sSubmeshInfo();
 
 	//parse file
 	while(*pos != 0)
@@ -1154,7 +1660,7 @@ bool Mesh::loadOBJ(const char* filename)
 				submesh_info.length = vertices.size() - submesh_info.start;
 				last_submesh_vertex = vertices.size();
 				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
+				submesh_info = sSubmeshInfo();
 				strcpy(submesh_info.name, tokens[1].c_str());
 				submesh_info.start = last_submesh_vertex;
 			}
@@ -1168,7 +1674,7 @@ bool Mesh::loadOBJ(const char* filename)
 				submesh_info.length = vertices.size() - submesh_info.start;
 				last_submesh_vertex = vertices.size();
 				submeshes.push_back(submesh_info);
-				memset(&submesh_info, 0, sizeof(submesh_info));
+				submesh_info = sSubmeshInfo();
 				strcpy( submesh_info.name, tokens[1].c_str());
 				submesh_info.start = last_submesh_vertex;
 			}
@@ -1495,7 +2001,7 @@ void Mesh::updateBoundingBox()
 	else if (interleaved.size())
 	{
 		aabb_max = aabb_min = interleaved[0].vertex;
-		for (int i = 1; i < vertices.size(); ++i)
+		for (int i = 1; i < interleaved.size(); ++i)
 		{
 			aabb_min.setMin(interleaved[i].vertex);
 			aabb_max.setMax(interleaved[i].vertex);
@@ -1505,6 +2011,29 @@ void Mesh::updateBoundingBox()
 	box.halfsize = aabb_max - box.center;
 }
 
+void Mesh::updateSubmeshBoundings()
+{
+	if (!requireCPUData())
+		return;
+
+	for (int i = 0; i < submeshes.size(); ++i)
+	{
+		sSubmeshInfo& submesh = submeshes[i];
+		Vector3 min_pos, max_pos;
+		for (int j = submesh.start; j < submesh.start + submesh.length; ++j)
+		{
+			unsigned int index = m_indices.size() ? m_indices[j] : j;
+			const Vector3& pos = interleaved.size() ? interleaved[index].vertex : vertices[index];
+			if (j == submesh.start)
+				min_pos = max_pos = pos;
+			min_pos.setMin(pos);
+			max_pos.setMax(pos);
+		}
+		submesh.box.center = (max_pos + min_pos) * 0.5f;
+		submesh.box.halfsize = max_pos - submesh.box.center;
+	}
+}
+
 Mesh* wire_box = NULL;
 
 void Mesh::renderBounding( const Matrix44& model, bool world_bounding )
@@ -1567,6 +2096,54 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 		return NULL;
 
 	Mesh* m = new Mesh();
+	if (!m->load(filename))
+	{
+		delete m;
+		return NULL;
+	}
+
+	//and upload them to VRAM
+	if (auto_upload_to_vram)
+		m->uploadToVRAM();
+
+	m->registerMesh(filename);
+	return m;
+}
+
+Mesh* Mesh::GetAsync(const char* filename)
+{
+	assert(filename);
+	std::map<std::string, Mesh*>::iterator it = sMeshesLoaded.find(filename);
+	if (it != sMeshesLoaded.end())
+		return it->second;
+
+	//register an empty mesh so nobody loads it twice
+	Mesh* m = new Mesh();
+	m->loading = true;
+	m->registerMesh(filename);
+
+	//add action to BG Thread
+	TaskManager::background.addTask(new LoadMeshTask(filename));
+	return m;
+}
+
+void Mesh::prefetch(const char* filename)
+{
+	if (sMeshesLoaded.find(filename) != sMeshesLoaded.end())
+		return;
+	//the binary version if load is going to use it
+	std::string name = filename;
+	std::string ext = name.substr(name.find_last_of(".") + 1);
+	std::string binfilename = name + ".mbin";
+	if (ext != "mbin" && ext != "MBIN" && use_binary && getFileTime(binfilename))
+		FileIO::prefetch(binfilename);
+	else
+		FileIO::prefetch(name);
+}
+
+bool Mesh::load(const char* filename)
+{
+	assert(filename);
 	std::string name = filename;
 
 	//detect format
@@ -1583,77 +2160,275 @@ Mesh* Mesh::Get(const char* filename, bool skip_load)
 	else 
 	{
 		//if (ext.size()) std::cerr << "Unknown mesh format: " << filename << std::endl;
-		return NULL;
+		return false;
 	}
 
 	//stats
 	double time = getTime();
-	std::cout << " + Mesh loading: " << filename << " ... ";
 	std::string binfilename = filename;
 
 	if (file_format != FORMAT_MBIN)
 		binfilename = binfilename + ".mbin";
 
 	//try loading the binary version
-	if (use_binary && m->readBin(binfilename.c_str()) )
+	if ((use_binary || file_format == FORMAT_MBIN) && readBin(binfilename.c_str()) )
 	{
-		if (interleave_meshes && m->interleaved.size() == 0)
-		{
-			std::cout << "[INTERL] ";
-			m->interleaveBuffers();
-		}
-
-		if (auto_upload_to_vram)
-		{
-			std::cout << "[VRAM] ";
-			m->uploadToVRAM();
-		}
+		if (interleave_meshes && interleaved.size() == 0)
+			interleaveBuffers();
 
-		std::cout << "[OK BIN]  Faces: " << (m->interleaved.size() ? m->interleaved.size() : m->vertices.size()) / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-		sMeshesLoaded[filename] = m;
-		return m;
+		std::cout << " + Mesh loaded: " << filename << " [OK BIN]  Faces: " << getNumVertices() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+		return true;
 	}
 
 	//load the ascii version
 	bool loaded = false;
 	if (file_format == FORMAT_OBJ)
-		loaded = m->loadOBJ(filename);
+		loaded = loadOBJ(filename);
 	else if (file_format == FORMAT_ASE)
-		loaded = m->loadASE(filename);
+		loaded = loadASE(filename);
 	else if (file_format == FORMAT_MESH)
-		loaded = m->loadMESH(filename);
+		loaded = loadMESH(filename);
 
 	if (!loaded)
 	{
-		delete m;
-		std::cout << "[ERROR]: Mesh not found" << std::endl;
-		return NULL;
+		std::cout << " + Mesh loading: " << filename << " [ERROR]: Mesh not found" << std::endl;
+		return false;
 	}
 
 	//to optimize, interleave the meshes
 	if (interleave_meshes)
+		interleaveBuffers();
+
+	//split in clusters before uploading as it reorders the triangles
+	if (build_clusters)
+		createClusters();
+	updateSubmeshBoundings();
+
+	std::cout << " + Mesh loaded: " << filename << " [OK]  Faces: " << getNumVertices() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	if (use_binary)
+		writeBin(filename);
+
+	return true;
+}
+
+void Mesh::swapData(Mesh& mesh)
+{
+	submeshes.swap(mesh.submeshes);
+	clusters.swap(mesh.clusters);
+	vertices.swap(mesh.vertices);
+	normals.swap(mesh.normals);
+	uvs.swap(mesh.uvs);
+	m_uvs1.swap(mesh.m_uvs1);
+	colors.swap(mesh.colors);
+	interleaved.swap(mesh.interleaved);
+	m_indices.swap(mesh.m_indices);
+	bones.swap(mesh.bones);
+	weights.swap(mesh.weights);
+	bones_info.swap(mesh.bones_info);
+	std::swap(bind_matrix, mesh.bind_matrix);
+	std::swap(aabb_min, mesh.aabb_min);
+	std::swap(aabb_max, mesh.aabb_max);
+	std::swap(box, mesh.box);
+	std::swap(radius, mesh.radius);
+}
+
+//frees the memory of a vector
+template<typename T>
+static void freeVector(std::vector<T>& v)
+{
+	std::vector<T>().swap(v);
+}
+
+std::string Mesh::getCacheFilename()
+{
+	if (name.empty())
+		return "";
+	std::string ext = name.substr(name.find_last_of(".") + 1);
+	if (ext == "mbin" || ext == "MBIN")
+		return name;
+
+	//meshes from GLTFs are named file::mesh::index
+	std::string filename = name;
+	size_t pos;
+	while ((pos = filename.find("::")) != std::string::npos)
+		filename.replace(pos, 2, ".");
+	for (int i = 0; i < filename.size(); ++i)
+		if (strchr(":*?\"<>|", filename[i]))
+			filename[i] = '_';
+	return filename + ".mbin";
+}
+
+bool Mesh::isCacheValid()
+{
+	std::string cache = getCacheFilename();
+	if (cache.empty())
+		return false;
+	long cache_time = getFileTime(cache);
+	if (!cache_time)
+		return false;
+	if (cache == name)
+		return true;
+	//the cache must be newer than the file it comes from
+	std::string source = name.substr(0, name.find("::"));
+	return cache_time >= getFileTime(source);
+}
+
+bool Mesh::requireCPUData()
+{
+	if (hasCPUData())
+		return true;
+	if (!isCacheValid())
+		return false;
+
+	Mesh temp;
+	if (!temp.readBin(getCacheFilename().c_str()))
+		return false;
+	vertices.swap(temp.vertices);
+	normals.swap(temp.normals);
+	uvs.swap(temp.uvs);
+	m_uvs1.swap(temp.m_uvs1);
+	colors.swap(temp.colors);
+	interleaved.swap(temp.interleaved);
+	m_indices.swap(temp.m_indices);
+	bones.swap(temp.bones);
+	weights.swap(temp.weights);
+	return true;
+}
+
+bool Mesh::releaseCPUData()
+{
+	if (!hasCPUData() || keep_cpu_data || loading)
+		return false;
+	if (!interleaved_vbo_id && !vertices_vbo_id)
+		return false; //rendering still needs it
+
+	std::string cache = getCacheFilename();
+	if (cache.empty())
+		return false;
+	if (!isCacheValid() && !writeBin(cache.substr(0, cache.size() - 5).c_str()))
+		return false;
+
+	freeVector(vertices);
+	freeVector(normals);
+	freeVector(uvs);
+	freeVector(m_uvs1);
+	freeVector(colors);
+	freeVector(interleaved);
+	freeVector(m_indices);
+	freeVector(bones);
+	freeVector(weights);
+	freeVector(packed_normals.data); //the type is kept, it describes what is in the VBO
+	freeVector(packed_uvs.data);
+	return true;
+}
+
+bool Mesh::makeResident()
+{
+	if (!evicted)
+		return true;
+	if (!requireCPUData())
+		return false;
+	uploadToVRAM();
+	return !evicted;
+}
+
+size_t Mesh::getCPUMemory()
+{
+	return interleaved.capacity() * sizeof(tInterleaved) + vertices.capacity() * sizeof(Vector3) + normals.capacity() * sizeof(Vector3) + uvs.capacity() * sizeof(Vector2) +
+		m_uvs1.capacity() * sizeof(Vector2) + colors.capacity() * sizeof(Vector4) + bones.capacity() * sizeof(Vector4ub) + weights.capacity() * sizeof(Vector4) +
+		m_indices.capacity() * sizeof(unsigned int) + submeshes.capacity() * sizeof(sSubmeshInfo) + clusters.capacity() * sizeof(sMeshCluster) + bones_info.capacity() * sizeof(BoneInfo) +
+		packed_normals.data.capacity() + packed_uvs.data.capacity() + (bvh ? bvh->getMemory() : 0);
+}
+
+void Mesh::computeUVDensity()
+{
+	//quantized uvs are not read, the texture streaming uses the size of the object instead
+	bool use_interleaved = interleaved.size() > 0;
+	if (!use_interleaved && (uvs.empty() || uvs.size() != vertices.size()))
+		return;
+
+	int num_vertices = use_interleaved ? (int)interleaved.size() : (int)vertices.size();
+	int num_triangles = (m_indices.size() ? (int)m_indices.size() : num_vertices) / 3;
+	double area = 0, uv_area = 0;
+	for (int i = 0; i < num_triangles; ++i)
+	{
+		int index[3];
+		for (int j = 0; j < 3; ++j)
+			index[j] = m_indices.size() ? m_indices[i * 3 + j] : i * 3 + j;
+		const Vector3& a = use_interleaved ? interleaved[index[0]].vertex : vertices[index[0]];
+		const Vector3& b = use_interleaved ? interleaved[index[1]].vertex : vertices[index[1]];
+		const Vector3& c = use_interleaved ? interleaved[index[2]].vertex : vertices[index[2]];
+		const Vector2& ta = use_interleaved ? interleaved[index[0]].uv : uvs[index[0]];
+		const Vector2& tb = use_interleaved ? interleaved[index[1]].uv : uvs[index[1]];
+		const Vector2& tc = use_interleaved ? interleaved[index[2]].uv : uvs[index[2]];
+		area += (b - a).cross(c - a).length() * 0.5;
+		uv_area += fabs((tb.x - ta.x) * (tc.y - ta.y) - (tc.x - ta.x) * (tb.y - ta.y)) * 0.5;
+	}
+	if (area > 0 && uv_area > 0)
+		uv_density = (float)sqrt(uv_area / area);
+}
+
+void Mesh::getTotalMemory(size_t& cpu, size_t& gpu)
+{
+	cpu = gpu = 0;
+	for (auto it : sMeshesLoaded)
 	{
-		std::cout << "[INTERL] ";
-		m->interleaveBuffers();
+		cpu += it.second->getCPUMemory();
+		gpu += it.second->gpu_memory;
 	}
+}
 
-	//and upload them to VRAM
-	if (auto_upload_to_vram)
+static bool lruSort(const Mesh* a, const Mesh* b) { return a->last_used_frame < b->last_used_frame; }
+
+void Mesh::updateResidency()
+{
+	frame++;
+
+	//free the RAM of the meshes already in VRAM, only a few per frame as it could have to write the cache
+	const int max_released_per_frame = 8;
+	int released = 0;
+	std::vector<Mesh*> candidates;
+	size_t total = 0;
+	for (auto it : sMeshesLoaded)
 	{
-		std::cout << "[VRAM] ";
-		m->uploadToVRAM();
+		Mesh* mesh = it.second;
+		if (release_cpu_data && released < max_released_per_frame && mesh->hasCPUData() && mesh->releaseCPUData())
+			released++;
+		total += mesh->getCPUMemory() + mesh->gpu_memory;
+		if (mesh->gpu_memory && !mesh->loading && (frame - mesh->last_used_frame) > 60) //not used in the last second
+			candidates.push_back(mesh);
 	}
 
-	std::cout << "[OK]  Faces: " << m->vertices.size() / 3 << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
-	if (use_binary)
+	if (!memory_budget || total <= memory_budget)
+		return;
+
+	//evict the least recently used ones
+	std::sort(candidates.begin(), candidates.end(), lruSort);
+	for (int i = 0; i < candidates.size() && total > memory_budget; ++i)
 	{
-		std::cout << "\t\t Writing .BIN ... ";
-		m->writeBin(filename);
-		std::cout << "[OK]" << std::endl;
+		Mesh* mesh = candidates[i];
+		size_t used = mesh->getCPUMemory() + mesh->gpu_memory;
+		mesh->releaseCPUData();
+		if (!mesh->hasCPUData() && !mesh->isCacheValid())
+			continue; //we could not restore it
+		mesh->releaseGPUData();
+		mesh->evicted = true;
+		total -= used - mesh->getCPUMemory();
 	}
+}
 
-	m->registerMesh(name);
-	return m;
+void Mesh::printMemoryReport()
+{
+	size_t cpu = 0, gpu = 0;
+	std::cout << "Mesh memory report (KB):" << std::endl;
+	for (auto it : sMeshesLoaded)
+	{
+		Mesh* mesh = it.second;
+		std::cout << "\t" << it.first << "\t RAM: " << mesh->getCPUMemory() / 1024 << "\t VRAM: " << mesh->gpu_memory / 1024 << (mesh->evicted ? "\t [EVICTED]" : "") << "\t last used frame: " << mesh->last_used_frame << std::endl;
+		cpu += mesh->getCPUMemory();
+		gpu += mesh->gpu_memory;
+	}
+	std::cout << "Total: " << sMeshesLoaded.size() << " meshes, RAM: " << cpu / 1024 << "KB, VRAM: " << gpu / 1024 << "KB, budget: " << memory_budget / 1024 << "KB" << std::endl;
 }
 
 void Mesh::registerMesh( std::string name )
@@ -1662,6 +2437,44 @@ void Mesh::registerMesh( std::string name )
 	sMeshesLoaded[name] = this;
 }
 
+uint64_t Mesh::computeContentHash()
+{
+	ContentHash hash = hashVector(vertices);
+	hash = hashVector(normals, hash);
+	hash = hashVector(uvs, hash);
+	hash = hashVector(m_uvs1, hash);
+	hash = hashVector(colors, hash);
+	hash = hashVector(interleaved, hash);
+	hash = hashVector(m_indices, hash);
+	hash = hashVector(bones, hash);
+	hash = hashVector(weights, hash);
+	hash = hashVector(bones_info, hash);
+	hash = hashVector(submeshes, hash);
+	hash = hashVector(packed_normals.data, hash);
+	hash = hashVector(packed_uvs.data, hash);
+	int formats[4] = { (int)packed_normals.type, packed_normals.components, (int)packed_uvs.type, packed_uvs.components };
+	return hashMemory(formats, sizeof(formats), hash);
+}
+
+Mesh* Mesh::Share(Mesh* mesh)
+{
+	if (!mesh->content_hash)
+		mesh->content_hash = mesh->computeContentHash();
+
+	auto it = sMeshesByContent.find(mesh->content_hash);
+	if (it != sMeshesByContent.end() && it->second != mesh)
+	{
+		dedup_stats.meshes++;
+		dedup_stats.mesh_bytes += mesh->getCPUMemory();
+		mesh->content_hash = 0; //so it doesnt unregister the shared one
+		delete mesh;
+		return it->second;
+	}
+
+	sMeshesByContent[mesh->content_hash] = mesh;
+	return mesh;
+}
+
 void Mesh::Release()
 {
 	for (auto m : sMeshesLoaded)
@@ -1671,3 +2484,49 @@ void Mesh::Release()
 	}
 	sMeshesLoaded.clear();
 }
+
+LoadMeshTask::LoadMeshTask(const char* str)
+{
+	filename = str;
+}
+
+void LoadMeshTask::onExecute()
+{
+	Mesh* mesh = new Mesh();
+	if (!mesh->load(filename.c_str()))
+	{
+		delete mesh;
+		mesh = NULL;
+	}
+
+	//mesh ready, the upload must be done from the main thread
+	UploadMeshTask* upload_task = new UploadMeshTask(filename.c_str(), mesh);
+	TaskManager::foreground.addTask(upload_task);
+}
+
+UploadMeshTask::UploadMeshTask(const char* filename, Mesh* mesh)
+{
+	this->filename = filename;
+	this->mesh = mesh;
+}
+
+void UploadMeshTask::onExecute()
+{
+	auto it = Mesh::sMeshesLoaded.find(filename);
+	if (it == Mesh::sMeshesLoaded.end())
+	{
+		delete mesh;
+		std::cout << "Warning: mesh loaded in background not found foreground thread" << std::endl;
+		return;
+	}
+
+	Mesh* target = it->second;
+	target->loading = false;
+	if (!mesh)
+		return; //it will stay empty
+
+	target->swapData(*mesh);
+	if (Mesh::auto_upload_to_vram)
+		target->uploadToVRAM();
+	delete mesh;
+}
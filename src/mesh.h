@@ -3,6 +3,7 @@
 
 #include <vector>
 #include "framework.h"
+#include "task.h"
 
 #include <map>
 #include <string>
@@ -10,9 +11,13 @@
 class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
+class Camera; //for culling
+class MeshBVH; //for collisions
 
 //version from 11/5/2020
-#define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
+#define MESH_BIN_VERSION 13 //this is used to regenerate bins if the format changes
+
+#define MESH_CLUSTER_SIZE 64 //max triangles per cluster
 
 struct BoneInfo {
 	char name[32]; //max 32 chars per bone name
@@ -25,27 +30,73 @@ struct sSubmeshInfo
 	char material[64];
 	int start;//in primitive
 	int length;//in primitive
+	BoundingBox box; //in object space
+};
+
+//a small group of contiguous triangles used for fine grained culling
+struct sMeshCluster
+{
+	Vector3 center; //bounding sphere, in object space
+	float radius;
+	Vector3 cone_axis; //average facing of the triangles
+	float cone_cutoff; //sin of the cone spread, 1 if the cluster cannot be backface culled
+	int start;//in primitive
+	int length;//in primitive
+};
+
+//a range of primitives to draw
+struct sDrawRange
+{
+	int start;//in primitive
+	int length;//in primitive
+};
+
+//a stream kept in the compact format it had in the file (quantized glTF accessors) so it is uploaded as it is
+struct sPackedStream
+{
+	std::vector<unsigned char> data;
+	unsigned int type; //GL_BYTE, GL_UNSIGNED_BYTE, GL_SHORT or GL_UNSIGNED_SHORT, 0 if the VBO contains floats
+	int components;
+	int stride; //in bytes, padded to 4
+	bool normalized;
+
+	sPackedStream() { type = 0; components = stride = 0; normalized = false; }
+	void clear() { data.clear(); type = 0; }
 };
 
 class Mesh
 {
 public:
 	static std::map<std::string, Mesh*> sMeshesLoaded;
+	static std::map<uint64_t, Mesh*> sMeshesByContent; //imported meshes by content hash (see content_hash.h)
 	static bool use_binary; //always load the binary version of a mesh when possible
 	static bool interleave_meshes; //loaded meshes will me automatically interleaved
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static bool build_clusters; //loaded meshes will be split in clusters for culling
+	static long num_clusters_tested;
+	static long num_clusters_culled;
+	static bool release_cpu_data; //once in VRAM the geometry is removed from RAM (it can be restored from the binary cache)
+	static size_t memory_budget; //in bytes (RAM + VRAM), meshes not used recently are evicted when exceeded, 0 means no limit
+	static long frame; //incremented every time updateResidency is called
+	static bool use_coldet; //use the old coldet library for collisions instead of the BVH
+	static bool keep_quantized_streams; //quantized normals and uvs from glTF are uploaded without expanding them to floats
 
 	std::string name;
+	bool loading; //true while it is being loaded in the background
+	uint64_t content_hash; //0 if it is not registered by content
 
 	std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
+	std::vector<sMeshCluster> clusters; //contiguous groups of triangles, never crossing a submesh
 
 	std::vector< Vector3 > vertices; //here we store the vertices
 	std::vector< Vector3 > normals;	 //here we store the normals
 	std::vector< Vector2 > uvs;	 //here we store the texture coordinates
 	std::vector< Vector2 > m_uvs1; //secondary sets of uvs
 	std::vector< Vector4 > colors; //here we store the colors
+	sPackedStream packed_normals; //if filled it is uploaded instead of normals (which are still used in the CPU)
+	sPackedStream packed_uvs; //if filled it is uploaded instead of uvs
 	
 	struct tInterleaved {
 		Vector3 vertex;
@@ -80,12 +131,22 @@ public:
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
 
+	//residency
+	bool keep_cpu_data; //set it if you need the geometry in RAM (collisions, baking, ...)
+	bool evicted; //removed from VRAM because of the memory budget, it will be restored when rendered
+	long last_used_frame;
+	unsigned int num_vertices; //uploaded to VRAM, valid even if the geometry is not in RAM
+	unsigned int num_indices; //uploaded to VRAM
+	size_t gpu_memory; //in bytes
+	float uv_density; //uv units per local unit, used to choose the texture levels (0 if unknown)
+
 	Mesh();
 	~Mesh();
 
 	void clear();
 
 	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0 );
+	void renderRanges(unsigned int primitive, const std::vector<sDrawRange>& ranges);
 	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
 	void renderBounding( const Matrix44& model, bool world_bounding = true );
 	void renderFixedPipeline(int primitive); //sloooooooow
@@ -93,25 +154,61 @@ public:
 
 	void enableBuffers(Shader* shader);
 	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
+	void drawRange(unsigned int primitive, int start, int length, int num_instances = 0);
 	void disableBuffers(Shader* shader);
 
 	bool readBin(const char* filename);
 	bool writeBin(const char* filename);
+	bool readBinFromMemory(const unsigned char* data, size_t size, const char* name = ""); //name is only for the error messages
+	bool writeBinToMemory(std::vector<unsigned char>& buffer);
 
 	unsigned int getNumSubmeshes() { return (unsigned int)submeshes.size(); }
-	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (unsigned int)vertices.size(); }
+	unsigned int getNumVertices() { return (unsigned int)interleaved.size() ? (unsigned int)interleaved.size() : (vertices.size() ? (unsigned int)vertices.size() : num_vertices); }
+	unsigned int getNumIndices() { return m_indices.size() ? (unsigned int)m_indices.size() : num_indices; }
+
+	//residency
+	bool hasCPUData() { return interleaved.size() || vertices.size(); }
+	bool requireCPUData(); //makes sure the geometry is in RAM, loading it from the binary cache if it was released
+	bool releaseCPUData(); //removes the geometry from RAM (writing the binary cache if needed)
+	void releaseGPUData(); //removes the VBOs
+	bool makeResident(); //uploads again an evicted mesh
+	std::string getCacheFilename(); //binary file used to restore the geometry
+	bool isCacheValid();
+	size_t getCPUMemory(); //in bytes
+	void computeUVDensity(); //from the area of the triangles in space and in uv space, needs the geometry in RAM
+	static void updateResidency(); //call it once per frame, releases RAM copies and applies the memory budget
+	static void getTotalMemory(size_t& cpu, size_t& gpu);
+	static void printMemoryReport();
 
 	//collision testing
 	void* collision_model;
 	bool createCollisionModel(bool is_static = false); //is_static sets if the inv matrix should be computed after setTransform (true) or before rayCollision (false)
+	MeshBVH* bvh; //built the first time it is needed, or in background with createBVHAsync
+	bool bvh_pending; //being built in background
+	bool createBVH();
+	void createBVHAsync();
 	//help: model is the transform of the mesh, ray origin and direction, a Vector3 where to store the collision if found, a Vector3 where to store the normal if there was a collision, max ray distance in case the ray should go to infintiy, and in_object_space to get the collision point in object space or world space
 	bool testRayCollision( Matrix44 model, Vector3 ray_origin, Vector3 ray_direction, Vector3& collision, Vector3& normal, float max_ray_dist = 3.4e+38F, bool in_object_space = false );
 	bool testSphereCollision(Matrix44 model, Vector3 center, float radius, Vector3& collision, Vector3& normal);
+	//like testRayCollision but stops at the first triangle found, for visibility tests
+	bool testRayAnyHit(Matrix44 model, Vector3 ray_origin, Vector3 ray_direction, float max_ray_dist = 3.4e+38F);
+
+	//clusters: reorders the triangles of every submesh spatially and groups them
+	bool createClusters(int triangles_per_cluster = MESH_CLUSTER_SIZE);
+	//fills ranges with the visible clusters (merging the contiguous ones), returns the number of triangles to draw. It doesnt need a GPU
+	int cullClusters(const Matrix44& model, Camera* camera, std::vector<sDrawRange>& ranges, bool backface_culling = true, int submesh_id = -1);
 
 	//loader
 	static Mesh* Get(const char* filename, bool skip_load = false);
+	static Mesh* GetAsync(const char* filename); //returns an empty mesh that gets filled once loaded
+	static void prefetch(const char* filename); //reads in the background the file load will use (see file_io.h)
+	bool load(const char* filename); //parses and optimizes the file, it doesnt use the GPU so it can be called from any thread
+	void swapData(Mesh& mesh); //exchanges the geometry with other mesh
 	static void Release();
 	void registerMesh(std::string name);
+	uint64_t computeContentHash(); //of the geometry in RAM, call it before uploading (it can be released after)
+	//returns the mesh with the same content if there is one (deleting this one), otherwise registers it by content
+	static Mesh* Share(Mesh* mesh);
 
 	//create help meshes
 	void createQuad(float center_x, float center_y, float w, float h, bool flip_uvs);
@@ -124,6 +221,7 @@ public:
 	static Mesh* getQuad(); //get global quad
 
 	void updateBoundingBox();
+	void updateSubmeshBoundings();
 
 	//optimize meshes
 	void uploadToVRAM();
@@ -135,4 +233,24 @@ private:
 	bool loadMESH(const char* filename); //personal format used for animations
 };
 
+//When loading meshes asynchronously, the file is parsed and optimized in a background thread
+//and the main thread only uploads it to the GPU. While loading the registered mesh is empty
+
+class LoadMeshTask : public Task {
+public:
+	std::string filename;
+
+	LoadMeshTask(const char* filename);
+	void onExecute();
+};
+
+class UploadMeshTask : public Task {
+public:
+	std::string filename;
+	Mesh* mesh;
+
+	UploadMeshTask(const char* filename, Mesh* mesh);
+	void onExecute();
+};
+
 #endif
@@ -0,0 +1,389 @@
+#include "mipmaps.h"
+
+#include "texture.h"
+#include "utils.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+//use SSE when the compiler targets it (always on x64)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define MIP_USE_SSE
+	#include <emmintrin.h>
+#endif
+
+#ifndef M_PI
+	#define M_PI 3.14159265358979323846
+#endif
+
+#define KAISER_WIDTH 3.0f //support radius, in pixels of the smaller level
+#define KAISER_ALPHA 4.0f
+#define SRGB_TABLE_SIZE 16384
+
+//** COLOR SPACES
+
+struct sSRGBTables
+{
+	float to_linear[256];
+	unsigned char to_srgb[SRGB_TABLE_SIZE];
+
+	sSRGBTables()
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			float v = i / 255.0f;
+			to_linear[i] = v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+		}
+		for (int i = 0; i < SRGB_TABLE_SIZE; ++i)
+		{
+			float v = i / (float)(SRGB_TABLE_SIZE - 1);
+			float s = v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1.0f / 2.4f) - 0.055f;
+			to_srgb[i] = (unsigned char)(s * 255.0f + 0.5f);
+		}
+	}
+};
+
+static const sSRGBTables& getSRGBTables()
+{
+	static sSRGBTables tables; //thread safe initialization
+	return tables;
+}
+
+float sRGBToLinear(unsigned char value)
+{
+	return getSRGBTables().to_linear[value];
+}
+
+unsigned char linearToSRGB(float value)
+{
+	value = std::min(std::max(value, 0.0f), 1.0f);
+	return getSRGBTables().to_srgb[(int)(value * (SRGB_TABLE_SIZE - 1) + 0.5f)];
+}
+
+static inline unsigned char toByte(float value)
+{
+	return (unsigned char)(std::min(std::max(value, 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+//** FILTERS
+
+//the source pixels that contribute to every output pixel, with a fixed number of taps per output (padded with 0 weight)
+struct sFilterTaps
+{
+	int num_taps;
+	std::vector<int> indices;
+	std::vector<float> weights;
+};
+
+static float besselI0(float x)
+{
+	float sum = 1.0f, term = 1.0f;
+	for (int k = 1; k < 20; ++k)
+	{
+		term *= (x * 0.5f / k) * (x * 0.5f / k);
+		sum += term;
+	}
+	return sum;
+}
+
+static float kaiserKernel(float t)
+{
+	if (fabs(t) >= KAISER_WIDTH)
+		return 0.0f;
+	float sinc = t == 0.0f ? 1.0f : sinf((float)M_PI * t) / ((float)M_PI * t);
+	float r = t / KAISER_WIDTH;
+	return sinc * besselI0(KAISER_ALPHA * sqrtf(1.0f - r * r)) / besselI0(KAISER_ALPHA);
+}
+
+static void buildTaps(int src_size, int dst_size, eMipFilter filter, bool wrap, sFilterTaps& taps)
+{
+	float scale = src_size / (float)dst_size;
+	if (src_size == dst_size) //nothing to filter in this axis
+	{
+		taps.num_taps = 1;
+		taps.indices.resize(dst_size);
+		taps.weights.assign(dst_size, 1.0f);
+		for (int i = 0; i < dst_size; ++i)
+			taps.indices[i] = i;
+		return;
+	}
+
+	float radius = filter == MIP_FILTER_BOX ? scale * 0.5f : KAISER_WIDTH * scale;
+	taps.num_taps = (int)ceilf(radius * 2.0f) + 1;
+	taps.indices.assign(dst_size * taps.num_taps, 0);
+	taps.weights.assign(dst_size * taps.num_taps, 0.0f);
+
+	for (int o = 0; o < dst_size; ++o)
+	{
+		float center = (o + 0.5f) * scale;
+		int first = (int)floorf(center - radius);
+		float total = 0.0f;
+		for (int k = 0; k < taps.num_taps; ++k)
+		{
+			int i = first + k;
+			float weight;
+			if (filter == MIP_FILTER_BOX) //overlap of the source pixel with the footprint of the output pixel
+				weight = std::max(std::min((float)i + 1.0f, center + radius) - std::max((float)i, center - radius), 0.0f);
+			else
+				weight = kaiserKernel((i + 0.5f - center) / scale);
+			if (wrap)
+				i = ((i % src_size) + src_size) % src_size;
+			else
+				i = std::min(std::max(i, 0), src_size - 1);
+			taps.indices[o * taps.num_taps + k] = i;
+			taps.weights[o * taps.num_taps + k] = weight;
+			total += weight;
+		}
+		for (int k = 0; k < taps.num_taps; ++k)
+			taps.weights[o * taps.num_taps + k] /= total;
+	}
+}
+
+//weighted sum of the pixels base + index * stride (4 floats per pixel)
+static inline void accumulatePixels(const float* base, size_t stride, const int* indices, const float* weights, int num_taps, float* output)
+{
+#ifdef MIP_USE_SSE
+	__m128 sum = _mm_setzero_ps();
+	for (int k = 0; k < num_taps; ++k)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(base + indices[k] * stride)));
+	_mm_storeu_ps(output, sum);
+#else
+	float sum[4] = { 0, 0, 0, 0 };
+	for (int k = 0; k < num_taps; ++k)
+	{
+		const float* pixel = base + indices[k] * stride;
+		for (int c = 0; c < 4; ++c)
+			sum[c] += weights[k] * pixel[c];
+	}
+	memcpy(output, sum, sizeof(sum));
+#endif
+}
+
+void downsampleLevel(const sMipLevel& src, sMipLevel& dst, const sMipOptions& options)
+{
+	dst.width = std::max(src.width / 2, 1);
+	dst.height = std::max(src.height / 2, 1);
+	dst.data.resize((size_t)dst.width * dst.height * 4);
+
+	sFilterTaps taps_x, taps_y;
+	buildTaps(src.width, dst.width, options.filter, options.wrap, taps_x);
+	buildTaps(src.height, dst.height, options.filter, options.wrap, taps_y);
+
+	//separable: horizontally every source row, then vertically every column of that
+	std::vector<float> temp((size_t)dst.width * src.height * 4);
+	parallelFor(src.height, [&](int y) {
+		const float* row = &src.data[(size_t)y * src.width * 4];
+		for (int x = 0; x < dst.width; ++x)
+			accumulatePixels(row, 4, &taps_x.indices[x * taps_x.num_taps], &taps_x.weights[x * taps_x.num_taps], taps_x.num_taps, &temp[((size_t)y * dst.width + x) * 4]);
+	}, options.num_threads);
+
+	parallelFor(dst.height, [&](int y) {
+		float* row = &dst.data[(size_t)y * dst.width * 4];
+		const int* indices = &taps_y.indices[y * taps_y.num_taps];
+		const float* weights = &taps_y.weights[y * taps_y.num_taps];
+		for (int x = 0; x < dst.width; ++x)
+			accumulatePixels(&temp[x * 4], (size_t)dst.width * 4, indices, weights, taps_y.num_taps, row + x * 4);
+
+		if (options.content == MIP_CONTENT_NORMALMAP)
+			for (int x = 0; x < dst.width; ++x)
+			{
+				float* n = row + x * 4;
+				float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				if (length > 1e-6f)
+				{
+					n[0] /= length; n[1] /= length; n[2] /= length;
+				}
+				else
+				{
+					n[0] = n[1] = 0.0f; n[2] = 1.0f;
+				}
+			}
+	}, options.num_threads);
+}
+
+//** MIP CHAIN
+
+void MipChain::build(const float* rgba, int width, int height, const sMipOptions& options)
+{
+	this->options = options;
+	levels.clear();
+	levels.resize(1);
+	levels[0].width = width;
+	levels[0].height = height;
+	levels[0].data.assign(rgba, rgba + (size_t)width * height * 4);
+
+	//every level depends on the previous one, the rows of a level are filtered in parallel
+	while (levels.back().width > 1 || levels.back().height > 1)
+	{
+		levels.push_back(sMipLevel());
+		downsampleLevel(levels[levels.size() - 2], levels.back(), options);
+	}
+}
+
+void MipChain::build(Image* image, const sMipOptions& options)
+{
+	const sSRGBTables& tables = getSRGBTables();
+	int num_pixels = image->width * image->height;
+	std::vector<float> rgba((size_t)num_pixels * 4);
+	for (int i = 0; i < num_pixels; ++i)
+	{
+		const unsigned char* pixel = image->data + i * image->num_channels;
+		float* out = &rgba[(size_t)i * 4];
+		for (int c = 0; c < 3; ++c)
+		{
+			if (options.content == MIP_CONTENT_SRGB)
+				out[c] = tables.to_linear[pixel[c]];
+			else if (options.content == MIP_CONTENT_NORMALMAP)
+				out[c] = pixel[c] / 127.5f - 1.0f;
+			else
+				out[c] = pixel[c] / 255.0f;
+		}
+		out[3] = image->num_channels == 4 ? pixel[3] / 255.0f : 1.0f; //alpha is always linear
+	}
+	build(rgba.data(), image->width, image->height, options);
+}
+
+void MipChain::build(FloatImage* image, const sMipOptions& options)
+{
+	int num_pixels = image->width * image->height;
+	std::vector<float> rgba((size_t)num_pixels * 4);
+	for (int i = 0; i < num_pixels; ++i)
+	{
+		const float* pixel = image->data + i * image->num_channels;
+		float* out = &rgba[(size_t)i * 4];
+		out[0] = pixel[0];
+		out[1] = image->num_channels > 1 ? pixel[1] : pixel[0];
+		out[2] = image->num_channels > 2 ? pixel[2] : pixel[0];
+		out[3] = image->num_channels == 4 ? pixel[3] : 1.0f;
+	}
+	build(rgba.data(), image->width, image->height, options);
+}
+
+void MipChain::getLevelRGBA8(int level, unsigned char* output) const
+{
+	const sMipLevel& mip = levels[level];
+	size_t num_pixels = (size_t)mip.width * mip.height;
+	for (size_t i = 0; i < num_pixels; ++i)
+	{
+		const float* pixel = &mip.data[i * 4];
+		unsigned char* out = output + i * 4;
+		for (int c = 0; c < 3; ++c)
+		{
+			if (options.content == MIP_CONTENT_SRGB)
+				out[c] = linearToSRGB(pixel[c]);
+			else if (options.content == MIP_CONTENT_NORMALMAP)
+				out[c] = toByte(pixel[c] * 0.5f + 0.5f);
+			else
+				out[c] = toByte(pixel[c]);
+		}
+		out[3] = toByte(pixel[3]);
+	}
+}
+
+void MipChain::getLevelFloat(int level, float* output, int num_channels) const
+{
+	const sMipLevel& mip = levels[level];
+	size_t num_pixels = (size_t)mip.width * mip.height;
+	for (size_t i = 0; i < num_pixels; ++i)
+		memcpy(output + i * num_channels, &mip.data[i * 4], sizeof(float) * num_channels);
+}
+
+//** BENCHMARK
+
+static double computePSNR(const std::vector<unsigned char>& a, const std::vector<unsigned char>& b)
+{
+	double error = 0.0;
+	for (size_t i = 0; i < a.size(); ++i)
+	{
+		double diff = (double)a[i] - b[i];
+		error += diff * diff;
+	}
+	error /= a.size();
+	return error > 0.0 ? 10.0 * log10(255.0 * 255.0 / error) : 99.0;
+}
+
+void benchmarkMipmaps(int size)
+{
+	//sRGB color texture with fine black and white lines (where filtering in gamma space is most wrong), gradients and noise
+	Image image;
+	image.resize(size, size, 4);
+	for (int y = 0; y < size; ++y)
+		for (int x = 0; x < size; ++x)
+		{
+			unsigned char* pixel = image.data + (y * size + x) * 4;
+			if (x < size / 2)
+				pixel[0] = pixel[1] = pixel[2] = ((x + y / 3) & 1) ? 255 : 0;
+			else
+			{
+				pixel[0] = (x * 255) / size;
+				pixel[1] = (y * 255) / size;
+				pixel[2] = std::min(std::max(128 + (rand() % 64) - 32, 0), 255);
+			}
+			pixel[3] = 255;
+		}
+
+	//reference: every texel of the level is the average in linear space of its footprint in the image
+	int num_levels = 1;
+	while ((size >> num_levels) > 0)
+		num_levels++;
+	std::vector<std::vector<unsigned char>> reference(num_levels);
+	for (int level = 1; level < num_levels; ++level)
+	{
+		int level_size = size >> level;
+		int footprint = 1 << level;
+		reference[level].resize(level_size * level_size * 4);
+		for (int y = 0; y < level_size; ++y)
+			for (int x = 0; x < level_size; ++x)
+			{
+				double sum[3] = { 0, 0, 0 };
+				for (int fy = 0; fy < footprint; ++fy)
+					for (int fx = 0; fx < footprint; ++fx)
+					{
+						const unsigned char* pixel = image.data + ((y * footprint + fy) * size + x * footprint + fx) * 4;
+						for (int c = 0; c < 3; ++c)
+							sum[c] += sRGBToLinear(pixel[c]);
+					}
+				unsigned char* out = &reference[level][(y * level_size + x) * 4];
+				for (int c = 0; c < 3; ++c)
+					out[c] = linearToSRGB((float)(sum[c] / (footprint * footprint)));
+				out[3] = 255;
+			}
+	}
+
+	struct sConfig { const char* name; eMipFilter filter; eMipContent content; int num_threads; };
+	sConfig configs[] = {
+		{ "box in gamma space (like the driver)", MIP_FILTER_BOX, MIP_CONTENT_LINEAR, 0 },
+		{ "box sRGB", MIP_FILTER_BOX, MIP_CONTENT_SRGB, 0 },
+		{ "kaiser sRGB", MIP_FILTER_KAISER, MIP_CONTENT_SRGB, 0 },
+		{ "kaiser sRGB, 1 thread", MIP_FILTER_KAISER, MIP_CONTENT_SRGB, 1 },
+	};
+
+	std::cout << " + Mipmaps benchmark " << size << "x" << size << " (PSNR against a box average in linear space, kaiser is sharper so it differs more):" << std::endl;
+	for (int i = 0; i < sizeof(configs) / sizeof(sConfig); ++i)
+	{
+		sMipOptions options;
+		options.filter = configs[i].filter;
+		options.content = configs[i].content;
+		options.wrap = false;
+		options.num_threads = configs[i].num_threads;
+
+		long start_time = getTime();
+		MipChain chain;
+		chain.build(&image, options);
+		std::vector<std::vector<unsigned char>> levels(chain.getNumLevels());
+		for (int level = 1; level < chain.getNumLevels(); ++level)
+		{
+			levels[level].resize(chain.levels[level].width * chain.levels[level].height * 4);
+			chain.getLevelRGBA8(level, levels[level].data());
+		}
+		long time = getTime() - start_time;
+
+		double psnr = 0.0;
+		for (int level = 1; level < num_levels; ++level)
+			psnr += computePSNR(levels[level], reference[level]);
+		psnr /= std::max(num_levels - 1, 1);
+		std::cout << "\t" << configs[i].name << ": " << time << "ms, average PSNR " << psnr << "dB" << std::endl;
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+
+//Mipmaps generated in the CPU (instead of glGenerateMipmap, which filters in gamma space and runs on every load)
+//so they can be stored in the texture cache. Levels are filtered in linear space as RGBA floats
+
+class Image;
+class FloatImage;
+
+enum eMipFilter {
+	MIP_FILTER_BOX, //2x2 average (exact overlap for odd sizes)
+	MIP_FILTER_KAISER //windowed sinc, sharper
+};
+
+enum eMipContent {
+	MIP_CONTENT_LINEAR, //data (roughness, masks, HDR)
+	MIP_CONTENT_SRGB, //colors, converted to linear to filter them and back to sRGB
+	MIP_CONTENT_NORMALMAP //tangent space normals, renormalized after every level
+};
+
+struct sMipOptions
+{
+	eMipFilter filter;
+	eMipContent content;
+	bool wrap; //sample the other side at the borders (for tiling textures), otherwise clamp
+	int num_threads; //0 means one per core, use 1 from threads that already run in parallel
+
+	sMipOptions() { filter = MIP_FILTER_KAISER; content = MIP_CONTENT_LINEAR; wrap = true; num_threads = 1; }
+};
+
+struct sMipLevel
+{
+	int width;
+	int height;
+	std::vector<float> data; //RGBA, linear (normals in -1..1)
+};
+
+class MipChain
+{
+public:
+	sMipOptions options;
+	std::vector<sMipLevel> levels; //level 0 is the image
+
+	//down to 1x1
+	void build(Image* image, const sMipOptions& options);
+	void build(FloatImage* image, const sMipOptions& options);
+	void build(const float* rgba, int width, int height, const sMipOptions& options);
+
+	int getNumLevels() const { return (int)levels.size(); }
+	//encoded back as it was in the image (sRGB, normals in 0..1)
+	void getLevelRGBA8(int level, unsigned char* output) const;
+	void getLevelFloat(int level, float* output, int num_channels = 4) const;
+};
+
+void downsampleLevel(const sMipLevel& src, sMipLevel& dst, const sMipOptions& options);
+
+float sRGBToLinear(unsigned char value);
+unsigned char linearToSRGB(float value);
+
+//compares the filters against a reference made averaging in linear space and prints the PSNR and the timings
+void benchmarkMipmaps(int size = 2048);
@@ -8,6 +8,8 @@
 #include "camera.h"
 
 #include "gltf_loader.h"
+#include "prefab_cache.h"
+#include "file_io.h"
 #include "utils.h"
 #include "framework.h"
 #include "application.h"
@@ -199,6 +201,7 @@ void Prefab::updateBounding()
 }
 
 std::map<std::string, Prefab*> Prefab::sPrefabsLoaded;
+bool Prefab::use_cooked = true;
 
 Prefab* Prefab::Get(const char* filename)
 {
@@ -209,6 +212,18 @@ Prefab* Prefab::Get(const char* filename)
 
 	Prefab* prefab = nullptr;
 	{
+		//plain meshes are wrapped in a prefab and loaded in the background
+		std::string ext = std::string(filename).substr(std::string(filename).find_last_of(".") + 1);
+		if (ext == "ase" || ext == "ASE" || ext == "obj" || ext == "OBJ" || ext == "mbin" || ext == "MBIN")
+		{
+			prefab = new Prefab();
+			prefab->root.name = filename;
+			prefab->root.mesh = Mesh::GetAsync(filename);
+			prefab->root.material = new Material();
+		}
+
+		if (!prefab && use_cooked && isCookedPrefabValid(filename))
+			prefab = loadCookedPrefab(filename);
 		if (!prefab)
 			prefab = loadGLTF(filename);
 		if (!prefab) {
@@ -223,6 +238,20 @@ Prefab* Prefab::Get(const char* filename)
 	return prefab;
 }
 
+void Prefab::prefetch(const char* filename)
+{
+	if (sPrefabsLoaded.find(filename) != sPrefabsLoaded.end())
+		return;
+	//the same choice as Get
+	std::string ext = std::string(filename).substr(std::string(filename).find_last_of(".") + 1);
+	if (ext == "ase" || ext == "ASE" || ext == "obj" || ext == "OBJ" || ext == "mbin" || ext == "MBIN")
+		Mesh::prefetch(filename);
+	else if (use_cooked && isCookedPrefabValid(filename))
+		FileIO::prefetch(getCookedPrefabFilename(filename));
+	else
+		FileIO::prefetch(filename);
+}
+
 void Prefab::registerPrefab(std::string name)
 {
 	this->name = name;
@@ -112,7 +112,9 @@ namespace GTR {
 
 				//Manager to cache loaded prefabs
 		static std::map<std::string, Prefab*> sPrefabsLoaded;
+		static bool use_cooked; //load glTFs from their cooked version (.pbin) when it is up to date, and create it otherwise
 		static Prefab* Get(const char* filename);
+		static void prefetch(const char* filename); //reads in the background the file Get will use (see file_io.h)
 		void registerPrefab(std::string name);
 	};
 
@@ -0,0 +1,502 @@
+#include "prefab_cache.h"
+
+#include "mesh.h"
+#include "texture.h"
+#include "material.h"
+#include "utils.h"
+
+#include <iostream>
+#include <cassert>
+
+using namespace GTR;
+
+struct sPrefabBinHeader
+{
+	int version;
+	int header_bytes;
+	int num_textures;
+	int num_materials;
+	int num_meshes;
+	int num_nodes;
+};
+
+#define PREFAB_NUM_SAMPLERS 6
+
+struct sMaterialBinInfo
+{
+	int alpha_mode;
+	float alpha_cutoff;
+	int two_sided;
+	Vector4 color;
+	float roughness_factor;
+	float metallic_factor;
+	Vector3 emissive_factor;
+	int textures[PREFAB_NUM_SAMPLERS]; //index in the textures table, -1 if none
+	int uv_channels[PREFAB_NUM_SAMPLERS];
+};
+
+struct sNodeBinInfo
+{
+	int visible;
+	int layers;
+	Matrix44 model;
+	int mesh; //index in the meshes table, -1 if none
+	int material; //index in the materials table, -1 if none
+	int num_children;
+};
+
+enum eCookedTexture {
+	COOKED_TEXTURE_FILE, //only the filename is stored
+	COOKED_TEXTURE_EMBEDDED //the encoded image is stored
+};
+
+static void getSamplers(Material* material, Sampler* samplers[PREFAB_NUM_SAMPLERS])
+{
+	samplers[0] = &material->color_texture;
+	samplers[1] = &material->emissive_texture;
+	samplers[2] = &material->opacity_texture;
+	samplers[3] = &material->metallic_roughness_texture;
+	samplers[4] = &material->occlusion_texture;
+	samplers[5] = &material->normal_texture;
+}
+
+std::string getCookedPrefabFilename(const char* filename)
+{
+	return std::string(filename) + ".pbin";
+}
+
+bool isCookedPrefabValid(const char* filename)
+{
+	long cooked_time = getFileTime(getCookedPrefabFilename(filename));
+	return cooked_time && cooked_time >= getFileTime(filename);
+}
+
+//*** WRITING ***
+
+class BinWriter
+{
+public:
+	std::vector<unsigned char> data;
+
+	void write(const void* src, size_t size) {
+		if (!size)
+			return;
+		size_t pos = data.size();
+		data.resize(pos + size);
+		memcpy(&data[pos], src, size);
+	}
+	template<typename T> void write(const T& value) { write(&value, sizeof(T)); }
+	void writeString(const std::string& str) {
+		write((int)str.size());
+		write(str.c_str(), str.size());
+	}
+};
+
+//gathers everything used by the nodes giving every element an index
+struct sCookTables
+{
+	std::vector<Texture*> textures;
+	std::vector<Material*> materials;
+	std::vector<Mesh*> meshes;
+	std::map<Texture*, int> texture_index;
+	std::map<Material*, int> material_index;
+	std::map<Mesh*, int> mesh_index;
+	int num_nodes;
+};
+
+static void collectNode(Node* node, sCookTables& tables, const std::map<Texture*, sCookedImage>& embedded_images)
+{
+	tables.num_nodes++;
+	if (node->mesh && tables.mesh_index.find(node->mesh) == tables.mesh_index.end())
+	{
+		tables.mesh_index[node->mesh] = (int)tables.meshes.size();
+		tables.meshes.push_back(node->mesh);
+	}
+	if (node->material && tables.material_index.find(node->material) == tables.material_index.end())
+	{
+		tables.material_index[node->material] = (int)tables.materials.size();
+		tables.materials.push_back(node->material);
+
+		Sampler* samplers[PREFAB_NUM_SAMPLERS];
+		getSamplers(node->material, samplers);
+		for (int i = 0; i < PREFAB_NUM_SAMPLERS; ++i)
+		{
+			Texture* texture = samplers[i]->texture;
+			if (!texture || tables.texture_index.find(texture) != tables.texture_index.end())
+				continue;
+			//textures without a file or the image cannot be restored
+			if (texture->filename.empty() && embedded_images.find(texture) == embedded_images.end())
+				continue;
+			tables.texture_index[texture] = (int)tables.textures.size();
+			tables.textures.push_back(texture);
+		}
+	}
+	for (int i = 0; i < node->children.size(); ++i)
+		collectNode(node->children[i], tables, embedded_images);
+}
+
+static void writeNode(BinWriter& writer, Node* node, sCookTables& tables)
+{
+	sNodeBinInfo info = sNodeBinInfo();
+	info.visible = node->visible;
+	info.layers = node->layers;
+	info.model = node->model;
+	info.mesh = node->mesh ? tables.mesh_index[node->mesh] : -1;
+	info.material = node->material ? tables.material_index[node->material] : -1;
+	info.num_children = (int)node->children.size();
+	writer.writeString(node->name);
+	writer.write(info);
+	for (int i = 0; i < node->children.size(); ++i)
+		writeNode(writer, node->children[i], tables);
+}
+
+bool writeCookedPrefab(Prefab* prefab, const char* filename, const std::map<Texture*, sCookedImage>& embedded_images)
+{
+	long start_time = getTime();
+	sCookTables tables;
+	tables.num_nodes = 0;
+	collectNode(&prefab->root, tables, embedded_images);
+
+	BinWriter writer;
+	writer.write("PBIN", 4);
+
+	sPrefabBinHeader header;
+	header.version = PREFAB_BIN_VERSION;
+	header.header_bytes = sizeof(sPrefabBinHeader);
+	header.num_textures = (int)tables.textures.size();
+	header.num_materials = (int)tables.materials.size();
+	header.num_meshes = (int)tables.meshes.size();
+	header.num_nodes = tables.num_nodes;
+	writer.write(header);
+
+	for (int i = 0; i < tables.textures.size(); ++i)
+	{
+		Texture* texture = tables.textures[i];
+		auto it = embedded_images.find(texture);
+		writer.write((int)(it != embedded_images.end() ? COOKED_TEXTURE_EMBEDDED : COOKED_TEXTURE_FILE));
+		writer.writeString(texture->filename);
+		writer.write((int)texture->srgb);
+		if (it == embedded_images.end())
+			continue;
+		writer.writeString(it->second.mime_type);
+		writer.write((int)it->second.size);
+		writer.write(it->second.data, it->second.size);
+	}
+
+	for (int i = 0; i < tables.materials.size(); ++i)
+	{
+		Material* material = tables.materials[i];
+		sMaterialBinInfo info = sMaterialBinInfo();
+		info.alpha_mode = material->alpha_mode;
+		info.alpha_cutoff = material->alpha_cutoff;
+		info.two_sided = material->two_sided;
+		info.color = material->color;
+		info.roughness_factor = material->roughness_factor;
+		info.metallic_factor = material->metallic_factor;
+		info.emissive_factor = material->emissive_factor;
+		Sampler* samplers[PREFAB_NUM_SAMPLERS];
+		getSamplers(material, samplers);
+		for (int j = 0; j < PREFAB_NUM_SAMPLERS; ++j)
+		{
+			auto it = tables.texture_index.find(samplers[j]->texture);
+			info.textures[j] = it != tables.texture_index.end() ? it->second : -1;
+			info.uv_channels[j] = samplers[j]->uv_channel;
+		}
+		writer.writeString(material->name);
+		writer.write(info);
+	}
+
+	std::vector<unsigned char> mesh_data;
+	for (int i = 0; i < tables.meshes.size(); ++i)
+	{
+		Mesh* mesh = tables.meshes[i];
+		if (!mesh->writeBinToMemory(mesh_data))
+		{
+			std::cout << "[WARN] cannot cook prefab, mesh without data: " << mesh->name << std::endl;
+			return false;
+		}
+		writer.writeString(mesh->name);
+		writer.write((int)mesh_data.size());
+		writer.write(&mesh_data[0], mesh_data.size());
+	}
+
+	writeNode(writer, &prefab->root, tables);
+
+	std::string cooked_filename = getCookedPrefabFilename(filename);
+	FILE* f = fopen(cooked_filename.c_str(), "wb");
+	if (f == NULL)
+	{
+		std::cout << "[ERROR] cannot write cooked prefab: " << cooked_filename << std::endl;
+		return false;
+	}
+	fwrite(&writer.data[0], writer.data.size(), 1, f);
+	fclose(f);
+
+	stdlog(std::string(" - Cooked ") + cooked_filename + " (" + std::to_string(writer.data.size() / 1024) + "KB) in " + std::to_string(getTime() - start_time) + "ms");
+	return true;
+}
+
+//*** READING ***
+
+class BinReader
+{
+public:
+	const unsigned char* pos;
+	const unsigned char* end;
+	bool ok; //false once it tried to read past the end
+
+	BinReader(const unsigned char* data, size_t size) { pos = data; end = data + size; ok = true; }
+
+	size_t remaining() const { return end - pos; }
+
+	const unsigned char* skip(size_t size) {
+		if (!ok || (size_t)(end - pos) < size)
+		{
+			ok = false;
+			return NULL;
+		}
+		const unsigned char* start = pos;
+		pos += size;
+		return start;
+	}
+	template<typename T> bool read(T& value) {
+		const unsigned char* src = skip(sizeof(T));
+		if (src)
+			memcpy(&value, src, sizeof(T));
+		return src != NULL;
+	}
+	std::string readString() {
+		int size = 0;
+		if (!read(size) || size < 0)
+			return "";
+		const unsigned char* src = skip(size);
+		return src ? std::string((const char*)src, size) : "";
+	}
+};
+
+struct sCookedTexture
+{
+	int kind;
+	std::string name;
+	std::string mime_type;
+	const unsigned char* data; //inside the mapped file
+	int size;
+	int srgb;
+	Texture* texture;
+};
+
+struct sCookedMesh
+{
+	std::string name;
+	const unsigned char* data; //inside the mapped file
+	int size;
+	Mesh* mesh;
+	bool loaded; //false if it was already loaded
+	bool valid;
+};
+
+static bool readNode(BinReader& reader, Node* node, int& remaining_nodes, const std::vector<sCookedMesh>& meshes, const std::vector<Material*>& materials)
+{
+	sNodeBinInfo info;
+	node->name = reader.readString();
+	if (!reader.read(info) || remaining_nodes-- <= 0)
+		return false;
+	node->visible = info.visible != 0;
+	node->layers = info.layers;
+	node->model = info.model;
+	if (info.mesh >= 0 && info.mesh < meshes.size())
+		node->mesh = meshes[info.mesh].mesh;
+	if (info.material >= 0 && info.material < materials.size())
+		node->material = materials[info.material];
+	for (int i = 0; i < info.num_children; ++i)
+	{
+		Node* child = new Node();
+		node->addChild(child);
+		if (!readNode(reader, child, remaining_nodes, meshes, materials))
+			return false;
+	}
+	return true;
+}
+
+Prefab* loadCookedPrefab(const char* filename)
+{
+	long start_time = getTime();
+	std::string cooked_filename = getCookedPrefabFilename(filename);
+	//shared with the tasks decoding the embedded images, it is closed when all are done
+	std::shared_ptr<MappedFile> file(new MappedFile());
+	if (!file->open(cooked_filename.c_str()))
+		return NULL;
+
+	BinReader reader(file->data, file->size);
+	const unsigned char* watermark = reader.skip(4);
+	sPrefabBinHeader header;
+	if (!watermark || memcmp(watermark, "PBIN", 4) != 0 || !reader.read(header))
+	{
+		std::cout << "[ERROR] loading cooked prefab: invalid content: " << cooked_filename << std::endl;
+		return NULL;
+	}
+	if (header.version != PREFAB_BIN_VERSION || header.header_bytes != sizeof(sPrefabBinHeader))
+	{
+		std::cout << "[WARN] loading cooked prefab: old version: " << cooked_filename << std::endl;
+		return NULL;
+	}
+	//every entry takes at least its fixed part, bigger counts come from a corrupted file (dont allocate them)
+	unsigned long long min_bytes = (unsigned long long)header.num_textures * (3 * sizeof(int)) +
+		(unsigned long long)header.num_materials * (sizeof(int) + sizeof(sMaterialBinInfo)) +
+		(unsigned long long)header.num_meshes * (2 * sizeof(int)) +
+		(unsigned long long)header.num_nodes * (sizeof(int) + sizeof(sNodeBinInfo));
+	if (header.num_textures < 0 || header.num_materials < 0 || header.num_meshes < 0 || header.num_nodes < 0 || min_bytes > reader.remaining())
+	{
+		std::cout << "[ERROR] loading cooked prefab: tables are corrupted: " << cooked_filename << std::endl;
+		return NULL;
+	}
+
+	//tables
+	std::vector<sCookedTexture> textures(header.num_textures);
+	for (int i = 0; i < textures.size() && reader.ok; ++i)
+	{
+		sCookedTexture& texture = textures[i];
+		texture.size = 0;
+		texture.data = NULL;
+		texture.texture = NULL;
+		texture.kind = COOKED_TEXTURE_FILE;
+		texture.srgb = 0;
+		reader.read(texture.kind);
+		texture.name = reader.readString();
+		reader.read(texture.srgb);
+		if (texture.kind != COOKED_TEXTURE_EMBEDDED)
+		{
+			//read while the meshes are decoded
+			if (texture.name.size())
+				Texture::prefetch(texture.name.c_str());
+			continue;
+		}
+		texture.mime_type = reader.readString();
+		reader.read(texture.size);
+		texture.data = reader.skip(texture.size);
+		if (texture.name.size())
+			texture.texture = Texture::Find(texture.name.c_str(), texture.srgb != 0); //no need to decode it
+	}
+
+	std::vector<sMaterialBinInfo> material_infos(header.num_materials);
+	std::vector<std::string> material_names(header.num_materials);
+	for (int i = 0; i < material_infos.size() && reader.ok; ++i)
+	{
+		material_names[i] = reader.readString();
+		reader.read(material_infos[i]);
+	}
+
+	std::vector<sCookedMesh> meshes(header.num_meshes);
+	for (int i = 0; i < meshes.size() && reader.ok; ++i)
+	{
+		sCookedMesh& cooked = meshes[i];
+		cooked.name = reader.readString();
+		cooked.size = 0;
+		reader.read(cooked.size);
+		cooked.data = reader.skip(cooked.size);
+		cooked.mesh = cooked.name.size() ? Mesh::Get(cooked.name.c_str(), true) : NULL;
+		cooked.loaded = cooked.mesh == NULL;
+		cooked.valid = true;
+		if (cooked.loaded)
+			cooked.mesh = new Mesh();
+	}
+
+	//decode meshes in parallel (embedded images are decoded in the background later)
+	if (reader.ok)
+	{
+		parallelFor((int)meshes.size(), [&](int i) {
+			sCookedMesh& cooked = meshes[i];
+			if (cooked.loaded)
+				cooked.valid = cooked.mesh->readBinFromMemory(cooked.data, cooked.size, cooked.name.c_str());
+			if (cooked.loaded && cooked.valid)
+				cooked.mesh->content_hash = cooked.mesh->computeContentHash();
+		});
+	}
+
+	bool valid = reader.ok;
+	for (int i = 0; i < meshes.size(); ++i)
+		valid = valid && meshes[i].valid;
+	if (!valid)
+	{
+		std::cout << "[ERROR] loading cooked prefab: corrupted: " << cooked_filename << std::endl;
+		for (int i = 0; i < meshes.size(); ++i)
+			if (meshes[i].loaded)
+				delete meshes[i].mesh;
+		return NULL;
+	}
+
+	//upload in the main thread, unless the same geometry is already loaded
+	for (int i = 0; i < meshes.size(); ++i)
+	{
+		sCookedMesh& cooked = meshes[i];
+		if (!cooked.loaded)
+			continue;
+		Mesh* shared = Mesh::Share(cooked.mesh);
+		if (shared != cooked.mesh)
+		{
+			cooked.mesh = shared;
+			cooked.loaded = false;
+			continue;
+		}
+		cooked.mesh->uploadToVRAM();
+		if (cooked.name.size())
+			cooked.mesh->registerMesh(cooked.name);
+	}
+
+	for (int i = 0; i < textures.size(); ++i)
+	{
+		sCookedTexture& texture = textures[i];
+		if (texture.texture)
+			continue;
+		if (texture.kind == COOKED_TEXTURE_FILE)
+		{
+			texture.texture = Texture::GetAsync(texture.name.c_str(), true, true, texture.srgb != 0);
+			continue;
+		}
+		texture.texture = Texture::GetAsyncFromMemory(texture.name.size() ? texture.name.c_str() : NULL, file, texture.data, texture.size, texture.mime_type.c_str(), true, texture.srgb != 0);
+	}
+
+	std::vector<Material*> materials(material_infos.size());
+	for (int i = 0; i < materials.size(); ++i)
+	{
+		const std::string& name = material_names[i];
+		Material* material = name.size() ? Material::Get(name.c_str()) : NULL;
+		if (!material)
+		{
+			material = new Material();
+			if (name.size())
+				material->registerMaterial(name.c_str());
+			sMaterialBinInfo& info = material_infos[i];
+			material->alpha_mode = (eAlphaMode)info.alpha_mode;
+			material->alpha_cutoff = info.alpha_cutoff;
+			material->two_sided = info.two_sided != 0;
+			material->color = info.color;
+			material->roughness_factor = info.roughness_factor;
+			material->metallic_factor = info.metallic_factor;
+			material->emissive_factor = info.emissive_factor;
+			Sampler* samplers[PREFAB_NUM_SAMPLERS];
+			getSamplers(material, samplers);
+			for (int j = 0; j < PREFAB_NUM_SAMPLERS; ++j)
+			{
+				if (info.textures[j] >= 0 && info.textures[j] < textures.size())
+					samplers[j]->texture = textures[info.textures[j]].texture;
+				samplers[j]->uv_channel = info.uv_channels[j];
+			}
+			material = Material::Share(material);
+		}
+		materials[i] = material;
+	}
+
+	Prefab* prefab = new Prefab();
+	int remaining_nodes = header.num_nodes;
+	if (!readNode(reader, &prefab->root, remaining_nodes, meshes, materials))
+	{
+		std::cout << "[ERROR] loading cooked prefab: nodes are corrupted: " << cooked_filename << std::endl;
+		delete prefab; //the source glTF is loaded instead
+		return NULL;
+	}
+
+	prefab->updateNodesByName();
+	stdlog(std::string(" - Loaded cooked ") + cooked_filename + " in " + std::to_string(getTime() - start_time) + "ms");
+	return prefab;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "prefab.h"
+#include <map>
+#include <string>
+
+//Cooked prefabs: a binary snapshot of a loaded glTF (nodes, meshes, materials and texture references)
+//stored next to the source as <file>.pbin so it can be loaded without parsing it again
+
+#define PREFAB_BIN_VERSION 2
+
+class Texture;
+
+//encoded image embedded in the source file, it is stored as it is in the cooked file
+struct sCookedImage
+{
+	std::string mime_type;
+	const unsigned char* data;
+	size_t size;
+};
+
+std::string getCookedPrefabFilename(const char* filename);
+bool isCookedPrefabValid(const char* filename); //exists and it is newer than the source
+
+//textures not in embedded_images are stored by filename
+bool writeCookedPrefab(GTR::Prefab* prefab, const char* filename, const std::map<Texture*, sCookedImage>& embedded_images);
+//returns NULL if the file is missing or it is from another version
+GTR::Prefab* loadCookedPrefab(const char* filename);
@@ -0,0 +1,198 @@
+#include "raycast.h"
+
+#include "mesh.h"
+#include "bvh.h"
+#include "scene.h"
+#include "prefab.h"
+#include "utils.h"
+
+#include <thread>
+#include <atomic>
+#include <cassert>
+#include <algorithm>
+
+using namespace GTR;
+
+#define RAY_PACKETS_PER_JOB 16 //packets fetched at once by every thread
+
+void sRayBatch::resize(int num_rays)
+{
+	origin_x.resize(num_rays); origin_y.resize(num_rays); origin_z.resize(num_rays);
+	dir_x.resize(num_rays); dir_y.resize(num_rays); dir_z.resize(num_rays);
+	max_dist.resize(num_rays, 3.4e+38F);
+}
+
+void sRayBatch::set(int i, const Vector3& origin, const Vector3& direction, float max_dist)
+{
+	origin_x[i] = origin.x; origin_y[i] = origin.y; origin_z[i] = origin.z;
+	dir_x[i] = direction.x; dir_y[i] = direction.y; dir_z[i] = direction.z;
+	this->max_dist[i] = max_dist;
+}
+
+void sRayBatchHits::resize(int num_rays)
+{
+	distance.resize(num_rays);
+	normal_x.resize(num_rays); normal_y.resize(num_rays); normal_z.resize(num_rays);
+	node.resize(num_rays);
+	triangle.resize(num_rays);
+}
+
+RayBatchQuery::RayBatchQuery()
+{
+	query_time = 0;
+}
+
+void RayBatchQuery::addScene(GTR::Scene* scene, int layers)
+{
+	for (int i = 0; i < scene->entities.size(); ++i)
+	{
+		BaseEntity* ent = scene->entities[i];
+		if (!ent->visible || ent->entity_type != PREFAB)
+			continue;
+		PrefabEntity* pent = (GTR::PrefabEntity*)ent;
+		if (pent->prefab)
+			addNode(&pent->prefab->root, ent->model, layers);
+	}
+}
+
+void RayBatchQuery::addNode(GTR::Node* node, const Matrix44& prefab_model, int layers)
+{
+	if (!node->visible || !(node->layers & layers))
+		return;
+
+	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+
+	//meshes still loading are ignored, as when rendering
+	if (node->mesh && !node->mesh->loading && node->mesh->createBVH())
+	{
+		sRayInstance instance;
+		instance.node = node;
+		instance.mesh = node->mesh;
+		instance.model = node_model;
+		instance.inv_model = node_model;
+		instance.inv_model.inverse();
+		instances.push_back(instance);
+	}
+
+	for (int i = 0; i < node->children.size(); ++i)
+		addNode(node->children[i], prefab_model, layers);
+}
+
+//tests up to BVH_RAY_PACKET_SIZE consecutive rays against all the instances
+void RayBatchQuery::testPacket(const sRayBatch& rays, sRayBatchHits& hits, int start, int count, bool any_hit)
+{
+	float best[BVH_RAY_PACKET_SIZE];
+	int best_instance[BVH_RAY_PACKET_SIZE];
+	int best_triangle[BVH_RAY_PACKET_SIZE];
+	int num_done = 0;
+	for (int r = 0; r < count; ++r)
+	{
+		best[r] = rays.max_dist[start + r];
+		best_instance[r] = -1;
+	}
+
+	sBVHRayPacket packet;
+	packet.count = count;
+	for (int i = 0; i < instances.size() && num_done < count; ++i)
+	{
+		sRayInstance& instance = instances[i];
+
+		//to object space, the distance along the direction is the same in both spaces
+		for (int r = 0; r < count; ++r)
+		{
+			int ray = start + r;
+			packet.origin[r] = instance.inv_model * Vector3(rays.origin_x[ray], rays.origin_y[ray], rays.origin_z[ray]);
+			packet.direction[r] = instance.inv_model.rotateVector(Vector3(rays.dir_x[ray], rays.dir_y[ray], rays.dir_z[ray]));
+			//rays that already have a hit are disabled in any_hit mode
+			packet.max_dist[r] = (any_hit && best_instance[r] != -1) ? -1.0f : best[r];
+		}
+
+		if (!instance.mesh->bvh->testRayPacket(packet, any_hit))
+			continue;
+
+		for (int r = 0; r < count; ++r)
+		{
+			if (!packet.found[r])
+				continue;
+			if (best_instance[r] == -1 && any_hit)
+				num_done++;
+			best[r] = packet.hit[r].distance;
+			best_instance[r] = i;
+			best_triangle[r] = packet.hit[r].triangle;
+		}
+	}
+
+	for (int r = 0; r < count; ++r)
+	{
+		int ray = start + r;
+		if (best_instance[r] == -1)
+		{
+			hits.distance[ray] = -1.0f;
+			hits.normal_x[ray] = hits.normal_y[ray] = hits.normal_z[ray] = 0.0f;
+			hits.node[ray] = NULL;
+			hits.triangle[ray] = -1;
+			continue;
+		}
+
+		sRayInstance& instance = instances[best_instance[r]];
+		Vector3 a, b, c;
+		instance.mesh->bvh->getTriangle(best_triangle[r], a, b, c);
+		a = instance.model * a;
+		b = instance.model * b;
+		c = instance.model * c;
+		Vector3 normal = (b - a).cross(c - a);
+		normal.normalize();
+
+		hits.distance[ray] = best[r];
+		hits.normal_x[ray] = normal.x;
+		hits.normal_y[ray] = normal.y;
+		hits.normal_z[ray] = normal.z;
+		hits.node[ray] = instance.node;
+		hits.triangle[ray] = best_triangle[r];
+	}
+}
+
+int RayBatchQuery::testRays(const sRayBatch& rays, sRayBatchHits& hits, bool any_hit, int num_threads)
+{
+	long start_time = getTime();
+	int num_rays = rays.size();
+	hits.resize(num_rays);
+	if (!num_rays)
+		return 0;
+
+	int num_packets = (num_rays + BVH_RAY_PACKET_SIZE - 1) / BVH_RAY_PACKET_SIZE;
+	if (num_threads <= 0)
+		num_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+	num_threads = std::min(num_threads, (num_packets + RAY_PACKETS_PER_JOB - 1) / RAY_PACKETS_PER_JOB);
+
+	//every thread takes chunks of packets until there are no more
+	std::atomic<int> next_packet(0);
+	auto worker = [&]() {
+		while (true)
+		{
+			int first = next_packet.fetch_add(RAY_PACKETS_PER_JOB);
+			if (first >= num_packets)
+				break;
+			int last = std::min(first + RAY_PACKETS_PER_JOB, num_packets);
+			for (int p = first; p < last; ++p)
+			{
+				int start = p * BVH_RAY_PACKET_SIZE;
+				testPacket(rays, hits, start, std::min(BVH_RAY_PACKET_SIZE, num_rays - start), any_hit);
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < num_threads; ++i)
+		threads.push_back(std::thread(worker));
+	worker(); //this thread works too
+	for (int i = 0; i < threads.size(); ++i)
+		threads[i].join();
+
+	int num_hits = 0;
+	for (int i = 0; i < num_rays; ++i)
+		num_hits += hits.hasHit(i) ? 1 : 0;
+
+	query_time = getTime() - start_time;
+	return num_hits;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "framework.h"
+#include <vector>
+
+class Mesh;
+
+namespace GTR {
+
+	class Scene;
+	class Node;
+
+	//rays stored as SoA, the rays are traversed in packets of consecutive rays so sort them to keep them coherent
+	struct sRayBatch
+	{
+		std::vector<float> origin_x, origin_y, origin_z;
+		std::vector<float> dir_x, dir_y, dir_z; //does not need to be normalized, distances are in units of the direction
+		std::vector<float> max_dist;
+
+		int size() const { return (int)origin_x.size(); }
+		void resize(int num_rays);
+		void set(int i, const Vector3& origin, const Vector3& direction, float max_dist = 3.4e+38F);
+	};
+
+	//results of a batch, distance is -1 when the ray didnt hit anything
+	struct sRayBatchHits
+	{
+		std::vector<float> distance;
+		std::vector<float> normal_x, normal_y, normal_z; //world space, normalized
+		std::vector<GTR::Node*> node;
+		std::vector<int> triangle; //triangle index in the mesh of the node
+
+		int size() const { return (int)distance.size(); }
+		void resize(int num_rays);
+		bool hasHit(int i) const { return distance[i] >= 0.0f; }
+	};
+
+	//answers many ray queries against the meshes of a scene at once (for AI, audio or lightmap baking)
+	class RayBatchQuery
+	{
+	public:
+		struct sRayInstance {
+			GTR::Node* node;
+			Mesh* mesh;
+			Matrix44 model;
+			Matrix44 inv_model;
+		};
+
+		std::vector<sRayInstance> instances;
+		long query_time; //in ms, of the last testRays
+
+		RayBatchQuery();
+
+		//collects the visible nodes with a mesh, it builds the BVHs that are missing so call it from the main thread
+		void addScene(GTR::Scene* scene, int layers = 0xFF);
+		void addNode(GTR::Node* node, const Matrix44& prefab_model, int layers = 0xFF);
+		void clear() { instances.clear(); }
+
+		//tests all the rays using num_threads (0 = one per core), returns the number of rays that hit
+		int testRays(const sRayBatch& rays, sRayBatchHits& hits, bool any_hit = false, int num_threads = 0);
+
+	private:
+		void testPacket(const sRayBatch& rays, sRayBatchHits& hits, int start, int count, bool any_hit);
+	};
+
+};
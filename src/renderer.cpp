@@ -4,6 +4,9 @@
 #include "shader.h"
 #include "mesh.h"
 #include "texture.h"
+#include "texture_streaming.h"
+#include "texture_arrays.h"
+#include "jobs.h"
 #include "prefab.h"
 #include "material.h"
 #include "utils.h"
@@ -14,6 +17,7 @@
 #include <algorithm>
 #include <string>
 #include "shadowAtlas.h"
+#include "uniform_blocks.h"
 
 
 using namespace GTR;
@@ -117,15 +121,101 @@ void Renderer::renderSkybox(Camera* camera)
 
 void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 {
-	
-	
-	//render entities
+	//the CPU stages run as jobs, only the ones using GL stay in the main thread (see frame_graph.h)
+	frame_graph.clear();
+	frame_camera = camera;
+
+	int residency = frame_graph.addStage("residency", [this]() {
+		Shader::newFrame();
+		Mesh::updateResidency();
+		Texture::updateResidency();
+		this->shadowMapAtlas->clearArray();
+	}, {}, true);
+
+	int gather = frame_graph.addStage("gather", [this, scene, camera]() {
+		gatherRenderCalls(scene, camera);
+	}, { residency });
+
+	int sort_lights = frame_graph.addStage("sort lights", [this]() {
+		std::sort(this->lights.begin(), this->lights.end(), lightSort);
+	}, { gather });
+
+	int sort_calls = frame_graph.addStage("sort calls", [this]() {
+		if (this->orderNodes)
+			std::sort(this->render_calls.begin(), this->render_calls.end(), transparencySort);
+	}, { gather });
+
+	int cull = frame_graph.addStage("camera cull", [this, camera]() {
+		JobSystem::parallelFor((int)this->render_calls.size(), [&](int i) {
+			RenderCall& rc = this->render_calls[i];
+			rc.visible = camera->testBoxInFrustum(rc.boundingBox.center, rc.boundingBox.halfsize);
+		}, 256);
+	}, { sort_calls });
+
+	//the shadow cameras and the casters of every light
+	int shadow_setup = frame_graph.addStage("shadow setup", [this]() {
+		for (int i = 0; i < lights.size(); ++i)
+			if (lights[i]->cast_shadows)
+				this->shadowMapAtlas->addLight(lights[i]);
+		this->shadowMapAtlas->prepareShadows(this->render_calls);
+	}, { sort_lights, sort_calls });
+
+	//the visible objects ask for the texture levels they need
+	int texture_requests = frame_graph.addStage("texture requests", [this, camera]() {
+		float viewport_height = (float)Application::instance->window_height;
+		for (int i = 0; i < this->render_calls.size(); ++i)
+		{
+			RenderCall& rc = this->render_calls[i];
+			if (rc.visible)
+				TextureStreamer::requestMaterial(rc.material, rc.mesh, rc.model, rc.boundingBox, camera, viewport_height);
+		}
+	}, { cull });
+
+	int texture_updates = frame_graph.addStage("texture updates", []() {
+		TextureStreamer::update();
+		TextureArrayPacker::update();
+	}, { texture_requests }, true);
+
+	int shadow_maps = frame_graph.addStage("shadow maps", [this]() {
+		this->shadowMapAtlas->calculateShadows(this->render_calls);
+	}, { shadow_setup }, true);
+
+	frame_graph.addStage("render", [this, scene, camera]() {
+		//the lights and their shadows are the same for every pass of the frame
+		UniformBlocks::updateLights(this->lights, this->shadowMapAtlas);
+
+		if (shouldCalculateProbes) {
+			this->shouldCalculateProbes = false;
+			this->CalculateIrradianceProbes(scene);
+		}
+
+		if (pipelineType == ePipeLineType::FORWARD)
+			RenderForward(camera, scene);
+		else
+			RenderDeferred(camera, scene);
+
+		if (displayIRRProbes) {
+			for (int i = 0; i < irrProbes.size(); ++i) {
+				sProbe& data = irrProbes[i];
+				renderProbe(data.pos, 5.0, (float*)&data.sh.coeffs);
+			}
+		}
+		if (displayReflectionProbes) {
+			renderReflectionProbes(scene, camera);
+		}
+	}, { cull, texture_updates, shadow_maps }, true);
+
+	frame_graph.execute();
+	frame_camera = NULL;
+}
 
+void Renderer::gatherRenderCalls(GTR::Scene* scene, Camera* camera)
+{
 	this->render_calls.clear();
 	this->lights.clear();
 	this->decals.clear();
-	this->shadowMapAtlas->clearArray();
 
+	std::vector<PrefabEntity*> prefabs;
 	for (int i = 0; i < scene->entities.size(); ++i)
 	{
 		BaseEntity* ent = scene->entities[i];
@@ -136,73 +226,39 @@ void Renderer::renderScene(GTR::Scene* scene, Camera* camera)
 		if (ent->entity_type == PREFAB)
 		{
 			PrefabEntity* pent = (GTR::PrefabEntity*)ent;
-			if (pent->prefab) {
-				renderPrefab(ent->model, pent->prefab, camera);
-				
-			}
+			if (pent->prefab)
+				prefabs.push_back(pent);
 		}
 		//is a light!
-		else if (ent->entity_type == eEntityType::LIGHT) {
-			LightEntity* light = (GTR::LightEntity*)ent;
-			this->lights.push_back(light);
-		}
-		else if (ent->entity_type == eEntityType::DECAL) {
-			decals.push_back((DecalEntity*) ent);
-		}
+		else if (ent->entity_type == eEntityType::LIGHT)
+			this->lights.push_back((GTR::LightEntity*)ent);
+		else if (ent->entity_type == eEntityType::DECAL)
+			decals.push_back((DecalEntity*)ent);
 	}
 
-	
-
-		std::sort(this->lights.begin(), this->lights.end(), lightSort);
-	if (this->orderNodes)
-		std::sort(this->render_calls.begin(), this->render_calls.end(), transparencySort);
-	
-
-	//generate shadowmaps
-	for (int i = 0; i < lights.size(); ++i) {
-		LightEntity* light = lights[i];
-		if (light->cast_shadows)
-			this->shadowMapAtlas->addLight(light);
-			//generateShadowMaps(light);
-	}
-	this->shadowMapAtlas->calculateShadows(this->render_calls);
-	
-//	this->shadowMapAtlas->atlasFBO->depth_texture->toViewport();
+	//every prefab to its own list, so the order is the same as traversing them one by one
+	std::vector<std::vector<RenderCall>> prefab_calls(prefabs.size());
+	JobSystem::parallelFor((int)prefabs.size(), [&](int i) {
+		renderNode(prefabs[i]->model, &prefabs[i]->prefab->root, camera, prefab_calls[i]);
+	});
+	for (int i = 0; i < prefab_calls.size(); ++i)
+		this->render_calls.insert(this->render_calls.end(), prefab_calls[i].begin(), prefab_calls[i].end());
+}
 
-	std::sort(this->lights.begin(), this->lights.end(), lightSort);
-	
-	if (shouldCalculateProbes) {
-		this->shouldCalculateProbes = false;
-		this->CalculateIrradianceProbes(scene);
-	}
-	
-	if (pipelineType==ePipeLineType::FORWARD)
-		RenderForward(camera,scene );
-	else
-		RenderDeferred(camera,scene);
-	
-	if (displayIRRProbes) {
-		
-		for (int i = 0; i < irrProbes.size(); ++i) {
-			sProbe& data= irrProbes[i];
-			float* coeff = (float*) & data.sh.coeffs[0];
-			renderProbe(data.pos, 5.0, (float*)&data.sh.coeffs);
-		}
-	}
-	if (displayReflectionProbes) {
-		renderReflectionProbes(scene, camera);
-	}
-	
-	
-	
-	
-	
+bool Renderer::isVisible(const RenderCall& rc, Camera* camera)
+{
+	//the camera of the frame was tested by the cull stage
+	if (camera == frame_camera)
+		return rc.visible;
+	return camera->testBoxInFrustum(rc.boundingBox.center, rc.boundingBox.halfsize);
 }
 
 
 
 void GTR::Renderer::RenderForward(Camera* camera, GTR::Scene* scene)
 {
+	UniformBlocks::updateCamera(camera);
+
 	//set the clear color (the background color)
 	glClearColor(scene->background_color.x, scene->background_color.y, scene->background_color.z, 1.0);
 	// Clear the color and the depth buffer
@@ -215,8 +271,12 @@ void GTR::Renderer::RenderForward(Camera* camera, GTR::Scene* scene)
 	for (int i = 0; i < this->render_calls.size(); ++i) {
 		RenderCall& rc = this->render_calls[i];
 		//BoundingBox world_bounding = transformBoundingBox(rc.model, rc.mesh->box);
-		if (camera->testBoxInFrustum(rc.boundingBox.center, rc.boundingBox.halfsize))
-			renderMeshWithMaterialAndLighting(rc.model, rc.mesh, rc.material, camera);
+		if (!isVisible(rc, camera))
+			continue;
+		const std::vector<sDrawRange>* ranges = cullRenderCall(rc, camera);
+		if (ranges && ranges->empty())
+			continue;
+		renderMeshWithMaterialAndLighting(rc.model, rc.mesh, rc.material, camera, ranges);
 
 	}
 }
@@ -442,6 +502,8 @@ void Renderer::CalculateIrradianceProbes(Scene* scene) {
 
 void GTR::Renderer::RenderDeferred(Camera* camera, GTR::Scene* scene)
 {
+	UniformBlocks::updateCamera(camera);
+
 	//Render GBuffer
 	//Create gbuffer if it doesn't exist
 
@@ -533,11 +595,16 @@ void GTR::Renderer::RenderDeferred(Camera* camera, GTR::Scene* scene)
 	for (int i = 0; i < this->render_calls.size(); ++i) {
 		RenderCall& rc = this->render_calls[i];
 		//BoundingBox world_bounding = transformBoundingBox(rc.model, rc.mesh->box);
-		if (camera->testBoxInFrustum(rc.boundingBox.center, rc.boundingBox.halfsize))
+		if (isVisible(rc, camera))
 			if (rc.material->alpha_mode == eAlphaMode::BLEND)
 				alphaNodes.push_back(&rc);
 			else
-				renderMeshWithMaterialToGBuffers(rc.model, rc.mesh, rc.material, camera);
+			{
+				const std::vector<sDrawRange>* ranges = cullRenderCall(rc, camera);
+				if (ranges && ranges->empty())
+					continue;
+				renderMeshWithMaterialToGBuffers(rc.model, rc.mesh, rc.material, camera, ranges);
+			}
 	}
 	gbuffers_fbo->unbind();
 
@@ -609,7 +676,6 @@ void GTR::Renderer::RenderDeferred(Camera* camera, GTR::Scene* scene)
 	shader = Shader::Get("deferred");
 	shader->enable();
 	shader->setUniform("u_ambient_light", scene->ambient_light);
-	shader->setUniform("u_camera_position", camera->eye);
 	shader->setUniform("u_gb0_texture", gbuffers_fbo->color_textures[0], 0);
 	shader->setUniform("u_gb1_texture", gbuffers_fbo->color_textures[1], 1);
 	shader->setUniform("u_gb2_texture", gbuffers_fbo->color_textures[2], 2);
@@ -629,12 +695,11 @@ void GTR::Renderer::RenderDeferred(Camera* camera, GTR::Scene* scene)
 	else
 		shader->setUniform("u_skybox_texture", reflection, 6);
 
-	//pass the inverse projection of the camera to reconstruct world pos.
+	//the inverse projection of the camera to reconstruct world pos is in the CameraBlock
 	
-	shader->setUniform("u_inverse_viewprojection", inv_vp);
 	//pass the inverse window resolution, this may be useful
 	shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-	this->shadowMapAtlas->uploadDataToShader(shader,this->lights);
+	this->shadowMapAtlas->uploadDataToShader(shader);
 	/*
 	if (this->isOptimizedDeferred) {
 		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
@@ -675,14 +740,11 @@ void GTR::Renderer::RenderDeferred(Camera* camera, GTR::Scene* scene)
 					shader->setUniform("u_depth_texture", gbuffers_fbo->depth_texture, 4);
 					
 					shader->setUniform("u_useReflections", false);
-					shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-					shader->setUniform("u_camera_position", camera->eye);
-					shader->setUniform("u_inverse_viewprojection", inv_vp);
 					shader->setUniform("useHDR", this->useHDR);
 					shader->setUniform("usePBR", usePBR);
 					//pass the inverse window resolution, this may be useful
 					shader->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
-					this->shadowMapAtlas->uploadDataToShader(shader, this->lights);
+					this->shadowMapAtlas->uploadDataToShader(shader);
 					glDisable(GL_DEPTH_TEST);
 					glDisable(GL_BLEND);
 
@@ -801,7 +863,10 @@ void GTR::Renderer::RenderDeferred(Camera* camera, GTR::Scene* scene)
 	for (int i = 0; i < alphaNodes.size(); ++i) {
 		RenderCall* rc = alphaNodes[i];
 		//BoundingBox world_bounding = transformBoundingBox(rc.model, rc.mesh->box);
-		renderMeshWithMaterialAndLighting(rc->model, rc->mesh, rc->material, camera);
+		const std::vector<sDrawRange>* ranges = cullRenderCall(*rc, camera);
+		if (ranges && ranges->empty())
+			continue;
+		renderMeshWithMaterialAndLighting(rc->model, rc->mesh, rc->material, camera, ranges);
 	}
 
 	
@@ -819,7 +884,7 @@ void GTR::Renderer::RenderDeferred(Camera* camera, GTR::Scene* scene)
 		shader->setUniform("u_iRes", Vector2(1.0 / (float)volumetric_fbo->color_textures[0]->width, 1.0 / (float)volumetric_fbo->color_textures[0]->height));
 		glDisable(GL_BLEND);
 		glBlendFunc(GL_ONE, GL_ONE);
-		this->shadowMapAtlas->uploadDataToShader(shader, this->lights);
+		this->shadowMapAtlas->uploadDataToShader(shader);
 		//Put in a for and get 
 		for (int i = 0; i < lights.size(); ++i) {
 			if (lights[i]->light_type == eLightType::POINT) continue;
@@ -1114,20 +1179,21 @@ void Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera*
 {
 	assert(prefab && "PREFAB IS NULL");
 	//assign the model to the root node
-	renderNode(model, &prefab->root, camera);
+	renderNode(model, &prefab->root, camera, this->render_calls);
 }
 
 //renders a node of the prefab and its children
-void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera, std::vector<RenderCall>& calls, const Matrix44& parent_model)
 {
 	if (!node->visible)
 		return;
 
-	//compute global matrix
-	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	//compute global matrix (without storing it in the node, several threads could be traversing the same prefab)
+	Matrix44 global_model = node->model * parent_model;
+	Matrix44 node_model = global_model * prefab_model;
 
-	//does this node have a mesh? then we must render it
-	if (node->mesh && node->material)
+	//does this node have a mesh? then we must render it (unless it is still loading, we dont know its bounding yet)
+	if (node->mesh && node->material && !node->mesh->loading)
 	{
 		/*
 		//compute the bounding box of the object in world space (by using the mesh bounding box transformed to world space)
@@ -1147,19 +1213,55 @@ void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera*
 		rc.model = node_model;
 		rc.distance_to_camera = distance(nodepos,camera->eye);
 		rc.boundingBox = transformBoundingBox(node_model, node->mesh->box);
-		this->render_calls.push_back(rc);
+
+		//multi part meshes are culled part by part
+		if (node->mesh->submeshes.size() > 1)
+			for (int i = 0; i < node->mesh->submeshes.size(); ++i)
+			{
+				rc.submesh_id = i;
+				rc.boundingBox = transformBoundingBox(node_model, node->mesh->submeshes[i].box);
+				rc.distance_to_camera = distance(rc.boundingBox.center, camera->eye);
+				calls.push_back(rc);
+			}
+		else
+			calls.push_back(rc);
 			
 		//}
 	}
 
 	//iterate recursively with children
 	for (int i = 0; i < node->children.size(); ++i)
-		renderNode(prefab_model, node->children[i], camera);
+		renderNode(prefab_model, node->children[i], camera, calls, global_model);
 }
 
 
 
-void GTR::Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+//draws the whole mesh or only the given ranges
+static void drawMesh(Mesh* mesh, const std::vector<sDrawRange>* ranges)
+{
+	if (ranges)
+		mesh->renderRanges(GL_TRIANGLES, *ranges);
+	else
+		mesh->render(GL_TRIANGLES);
+}
+
+const std::vector<sDrawRange>* GTR::Renderer::cullRenderCall(RenderCall& rc, Camera* camera)
+{
+	//small meshes are not worth it
+	if (useClusterCulling && rc.mesh->clusters.size() > 1)
+	{
+		rc.mesh->cullClusters(rc.model, camera, draw_ranges, !rc.material->two_sided, rc.submesh_id);
+		return &draw_ranges;
+	}
+
+	if (rc.submesh_id == -1)
+		return NULL;
+	sSubmeshInfo& submesh = rc.mesh->submeshes[rc.submesh_id];
+	draw_ranges.assign(1, { submesh.start, submesh.length });
+	return &draw_ranges;
+}
+
+void GTR::Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const std::vector<sDrawRange>* ranges)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -1199,9 +1301,9 @@ void GTR::Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh*
 		glEnable(GL_CULL_FACE);
 	assert(glGetError() == GL_NO_ERROR);
 
-	//chose a shader
-	
-	shader = Shader::Get("gbuffers");
+	//chose a shader, when all the textures are in arrays the draws of the same pages dont bind anything new
+	bool use_arrays = TextureArrayPacker::enabled && TextureArrayPacker::canUseArrays(material);
+	shader = Shader::Get(use_arrays ? "gbuffers_arrays" : "gbuffers");
 
 
 	assert(glGetError() == GL_NO_ERROR);
@@ -1212,42 +1314,54 @@ void GTR::Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh*
 	shader->enable();
 
 	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_model", model);
+	shader->setUniform(UNIFORM("u_model"), model);
 	
-	shader->setUniform("useHDR", this->useHDR);
-	shader->setFloat("u_emissive_factor", this->useEmissive ? 1.0 : 0.0);
-	shader->setUniform("u_use_normalmap", this->useNormalMap);
-	shader->setFloat("u_useOcclusion", this->useOcclusion);
-	shader->setUniform("usePBR", usePBR);
-	shader->setVector3("u_emmisive_mat_factor", material->emissive_factor);
-	shader->setFloat("u_roughness_mat_factor", material->roughness_factor);
-	shader->setFloat("u_metallic_mat_factor", material->metallic_factor);
+	shader->setUniform(UNIFORM("useHDR"), this->useHDR);
+	shader->setUniform(UNIFORM("u_emissive_factor"), this->useEmissive ? 1.0f : 0.0f);
+	shader->setUniform(UNIFORM("u_use_normalmap"), this->useNormalMap);
+	shader->setUniform(UNIFORM("u_useOcclusion"), this->useOcclusion ? 1.0f : 0.0f);
+	shader->setUniform(UNIFORM("usePBR"), usePBR);
+	shader->setUniform(UNIFORM("u_emmisive_mat_factor"), material->emissive_factor);
+	shader->setUniform(UNIFORM("u_roughness_mat_factor"), material->roughness_factor);
+	shader->setUniform(UNIFORM("u_metallic_mat_factor"), material->metallic_factor);
 	
 	float t = getTime();
-	shader->setUniform("u_time", t);
+	shader->setUniform(UNIFORM("u_time"), t);
 
-	shader->setUniform("u_color", material->color);
-	if (texture)
-		shader->setUniform("u_texture", texture, 0);
-
-	if (textureEmissive)
-		shader->setUniform("u_emissive_texture", textureEmissive, 1);
-	if (textureMRT) {
-		shader->setUniform("u_metallic_roughness_texture", textureMRT, 2);
-		shader->setUniform("u_has_MRT_texture", true);
-	}else
-		shader->setUniform("u_has_MRT_texture", false);
-	if (textureNormal)
-		shader->setUniform("u_normal_texture", textureNormal, 3);
+	shader->setUniform(UNIFORM("u_color"), material->color);
+	if (use_arrays)
+	{
+		//the empty slots use a white array
+		TextureArrayPacker::setTexture(shader, "u_texture", "u_texture_layer", material->color_texture.texture, 0);
+		TextureArrayPacker::setTexture(shader, "u_emissive_texture", "u_emissive_layer", material->emissive_texture.texture, 1);
+		TextureArrayPacker::setTexture(shader, "u_metallic_roughness_texture", "u_metallic_roughness_layer", textureMRT, 2);
+		TextureArrayPacker::setTexture(shader, "u_normal_texture", "u_normal_layer", textureNormal, 3);
+		shader->setUniform(UNIFORM("u_has_MRT_texture"), textureMRT != NULL);
+		if (!textureNormal)
+			shader->setUniform(UNIFORM("u_use_normalmap"), false);
+	}
 	else
-		shader->setUniform("u_use_normalmap", false);
+	{
+		if (texture)
+			shader->setUniform(UNIFORM("u_texture"), texture, 0);
+
+		if (textureEmissive)
+			shader->setUniform(UNIFORM("u_emissive_texture"), textureEmissive, 1);
+		if (textureMRT) {
+			shader->setUniform(UNIFORM("u_metallic_roughness_texture"), textureMRT, 2);
+			shader->setUniform(UNIFORM("u_has_MRT_texture"), true);
+		}else
+			shader->setUniform(UNIFORM("u_has_MRT_texture"), false);
+		if (textureNormal)
+			shader->setUniform(UNIFORM("u_normal_texture"), textureNormal, 3);
+		else
+			shader->setUniform(UNIFORM("u_use_normalmap"), false);
+	}
 
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+	shader->setUniform(UNIFORM("u_alpha_cutoff"), material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
 	
-	mesh->render(GL_TRIANGLES);
+	drawMesh(mesh, ranges);
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 	
@@ -1266,26 +1380,26 @@ void GTR::Renderer::renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh*
 
 void GTR::Renderer::uploadSingleLightToShader(Shader* shader, GTR::LightEntity* light)
 {
-	shader->setUniform("u_light_color", light->color * light->intensity);
-	shader->setUniform("u_light_intensity", light->intensity);
-	shader->setUniform("u_light_position", light->model.getTranslation());
-	shader->setUniform("u_light_max_distance", light->max_distance);
-	shader->setUniform("u_light_type", (int)light->light_type);
-	shader->setUniform("u_light_vector", light->lightDirection);
-	shader->setUniform("u_spotCosineCuttof", 0.0f);
-	shader->setUniform("u_cone_angle", 0.0f);
-	shader->setUniform("u_light_cast_shadows", false);
-	shader->setUniform("usePBR", usePBR);
+	shader->setUniform(UNIFORM("u_light_color"), light->color * light->intensity);
+	shader->setUniform(UNIFORM("u_light_intensity"), light->intensity);
+	shader->setUniform(UNIFORM("u_light_position"), light->model.getTranslation());
+	shader->setUniform(UNIFORM("u_light_max_distance"), light->max_distance);
+	shader->setUniform(UNIFORM("u_light_type"), (int)light->light_type);
+	shader->setUniform(UNIFORM("u_light_vector"), light->lightDirection);
+	shader->setUniform(UNIFORM("u_spotCosineCuttof"), 0.0f);
+	shader->setUniform(UNIFORM("u_cone_angle"), 0.0f);
+	shader->setUniform(UNIFORM("u_light_cast_shadows"), false);
+	shader->setUniform(UNIFORM("usePBR"), usePBR);
 	if (light->light_type == eLightType::SPOT) {
-		shader->setUniform("u_cone_angle", light->cone_angle);
-		shader->setUniform("u_cone_exp", light->cone_exp);
-		shader->setUniform("u_spotCosineCuttof", cos((float)(DEG2RAD * light->cone_angle)));
+		shader->setUniform(UNIFORM("u_cone_angle"), light->cone_angle);
+		shader->setUniform(UNIFORM("u_cone_exp"), light->cone_exp);
+		shader->setUniform(UNIFORM("u_spotCosineCuttof"), (float)cos((float)(DEG2RAD * light->cone_angle)));
 	}
 	if (light->has_shadow_map && light->cast_shadows) {
-		shader->setUniform("u_light_cast_shadows", true);
+		shader->setUniform(UNIFORM("u_light_cast_shadows"), true);
 		//shader->setUniform("u_light_shadowmap", light->shadow_map,8);
-		shader->setUniform("u_light_shadowmap_vp", light->shadow_cam->viewprojection_matrix);
-		shader->setUniform("u_shadow_bias", light->shadow_bias);
+		shader->setUniform(UNIFORM("u_light_shadowmap_vp"), light->shadow_cam->viewprojection_matrix);
+		shader->setUniform(UNIFORM("u_shadow_bias"), light->shadow_bias);
 	}
 }
 
@@ -1293,7 +1407,7 @@ void GTR::Renderer::uploadSingleLightToShader(Shader* shader, GTR::LightEntity*
 
 
 //renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void Renderer::renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const std::vector<sDrawRange>* ranges)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -1361,118 +1475,62 @@ void Renderer::renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mes
 	shader->enable();
 	
 	//upload uniforms
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_position", camera->eye);
-	shader->setUniform("u_useReflections", this->useReflections);
+	shader->setUniform(UNIFORM("u_useReflections"), this->useReflections);
 	
-	shader->setUniform("u_model", model );
+	shader->setUniform(UNIFORM("u_model"), model );
 	
-	shader->setFloat("u_emissive_factor", this->useEmissive?1.0:0.0 );
+	shader->setUniform(UNIFORM("u_emissive_factor"), this->useEmissive ? 1.0f : 0.0f);
 
-	shader->setVector3("u_emmisive_mat_factor", material->emissive_factor);
-	shader->setFloat("u_roughness_mat_factor", material->roughness_factor);
-	shader->setFloat("u_metallic_mat_factor", material->metallic_factor);
+	shader->setUniform(UNIFORM("u_emmisive_mat_factor"), material->emissive_factor);
+	shader->setUniform(UNIFORM("u_roughness_mat_factor"), material->roughness_factor);
+	shader->setUniform(UNIFORM("u_metallic_mat_factor"), material->metallic_factor);
 	
-	shader->setUniform("u_use_normalmap", this->useNormalMap);
-	shader->setFloat("u_useOcclusion", this->useOcclusion);
-	shader->setUniform("usePBR", usePBR);
+	shader->setUniform(UNIFORM("u_use_normalmap"), this->useNormalMap);
+	shader->setUniform(UNIFORM("u_useOcclusion"), this->useOcclusion ? 1.0f : 0.0f);
+	shader->setUniform(UNIFORM("usePBR"), usePBR);
 	float t = getTime();
-	shader->setUniform("u_time", t );
+	shader->setUniform(UNIFORM("u_time"), t );
 
-	shader->setUniform("u_color", material->color);
+	shader->setUniform(UNIFORM("u_color"), material->color);
 	if(texture)
-		shader->setUniform("u_texture", texture, 0);
+		shader->setUniform(UNIFORM("u_texture"), texture, 0);
 	
 	if (textureEmissive)
-		shader->setUniform("u_emissive_texture", textureEmissive, 1);
+		shader->setUniform(UNIFORM("u_emissive_texture"), textureEmissive, 1);
 	if (textureMRT) {
-		shader->setUniform("u_metallic_roughness_texture", textureMRT, 2);
-		shader->setUniform("u_has_MRT_texture",true);
+		shader->setUniform(UNIFORM("u_metallic_roughness_texture"), textureMRT, 2);
+		shader->setUniform(UNIFORM("u_has_MRT_texture"), true);
 	}
 	else {
-		shader->setUniform("u_has_MRT_texture",false);
+		shader->setUniform(UNIFORM("u_has_MRT_texture"), false);
 	}
 	if (textureNormal)
-		shader->setUniform("u_normal_texture", textureNormal, 3);
+		shader->setUniform(UNIFORM("u_normal_texture"), textureNormal, 3);
 	
 
 	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+	shader->setUniform(UNIFORM("u_alpha_cutoff"), material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
 	
 	Texture* reflection = skybox;
 	if(probe && isRenderingReflections)
-		shader->setUniform("u_skybox_texture", probe->texture, 4);
+		shader->setUniform(UNIFORM("u_skybox_texture"), probe->texture, 4);
 	else
-		shader->setUniform("u_skybox_texture", reflection, 4);
-	shader->setUniform("u_has_reflection", isRenderingReflections);
-	shader->setUniform("u_ambient_light", scene->ambient_light);
+		shader->setUniform(UNIFORM("u_skybox_texture"), reflection, 4);
+	shader->setUniform(UNIFORM("u_has_reflection"), isRenderingReflections);
+	shader->setUniform(UNIFORM("u_ambient_light"), scene->ambient_light);
 	
 	
 
 	if (!num_lights) {
-		mesh->render(GL_TRIANGLES);
+		drawMesh(mesh, ranges);
 		return;
 	}
 
 	if (this->multiLightType == (int)eMultiLightType::SINGLE_PASS) {
-		const int maxLights = 5;
-
-		std::vector<const char*> textureNames = { "u_shadow_texture0","u_shadow_texture1","u_shadow_texture2","u_shadow_texture3","u_shadow_texture4" };
-		
-		Vector3 light_position[maxLights] = {};
-		Vector3 light_color[maxLights] = {};
-		float light_max_distance[maxLights] = {};
-		int light_type[maxLights] = {};
-		Vector3 light_vector[maxLights] = {};
-		float spotCosineCuttof[maxLights] = {};
-		float coneAngle[maxLights] = {};
-		float coneExp[maxLights] = {};
-		int light_cast_shadows[maxLights] = {};
-		//Texture* light_shadowmap[maxLights] = {};
-		Matrix44 light_shadowmap_vp[maxLights] = {};
-		float shadowBias[maxLights] = {};
-		
-		
-		
-		for (int i = 0; i < num_lights; i++) {
-			light_position[i] = lights[i]->model.getTranslation();
-			light_color[i] = lights[i]->color * lights[i]->intensity;
-			light_max_distance[i] = lights[i]->max_distance;
-			light_type[i] = (int)(lights[i]->light_type);
-			light_vector[i] = lights[i]->lightDirection;
-			coneAngle[i] = lights[i]->cone_angle;
-			spotCosineCuttof[i] = cos((float)(DEG2RAD * lights[i]->cone_angle));
-			coneExp[i] = lights[i]->cone_exp;
-			light_cast_shadows[i] = (lights[i]->cast_shadows)?1:0;
-			//light_shadowmap[i] = lights[i]->shadow_map;
-			shadowBias[i] = lights[i]->shadow_bias;
-			
-			if ((lights[i]->has_shadow_map && lights[i]->cast_shadows)) {
-				//shader->setTexture(textureNames[i], lights[i]->shadow_map, 8 + i);
-				light_shadowmap_vp[i] = lights[i]->shadow_cam->viewprojection_matrix;
-				
-			}
-			
-
-			
-	
-		};
-		
-		shader->setUniform3Array("u_light_position", (float*)&light_position, num_lights);
-		shader->setUniform3Array("u_light_color", (float*)&light_color, num_lights);
-		shader->setUniform1Array("u_light_max_distance", (float*)&light_max_distance, num_lights);
-		shader->setUniform1Array("u_light_type", (int*)&light_type, num_lights);
-		shader->setUniform3Array("u_light_vector", (float*)&light_vector, num_lights);
-		shader->setUniform1Array("u_cone_angle", (float*)&coneAngle, num_lights);
-		shader->setUniform1Array("u_cosine_cutoff", (float*)&spotCosineCuttof, num_lights);
-		shader->setUniform1Array("u_cone_exp", (float*)&coneExp, num_lights);
-		shader->setUniform1Array("u_cast_shadow", (int*)&light_cast_shadows, num_lights);
-		shader->setMatrix44Array("u_shadow_map_vp", (Matrix44*)&light_shadowmap_vp, num_lights);
-		shader->setUniform1Array("u_shadowBias", (float*)&shadowBias, num_lights);
-		shader->setUniform1("u_num_lights", num_lights);
-		shader->setUniform("usePBR", usePBR);
-		this->shadowMapAtlas->uploadDataToShader(shader,this->lights);
-		mesh->render(GL_TRIANGLES);
+		//the lights are in the LightsBlock, filled once per frame (see uniform_blocks.h)
+		shader->setUniform(UNIFORM("usePBR"), usePBR);
+		this->shadowMapAtlas->uploadDataToShader(shader);
+		drawMesh(mesh, ranges);
 		shader->disable();
 	}
 	
@@ -1485,18 +1543,18 @@ void Renderer::renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mes
 		glBlendFunc(GL_SRC_ALPHA, material->alpha_mode==GTR::eAlphaMode::BLEND? GL_ONE_MINUS_SRC_ALPHA: GL_ONE);
 		
 		
-		this->shadowMapAtlas->uploadDataToShader(shader, this->lights);
+		this->shadowMapAtlas->uploadDataToShader(shader);
 		for (int i = 0; i < num_lights; i++) {
 			LightEntity* light = lights[i];
 			if (i > 0) {
-				shader->setUniform("u_ambient_light", Vector3());
-				shader->setFloat("u_emissive_factor", 0.0f);
+				shader->setUniform(UNIFORM("u_ambient_light"), Vector3());
+				shader->setUniform(UNIFORM("u_emissive_factor"), 0.0f);
 				
 			}
-			shader->setUniform("light_index", i);
+			shader->setUniform(UNIFORM("light_index"), i);
 			
 			uploadSingleLightToShader(shader, light);
-			mesh->render(GL_TRIANGLES);
+			drawMesh(mesh, ranges);
 			glEnable(GL_BLEND);
 			glBlendFunc(GL_SRC_ALPHA,  GL_ONE);
 		}
@@ -1615,23 +1673,38 @@ Texture* GTR::CubemapFromHDRE(const char* filename)
 	if (!hdre)
 		return NULL;
 
+	//uploaded straight from the mapped file in the type it is stored (half floats are not expanded),
+	//the driver converts the floats, 16 bits are enough for the environment and use half the VRAM
+	unsigned int format = hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA;
+	unsigned int type = GL_UNSIGNED_BYTE;
+	unsigned int internal_format = format;
+	if (hdre->header.type == HDRE_TYPE_FLOAT || hdre->header.type == HDRE_TYPE_HALF_FLOAT)
+	{
+		type = hdre->header.type == HDRE_TYPE_FLOAT ? GL_FLOAT : GL_HALF_FLOAT;
+		internal_format = format == GL_RGB ? GL_RGB16F : GL_RGBA16F;
+	}
+
+	//old files clamp the small levels to 8 pixels, those cannot be used as mipmaps
+	int num_levels = 0;
+	while (num_levels < hdre->stored_levels && hdre->level_sizes[num_levels] == (hdre->width >> num_levels))
+		num_levels++;
+
 	Texture* texture = new Texture();
-	if (hdre->getFacesf(0))
+	for (int i = 0; i < num_levels; ++i)
 	{
-		texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesf(0),
-			hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_FLOAT);
-		for (int i = 1; i < hdre->levels; ++i)
-			texture->uploadCubemap(texture->format, texture->type, false,
-				(Uint8**)hdre->getFacesf(i), GL_RGBA32F, i);
+		Uint8** faces = hdre->header.type == HDRE_TYPE_FLOAT ? (Uint8**)hdre->getFacesf(i) :
+			(hdre->header.type == HDRE_TYPE_HALF_FLOAT ? (Uint8**)hdre->getFacesh(i) : (Uint8**)hdre->getFacesb(i));
+		if (i == 0)
+			texture->createCubemap(hdre->width, hdre->height, faces, format, type, true, internal_format);
+		else
+			texture->uploadCubemap(format, type, false, faces, internal_format, i);
 	}
-	else
-		if (hdre->getFacesh(0))
-		{
-			texture->createCubemap(hdre->width, hdre->height, (Uint8**)hdre->getFacesh(0),
-				hdre->header.numChannels == 3 ? GL_RGB : GL_RGBA, GL_HALF_FLOAT);
-			for (int i = 1; i < hdre->levels; ++i)
-				texture->uploadCubemap(texture->format, texture->type, false,
-					(Uint8**)hdre->getFacesh(i), GL_RGBA16F, i);
-		}
+	glBindTexture(GL_TEXTURE_CUBE_MAP, texture->texture_id);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, std::max(num_levels - 1, 0));
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	texture->gpu_memory = texture->computeGPUMemory(num_levels);
+
+	//the header (luminance, SH) is kept, the pixels are in VRAM now
+	hdre->release();
 	return texture;
 }
\ No newline at end of file
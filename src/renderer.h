@@ -1,6 +1,8 @@
 #pragma once
 #include "prefab.h"
+#include "mesh.h"
 #include "sphericalharmonics.h"
+#include "frame_graph.h"
 
 
 //forward declarations
@@ -59,23 +61,31 @@ namespace GTR {
 		Matrix44 model;
 		BoundingBox boundingBox;
 		float distance_to_camera;
+		int submesh_id = -1; //-1 for the whole mesh
+		bool visible = false; //inside the frustum of the camera of the frame (set by the cull stage)
 	};
 
 	class Renderer
 	{
 	private:
 		std::vector<RenderCall> render_calls;
+		std::vector<sDrawRange> draw_ranges; //visible parts of the mesh being rendered
 		std::vector<GTR::LightEntity*> lights;
 		std::vector<GTR::DecalEntity*> decals;
 
 		std::vector<Vector3> randomPoints;
 		std::vector<sProbe> irrProbes;
 		std::vector<Texture*> LUTTextures;
+
+		Camera* frame_camera = NULL; //the one of renderScene while it is running
+		void gatherRenderCalls(GTR::Scene* scene, Camera* camera); //render calls, lights and decals of the visible entities
+		bool isVisible(const RenderCall& rc, Camera* camera); //uses the cull stage for the camera of the frame
 		
 		
 		
 	public:
 		GTR::shadowAtlas* shadowMapAtlas;
+		FrameGraph frame_graph; //stages of renderScene, with their timings
 		bool orderNodes = true;
 		bool useOcclusion = true;
 		bool useNormalMap = true;
@@ -88,6 +98,7 @@ namespace GTR {
 		bool useIrr = false;
 		bool useReflections = true;
 		bool useVolumetric = true;
+		bool useClusterCulling = true;
 
 		
 		
@@ -194,12 +205,12 @@ namespace GTR {
 		//to render a whole prefab (with all its nodes)
 		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
 
-		//to render one node from the prefab and its children
-		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera);
+		//to render one node from the prefab and its children (adds its render calls to calls)
+		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera, std::vector<RenderCall>& calls, const Matrix44& parent_model = Matrix44());
 
 
 		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		void renderMeshWithMaterialToGBuffers(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const std::vector<sDrawRange>* ranges = NULL);
 		void uploadSingleLightToShader(Shader* shader, GTR::LightEntity* light);
 
 		void updateReflectionProbes(GTR::Scene* scene);
@@ -208,7 +219,10 @@ namespace GTR {
 
 		void captureReflectionProbe(GTR::Scene* scene, Texture* tex, Vector3 pos);
 		
-		void renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		void renderMeshWithMaterialAndLighting(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const std::vector<sDrawRange>* ranges = NULL);
+
+		//culls the clusters of the render call and limits it to its submesh, returns NULL if the whole mesh has to be drawn
+		const std::vector<sDrawRange>* cullRenderCall(RenderCall& rc, Camera* camera);
 
 		void renderProbe(Vector3 pos, float size, float* coeffs);
 
@@ -236,4 +250,4 @@ namespace GTR {
 
 	Texture* CubemapFromHDRE(const char* filename);
 
-};
\ No newline at end of file
+};
\ No newline at end of file
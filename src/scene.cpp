@@ -4,6 +4,7 @@
 #include "prefab.h"
 #include "extra/cJSON.h"
 #include "texture.h"
+#include "file_io.h"
 
 GTR::Scene* GTR::Scene::instance = NULL;
 
@@ -35,6 +36,7 @@ bool GTR::Scene::load(const char* filename)
 
 	this->filename = filename;
 	std::cout << " + Reading scene JSON: " << filename << "..." << std::endl;
+	dedup_stats.reset();
 
 	if (!readFile(filename, content))
 	{
@@ -50,6 +52,9 @@ bool GTR::Scene::load(const char* filename)
 		return false;
 	}
 
+	//all the files referenced are read in the background, so the first entities are loaded while the rest are read
+	prefetch(json);
+
 	//read global properties
 	background_color = readJSONVector3(json, "background_color", background_color);
 	ambient_light = readJSONVector3(json, "ambient_light", ambient_light );
@@ -121,9 +126,32 @@ bool GTR::Scene::load(const char* filename)
 	//free memory
 	cJSON_Delete(json);
 
+	dedup = dedup_stats;
+	dedup.print(filename);
+
 	return true;
 }
 
+void GTR::Scene::prefetch(cJSON* json)
+{
+	cJSON* entities_json = cJSON_GetObjectItemCaseSensitive(json, "entities");
+	cJSON* entity_json;
+	cJSON_ArrayForEach(entity_json, entities_json)
+	{
+		cJSON* type_json = cJSON_GetObjectItem(entity_json, "type");
+		if (!type_json || !type_json->valuestring)
+			continue;
+		std::string type_str = type_json->valuestring;
+		cJSON* filename_json = cJSON_GetObjectItem(entity_json, "filename");
+		cJSON* texture_json = cJSON_GetObjectItem(entity_json, "texture");
+		//the same paths configure uses
+		if (type_str == "PREFAB" && filename_json && filename_json->valuestring)
+			GTR::Prefab::prefetch((std::string("data/") + filename_json->valuestring).c_str());
+		else if (type_str == "DECAL" && texture_json && texture_json->valuestring && !Texture::Find(texture_json->valuestring))
+			FileIO::prefetch(texture_json->valuestring);
+	}
+}
+
 GTR::BaseEntity* GTR::Scene::createEntity(std::string type)
 {
 	if (type == "PREFAB")
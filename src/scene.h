@@ -5,6 +5,7 @@
 #include "camera.h"
 #include <string>
 #include "fbo.h"
+#include "content_hash.h"
 
 
 //forward declaration
@@ -129,11 +130,13 @@ namespace GTR {
 
 		std::string filename;
 		std::vector<BaseEntity*> entities;
+		sDedupStats dedup; //resources shared with other prefabs while loading it
 
 		void clear();
 		void addEntity(BaseEntity* entity);
 
 		bool load(const char* filename);
+		void prefetch(cJSON* json); //starts reading the files referenced by the entities (see file_io.h)
 		BaseEntity* createEntity(std::string type);
 	};
 
@@ -1,13 +1,16 @@
 #include "shader.h"
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include "utils.h"
 #include <algorithm> 
 #include <functional> 
 #include <cctype>
 #include <locale>
+#include <chrono>
 
 #include "texture.h"
+#include "uniform_blocks.h"
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
@@ -56,6 +59,18 @@ std::map<std::string, std::string> Shader::s_shaders_atlas;
 std::map<std::string,Shader*> Shader::s_Shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
+GLuint Shader::s_bound_textures[MAX_TEXTURE_UNITS] = { 0 };
+int Shader::num_texture_requests = 0;
+int Shader::num_texture_binds = 0;
+int Shader::last_frame_texture_requests = 0;
+int Shader::last_frame_texture_binds = 0;
+bool Shader::use_uniform_cache = true;
+int Shader::num_uniform_requests = 0;
+int Shader::num_uniform_uploads = 0;
+int Shader::last_frame_uniform_requests = 0;
+int Shader::last_frame_uniform_uploads = 0;
+std::unordered_map<UniformHash, int> Shader::s_uniform_slots;
+std::vector<std::string> Shader::s_uniform_names;
 
 Shader::Shader()
 {
@@ -340,8 +355,10 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	validate();
 #endif
 
+	UniformBlocks::bindToProgram(program);
+
 	compiled = true;
-	locations.clear(); //regenerate table
+	uniform_slots.clear(); //regenerate table
 
 	return true;
 }
@@ -439,7 +456,7 @@ void Shader::release()
 		program = 0;
 	}
 
-	locations.clear();
+	uniform_slots.clear();
 
 	compiled = false;
 }
@@ -518,31 +535,57 @@ void Shader::saveProgramInfoLog(GLuint obj)
 	}
 }
 
-GLint Shader::getLocation(const char* varname,loctable* table)
+UniformHandle Shader::registerUniform(UniformHash hash, const char* name)
 {
-	if(varname == 0 || table == 0)
-		return 0;
-
-	GLint loc = 0;
-	loctable* locs = table;
-
-	loctable::iterator cur = locs->find(varname);
-	
-	if(cur == locs->end()) //not found in the locations table
+	auto it = s_uniform_slots.find(hash);
+	if (it != s_uniform_slots.end())
 	{
-		loc = glGetUniformLocation(program, varname);
-		if (loc == -1)
+		if (s_uniform_names[it->second] != name)
 		{
-			return -1;
+			std::cout << "Shader error: uniforms with the same hash: " << name << " and " << s_uniform_names[it->second] << std::endl;
+			assert(0 && "uniform hash collision, rename one of them");
 		}
-
-		//insert the new value
-		locs->insert(loctable::value_type(varname,loc));
-	}
-	else //found in the table
-	{
-		loc = (*cur).second;
+		return UniformHandle(it->second);
 	}
+	s_uniform_names.push_back(name);
+	s_uniform_slots[hash] = (int)s_uniform_names.size() - 1;
+	return UniformHandle((int)s_uniform_names.size() - 1);
+}
+
+UniformHandle Shader::getUniformHandle(const char* name)
+{
+	UniformHash hash = hashUniformName(name);
+	auto it = s_uniform_slots.find(hash);
+	if (it == s_uniform_slots.end())
+		return registerUniform(hash, name);
+	assert(s_uniform_names[it->second] == name && "uniform hash collision, rename one of them");
+	return UniformHandle(it->second);
+}
+
+GLint Shader::getLocation(UniformHandle handle)
+{
+	assert(handle.slot >= 0 && handle.slot < (int)s_uniform_names.size());
+	if (handle.slot >= (int)uniform_slots.size())
+		uniform_slots.resize(s_uniform_names.size());
+	sUniformSlot& slot = uniform_slots[handle.slot];
+	if (slot.location == -2)
+		slot.location = glGetUniformLocation(program, s_uniform_names[handle.slot].c_str());
+	return slot.location;
+}
+
+GLint Shader::getUploadLocation(UniformHandle handle, const void* value, int size)
+{
+	num_uniform_requests++;
+	GLint loc = getLocation(handle);
+	if (loc == -1)
+		return -1;
+	sUniformSlot& slot = uniform_slots[handle.slot];
+	assert(size <= sizeof(slot.value));
+	if (use_uniform_cache && slot.size == size && memcmp(slot.value, value, size) == 0)
+		return -1;
+	memcpy(slot.value, value, size);
+	slot.size = size;
+	num_uniform_uploads++;
 	return loc;
 }
 
@@ -560,7 +603,7 @@ int Shader::getAttribLocation(const char* varname)
 
 int Shader::getUniformLocation(const char* varname)
 {
-	int loc = getLocation(varname, &locations);
+	int loc = getLocation(getUniformHandle(varname));
 	if (loc == -1)
 	{
 		return loc;
@@ -571,10 +614,43 @@ int Shader::getUniformLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
-	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
+	setTexture(getUniformHandle(varname), tex, slot);
+}
+
+void Shader::setTexture(UniformHandle handle, Texture* tex, int slot)
+{
+	if (tex->evicted) //it was released to fit the memory budget
+		tex->makeResident();
+	if (tex->loading) //it is needed now, decode it before the rest
+		TextureDecodePool::setPriority(tex, TEXTURE_PRIORITY_VISIBLE);
+	tex->last_used_frame = Texture::frame;
+	assert(slot >= 0 && slot < SCRATCH_TEXTURE_UNIT);
+	num_texture_requests++;
+	if (s_bound_textures[slot] != tex->texture_id || !tex->texture_id)
+	{
+		glActiveTexture(GL_TEXTURE0 + slot);
+		glBindTexture(tex->texture_type, tex->texture_id);
+		glActiveTexture(GL_TEXTURE0 + SCRATCH_TEXTURE_UNIT);
+		s_bound_textures[slot] = tex->texture_id;
+		num_texture_binds++;
+	}
+	setUniform1(handle, slot);
+}
+
+void Shader::resetTextureBindings()
+{
+	memset(s_bound_textures, 0, sizeof(s_bound_textures));
+}
+
+void Shader::newFrame()
+{
+	last_frame_texture_requests = num_texture_requests;
+	last_frame_texture_binds = num_texture_binds;
+	num_texture_requests = num_texture_binds = 0;
+	last_frame_uniform_requests = num_uniform_requests;
+	last_frame_uniform_uploads = num_uniform_uploads;
+	num_uniform_requests = num_uniform_uploads = 0;
+	resetTextureBindings(); //the gui binds its own textures
 }
 
 /*
@@ -590,23 +666,17 @@ void Shader::setTexture(const char* varname, unsigned int tex)
 
 void Shader::setUniform1(const char* varname, bool input1)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc, varname);
-	glUniform1i(loc, input1);
-	assert(glGetError() == GL_NO_ERROR);
+	setUniform1(getUniformHandle(varname), (int)input1);
 }
 
 void Shader::setUniform1(const char* varname, int input1)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform1i(loc, input1);
-	assert (glGetError() == GL_NO_ERROR);
+	setUniform1(getUniformHandle(varname), input1);
 }
 
 void Shader::setUniform2(const char* varname, int input1, int input2)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform2i(loc, input1, input2);
 	assert (glGetError() == GL_NO_ERROR);
@@ -614,7 +684,7 @@ void Shader::setUniform2(const char* varname, int input1, int input2)
 
 void Shader::setUniform3(const char* varname, int input1, int input2, int input3)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform3i(loc, input1, input2, input3);
 	assert (glGetError() == GL_NO_ERROR);
@@ -622,7 +692,7 @@ void Shader::setUniform3(const char* varname, int input1, int input2, int input3
 
 void Shader::setUniform4(const char* varname, const int input1, const int input2, const int input3, const int input4)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform4i(loc, input1, input2, input3, input4);
 	assert (glGetError() == GL_NO_ERROR);
@@ -630,7 +700,7 @@ void Shader::setUniform4(const char* varname, const int input1, const int input2
 
 void Shader::setUniform1Array(const char* varname, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform1iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
@@ -638,7 +708,7 @@ void Shader::setUniform1Array(const char* varname, const int* input, const int c
 
 void Shader::setUniform2Array(const char* varname, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform2iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
@@ -646,7 +716,7 @@ void Shader::setUniform2Array(const char* varname, const int* input, const int c
 
 void Shader::setUniform3Array(const char* varname, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform3iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
@@ -654,7 +724,7 @@ void Shader::setUniform3Array(const char* varname, const int* input, const int c
 
 void Shader::setUniform4Array(const char* varname, const int* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform4iv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
@@ -662,39 +732,27 @@ void Shader::setUniform4Array(const char* varname, const int* input, const int c
 
 void Shader::setUniform1(const char* varname, const float input1)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform1f(loc, input1);
-	assert (glGetError() == GL_NO_ERROR);
+	setUniform1(getUniformHandle(varname), input1);
 }
 
 void Shader::setUniform2(const char* varname, const float input1, const float input2)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform2f(loc, input1, input2);
-	assert (glGetError() == GL_NO_ERROR);
+	setUniform2(getUniformHandle(varname), input1, input2);
 }
 
 void Shader::setUniform3(const char* varname, const float input1, const float input2, const float input3)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform3f(loc, input1, input2, input3);
-	assert (glGetError() == GL_NO_ERROR);
+	setUniform3(getUniformHandle(varname), input1, input2, input3);
 }
 
 void Shader::setUniform4(const char* varname, const float input1, const float input2, const float input3, const float input4)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniform4f(loc, input1, input2, input3, input4);
-	checkGLErrors();
+	setUniform4(getUniformHandle(varname), input1, input2, input3, input4);
 }
 
 void Shader::setUniform1Array(const char* varname, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform1fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
@@ -702,7 +760,7 @@ void Shader::setUniform1Array(const char* varname, const float* input, const int
 
 void Shader::setUniform2Array(const char* varname, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform2fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
@@ -710,7 +768,7 @@ void Shader::setUniform2Array(const char* varname, const float* input, const int
 
 void Shader::setUniform3Array(const char* varname, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform3fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
@@ -718,7 +776,7 @@ void Shader::setUniform3Array(const char* varname, const float* input, const int
 
 void Shader::setUniform4Array(const char* varname, const float* input, const int count)
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc,varname);
 	glUniform4fv(loc,count,input);
 	assert (glGetError() == GL_NO_ERROR);
@@ -726,28 +784,73 @@ void Shader::setUniform4Array(const char* varname, const float* input, const int
 
 void Shader::setMatrix44(const char* varname, const float* m)
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniformMatrix4fv(loc, 1, GL_FALSE, m);
-	assert (glGetError() == GL_NO_ERROR);
+	setMatrix44(getUniformHandle(varname), m);
 }
 
 void Shader::setMatrix44( const char* varname, const Matrix44 &m )
 {
-	GLint loc = getLocation(varname, &locations);
-	CHECK_SHADER_VAR(loc,varname);
-	glUniformMatrix4fv(loc, 1, GL_FALSE, m.m);
-	assert (glGetError() == GL_NO_ERROR);
+	setMatrix44(getUniformHandle(varname), m.m);
 }
 
 void Shader::setMatrix44Array( const char* varname, Matrix44* m_array, int num )
 {
-	GLint loc = getLocation(varname, &locations);
+	GLint loc = getLocation(getUniformHandle(varname));
 	CHECK_SHADER_VAR(loc, varname);
 	glUniformMatrix4fv(loc, num, GL_FALSE, (GLfloat*)m_array);
 	assert(glGetError() == GL_NO_ERROR);
 }
 
+void Shader::setUniform1(UniformHandle handle, const int input1)
+{
+	GLint loc = getUploadLocation(handle, &input1, sizeof(input1));
+	CHECK_SHADER_VAR(loc, handle.slot);
+	glUniform1i(loc, input1);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform1(UniformHandle handle, const float input1)
+{
+	GLint loc = getUploadLocation(handle, &input1, sizeof(input1));
+	CHECK_SHADER_VAR(loc, handle.slot);
+	glUniform1f(loc, input1);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform2(UniformHandle handle, const float input1, const float input2)
+{
+	float value[2] = { input1, input2 };
+	GLint loc = getUploadLocation(handle, value, sizeof(value));
+	CHECK_SHADER_VAR(loc, handle.slot);
+	glUniform2f(loc, input1, input2);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform3(UniformHandle handle, const float input1, const float input2, const float input3)
+{
+	float value[3] = { input1, input2, input3 };
+	GLint loc = getUploadLocation(handle, value, sizeof(value));
+	CHECK_SHADER_VAR(loc, handle.slot);
+	glUniform3f(loc, input1, input2, input3);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void Shader::setUniform4(UniformHandle handle, const float input1, const float input2, const float input3, const float input4)
+{
+	float value[4] = { input1, input2, input3, input4 };
+	GLint loc = getUploadLocation(handle, value, sizeof(value));
+	CHECK_SHADER_VAR(loc, handle.slot);
+	glUniform4f(loc, input1, input2, input3, input4);
+	checkGLErrors();
+}
+
+void Shader::setMatrix44(UniformHandle handle, const float* m)
+{
+	GLint loc = getUploadLocation(handle, m, sizeof(float) * 16);
+	CHECK_SHADER_VAR(loc, handle.slot);
+	glUniformMatrix4fv(loc, 1, GL_FALSE, m);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
 void Shader::init()
 {
 	static bool firsttime = true;
@@ -958,3 +1061,93 @@ Shader* Shader::getDefaultShader(std::string name)
 	s_Shaders[name] = sh;
 	return sh;
 }
+
+void benchmarkUniforms(int num_draws)
+{
+	Shader* shader = Shader::Get("gbuffers");
+	if (!shader)
+		return;
+	shader->enable();
+	bool use_cache = Shader::use_uniform_cache;
+	Vector4 color(1, 1, 1, 1);
+	std::vector<Matrix44> models(256);
+	for (int i = 0; i < models.size(); ++i)
+		models[i].setTranslation((float)i, 0, 0);
+
+	//what a draw of the gbuffers pass sets, only the model changes between draws (the camera is in the CameraBlock)
+	const char* names[] = { "u_model", "useHDR", "u_emissive_factor", "u_use_normalmap",
+		"u_useOcclusion", "usePBR", "u_emmisive_mat_factor", "u_roughness_mat_factor", "u_metallic_mat_factor", "u_color", "u_has_MRT_texture", "u_alpha_cutoff" };
+	const int num_names = sizeof(names) / sizeof(const char*);
+
+	//the string map used before the handles, as reference
+	struct ltstr { bool operator()(const char* s1, const char* s2) const { return strcmp(s1, s2) < 0; } };
+	std::map<const char*, int, ltstr> locations;
+	for (int i = 0; i < num_names; ++i)
+		locations[names[i]] = shader->getUniformLocation(names[i]);
+
+	typedef std::chrono::high_resolution_clock clock;
+	std::cout << " + Uniforms benchmark, " << num_draws << " draws of " << num_names << " uniforms:" << std::endl;
+	for (int mode = 0; mode < 4; ++mode)
+	{
+		Shader::use_uniform_cache = mode == 3;
+		int uploads = Shader::num_uniform_uploads;
+		clock::time_point start = clock::now();
+		for (int i = 0; i < num_draws; ++i)
+		{
+			const Matrix44& model = models[i % models.size()];
+			if (mode == 0)
+			{
+				glUniformMatrix4fv(locations.find("u_model")->second, 1, GL_FALSE, model.m);
+				glUniform1i(locations.find("useHDR")->second, 1);
+				glUniform1f(locations.find("u_emissive_factor")->second, 1.0f);
+				glUniform1i(locations.find("u_use_normalmap")->second, 1);
+				glUniform1f(locations.find("u_useOcclusion")->second, 1.0f);
+				glUniform1i(locations.find("usePBR")->second, 1);
+				glUniform3f(locations.find("u_emmisive_mat_factor")->second, 1, 1, 1);
+				glUniform1f(locations.find("u_roughness_mat_factor")->second, 0.5f);
+				glUniform1f(locations.find("u_metallic_mat_factor")->second, 0.5f);
+				glUniform4f(locations.find("u_color")->second, color.x, color.y, color.z, color.w);
+				glUniform1i(locations.find("u_has_MRT_texture")->second, 0);
+				glUniform1f(locations.find("u_alpha_cutoff")->second, 0.0f);
+			}
+			else if (mode == 1)
+			{
+				shader->setUniform("u_model", model);
+				shader->setUniform("useHDR", true);
+				shader->setUniform("u_emissive_factor", 1.0f);
+				shader->setUniform("u_use_normalmap", true);
+				shader->setUniform("u_useOcclusion", 1.0f);
+				shader->setUniform("usePBR", true);
+				shader->setUniform("u_emmisive_mat_factor", Vector3(1, 1, 1));
+				shader->setUniform("u_roughness_mat_factor", 0.5f);
+				shader->setUniform("u_metallic_mat_factor", 0.5f);
+				shader->setUniform("u_color", color);
+				shader->setUniform("u_has_MRT_texture", false);
+				shader->setUniform("u_alpha_cutoff", 0.0f);
+			}
+			else
+			{
+				shader->setUniform(UNIFORM("u_model"), model);
+				shader->setUniform(UNIFORM("useHDR"), true);
+				shader->setUniform(UNIFORM("u_emissive_factor"), 1.0f);
+				shader->setUniform(UNIFORM("u_use_normalmap"), true);
+				shader->setUniform(UNIFORM("u_useOcclusion"), 1.0f);
+				shader->setUniform(UNIFORM("usePBR"), true);
+				shader->setUniform(UNIFORM("u_emmisive_mat_factor"), Vector3(1, 1, 1));
+				shader->setUniform(UNIFORM("u_roughness_mat_factor"), 0.5f);
+				shader->setUniform(UNIFORM("u_metallic_mat_factor"), 0.5f);
+				shader->setUniform(UNIFORM("u_color"), color);
+				shader->setUniform(UNIFORM("u_has_MRT_texture"), false);
+				shader->setUniform(UNIFORM("u_alpha_cutoff"), 0.0f);
+			}
+		}
+		float time = std::chrono::duration<float, std::micro>(clock::now() - start).count();
+		const char* mode_names[] = { "string map (before)", "names, hashed", "handles", "handles and value cache" };
+		std::cout << "\t" << mode_names[mode] << ": " << (time / num_draws) << "us per draw";
+		if (mode)
+			std::cout << ", " << (Shader::num_uniform_uploads - uploads) << " uploads";
+		std::cout << std::endl;
+	}
+	Shader::use_uniform_cache = use_cache;
+	shader->disable();
+}
@@ -8,6 +8,10 @@
 #include "includes.h"
 #include <string>
 #include <map>
+#include <vector>
+#include <unordered_map>
+#include <type_traits>
+#include <cstdint>
 #include "framework.h"
 #include <cassert>
 
@@ -20,6 +24,26 @@
 
 class Texture;
 
+//Uniform names are hashed (FNV-1a) when compiling, every different name gets a global slot and every shader keeps
+//a flat array with the location and the last value uploaded of each slot. Setting a uniform doesnt compare strings
+//and the values that didnt change are not uploaded again
+typedef uint32_t UniformHash;
+constexpr UniformHash hashUniformName(const char* str, UniformHash hash = 2166136261u)
+{
+	return *str ? hashUniformName(str + 1, (hash ^ (unsigned char)*str) * 16777619u) : hash;
+}
+
+struct UniformHandle {
+	int slot;
+	explicit UniformHandle(int slot = -1) { this->slot = slot; }
+};
+
+//handle of a literal name, the slot is registered the first time the line runs
+#define UNIFORM(name) ([]() { static const UniformHandle handle = Shader::registerUniform(std::integral_constant<UniformHash, hashUniformName(name)>::value, name); return handle; }())
+
+#define MAX_TEXTURE_UNITS 16
+#define SCRATCH_TEXTURE_UNIT (MAX_TEXTURE_UNITS - 1) //left active after setTexture, so other binds dont change the cached units
+
 class Shader
 {
 	int last_slot;
@@ -29,6 +53,24 @@ class Shader
 public:
 	static Shader* current;
 
+	//setTexture remembers what is bound in every unit and skips binding it again
+	static GLuint s_bound_textures[MAX_TEXTURE_UNITS];
+	static int num_texture_requests; //setTexture calls this frame
+	static int num_texture_binds; //the ones that really called glBindTexture
+	static int last_frame_texture_requests;
+	static int last_frame_texture_binds;
+	static void resetTextureBindings(); //when a texture is deleted or the units could have been changed outside setTexture
+	static void newFrame(); //stores the stats of the last frame
+
+	static bool use_uniform_cache; //skip the uploads of values that didnt change
+	static int num_uniform_requests; //values set this frame
+	static int num_uniform_uploads; //the ones that really called glUniform
+	static int last_frame_uniform_requests;
+	static int last_frame_uniform_uploads;
+
+	static UniformHandle registerUniform(UniformHash hash, const char* name);
+	static UniformHandle getUniformHandle(const char* name); //hashes it when called, for the names that are not literals
+
 	Shader();
 	virtual ~Shader();
 
@@ -64,6 +106,16 @@ public:
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+	//upload using a handle, like setUniform(UNIFORM("u_model"), model)
+	void setUniform(UniformHandle handle, bool input) { assert(current == this); setUniform1(handle, (int)input); }
+	void setUniform(UniformHandle handle, int input) { assert(current == this); setUniform1(handle, input); }
+	void setUniform(UniformHandle handle, float input) { assert(current == this); setUniform1(handle, input); }
+	void setUniform(UniformHandle handle, const Vector2& input) { assert(current == this); setUniform2(handle, input.x, input.y); }
+	void setUniform(UniformHandle handle, const Vector3& input) { assert(current == this); setUniform3(handle, input.x, input.y, input.z); }
+	void setUniform(UniformHandle handle, const Vector4& input) { assert(current == this); setUniform4(handle, input.x, input.y, input.z, input.w); }
+	void setUniform(UniformHandle handle, const Matrix44& input) { assert(current == this); setMatrix44(handle, input.m); }
+	void setUniform(UniformHandle handle, Texture* texture, int slot) { assert(current == this); setTexture(handle, texture, slot); }
+
 
 	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -99,6 +151,15 @@ public:
 	//virtual void setTexture(const char* varname, const unsigned int tex) ;
 	virtual void setTexture(const char* varname, Texture* texture, int slot);
 
+	//the ones with a single value remember it, the string versions call them
+	void setUniform1(UniformHandle handle, const int input1);
+	void setUniform1(UniformHandle handle, const float input1);
+	void setUniform2(UniformHandle handle, const float input1, const float input2);
+	void setUniform3(UniformHandle handle, const float input1, const float input2, const float input3);
+	void setUniform4(UniformHandle handle, const float input1, const float input2, const float input3, const float input4);
+	void setMatrix44(UniformHandle handle, const float* m);
+	void setTexture(UniformHandle handle, Texture* texture, int slot);
+
 	virtual int getAttribLocation(const char* varname);
 	virtual int getUniformLocation(const char* varname);
 
@@ -141,21 +202,29 @@ protected:
 	GLuint program;
 	std::string log;
 
-//this is a hack to speed up shader usage (save info locally)
+//locations and values by uniform slot, filled when used
 private: 
 
-	struct ltstr
-	{
-		bool operator()(const char* s1, const char* s2) const
-		{
-			return strcmp(s1, s2) < 0;
-		}
-	};	
-	typedef std::map<const char*, int, ltstr> loctable;
+	struct sUniformSlot {
+		GLint location; //-2 until it is asked to the program
+		int size; //of the value stored, 0 if there is none
+		unsigned char value[sizeof(Matrix44)]; //the last one uploaded
+
+		sUniformSlot() { location = -2; size = 0; }
+	};
+	std::vector<sUniformSlot> uniform_slots;
+
+	static std::unordered_map<UniformHash, int> s_uniform_slots;
+	static std::vector<std::string> s_uniform_names;
+
+	//-1 if the uniform doesnt exist or it already has that value
+	GLint getUploadLocation(UniformHandle handle, const void* value, int size);
 
 public:
-	GLint getLocation( const char* varname, loctable* table );
-	loctable locations;	
+	GLint getLocation(UniformHandle handle);
 };
 
+//CPU cost of setting the uniforms of a draw with names, handles and the value cache (needs a GL context)
+void benchmarkUniforms(int num_draws = 20000);
+
 #endif
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "renderer.h"
 #include "application.h"
 #include "mesh.h"
+#include "jobs.h"
 
 
 
@@ -86,22 +87,13 @@ shadowData GTR::shadowAtlas::getData(GTR::LightEntity* light)
 
 
 
-void GTR::shadowAtlas::uploadDataToShader(Shader* shader,std::vector<LightEntity*>& lights)
+Vector3 GTR::shadowAtlas::getTileInfo(int index)
 {
-	const int maxL = MAX_ATLAS_LIGHTS;
-	
-	Vector3 dataToSend[maxL] = {};
-	const int numOfLights = lights.size();
-	
-	for (int i = 0; i < numOfLights; ++i) {
-		int ind= lights[i]->shadowAtlasIndex;
-		if (ind != -1)			
-			dataToSend[i] = Vector3((getTilePosition(ind) / (float)this->textureSize), getTileSize(ind) / (float)this->textureSize);
-	}
-		
-	//print of dataToSend to console
+	return Vector3(getTilePosition(index) / (float)this->textureSize, getTileSize(index) / (float)this->textureSize);
+}
 
-	shader->setUniform3Array("shadowMapInfo", (float*)&dataToSend, numOfLights);
+void GTR::shadowAtlas::uploadDataToShader(Shader* shader)
+{
 	shader->setTexture("shadowAtlasTexture", this->atlasFBO->depth_texture, 8);	
 }
 
@@ -134,7 +126,7 @@ void GTR::shadowAtlas::displayDepthToViewport( int size)
 }
 
 
-void renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera,Vector3 data) {
+void renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera,Vector3 data, int submesh_id = -1) {
 	if (!mesh || !mesh->getNumVertices() || !material)
 		return;
 	assert(glGetError() == GL_NO_ERROR);
@@ -146,28 +138,23 @@ void renderFlatMesh(const Matrix44 model, Mesh* mesh, GTR::Material* material, C
 	
 	assert(glGetError() == GL_NO_ERROR);
 	glViewport(data.x, data.y, data.z, data.z);
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_model", model);
-	shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
+	shader->setUniform(UNIFORM("u_viewprojection"), camera->viewprojection_matrix);
+	shader->setUniform(UNIFORM("u_model"), model);
+	shader->setUniform(UNIFORM("u_alpha_cutoff"), material->alpha_mode == GTR::eAlphaMode::MASK ? material->alpha_cutoff : 0);
 
 	glDepthFunc(GL_LESS);
 	glDisable(GL_BLEND);
-	mesh->render(GL_TRIANGLES);
+	mesh->render(GL_TRIANGLES, submesh_id);
 	shader->disable();
 }
 
-void GTR::shadowAtlas::calculateShadows(std::vector<RenderCall>& renderCalls)
+void GTR::shadowAtlas::prepareShadows(std::vector<RenderCall>& renderCalls)
 {
-	Camera* view_cam = Camera::current;
-	this->atlasFBO->bind();
-	glColorMask(0, 0, 0, 0);
-	glClear(GL_DEPTH_BUFFER_BIT);
-	Shader* shader = Shader::Get("flat");
-	int i_pos = 0;
-	for (shadowData& data : this->dataArray){
+	//every light only touches its own camera and casters
+	JobSystem::parallelFor((int)this->dataArray.size(), [&](int i) {
+		shadowData& data = this->dataArray[i];
 		LightEntity* light = data.light;
-		
-		
+
 		if (!light->shadow_cam)
 			light->shadow_cam = new Camera();
 
@@ -175,7 +162,6 @@ void GTR::shadowAtlas::calculateShadows(std::vector<RenderCall>& renderCalls)
 			light->shadow_cam->setOrthographic(-light->area_size / 2, light->area_size / 2, light->area_size / 2, -light->area_size / 2, .1, light->max_distance);
 
 			light->shadow_cam->lookAt(light->model.getTranslation(), light->model.getTranslation() - (light->lightDirection * 20), Vector3(0, 1, 0));
-			
 
 		//update viewproj matrix (be sure no one changes it)
 			light->shadow_cam->viewprojection_matrix = light->shadow_cam->view_matrix * light->shadow_cam->projection_matrix;
@@ -186,9 +172,30 @@ void GTR::shadowAtlas::calculateShadows(std::vector<RenderCall>& renderCalls)
 			light->shadow_cam->lookAt(light->model.getTranslation(), light->model * Vector3(0, 0, -1), light->model.rotateVector(Vector3(0, 1, 0)));
 		}
 
-		//compute texel size in world units, where frustum size is the distance from left to right in the camera
-		
+		data.casters.clear();
+		for (int j = 0; j < renderCalls.size(); ++j) {
+			RenderCall& rc = renderCalls[j];
+			if (rc.material->alpha_mode == eAlphaMode::BLEND)
+				continue;
+			if (light->shadow_cam->testBoxInFrustum(rc.boundingBox.center, rc.boundingBox.halfsize))
+				data.casters.push_back(j);
+		}
+	});
+}
+
+void GTR::shadowAtlas::calculateShadows(std::vector<RenderCall>& renderCalls)
+{
+	Camera* view_cam = Camera::current;
+	this->atlasFBO->bind();
+	glColorMask(0, 0, 0, 0);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	Shader* shader = Shader::Get("flat");
+	int i_pos = 0;
+	for (shadowData& data : this->dataArray){
+		LightEntity* light = data.light;
+		assert(light->shadow_cam && "prepareShadows was not called");
 
+		//compute texel size in world units, where frustum size is the distance from left to right in the camera
 		
 		light->shadow_cam->enable();
 		
@@ -202,11 +209,9 @@ void GTR::shadowAtlas::calculateShadows(std::vector<RenderCall>& renderCalls)
 		}
 		i_pos++;
 
-		for (RenderCall& rc : renderCalls){
-			if (rc.material->alpha_mode == eAlphaMode::BLEND)
-				continue;
-			if (light->shadow_cam->testBoxInFrustum(rc.boundingBox.center, rc.boundingBox.halfsize))
-				renderFlatMesh(rc.model, rc.mesh, rc.material, light->shadow_cam,Vector3(data.pos,data.shadowDimensions));
+		for (int j = 0; j < data.casters.size(); ++j){
+			RenderCall& rc = renderCalls[data.casters[j]];
+			renderFlatMesh(rc.model, rc.mesh, rc.material, light->shadow_cam,Vector3(data.pos,data.shadowDimensions), rc.submesh_id);
 		};
 		light->has_shadow_map = true;
 	};
@@ -21,6 +21,7 @@ struct shadowData {
 	GTR::LightEntity* light;
 	int shadowDimensions;
 	Vector2 pos;
+	std::vector<int> casters; //indices of the render calls inside the shadow camera (see prepareShadows)
 };
 
 
@@ -56,10 +57,14 @@ namespace GTR{
 		shadowData getData(int index);
 		shadowData getData(GTR::LightEntity* light);
 
+		//sets the shadow cameras and finds the casters of every light, it doesnt use GL so it can run in a job
+		void prepareShadows(std::vector<RenderCall>& renderCalls);
+		//renders the casters found by prepareShadows
 		void calculateShadows(std::vector<RenderCall>& renderCalls);
-		//void uploadDataToShader(Shader* shader);
+		//x, y and size of a tile from 0 to 1, the shaders get it in the ShadowAtlasBlock (see uniform_blocks.h)
+		Vector3 getTileInfo(int index);
 
-		void uploadDataToShader(Shader* shader, std::vector<LightEntity*>& lights);
+		void uploadDataToShader(Shader* shader);
 
 		void displayDepthToViewport(int size);
 		
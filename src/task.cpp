@@ -1,79 +1,140 @@
 #include "task.h"
+#include "jobs.h"
 #include <iostream>       // std::cout
 #include <thread>         // std::thread
 #include <chrono>		  //ms
 #include <cassert>
 
 TaskManager TaskManager::foreground;
-TaskManager TaskManager::background;
+TaskManager TaskManager::background(true);
 
-TaskManager::TaskManager()
+TaskManager::TaskManager(bool use_jobs)
 {
 	must_loop = false;
 	_thread = NULL;
+	this->use_jobs = use_jobs;
+	budget_ms = 4.0f;
+	last_executed = 0;
+	last_time_ms = 0.0f;
 }
 
 void TaskManager::loop()
 {
-	using namespace std::chrono_literals;
 	std::cout << "Starting Task Manager ..." << std::endl;
 
-	while (must_loop)
+	while (true)
 	{
-		if (pending_tasks.empty())
+		Task* task = NULL;
 		{
-			std::this_thread::sleep_for(10ms);
-			continue;
+			//sleeps until there is something to do
+			std::unique_lock<std::mutex> lock(tasks_mutex);
+			while (must_loop && !(task = popTask()))
+				condition.wait(lock);
 		}
-
-		fetchTask();
+		if (!task) //stopped
+			break;
+		task->onExecute();
+		delete task;
 	}
 
 	std::cout << "Ending Task Manager" << std::endl;
 }
 
-void TaskManager::fetchTask()
+Task* TaskManager::popTask()
+{
+	for (int i = TASK_PRIORITY_COUNT - 1; i >= 0; --i)
+	{
+		if (pending_tasks[i].empty())
+			continue;
+		Task* task = pending_tasks[i].front();
+		pending_tasks[i].pop_front();
+		return task;
+	}
+	return NULL;
+}
+
+bool TaskManager::fetchTask()
 {
 	Task* task = NULL;
-	try
 	{
-		//lock
 		const std::lock_guard<std::mutex> lock(tasks_mutex);
-		if (pending_tasks.empty())
-			return;
-		task = pending_tasks.front();
-		pending_tasks.pop_front();
-		//unlock after finishing scope
-	}
-	catch (std::logic_error&) {
-		std::cout << "[exception caught]\n";
+		task = popTask();
 	}
+	if (!task)
+		return false;
 
-	if (task)
+	task->onExecute();
+	delete task;
+	return true;
+}
+
+int TaskManager::fetchTasks()
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	float elapsed = 0.0f;
+	int executed = 0;
+	while (fetchTask())
 	{
-		task->onExecute();
-		delete task;
-		task = NULL;
+		executed++;
+		elapsed = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		if (elapsed >= budget_ms)
+			break;
 	}
+	last_executed = executed;
+	last_time_ms = elapsed;
+	return executed;
+}
+
+int TaskManager::getNumPending(int priority)
+{
+	const std::lock_guard<std::mutex> lock(tasks_mutex);
+	return (int)pending_tasks[priority].size();
 }
 
 void thread_loop_func(TaskManager* manager)
 {
 	manager->loop();
-	//join?
 }
 
 void TaskManager::startThread()
 {
 	assert(!_thread && "TaskManager already in a thread");
+	assert(!use_jobs && "the job system has its own threads");
 	must_loop = true;
 	_thread = new std::thread(thread_loop_func, this);
 }
 
-void TaskManager::addTask(Task* task)
+void TaskManager::stopThread()
 {
-	//block pending_tasks
-	const std::lock_guard<std::mutex> lock(tasks_mutex);
-	pending_tasks.push_back(task);
-	//release pending_tasks automatically
-}
\ No newline at end of file
+	if (!_thread)
+		return;
+	{
+		const std::lock_guard<std::mutex> lock(tasks_mutex);
+		must_loop = false;
+	}
+	condition.notify_all();
+	_thread->join();
+	delete _thread;
+	_thread = NULL;
+}
+
+void TaskManager::addTask(Task* task, int priority)
+{
+	assert(priority >= 0 && priority < TASK_PRIORITY_COUNT);
+	if (use_jobs)
+	{
+		JobSystem::run([task]() {
+			task->onExecute();
+			delete task;
+		});
+		return;
+	}
+
+	{
+		//block pending_tasks
+		const std::lock_guard<std::mutex> lock(tasks_mutex);
+		pending_tasks[priority].push_back(task);
+		//release pending_tasks automatically
+	}
+	condition.notify_one();
+}
@@ -4,8 +4,17 @@
 #include <list>
 #include <mutex>
 #include <thread>         // std::thread
+#include <condition_variable>
 #include <functional>
 
+//priority classes of the queued tasks, the higher ones are executed first
+enum eTaskPriority {
+	TASK_PRIORITY_LOW, //improvements of things already usable (streamed levels, packing)
+	TASK_PRIORITY_NORMAL,
+	TASK_PRIORITY_HIGH, //needed to render now
+	TASK_PRIORITY_COUNT
+};
+
 //any task executed in BG should inherit from this one
 class Task {
 public:
@@ -18,17 +27,30 @@ public:
 
 class TaskManager {
 public:
-	std::list<Task*> pending_tasks;
+	std::list<Task*> pending_tasks[TASK_PRIORITY_COUNT];
 	std::mutex tasks_mutex;  // protects pending_tasks
+	std::condition_variable condition; //wakes up the thread when a task is added
 	bool must_loop;
 	std::thread* _thread;
+	bool use_jobs; //the tasks are run by the job system (see jobs.h) instead of by this queue
+	float budget_ms; //fetchTasks stops once this time is used
 
-	static TaskManager foreground;
-	static TaskManager background;
+	//stats of the last fetchTasks
+	int last_executed;
+	float last_time_ms;
 
-	TaskManager();
-	void addTask(Task* task);
-	void fetchTask();
+	static TaskManager foreground; //executed by the main thread
+	static TaskManager background; //a wrapper of the job system, the tasks can run at the same time
+
+	TaskManager(bool use_jobs = false);
+	void addTask(Task* task, int priority = TASK_PRIORITY_NORMAL);
+	bool fetchTask(); //executes the first one, false if there was none
+	int fetchTasks(); //executes tasks until the queue is empty or the budget is used (at least one), returns how many
+	int getNumPending(int priority);
 	void loop();
 	void startThread();
+	void stopThread(); //waits for the running task, the pending ones are left
+
+private:
+	Task* popTask(); //with tasks_mutex locked
 };
\ No newline at end of file
@@ -2,9 +2,15 @@
 #include "texture.h"
 #include "fbo.h"
 #include "utils.h"
+#include "content_hash.h"
+#include "texture_compression.h"
+#include "texture_streaming.h"
+#include "texture_arrays.h"
+#include "file_io.h"
 
 #include <iostream> //to output
 #include <cmath>
+#include <algorithm>
 
 #include "mesh.h"
 #include "shader.h"
@@ -58,9 +64,44 @@ Vector4 Image::getPixelInterpolatedHigh(float x, float y, bool repeat) {
 
 
 std::map<std::string, Texture*> Texture::sTexturesLoaded;
+std::map<uint64_t, Texture*> Texture::sTexturesByContent;
+std::set<Texture*> Texture::sAllTextures;
 
 int Texture::default_mag_filter = GL_LINEAR;
 int Texture::default_min_filter = GL_LINEAR_MIPMAP_LINEAR;
+bool Texture::use_compression = true;
+size_t Texture::memory_budget = 1024 * 1024 * 1024; //1GB between RAM and VRAM
+long Texture::frame = 0;
+
+static int getNumMipLevels(int width, int height)
+{
+	int levels = 1;
+	while ((width >> levels) || (height >> levels))
+		levels++;
+	return levels;
+}
+
+static int getBytesPerPixel(unsigned int internal_format, unsigned int format, unsigned int type)
+{
+	switch (internal_format)
+	{
+		case GL_RGBA32F: return 16;
+		case GL_RGB32F: return 12;
+		case GL_RGBA16F: return 8;
+		case GL_RGB16F: return 6;
+		case GL_RGBA8: case GL_RG16F: case GL_R32F: case GL_DEPTH_COMPONENT24: case GL_DEPTH_COMPONENT32F: return 4;
+		case GL_RGB8: return 3;
+		case GL_RG8: case GL_R16F: return 2;
+		case GL_R8: return 1;
+		default: break;
+	}
+
+	//unsized formats, from the data uploaded
+	int channels = (format == GL_RGBA || format == GL_BGRA) ? 4 : ((format == GL_RGB || format == GL_BGR) ? 3 : (format == GL_RG ? 2 : 1));
+	int size = (type == GL_FLOAT || type == GL_UNSIGNED_INT) ? 4 : ((type == GL_HALF_FLOAT || type == GL_UNSIGNED_SHORT) ? 2 : 1);
+	return channels * size;
+}
+
 FBO* Texture::global_fbo = NULL;
 
 Texture::Texture()
@@ -74,12 +115,40 @@ Texture::Texture()
 	type = 0;
 	texture_type = GL_TEXTURE_2D;
 	loading = false;
+	content_hash = 0;
+	srgb = false;
+	gpu_memory = 0;
+	streamed = false;
+	num_levels = 1;
+	source_width = source_height = 0;
+	resident_level = requested_level = 0;
+	streaming_level = -1;
+	last_used_frame = 0;
+	reloadable = async = evicted = false;
+	wrap = true;
+	packed_array = NULL;
+	packed_layer = -1;
+	sAllTextures.insert(this);
 }
 
 Texture::Texture(unsigned int width, unsigned int height, unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format)
 {
 	loading = false;
 	texture_id = 0;
+	content_hash = 0;
+	srgb = false;
+	gpu_memory = 0;
+	streamed = false;
+	num_levels = 1;
+	source_width = source_height = 0;
+	resident_level = requested_level = 0;
+	streaming_level = -1;
+	last_used_frame = 0;
+	reloadable = async = evicted = false;
+	wrap = true;
+	packed_array = NULL;
+	packed_layer = -1;
+	sAllTextures.insert(this);
 	create(width, height, format, type, mipmaps, data, internal_format);
 }
 
@@ -87,11 +156,36 @@ Texture::Texture(Image* img)
 {
 	loading = false;
 	texture_id = 0;
+	content_hash = 0;
+	srgb = false;
+	gpu_memory = 0;
+	streamed = false;
+	num_levels = 1;
+	source_width = source_height = 0;
+	resident_level = requested_level = 0;
+	streaming_level = -1;
+	last_used_frame = 0;
+	reloadable = async = evicted = false;
+	wrap = true;
+	packed_array = NULL;
+	packed_layer = -1;
+	sAllTextures.insert(this);
 	create(img->width, img->height, img->num_channels == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, true, img->data);
 }
 
 Texture::~Texture()
 {
+	if (loading || streaming_level != -1) //nobody will use it
+		TextureDecodePool::cancel(this);
+	if (packed_array)
+		TextureArrayPacker::remove(this);
+	sAllTextures.erase(this);
+	if (content_hash)
+	{
+		auto it = sTexturesByContent.find(content_hash);
+		if (it != sTexturesByContent.end() && it->second == this)
+			sTexturesByContent.erase(it);
+	}
 	clear();
 }
 
@@ -101,7 +195,10 @@ void Texture::clear()
 
 	//external textures are handled by an outside system (like Android OS)
 	if( texture_type != GL_TEXTURE_EXTERNAL_OES)
+	{
 		glDeleteTextures(1, &texture_id);
+		Shader::resetTextureBindings(); //the id could be reused
+	}
 
 	if(!loading) //when loading the texture of 1x1 is replaced with the new one
 		stdlog("Destroy texture: " + filename );
@@ -117,6 +214,7 @@ void Texture::clear()
 
 void Texture::Release()
 {
+	TextureArrayPacker::release();
 	std::vector<Texture *> texs;
 
 	for (auto mp : sTexturesLoaded)
@@ -227,12 +325,36 @@ Texture* Texture::Find(const char* filename)
 	return NULL;
 }
 
+Texture* Texture::Find(const char* filename, bool srgb)
+{
+	Texture* texture = Find(filename);
+	if (texture && texture->srgb != srgb)
+		return NULL; //its mipmaps were filtered in the other space
+	return texture;
+}
+
+void Texture::prefetch(const char* filename)
+{
+	if (Find(filename))
+		return;
+	//the cache if it is up to date, like loadCompressedTexture
+	std::string cache_filename = getCompressedTextureFilename(filename);
+	if (getFileTime(cache_filename) >= getFileTime(filename))
+		FileIO::prefetch(cache_filename);
+	else
+		FileIO::prefetch(filename);
+}
+
 Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
 {
 	//load it
 	Texture* texture = Find(filename);
 	if (texture)
+	{
+		if (texture->evicted) //it is needed now
+			texture->makeResident(false);
 		return texture;
+	}
 
 	texture = new Texture();
 	if (!texture->load(filename, mipmaps, wrap))
@@ -240,16 +362,22 @@ Texture* Texture::Get(const char* filename, bool mipmaps, bool wrap)
 		delete texture;
 		return NULL;
 	}
+	texture->reloadable = true;
+	texture->wrap = wrap;
 
 	return texture;
 }
 
-Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap)
+Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap, bool srgb)
 {
 	//check if exists
 	Texture* texture = Find(filename);
 	if (texture)
+	{
+		if (texture->evicted)
+			texture->makeResident(true);
 		return texture;
+	}
 
 	//create temp texture
 	Texture* temp = new Texture();
@@ -257,10 +385,52 @@ Texture* Texture::GetAsync(const char* filename, bool mipmaps, bool wrap)
 	//register
 	temp->setName(filename);
 	temp->loading = true;
+	temp->srgb = srgb;
+	temp->reloadable = temp->async = true;
+	temp->wrap = wrap;
 
-	//add action to BG Thread 
-	LoadTextureTask* task = new LoadTextureTask(filename);
-	TaskManager::background.addTask(task);
+	//add action to the decoding threads
+	LoadTextureTask* task = new LoadTextureTask(filename, mipmaps, srgb);
+	task->texture = temp;
+	TextureDecodePool::addTask(task);
+
+	return temp;
+}
+
+Texture* Texture::GetAsyncFromMemory(const char* name, std::shared_ptr<void> owner, const unsigned char* data, size_t size, const char* mime_type, bool mipmaps, bool srgb)
+{
+	if (name)
+	{
+		Texture* texture = Find(name, srgb);
+		if (texture)
+			return texture;
+		if (Find(name))
+			name = NULL; //the name is used by the other color space, this one stays unnamed
+	}
+
+	//same image imported from another file or with another name, the mipmaps depend on srgb so it is part of the key
+	int variant = (srgb ? 1 : 0) | (mipmaps ? 2 : 0);
+	ContentHash hash = hashMemory(data, size, hashMemory(&variant, sizeof(variant)));
+	auto it = sTexturesByContent.find(hash);
+	if (it != sTexturesByContent.end())
+	{
+		dedup_stats.textures++;
+		dedup_stats.texture_bytes += size;
+		return it->second;
+	}
+
+	//create temp texture
+	Texture* temp = new Texture();
+	temp->create(1, 1);
+	if (name)
+		temp->setName(name);
+	temp->loading = true;
+	temp->content_hash = hash;
+	temp->srgb = srgb;
+	sTexturesByContent[hash] = temp;
+
+	DecodeTextureTask* task = new DecodeTextureTask(temp, owner, data, size, mime_type, mipmaps, srgb);
+	TextureDecodePool::addTask(task);
 
 	return temp;
 }
@@ -330,6 +500,8 @@ void Texture::upload( unsigned int format, unsigned int type, bool mipmaps, Uint
 	}
 
 	glTexImage2D(this->texture_type, 0, internal_format == 0 ? format : internal_format, width, height, 0, format, type, data);
+	this->internal_format = internal_format;
+	gpu_memory = computeGPUMemory(this->mipmaps ? getNumMipLevels((int)width, (int)height) : 1);
 
 	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);	//set the min filter
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);   //set the mag filter
@@ -344,6 +516,54 @@ void Texture::upload( unsigned int format, unsigned int type, bool mipmaps, Uint
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
+void Texture::uploadCompressed(CompressedImage* image, bool wrap, int first_level)
+{
+	assert(image->data && image->format != BC_NONE);
+	bool compressed = image->format != BC_RGBA8;
+	assert(first_level >= 0 && first_level < image->num_levels);
+
+	//not using create, it would unregister the name of the temp texture
+	if (texture_id)
+	{
+		glDeleteTextures(1, &texture_id);
+		Shader::resetTextureBindings(); //the id could be reused
+	}
+	glGenTextures(1, &texture_id);
+
+	this->width = (float)image->getLevelWidth(first_level);
+	this->height = (float)image->getLevelHeight(first_level);
+	this->depth = 0;
+	this->texture_type = GL_TEXTURE_2D;
+	this->format = compressed ? getBCGLFormat(image->format) : GL_RGBA;
+	this->internal_format = compressed ? this->format : GL_RGBA8;
+	this->type = GL_UNSIGNED_BYTE;
+	this->mipmaps = image->num_levels > 1;
+	this->srgb = image->srgb;
+	this->num_levels = image->num_levels;
+	this->source_width = image->width;
+	this->source_height = image->height;
+	this->resident_level = first_level;
+	this->gpu_memory = image->getSize() - image->getLevelOffset(first_level);
+
+	glBindTexture(this->texture_type, texture_id);
+	for (int i = first_level; i < image->num_levels; ++i)
+	{
+		const unsigned char* level = image->data + image->getLevelOffset(i);
+		if (compressed)
+			glCompressedTexImage2D(this->texture_type, i - first_level, this->format, image->getLevelWidth(i), image->getLevelHeight(i), 0, (GLsizei)image->getLevelSize(i), level);
+		else
+			glTexImage2D(this->texture_type, i - first_level, this->internal_format, image->getLevelWidth(i), image->getLevelHeight(i), 0, GL_RGBA, GL_UNSIGNED_BYTE, level);
+	}
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, image->num_levels - 1 - first_level);
+	setBCSwizzle(this->texture_type, image->format);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, (this->mipmaps && wrap) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading compressed texture");
+}
+
 /*
 void Texture::upload3D(unsigned int format, unsigned int type, bool mipmaps, Uint8* data, unsigned int internal_format) {
 	assert(texture_id && "Must create texture before uploading data.");
@@ -393,6 +613,8 @@ void Texture::uploadCubemap(unsigned int format, unsigned int t, bool mips, Uint
 
 	for (int i = 0; i < 6; i++)
 		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, level, internal_format == 0 ? format : internal_format, w, h, 0, format, t, data ? data[i] : NULL);
+	if (level == 0) //the rest of levels are uploaded or generated afterwards
+		gpu_memory = computeGPUMemory(this->mipmaps ? getNumMipLevels(w, h) : 1);
 
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
@@ -534,6 +756,120 @@ void Texture::generateMipmaps()
 	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, Texture::default_min_filter);
 	glGenerateMipmap(this->texture_type);
     #endif
+	gpu_memory = computeGPUMemory(getNumMipLevels((int)width, (int)height));
+}
+
+//** RESIDENCY
+
+size_t Texture::computeGPUMemory(int num_levels)
+{
+	size_t bytes_per_pixel = getBytesPerPixel(internal_format, format, type);
+	size_t faces = texture_type == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+	size_t layers = (texture_type == GL_TEXTURE_2D_ARRAY && depth > 0) ? (size_t)depth : 1;
+	size_t total = 0;
+	for (int i = 0; i < num_levels; ++i)
+		total += (size_t)std::max((int)width >> i, 1) * std::max((int)height >> i, 1) * bytes_per_pixel;
+	return total * faces * layers;
+}
+
+size_t Texture::getCPUMemory()
+{
+	return image.data ? (size_t)image.width * image.height * image.num_channels : 0;
+}
+
+void Texture::releaseGPUData()
+{
+	if (texture_id)
+	{
+		glDeleteTextures(1, &texture_id);
+		Shader::resetTextureBindings(); //the id could be reused
+	}
+	texture_id = 0;
+	gpu_memory = 0;
+	image.clear();
+	streamed = false;
+}
+
+bool Texture::makeResident(bool async)
+{
+	if (!evicted)
+		return true;
+	evicted = false;
+	last_used_frame = frame;
+
+	//like GetAsync, a texture of 1x1 until it is loaded (create doesnt unregister it as there is no GL texture)
+	if (async && this->async)
+	{
+		create(1, 1);
+		loading = true;
+		LoadTextureTask* task = new LoadTextureTask(filename.c_str(), mipmaps, srgb);
+		task->texture = this;
+		TextureDecodePool::addTask(task);
+		return true;
+	}
+
+	if (!load(filename.c_str(), mipmaps, wrap))
+	{
+		std::cout << "Error reloading texture: " << filename << std::endl;
+		create(1, 1);
+		reloadable = false;
+		return false;
+	}
+	return true;
+}
+
+static bool lruSort(const Texture* a, const Texture* b) { return a->last_used_frame < b->last_used_frame; }
+
+void Texture::updateResidency()
+{
+	frame++;
+
+	std::vector<Texture*> candidates;
+	size_t total = 0;
+	for (auto texture : sAllTextures)
+	{
+		total += texture->getCPUMemory() + texture->gpu_memory;
+		if (texture->reloadable && !texture->evicted && !texture->loading && texture->streaming_level == -1 && (frame - texture->last_used_frame) > 60) //not used in the last second
+			candidates.push_back(texture);
+	}
+
+	if (!memory_budget || total <= memory_budget)
+		return;
+
+	//evict the least recently used ones
+	std::sort(candidates.begin(), candidates.end(), lruSort);
+	for (int i = 0; i < candidates.size() && total > memory_budget; ++i)
+	{
+		Texture* texture = candidates[i];
+		total -= texture->getCPUMemory() + texture->gpu_memory;
+		texture->releaseGPUData();
+		texture->evicted = true;
+	}
+}
+
+void Texture::getTotalMemory(size_t& cpu, size_t& gpu)
+{
+	cpu = gpu = 0;
+	for (auto texture : sAllTextures)
+	{
+		cpu += texture->getCPUMemory();
+		gpu += texture->gpu_memory;
+	}
+}
+
+void Texture::printMemoryReport()
+{
+	size_t cpu = 0, gpu = 0;
+	std::cout << "Texture memory report (KB):" << std::endl;
+	for (auto texture : sAllTextures)
+	{
+		std::cout << "\t" << (texture->filename.size() ? texture->filename : "[unnamed]") << "\t " << (int)texture->width << "x" << (int)texture->height <<
+			(texture->texture_type == GL_TEXTURE_CUBE_MAP ? " cube" : "") << "\t RAM: " << texture->getCPUMemory() / 1024 << "\t VRAM: " << texture->gpu_memory / 1024 <<
+			(texture->evicted ? "\t [EVICTED]" : "") << (texture->streamed ? "\t [STREAMED]" : "") << "\t last used frame: " << texture->last_used_frame << std::endl;
+		cpu += texture->getCPUMemory();
+		gpu += texture->gpu_memory;
+	}
+	std::cout << "Total: " << sAllTextures.size() << " textures, RAM: " << cpu / 1024 << "KB, VRAM: " << gpu / 1024 << "KB, budget: " << memory_budget / 1024 << "KB" << std::endl;
 }
 
 
@@ -780,9 +1116,14 @@ bool Image::loadPNG(const char* filename, bool flip_y)
 }
 
 bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
+{
+	return loadPNG(buffer.empty() ? NULL : &buffer[0], buffer.size(), flip_y);
+}
+
+bool Image::loadPNG(const unsigned char* buffer, size_t size, bool flip_y)
 {
 #ifdef USE_SKIA
-    sk_sp<SkData> skData = SkData::MakeWithoutCopy(&buffer[0], buffer.size());
+    sk_sp<SkData> skData = SkData::MakeWithoutCopy(buffer, size);
     std::unique_ptr<SkCodec> codec(SkCodec::MakeFromData(skData));
     SkBitmap bitmap;
     const SkImageInfo skInfo = codec->getInfo();
@@ -805,7 +1146,7 @@ bool Image::loadPNG(std::vector<unsigned char>& buffer, bool flip_y)
 #else
     std::vector<unsigned char> out_image;
 
-	if (decodePNG(out_image, width, height, buffer.empty() ? 0 : &buffer[0], (unsigned long)buffer.size(), true) != 0)
+	if (decodePNG(out_image, width, height, buffer, (unsigned long)size, true) != 0)
 		return false;
 
 	data = new Uint8[out_image.size()];
@@ -829,6 +1170,11 @@ bool Image::loadJPG(const char* filename, bool flip_y)
 }
 
 bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
+{
+	return loadJPG(buffer.empty() ? NULL : &buffer[0], buffer.size(), flip_y);
+}
+
+bool Image::loadJPG(const unsigned char* buffer, size_t size, bool flip_y)
 {
 	std::vector<unsigned char> out_image;
 
@@ -840,7 +1186,7 @@ bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
 	/*
 	int req_comps = 3;
 	assert(data == NULL); //image must be empty
-	data = jpgd::decompress_jpeg_image_from_memory(&buffer[0], (unsigned long)buffer.size(), &width, &height, &actual_comps, req_comps);
+	data = jpgd::decompress_jpeg_image_from_memory(buffer, (unsigned long)size, &width, &height, &actual_comps, req_comps);
 	if(!data)
 		return false;
 
@@ -849,7 +1195,7 @@ bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
 	*/
 
 #ifdef USE_SKIA
-    sk_sp<SkData> skData = SkData::MakeWithoutCopy(&buffer[0], buffer.size());
+    sk_sp<SkData> skData = SkData::MakeWithoutCopy(buffer, size);
     std::unique_ptr<SkCodec> codec(SkCodec::MakeFromData(skData));
     SkBitmap bitmap;
     const SkImageInfo skInfo = codec->getInfo();
@@ -871,7 +1217,7 @@ bool Image::loadJPG(std::vector<unsigned char>& buffer, bool flip_y)
     }
 #else
 	//stb_image
-	unsigned char* image_data = stbi_load_from_memory( (stbi_uc*) &buffer[0], (unsigned long)buffer.size(), &width, &height, &channels, STBI_rgb);
+	unsigned char* image_data = stbi_load_from_memory( (stbi_uc*) buffer, (unsigned long)size, &width, &height, &channels, STBI_rgb);
 	if (!image_data)
 		return false;
 	this->width = (unsigned int)width;
@@ -1020,32 +1366,175 @@ bool isPowerOfTwo( int n )
 	return (n & (n - 1)) == 0;
 }
 
+Image* decodeEmbeddedImage(const unsigned char* data, size_t size, const char* mime_type, std::string& error)
+{
+	Image* img = new Image();
+	if (mime_type && !strcmp(mime_type, "image/png"))
+		img->loadPNG(data, size);
+	else if (mime_type && !strcmp(mime_type, "image/jpeg"))
+		img->loadJPG(data, size);
+	else
+		error = std::string("image format not supported: ") + (mime_type ? mime_type : "");
+
+	if (!img->width)
+	{
+		if (error.empty())
+			error = std::string("image encoding has error: ") + mime_type;
+		delete img;
+		return NULL;
+	}
+	return img;
+}
+
 //*********************
 
-LoadTextureTask::LoadTextureTask(const char* str)
+int TextureDecodePool::num_workers = 0;
+std::mutex TextureDecodePool::mutex;
+std::condition_variable TextureDecodePool::condition;
+std::map<Texture*, TextureDecodeTask*> TextureDecodePool::pending;
+std::map<Texture*, long> TextureDecodePool::in_flight;
+long TextureDecodePool::last_order = 0;
+std::vector<std::thread*> TextureDecodePool::threads;
+bool TextureDecodePool::must_loop = false;
+
+void TextureDecodePool::startThreads()
+{
+	assert(threads.empty() && "TextureDecodePool already started");
+	int num = num_workers;
+	if (num <= 0)
+		num = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+	std::cout << "Starting " << num << " texture decoding threads" << std::endl;
+	must_loop = true;
+	for (int i = 0; i < num; ++i)
+		threads.push_back(new std::thread(workerLoop));
+}
+
+void TextureDecodePool::stopThreads()
+{
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		must_loop = false;
+	}
+	condition.notify_all();
+	for (int i = 0; i < threads.size(); ++i)
+	{
+		threads[i]->join();
+		delete threads[i];
+	}
+	threads.clear();
+}
+
+void TextureDecodePool::addTask(TextureDecodeTask* task)
+{
+	assert(task->texture);
+	{
+		const std::lock_guard<std::mutex> lock(mutex);
+		auto it = pending.find(task->texture);
+		if (it != pending.end()) //only one decode per texture
+		{
+			delete it->second;
+			pending.erase(it);
+		}
+		task->order = last_order++;
+		task->ticket = task->order;
+		pending[task->texture] = task;
+		in_flight[task->texture] = task->ticket; //a running older decode will not finish
+	}
+	condition.notify_one();
+}
+
+void TextureDecodePool::setPriority(Texture* texture, int priority)
+{
+	const std::lock_guard<std::mutex> lock(mutex);
+	auto it = pending.find(texture);
+	if (it != pending.end())
+		it->second->priority = priority;
+}
+
+void TextureDecodePool::cancel(Texture* texture)
+{
+	const std::lock_guard<std::mutex> lock(mutex);
+	auto it = pending.find(texture);
+	if (it != pending.end())
+	{
+		delete it->second;
+		pending.erase(it);
+	}
+	in_flight.erase(texture);
+}
+
+bool TextureDecodePool::finish(Texture* texture, long ticket)
+{
+	const std::lock_guard<std::mutex> lock(mutex);
+	auto it = in_flight.find(texture);
+	if (it == in_flight.end() || it->second != ticket)
+		return false;
+	in_flight.erase(it);
+	return true;
+}
+
+int TextureDecodePool::getNumPending()
+{
+	const std::lock_guard<std::mutex> lock(mutex);
+	return (int)pending.size();
+}
+
+void TextureDecodePool::workerLoop()
+{
+	while (true)
+	{
+		TextureDecodeTask* task = NULL;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [] { return !pending.empty() || !must_loop; });
+			if (!must_loop)
+				break;
+
+			//priorities change while waiting, so the best one is searched every time
+			auto best = pending.begin();
+			for (auto it = pending.begin(); it != pending.end(); ++it)
+			{
+				TextureDecodeTask* candidate = it->second;
+				if (candidate->priority > best->second->priority || (candidate->priority == best->second->priority && candidate->order < best->second->order))
+					best = it;
+			}
+			task = best->second;
+			pending.erase(best);
+		}
+
+		task->onExecute();
+		delete task;
+	}
+}
+
+//*********************
+
+LoadTextureTask::LoadTextureTask(const char* str, bool mipmaps, bool srgb)
 {
 	filename = str;
 	image = NULL;
+	compressed = NULL;
+	this->mipmaps = mipmaps;
+	this->srgb = srgb;
 }
 
 void LoadTextureTask::onExecute()
 {
-	image = new Image();
-	if (!image->load(filename.c_str()))
-	{
-		delete image;
-		image = NULL;
-	}
+	//from the cache if possible, the mipmaps are made here instead of in the driver
+	compressed = loadCompressedTexture(filename.c_str(), mipmaps, Texture::use_compression, srgb);
 
 	//image loaded, ready to go back to main thread
-	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image);
-	TaskManager::foreground.addTask(upload_task);
+	UploadTextureTask* upload_task = new UploadTextureTask(filename.c_str(), image, compressed);
+	upload_task->ticket = ticket;
+	TaskManager::foreground.addTask(upload_task, priority == TEXTURE_PRIORITY_VISIBLE ? TASK_PRIORITY_HIGH : TASK_PRIORITY_NORMAL);
 }
 
-UploadTextureTask::UploadTextureTask(const char* filename, Image* image)
+UploadTextureTask::UploadTextureTask(const char* filename, Image* image, CompressedImage* compressed)
 {
 	this->filename = filename;
 	this->image = image;
+	this->compressed = compressed;
+	ticket = 0;
 }
 
 void UploadTextureTask::onExecute()
@@ -1062,16 +1551,93 @@ void UploadTextureTask::onExecute()
 			texture = new Texture();
 		*/
 		delete image;
+		delete compressed;
 		std::cout << "Warning: image loaded in background not found foreground thread" << std::endl;
 		return;
 	}
 
 	texture = it->second;
+	if (!TextureDecodePool::finish(texture, ticket))
+	{
+		delete image;
+		delete compressed;
+		return;
+	}
 
-	//upload to GPU
-	texture->loadFromImage(image);
+	//upload to GPU, when streaming only the small levels until the renderer asks for more
+	if (compressed)
+	{
+		texture->streamed = TextureStreamer::enabled && compressed->num_levels > 1;
+		texture->uploadCompressed(compressed, true, texture->streamed ? TextureStreamer::getInitialLevel(compressed->width, compressed->height, compressed->num_levels) : 0);
+		texture->requested_level = texture->num_levels - 1;
+	}
+	else if (image)
+		texture->loadFromImage(image);
+	else
+		std::cout << "Error loading texture: " << filename << std::endl;
 	texture->loading = false;
 
 	//delete image
 	delete image;
+	delete compressed;
+}
+
+DecodeTextureTask::DecodeTextureTask(Texture* texture, std::shared_ptr<void> owner, const unsigned char* data, size_t size, const char* mime_type, bool mipmaps, bool srgb)
+{
+	this->texture = texture;
+	this->owner = owner;
+	this->data = data;
+	this->size = size;
+	this->mime_type = mime_type ? mime_type : "";
+	this->mipmaps = mipmaps;
+	this->srgb = srgb;
+	image = NULL;
+	compressed = NULL;
+	background = true;
+}
+
+void DecodeTextureTask::onExecute()
+{
+	if (background)
+	{
+		image = decodeEmbeddedImage(data, size, mime_type.c_str(), error);
+		owner.reset(); //the encoded data is not needed anymore
+
+		//there is no file to cache it, so it is encoded every time (also the mipmaps when not compressing)
+		if (image)
+		{
+			compressed = new CompressedImage();
+			compressed->encode(image, Texture::use_compression ? chooseBCFormat(image) : BC_RGBA8, mipmaps, 1, srgb);
+			delete image;
+			image = NULL;
+		}
+
+		//tasks are deleted once executed, so a copy goes back to the main thread
+		DecodeTextureTask* upload_task = new DecodeTextureTask(texture, NULL, NULL, 0, mime_type.c_str(), mipmaps, srgb);
+		upload_task->image = image;
+		upload_task->compressed = compressed;
+		upload_task->error = error;
+		upload_task->background = false;
+		upload_task->ticket = ticket;
+		TaskManager::foreground.addTask(upload_task, priority == TEXTURE_PRIORITY_VISIBLE ? TASK_PRIORITY_HIGH : TASK_PRIORITY_NORMAL);
+		return;
+	}
+
+	//it could have been destroyed meanwhile
+	if (!TextureDecodePool::finish(texture, ticket))
+	{
+		delete image;
+		delete compressed;
+		return;
+	}
+
+	if (compressed)
+		texture->uploadCompressed(compressed);
+	else if (image)
+		texture->loadFromImage(image, mipmaps);
+	else
+		std::cout << "Error decoding texture " << texture->filename << ": " << error << std::endl;
+	texture->loading = false;
+	delete image;
+	delete compressed;
 }
@@ -10,11 +10,15 @@
 #include <map>
 #include <set>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 #include <cassert>
 
 class Shader;
 class FBO;
 class Texture;
+class CompressedImage;
 
 #ifndef OPENGL_ES3
 #define GL_RGBA32F 0x8814
@@ -72,8 +76,10 @@ public:
 	bool loadTGA(const char* filename);
 	bool loadPNG(const char* filename, bool flip_y = true);
 	bool loadPNG(std::vector<unsigned char>& buffer, bool flip_y = false);
+	bool loadPNG(const unsigned char* buffer, size_t size, bool flip_y = false);
 	bool loadJPG(const char* filename, bool flip_y = false);
 	bool loadJPG(std::vector<unsigned char>& buffer, bool flip_y = false);
+	bool loadJPG(const unsigned char* buffer, size_t size, bool flip_y = false);
 	bool saveTGA(const char* filename, bool flip_y = false);
 };
 
@@ -106,12 +112,17 @@ class Texture
 public:
 	static int default_mag_filter;
 	static int default_min_filter;
+	static bool use_compression; //textures loaded asynchronously are compressed to BCn (see texture_compression.h)
+	static size_t memory_budget; //in bytes (RAM + VRAM), textures not used recently are evicted when exceeded, 0 means no limit
+	static long frame; //incremented every time updateResidency is called
 	static FBO* global_fbo;
 
 	//a general struct to store all the information about a TGA file
 
 	//textures manager
 	static std::map<std::string, Texture*> sTexturesLoaded;
+	static std::map<uint64_t, Texture*> sTexturesByContent; //embedded images by hash of the encoded data (see content_hash.h)
+	static std::set<Texture*> sAllTextures; //also the ones without name (render targets), for the memory report
 
 	GLuint texture_id; // GL id to identify the texture in opengl, every texture must have its own id
 	float width;
@@ -119,12 +130,35 @@ public:
 	float depth;	//Optional for 3dTexture or 2dTexture array
 	std::string filename;
 	bool loading;
+	uint64_t content_hash; //0 if it is not registered by content
 
 	unsigned int format; //GL_RGB, GL_RGBA
 	unsigned int type; //GL_UNSIGNED_INT, GL_FLOAT
 	unsigned int internal_format;
 	unsigned int texture_type; //GL_TEXTURE_2D, GL_TEXTURE_CUBE, GL_TEXTURE_2D_ARRAY
 	bool mipmaps;
+	bool srgb; //colors, its mipmaps are filtered in linear space (the data is still uploaded as it is)
+	size_t gpu_memory; //in bytes, every level and face
+
+	//mip streaming (see texture_streaming.h), the GL texture starts at resident_level of the whole chain
+	bool streamed;
+	int num_levels; //of the whole chain
+	int source_width; //of the level 0 of the chain
+	int source_height;
+	int resident_level;
+	int requested_level; //finest level asked by the renderer since the last update
+	int streaming_level; //being loaded, -1 if none
+	long last_used_frame; //bound or requested by the renderer
+
+	//residency
+	bool reloadable; //loaded from a file by the manager, so it can be evicted and loaded again
+	bool async; //reloaded in the background
+	bool wrap;
+	bool evicted; //removed because of the memory budget, it is loaded again when used
+
+	//copy in a texture array (see texture_arrays.h), the texture itself is kept
+	Texture* packed_array;
+	int packed_layer; //-1 while it is being copied
 
 	unsigned int wrapS;
 	unsigned int wrapT;
@@ -152,6 +186,7 @@ public:
 	//void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8* data = NULL, unsigned int internal_format = 0);
 	void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, Uint8** data = NULL, unsigned int internal_format = 0, int level = 0);
 	void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
+	void uploadCompressed(CompressedImage* image, bool wrap = true, int first_level = 0); //its levels from first_level, also the uncompressed BC_RGBA8 ones
 
 	void bind();
 	void unbind();
@@ -168,8 +203,13 @@ public:
 
 	//load using the manager (caching loaded ones to avoid reloading them)
 	static Texture* Get(const char* filename, bool mipmaps = true, bool wrap = true);
-	static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true);
+	static Texture* GetAsync(const char* filename, bool mipmaps = true, bool wrap = true, bool srgb = false);
+	//decodes an encoded image (PNG or JPG) that is already in memory in the background, name can be NULL.
+	//owner must keep data alive, it is released once the image is decoded. Images with the same content share the texture
+	static Texture* GetAsyncFromMemory(const char* name, std::shared_ptr<void> owner, const unsigned char* data, size_t size, const char* mime_type, bool mipmaps = true, bool srgb = false);
 	static Texture* Find(const char* filename);
+	static Texture* Find(const char* filename, bool srgb); //only if it was loaded for the same color space
+	static void prefetch(const char* filename); //reads in the background the file GetAsync will use (see file_io.h)
 	void setName(const char* name) {
 		filename = name;
 		sTexturesLoaded[filename] = this;
@@ -177,6 +217,15 @@ public:
 
 	void generateMipmaps();
 
+	//residency
+	size_t getCPUMemory(); //in bytes, the image kept in RAM
+	size_t computeGPUMemory(int num_levels); //in bytes, from the size, format and faces
+	void releaseGPUData(); //it is not unregistered, it can be restored with makeResident
+	bool makeResident(bool async = true); //loads again an evicted texture
+	static void updateResidency(); //call it once per frame, applies the memory budget
+	static void getTotalMemory(size_t& cpu, size_t& gpu);
+	static void printMemoryReport();
+
 	//show the texture on the current viewport
 	void toViewport( Shader* shader = NULL );
 	//copy to another texture
@@ -189,16 +238,62 @@ public:
 
 bool isPowerOfTwo(int n);
 
+//decodes a PNG or JPG stored in memory (embedded in a glb), it doesnt touch GL so it can run in any thread
+Image* decodeEmbeddedImage(const unsigned char* data, size_t size, const char* mime_type, std::string& error);
+
 //When loading textures asyncrhonously, first we load them from the hard drive in a background thread
 //afterwards we pass the data to the main thread as bg threads cannot access opengl, and main thread
 //uploads to GPU. While loading a fake 1x1 texture is created
 
-class LoadTextureTask : public Task {
+#define TEXTURE_PRIORITY_NORMAL 0
+#define TEXTURE_PRIORITY_VISIBLE 1 //used for rendering while loading
+
+//a decode executed by the TextureDecodePool
+class TextureDecodeTask : public Task {
+public:
+	Texture* texture; //only to identify the job, the workers must not access it
+	int priority; //higher first
+	long order; //first added first, between tasks with the same priority
+	long ticket; //given by addTask, the texture address can be reused by a new texture so finish checks this
+
+	TextureDecodeTask() { texture = NULL; priority = TEXTURE_PRIORITY_NORMAL; order = ticket = 0; }
+};
+
+//Textures are decoded by their own threads (not the job system), so the pending ones can be picked by
+//priority every time a worker is free. A texture destroyed before being uploaded cancels its decode
+class TextureDecodePool {
+public:
+	static int num_workers; //0 means one per core except the main thread
+
+	static void startThreads();
+	static void stopThreads(); //waits for the running decodes, the pending ones are left
+	static void addTask(TextureDecodeTask* task);
+	static void setPriority(Texture* texture, int priority);
+	static void cancel(Texture* texture); //removes the pending decode, if it is running the result is discarded
+	static bool finish(Texture* texture, long ticket); //called before uploading, returns false if it was cancelled or replaced
+	static int getNumPending();
+
+private:
+	static std::mutex mutex;
+	static std::condition_variable condition;
+	static std::map<Texture*, TextureDecodeTask*> pending;
+	static std::map<Texture*, long> in_flight; //ticket of the current decode, from addTask until finish or cancel
+	static long last_order;
+	static std::vector<std::thread*> threads;
+	static bool must_loop;
+
+	static void workerLoop();
+};
+
+class LoadTextureTask : public TextureDecodeTask {
 public:
 	std::string filename;
 	Image* image;
+	CompressedImage* compressed; //the cached levels, the image is only used if there is no cache
+	bool mipmaps;
+	bool srgb;
 
-	LoadTextureTask(const char* filename);
+	LoadTextureTask(const char* filename, bool mipmaps = true, bool srgb = false);
 	void onExecute();
 };
 
@@ -206,8 +301,29 @@ class UploadTextureTask : public Task {
 public:
 	std::string filename;
 	Image* image;
+	CompressedImage* compressed;
+	long ticket; //of the LoadTextureTask
+
+	UploadTextureTask(const char* filename, Image* image, CompressedImage* compressed = NULL);
+	void onExecute();
+};
+
+//decodes an image from memory in the background and then uploads it in the main thread to the temp texture
+//(it is the same task, it adds itself again to the foreground once decoded)
+class DecodeTextureTask : public TextureDecodeTask {
+public:
+	std::shared_ptr<void> owner; //keeps the encoded data alive
+	const unsigned char* data;
+	size_t size;
+	std::string mime_type;
+	bool mipmaps;
+	bool srgb;
+	Image* image;
+	CompressedImage* compressed;
+	std::string error;
+	bool background;
 
-	UploadTextureTask(const char* filename, Image* image);
+	DecodeTextureTask(Texture* texture, std::shared_ptr<void> owner, const unsigned char* data, size_t size, const char* mime_type, bool mipmaps, bool srgb = false);
 	void onExecute();
 };
 
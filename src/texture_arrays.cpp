@@ -0,0 +1,278 @@
+#include "texture_arrays.h"
+
+#include "texture_compression.h"
+#include "material.h"
+#include "shader.h"
+#include "utils.h"
+#include "includes.h"
+
+#include <algorithm>
+#include <iostream>
+
+bool TextureArrayPacker::enabled = true;
+int TextureArrayPacker::max_size = 256;
+int TextureArrayPacker::layers_per_page = 16;
+int TextureArrayPacker::max_copies_per_frame = 8;
+std::vector<sTextureArrayPage*> TextureArrayPacker::pages;
+std::set<std::string> TextureArrayPacker::rejected;
+
+sTextureArrayPage* TextureArrayPacker::getPage(Texture* texture, int& layer)
+{
+	bool wrap = texture->wrap && texture->num_levels > 1;
+	for (int i = 0; i < pages.size(); ++i)
+	{
+		sTextureArrayPage* page = pages[i];
+		if (page->width != texture->source_width || page->height != texture->source_height || page->num_levels != texture->num_levels ||
+			page->internal_format != texture->internal_format || page->wrap != wrap || page->num_used == page->layers.size())
+			continue;
+		layer = (int)(std::find(page->layers.begin(), page->layers.end(), (Texture*)NULL) - page->layers.begin());
+		return page;
+	}
+
+	//a new one, only the levels are allocated
+	sTextureArrayPage* page = new sTextureArrayPage();
+	page->width = texture->source_width;
+	page->height = texture->source_height;
+	page->num_levels = texture->num_levels;
+	page->internal_format = texture->internal_format;
+	page->wrap = wrap;
+	page->layers.resize(layers_per_page, NULL);
+	page->num_used = 0;
+
+	CompressedImage chain; //only the header, for the sizes of the levels
+	chain.format = getBCFormatFromGL(texture->internal_format);
+	chain.width = page->width;
+	chain.height = page->height;
+	chain.num_levels = page->num_levels;
+	bool compressed = chain.format != BC_RGBA8;
+
+	Texture* array = page->texture = new Texture();
+	array->texture_type = GL_TEXTURE_2D_ARRAY;
+	array->width = (float)page->width;
+	array->height = (float)page->height;
+	array->depth = (float)layers_per_page;
+	array->format = compressed ? texture->internal_format : GL_RGBA;
+	array->internal_format = texture->internal_format;
+	array->type = GL_UNSIGNED_BYTE;
+	array->mipmaps = page->num_levels > 1;
+	array->num_levels = page->num_levels;
+	array->wrap = wrap;
+	array->gpu_memory = chain.getSize() * layers_per_page;
+
+	glGenTextures(1, &array->texture_id);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, array->texture_id);
+	for (int i = 0; i < page->num_levels; ++i)
+	{
+		if (compressed)
+			glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, i, array->internal_format, chain.getLevelWidth(i), chain.getLevelHeight(i), layers_per_page, 0, (GLsizei)(chain.getLevelSize(i) * layers_per_page), NULL);
+		else
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, i, GL_RGBA8, chain.getLevelWidth(i), chain.getLevelHeight(i), layers_per_page, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, page->num_levels - 1);
+	setBCSwizzle(GL_TEXTURE_2D_ARRAY, chain.format);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, Texture::default_mag_filter);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, array->mipmaps ? Texture::default_min_filter : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	assert(checkGLErrors() && "Error creating texture array");
+
+	pages.push_back(page);
+	layer = 0;
+	return page;
+}
+
+void TextureArrayPacker::update()
+{
+	if (!enabled)
+		return;
+
+	int started = 0;
+	for (auto it : Texture::sTexturesLoaded)
+	{
+		if (started >= max_copies_per_frame)
+			break;
+		Texture* texture = it.second;
+		//only the ones with a cache to read the levels from
+		if (texture->packed_array || !texture->async || texture->loading || texture->evicted || texture->texture_type != GL_TEXTURE_2D)
+			continue;
+		if (!texture->source_width || texture->source_width > max_size || texture->source_height > max_size || rejected.count(texture->filename))
+			continue;
+
+		int layer = 0;
+		sTextureArrayPage* page = getPage(texture, layer);
+		page->layers[layer] = texture;
+		page->num_used++;
+		texture->packed_array = page->texture;
+		texture->packed_layer = -1;
+		TaskManager::background.addTask(new PackTextureTask(texture, page, layer));
+		started++;
+	}
+}
+
+void TextureArrayPacker::remove(Texture* texture)
+{
+	for (int i = 0; i < pages.size(); ++i)
+	{
+		sTextureArrayPage* page = pages[i];
+		if (page->texture != texture->packed_array)
+			continue;
+		for (int j = 0; j < page->layers.size(); ++j)
+			if (page->layers[j] == texture)
+			{
+				page->layers[j] = NULL; //a copy still running is discarded
+				page->num_used--;
+			}
+	}
+	texture->packed_array = NULL;
+	texture->packed_layer = -1;
+}
+
+void TextureArrayPacker::release()
+{
+	for (int i = 0; i < pages.size(); ++i)
+	{
+		sTextureArrayPage* page = pages[i];
+		for (int j = 0; j < page->layers.size(); ++j)
+			if (page->layers[j])
+			{
+				page->layers[j]->packed_array = NULL;
+				page->layers[j]->packed_layer = -1;
+			}
+		delete page->texture;
+		delete page;
+	}
+	pages.clear();
+}
+
+bool TextureArrayPacker::canUseArrays(GTR::Material* material)
+{
+	Texture* textures[] = { material->color_texture.texture, material->emissive_texture.texture,
+		material->metallic_roughness_texture.texture, material->normal_texture.texture };
+	bool any = false;
+	for (int i = 0; i < 4; ++i)
+	{
+		if (!textures[i])
+			continue;
+		if (!isPacked(textures[i]))
+			return false;
+		any = true;
+	}
+	return any;
+}
+
+void TextureArrayPacker::setTexture(Shader* shader, const char* varname, const char* layer_varname, Texture* texture, int slot)
+{
+	if (texture && isPacked(texture))
+	{
+		texture->last_used_frame = Texture::frame;
+		shader->setTexture(varname, texture->packed_array, slot);
+		shader->setUniform(layer_varname, (float)texture->packed_layer);
+	}
+	else
+	{
+		shader->setTexture(varname, getWhiteArray(), slot);
+		shader->setUniform(layer_varname, 0.0f);
+	}
+}
+
+Texture* TextureArrayPacker::getWhiteArray()
+{
+	static Texture* white = NULL;
+	if (white)
+		return white;
+
+	Uint8 data[4] = { 255, 255, 255, 255 };
+	white = new Texture();
+	white->texture_type = GL_TEXTURE_2D_ARRAY;
+	white->width = white->height = white->depth = 1;
+	white->format = GL_RGBA;
+	white->internal_format = GL_RGBA8;
+	white->type = GL_UNSIGNED_BYTE;
+	white->gpu_memory = 4;
+	glGenTextures(1, &white->texture_id);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, white->texture_id);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, 1, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	return white;
+}
+
+void TextureArrayPacker::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Enabled", &enabled);
+	ImGui::SliderInt("Max size", &max_size, 1, 2048);
+	int num_packed = 0;
+	size_t memory = 0;
+	for (int i = 0; i < pages.size(); ++i)
+	{
+		num_packed += pages[i]->num_used;
+		memory += pages[i]->texture->gpu_memory;
+	}
+	ImGui::Text("Pages: %d, packed textures: %d, VRAM: %d KB", (int)pages.size(), num_packed, (int)(memory / 1024));
+	ImGui::Text("Texture binds last frame: %d (%d requested)", Shader::last_frame_texture_binds, Shader::last_frame_texture_requests);
+#endif
+}
+
+//*********************
+
+PackTextureTask::PackTextureTask(Texture* texture, sTextureArrayPage* page, int layer)
+{
+	this->texture = texture;
+	this->page = page;
+	this->layer = layer;
+	filename = texture->filename;
+	compress = texture->internal_format != GL_RGBA8;
+	srgb = texture->srgb;
+	compressed = NULL;
+	background = true;
+}
+
+void PackTextureTask::onExecute()
+{
+	if (background)
+	{
+		compressed = loadCompressedTexture(filename.c_str(), true, compress, srgb);
+		PackTextureTask* copy_task = new PackTextureTask(*this);
+		copy_task->background = false;
+		compressed = NULL;
+		TaskManager::foreground.addTask(copy_task, TASK_PRIORITY_LOW); //the texture can be used meanwhile
+		return;
+	}
+
+	//the texture could have been destroyed meanwhile
+	std::vector<sTextureArrayPage*>& pages = TextureArrayPacker::pages;
+	if (std::find(pages.begin(), pages.end(), page) == pages.end() || page->layers[layer] != texture || texture->filename != filename)
+	{
+		delete compressed;
+		return;
+	}
+
+	if (!compressed || compressed->format != getBCFormatFromGL(page->internal_format) || compressed->width != page->width ||
+		compressed->height != page->height || compressed->num_levels != page->num_levels)
+	{
+		std::cout << "Texture cannot be packed in an array: " << filename << std::endl;
+		TextureArrayPacker::remove(texture);
+		TextureArrayPacker::rejected.insert(filename);
+		delete compressed;
+		return;
+	}
+
+	bool is_compressed = compressed->format != BC_RGBA8;
+	glBindTexture(GL_TEXTURE_2D_ARRAY, page->texture->texture_id);
+	for (int i = 0; i < compressed->num_levels; ++i)
+	{
+		const unsigned char* level = compressed->data + compressed->getLevelOffset(i);
+		if (is_compressed)
+			glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer, compressed->getLevelWidth(i), compressed->getLevelHeight(i), 1, page->internal_format, (GLsizei)compressed->getLevelSize(i), level);
+		else
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, i, 0, 0, layer, compressed->getLevelWidth(i), compressed->getLevelHeight(i), 1, GL_RGBA, GL_UNSIGNED_BYTE, level);
+	}
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	assert(checkGLErrors() && "Error copying texture to array");
+	texture->packed_layer = layer;
+	delete compressed;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "texture.h"
+
+//Texture arrays: the small textures loaded from a file are copied as layers of GL_TEXTURE_2D_ARRAY pages shared by the
+//textures with the same size, format and levels. The G-buffer pass draws the materials with every texture packed using
+//the pages, so consecutive draws keep the same bindings and only the layers (uniforms) change.
+//The layers are read from the DDS cache in the background and copied in the main thread, the textures are kept as they are
+
+class Shader;
+namespace GTR { class Material; }
+
+struct sTextureArrayPage
+{
+	Texture* texture; //the GL_TEXTURE_2D_ARRAY
+	int width;
+	int height;
+	int num_levels;
+	unsigned int internal_format;
+	bool wrap;
+	std::vector<Texture*> layers; //NULL if free
+	int num_used;
+};
+
+class TextureArrayPacker {
+public:
+	static bool enabled;
+	static int max_size; //textures up to this size are packed
+	static int layers_per_page;
+	static int max_copies_per_frame; //new copies started per frame
+	static std::vector<sTextureArrayPage*> pages;
+	static std::set<std::string> rejected; //files whose cache doesnt match the texture
+
+	static void update(); //once per frame, looks for textures that can be packed and starts copying them
+	static void remove(Texture* texture); //frees its layer, called when the texture is destroyed
+	static void release(); //deletes all the pages
+
+	static bool isPacked(Texture* texture) { return texture->packed_array && texture->packed_layer != -1; }
+	//every texture used by the G-buffer pass is packed (and there is at least one)
+	static bool canUseArrays(GTR::Material* material);
+	//binds the page of the texture (a white one if it is NULL) and sets the layer
+	static void setTexture(Shader* shader, const char* varname, const char* layer_varname, Texture* texture, int slot);
+	static Texture* getWhiteArray();
+
+	static void renderInMenu();
+
+private:
+	static sTextureArrayPage* getPage(Texture* texture, int& layer); //a free layer of a page for the texture, creates the page if needed
+};
+
+//reads the levels of a texture from the cache in the background and copies them to its layer in the main thread
+//(it is the same task, it adds itself again to the foreground once read)
+class PackTextureTask : public Task {
+public:
+	Texture* texture;
+	std::string filename;
+	bool compress;
+	bool srgb;
+	sTextureArrayPage* page;
+	int layer;
+	CompressedImage* compressed;
+	bool background;
+
+	PackTextureTask(Texture* texture, sTextureArrayPage* page, int layer);
+	void onExecute();
+};
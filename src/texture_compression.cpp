@@ -0,0 +1,600 @@
+#include "texture_compression.h"
+
+#include "texture.h"
+#include "mipmaps.h"
+
+#include <cstring>
+#include <cmath>
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+
+#ifdef BC_USE_SSE
+	#include <emmintrin.h>
+#endif
+
+//** FORMAT SELECTION
+
+eBCFormat chooseBCFormat(Image* image)
+{
+	int num_pixels = image->width * image->height;
+	int channels = image->num_channels;
+	bool has_alpha = false;
+	bool grayscale = true;
+	int unit_normals = 0;
+	for (int i = 0; i < num_pixels; ++i)
+	{
+		const unsigned char* pixel = image->data + i * channels;
+		if (channels == 4 && pixel[3] != 255)
+			has_alpha = true;
+		if (pixel[0] != pixel[1] || pixel[0] != pixel[2])
+			grayscale = false;
+		//tangent space normals have unit length and point outwards
+		float x = pixel[0] / 127.5f - 1.0f;
+		float y = pixel[1] / 127.5f - 1.0f;
+		float z = pixel[2] / 127.5f - 1.0f;
+		float length2 = x * x + y * y + z * z;
+		if (z > 0.0f && length2 > 0.8f && length2 < 1.2f)
+			unit_normals++;
+	}
+
+	if (has_alpha)
+		return BC3;
+	if (grayscale)
+		return BC4;
+	if (unit_normals > num_pixels * 0.95f)
+		return BC5;
+	return BC1;
+}
+
+int getBCBlockSize(eBCFormat format)
+{
+	if (format == BC_RGBA8)
+		return 4;
+	return (format == BC1 || format == BC4) ? 8 : 16;
+}
+
+unsigned int getBCGLFormat(eBCFormat format)
+{
+	switch (format)
+	{
+		case BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+		case BC3: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+		case BC4: return GL_COMPRESSED_RED_RGTC1;
+		case BC5: return GL_COMPRESSED_RG_RGTC2;
+		default: return 0;
+	}
+}
+
+eBCFormat getBCFormatFromGL(unsigned int internal_format)
+{
+	switch (internal_format)
+	{
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: return BC1;
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: return BC3;
+		case GL_COMPRESSED_RED_RGTC1: return BC4;
+		case GL_COMPRESSED_RG_RGTC2: return BC5;
+		default: return BC_RGBA8;
+	}
+}
+
+void setBCSwizzle(unsigned int target, eBCFormat format)
+{
+	if (format != BC4)
+		return;
+	GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+	glTexParameteriv(target, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+}
+
+const char* getBCFormatName(eBCFormat format)
+{
+	const char* names[] = { "NONE", "BC1", "BC3", "BC4", "BC5", "RGBA8" };
+	return names[format];
+}
+
+//** BLOCK ENCODING
+
+static inline int quantize565(const float* color)
+{
+	int r = std::min(std::max((int)(color[0] * 31.0f / 255.0f + 0.5f), 0), 31);
+	int g = std::min(std::max((int)(color[1] * 63.0f / 255.0f + 0.5f), 0), 63);
+	int b = std::min(std::max((int)(color[2] * 31.0f / 255.0f + 0.5f), 0), 31);
+	return (r << 11) | (g << 5) | b;
+}
+
+static inline void expand565(int c, float* color)
+{
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	color[0] = (float)((r << 3) | (r >> 2));
+	color[1] = (float)((g << 2) | (g >> 4));
+	color[2] = (float)((b << 3) | (b >> 2));
+}
+
+//finds the closest palette entry for every pixel, returns the squared error
+static float findBC1Indices(const float pixels[3][16], const float palette[4][3], int* indices)
+{
+#ifdef BC_USE_SSE
+	__m128 total = _mm_setzero_ps();
+	for (int i = 0; i < 16; i += 4)
+	{
+		__m128 r = _mm_loadu_ps(pixels[0] + i);
+		__m128 g = _mm_loadu_ps(pixels[1] + i);
+		__m128 b = _mm_loadu_ps(pixels[2] + i);
+		__m128 best = _mm_set1_ps(3.4e+38F);
+		__m128i best_index = _mm_setzero_si128();
+		for (int p = 0; p < 4; ++p)
+		{
+			__m128 dr = _mm_sub_ps(r, _mm_set1_ps(palette[p][0]));
+			__m128 dg = _mm_sub_ps(g, _mm_set1_ps(palette[p][1]));
+			__m128 db = _mm_sub_ps(b, _mm_set1_ps(palette[p][2]));
+			__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+			__m128i closer = _mm_castps_si128(_mm_cmplt_ps(dist, best));
+			best = _mm_min_ps(dist, best);
+			best_index = _mm_or_si128(_mm_andnot_si128(closer, best_index), _mm_and_si128(closer, _mm_set1_epi32(p)));
+		}
+		_mm_storeu_si128((__m128i*)(indices + i), best_index);
+		total = _mm_add_ps(total, best);
+	}
+	float sums[4];
+	_mm_storeu_ps(sums, total);
+	return sums[0] + sums[1] + sums[2] + sums[3];
+#else
+	float total = 0.0f;
+	for (int i = 0; i < 16; ++i)
+	{
+		float best = 3.4e+38F;
+		for (int p = 0; p < 4; ++p)
+		{
+			float dr = pixels[0][i] - palette[p][0];
+			float dg = pixels[1][i] - palette[p][1];
+			float db = pixels[2][i] - palette[p][2];
+			float dist = dr * dr + dg * dg + db * db;
+			if (dist < best)
+			{
+				best = dist;
+				indices[i] = p;
+			}
+		}
+		total += best;
+	}
+	return total;
+#endif
+}
+
+//quantizes the endpoints and picks the indices, always in 4 colors mode (c0 > c1) so it is also valid for BC3
+static float encodeBC1Endpoints(const float pixels[3][16], const float* end0, const float* end1, int& c0, int& c1, int* indices)
+{
+	c0 = quantize565(end0);
+	c1 = quantize565(end1);
+	if (c0 < c1)
+		std::swap(c0, c1);
+
+	float palette[4][3];
+	expand565(c0, palette[0]);
+	expand565(c1, palette[1]);
+	for (int k = 0; k < 3; ++k)
+	{
+		palette[2][k] = (2.0f * palette[0][k] + palette[1][k]) / 3.0f;
+		palette[3][k] = (palette[0][k] + 2.0f * palette[1][k]) / 3.0f;
+	}
+
+	float error = findBC1Indices(pixels, palette, indices);
+	if (c0 == c1) //the block would be in 3 colors mode, where index 3 is black
+		for (int i = 0; i < 16; ++i)
+			indices[i] = 0;
+	return error;
+}
+
+float encodeBC1Block(const unsigned char* rgba, unsigned char* output)
+{
+	float pixels[3][16];
+	float mean[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; ++i)
+		for (int k = 0; k < 3; ++k)
+		{
+			pixels[k][i] = rgba[i * 4 + k];
+			mean[k] += pixels[k][i];
+		}
+	for (int k = 0; k < 3; ++k)
+		mean[k] /= 16.0f;
+
+	//principal axis of the colors (power iteration over the covariance)
+	float cov[6] = { 0, 0, 0, 0, 0, 0 };
+	for (int i = 0; i < 16; ++i)
+	{
+		float r = pixels[0][i] - mean[0], g = pixels[1][i] - mean[1], b = pixels[2][i] - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+	}
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	for (int iteration = 0; iteration < 4; ++iteration)
+	{
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float length = std::max(std::max(fabs(x), fabs(y)), fabs(z));
+		if (length < 1e-6f)
+			break;
+		axis[0] = x / length; axis[1] = y / length; axis[2] = z / length;
+	}
+
+	//endpoints at the extremes of the projection, slightly inset to reduce the error of the middle colors
+	float min_t = 3.4e+38F, max_t = -3.4e+38F;
+	float axis_length2 = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+	for (int i = 0; i < 16; ++i)
+	{
+		float t = ((pixels[0][i] - mean[0]) * axis[0] + (pixels[1][i] - mean[1]) * axis[1] + (pixels[2][i] - mean[2]) * axis[2]) / axis_length2;
+		min_t = std::min(min_t, t);
+		max_t = std::max(max_t, t);
+	}
+	float inset = (max_t - min_t) / 32.0f;
+	float end0[3], end1[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		end0[k] = mean[k] + axis[k] * (max_t - inset);
+		end1[k] = mean[k] + axis[k] * (min_t + inset);
+	}
+
+	int c0, c1, indices[16];
+	float error = encodeBC1Endpoints(pixels, end0, end1, c0, c1, indices);
+
+	//refine the endpoints with a least squares fit to the chosen indices
+	if (c0 != c1 && error > 0.0f)
+	{
+		const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+		float aa = 0, ab = 0, bb = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+		for (int i = 0; i < 16; ++i)
+		{
+			float a = weights[indices[i]], b = 1.0f - a;
+			aa += a * a; ab += a * b; bb += b * b;
+			for (int k = 0; k < 3; ++k)
+			{
+				ax[k] += a * pixels[k][i];
+				bx[k] += b * pixels[k][i];
+			}
+		}
+		float det = aa * bb - ab * ab;
+		if (fabs(det) > 1e-6f)
+		{
+			float refined0[3], refined1[3];
+			for (int k = 0; k < 3; ++k)
+			{
+				refined0[k] = (bb * ax[k] - ab * bx[k]) / det;
+				refined1[k] = (aa * bx[k] - ab * ax[k]) / det;
+			}
+			int r0, r1, refined_indices[16];
+			float refined_error = encodeBC1Endpoints(pixels, refined0, refined1, r0, r1, refined_indices);
+			if (refined_error < error)
+			{
+				error = refined_error;
+				c0 = r0;
+				c1 = r1;
+				memcpy(indices, refined_indices, sizeof(indices));
+			}
+		}
+	}
+
+	unsigned int bits = 0;
+	for (int i = 0; i < 16; ++i)
+		bits |= indices[i] << (i * 2);
+	output[0] = c0 & 0xFF; output[1] = c0 >> 8;
+	output[2] = c1 & 0xFF; output[3] = c1 >> 8;
+	output[4] = bits & 0xFF; output[5] = (bits >> 8) & 0xFF; output[6] = (bits >> 16) & 0xFF; output[7] = bits >> 24;
+	return error;
+}
+
+//8 values mode (a0 > a1), the palette is uniform so rounding the position gives the closest entry
+float encodeBC4Block(const unsigned char* values, int stride, unsigned char* output)
+{
+	int min_value = 255, max_value = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		min_value = std::min(min_value, (int)values[i * stride]);
+		max_value = std::max(max_value, (int)values[i * stride]);
+	}
+
+	output[0] = max_value;
+	output[1] = min_value;
+	unsigned long long bits = 0;
+	float error = 0.0f;
+	if (max_value != min_value)
+	{
+		float scale = 7.0f / (max_value - min_value);
+		for (int i = 0; i < 16; ++i)
+		{
+			int step = (int)((values[i * stride] - min_value) * scale + 0.5f); //0 is min, 7 is max
+			int index = step == 7 ? 0 : (step == 0 ? 1 : 8 - step);
+			float decoded = (step * max_value + (7 - step) * min_value) / 7.0f;
+			float diff = decoded - values[i * stride];
+			error += diff * diff;
+			bits |= (unsigned long long)index << (i * 3);
+		}
+	}
+	for (int i = 0; i < 6; ++i)
+		output[2 + i] = (bits >> (i * 8)) & 0xFF;
+	return error;
+}
+
+//** COMPRESSED IMAGE
+
+CompressedImage::CompressedImage()
+{
+	format = BC_NONE;
+	width = height = num_levels = 0;
+	data = NULL;
+	srgb = false;
+}
+
+size_t CompressedImage::getLevelSize(int level) const
+{
+	if (format == BC_RGBA8)
+		return (size_t)getLevelWidth(level) * getLevelHeight(level) * 4;
+	int blocks_x = (getLevelWidth(level) + 3) / 4;
+	int blocks_y = (getLevelHeight(level) + 3) / 4;
+	return (size_t)blocks_x * blocks_y * getBCBlockSize(format);
+}
+
+size_t CompressedImage::getLevelOffset(int level) const
+{
+	size_t offset = 0;
+	for (int i = 0; i < level; ++i)
+		offset += getLevelSize(i);
+	return offset;
+}
+
+static void encodeLevel(const std::vector<unsigned char>& rgba, int width, int height, eBCFormat format, unsigned char* output, int num_threads)
+{
+	int blocks_x = (width + 3) / 4;
+	int blocks_y = (height + 3) / 4;
+	int block_size = getBCBlockSize(format);
+	if (format == BC_RGBA8)
+	{
+		memcpy(output, rgba.data(), (size_t)width * height * 4);
+		return;
+	}
+
+	auto encodeRow = [&](int by) {
+		unsigned char block[64];
+		for (int bx = 0; bx < blocks_x; ++bx)
+		{
+			//gather the 4x4 pixels, repeating the border ones outside the image
+			for (int y = 0; y < 4; ++y)
+				for (int x = 0; x < 4; ++x)
+				{
+					int px = std::min(bx * 4 + x, width - 1);
+					int py = std::min(by * 4 + y, height - 1);
+					memcpy(block + (y * 4 + x) * 4, &rgba[(py * width + px) * 4], 4);
+				}
+
+			unsigned char* out = output + ((size_t)by * blocks_x + bx) * block_size;
+			switch (format)
+			{
+				case BC1: encodeBC1Block(block, out); break;
+				case BC3: encodeBC4Block(block + 3, 4, out); encodeBC1Block(block, out + 8); break;
+				case BC4: encodeBC4Block(block, 4, out); break;
+				case BC5: encodeBC4Block(block, 4, out); encodeBC4Block(block + 1, 4, out + 8); break;
+				default: break;
+			}
+		}
+	};
+
+	if (num_threads == 1)
+		for (int by = 0; by < blocks_y; ++by)
+			encodeRow(by);
+	else
+		parallelFor(blocks_y, encodeRow, num_threads);
+}
+
+bool CompressedImage::encode(Image* image, eBCFormat format, bool mipmaps, int num_threads, bool srgb)
+{
+	if (!image || !image->data || format == BC_NONE)
+		return false;
+
+	this->format = format;
+	this->srgb = srgb;
+	width = image->width;
+	height = image->height;
+	num_levels = 1;
+	if (mipmaps)
+		while ((width >> num_levels) || (height >> num_levels))
+			num_levels++;
+
+	file.close();
+	storage.resize(getSize());
+	data = storage.data();
+
+	std::vector<unsigned char> level(width * height * 4);
+	for (int i = 0; i < width * height; ++i)
+	{
+		const unsigned char* pixel = image->data + i * image->num_channels;
+		level[i * 4 + 0] = pixel[0];
+		level[i * 4 + 1] = pixel[1];
+		level[i * 4 + 2] = pixel[2];
+		level[i * 4 + 3] = image->num_channels == 4 ? pixel[3] : 255;
+	}
+
+	//the first level is encoded as it is, the rest come from the filtered chain
+	MipChain chain;
+	if (num_levels > 1)
+	{
+		sMipOptions options;
+		options.content = format == BC5 ? MIP_CONTENT_NORMALMAP : (srgb ? MIP_CONTENT_SRGB : MIP_CONTENT_LINEAR);
+		options.num_threads = num_threads;
+		chain.build(image, options);
+		assert(chain.getNumLevels() == num_levels);
+	}
+
+	for (int i = 0; i < num_levels; ++i)
+	{
+		int level_width = getLevelWidth(i);
+		int level_height = getLevelHeight(i);
+		if (i > 0)
+		{
+			level.resize((size_t)level_width * level_height * 4);
+			chain.getLevelRGBA8(i, level.data());
+		}
+		encodeLevel(level, level_width, level_height, format, storage.data() + getLevelOffset(i), num_threads);
+	}
+	return true;
+}
+
+//** DDS
+
+struct sDDSHeader
+{
+	unsigned int size; //124
+	unsigned int flags;
+	unsigned int height;
+	unsigned int width;
+	unsigned int linear_size;
+	unsigned int depth;
+	unsigned int mipmap_count;
+	unsigned int reserved1[11]; //[0] tag, [1] version and [2] settings of our caches
+	unsigned int pf_size; //32
+	unsigned int pf_flags;
+	unsigned int pf_fourcc;
+	unsigned int pf_bitcount;
+	unsigned int pf_masks[4];
+	unsigned int caps;
+	unsigned int caps2;
+	unsigned int caps3;
+	unsigned int caps4;
+	unsigned int reserved2;
+};
+
+#define DDS_FOURCC(a,b,c,d) ((unsigned int)(a) | ((unsigned int)(b) << 8) | ((unsigned int)(c) << 16) | ((unsigned int)(d) << 24))
+#define DDS_CACHE_TAG DDS_FOURCC('G','T','R','C')
+#define DDS_CACHE_SRGB 1
+
+static unsigned int getDDSFourCC(eBCFormat format)
+{
+	switch (format)
+	{
+		case BC1: return DDS_FOURCC('D', 'X', 'T', '1');
+		case BC3: return DDS_FOURCC('D', 'X', 'T', '5');
+		case BC4: return DDS_FOURCC('A', 'T', 'I', '1');
+		case BC5: return DDS_FOURCC('A', 'T', 'I', '2');
+		default: return 0;
+	}
+}
+
+static eBCFormat getFormatFromFourCC(unsigned int fourcc)
+{
+	if (fourcc == DDS_FOURCC('D', 'X', 'T', '1')) return BC1;
+	if (fourcc == DDS_FOURCC('D', 'X', 'T', '5')) return BC3;
+	if (fourcc == DDS_FOURCC('A', 'T', 'I', '1') || fourcc == DDS_FOURCC('B', 'C', '4', 'U')) return BC4;
+	if (fourcc == DDS_FOURCC('A', 'T', 'I', '2') || fourcc == DDS_FOURCC('B', 'C', '5', 'U')) return BC5;
+	return BC_NONE;
+}
+
+bool CompressedImage::saveDDS(const char* filename)
+{
+	assert(data && format != BC_NONE);
+	sDDSHeader header;
+	memset(&header, 0, sizeof(header));
+	header.size = 124;
+	header.flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | (num_levels > 1 ? 0x20000 : 0); //caps, height, width, pixelformat, linearsize, mipmapcount
+	header.height = height;
+	header.width = width;
+	header.linear_size = format == BC_RGBA8 ? width * 4 : (unsigned int)getLevelSize(0); //pitch when not compressed
+	header.mipmap_count = num_levels;
+	header.reserved1[0] = DDS_CACHE_TAG;
+	header.reserved1[1] = TEXTURE_CACHE_VERSION;
+	header.reserved1[2] = srgb ? DDS_CACHE_SRGB : 0;
+	header.pf_size = 32;
+	if (format == BC_RGBA8)
+	{
+		header.flags = (header.flags & ~0x80000) | 0x8; //pitch instead of linearsize
+		header.pf_flags = 0x1 | 0x40; //alphapixels, rgb
+		header.pf_bitcount = 32;
+		header.pf_masks[0] = 0x000000FF;
+		header.pf_masks[1] = 0x0000FF00;
+		header.pf_masks[2] = 0x00FF0000;
+		header.pf_masks[3] = 0xFF000000;
+	}
+	else
+	{
+		header.pf_flags = 0x4; //fourcc
+		header.pf_fourcc = getDDSFourCC(format);
+	}
+	header.caps = 0x1000 | (num_levels > 1 ? 0x400008 : 0); //texture, mipmap + complex
+
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+	{
+		std::cout << "[ERROR] cannot write compressed texture: " << filename << std::endl;
+		return false;
+	}
+	fwrite("DDS ", 1, 4, f);
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(data, getSize(), 1, f);
+	fclose(f);
+	return true;
+}
+
+bool CompressedImage::loadDDS(const char* filename, bool check_cache_version)
+{
+	if (!file.open(filename))
+		return false;
+
+	sDDSHeader header;
+	if (file.size < 4 + sizeof(header) || memcmp(file.data, "DDS ", 4) != 0)
+	{
+		file.close();
+		return false;
+	}
+	memcpy(&header, file.data + 4, sizeof(header));
+	if (check_cache_version && (header.reserved1[0] != DDS_CACHE_TAG || header.reserved1[1] != TEXTURE_CACHE_VERSION))
+	{
+		file.close();
+		return false;
+	}
+
+	format = getFormatFromFourCC(header.pf_fourcc);
+	if (!(header.pf_flags & 0x4) && header.pf_bitcount == 32 && header.pf_masks[0] == 0x000000FF && header.pf_masks[1] == 0x0000FF00 && header.pf_masks[2] == 0x00FF0000)
+		format = BC_RGBA8;
+	srgb = header.reserved1[0] == DDS_CACHE_TAG && (header.reserved1[2] & DDS_CACHE_SRGB);
+	width = header.width;
+	height = header.height;
+	num_levels = std::max((int)header.mipmap_count, 1);
+	data = file.data + 4 + sizeof(header);
+	if (format == BC_NONE || !width || !height || 4 + sizeof(header) + getSize() > file.size)
+	{
+		std::cout << "[ERROR] DDS format not supported: " << filename << std::endl;
+		file.close();
+		data = NULL;
+		return false;
+	}
+	storage.clear();
+	return true;
+}
+
+//** CACHE
+
+std::string getCompressedTextureFilename(const char* filename)
+{
+	return std::string(filename) + ".dds";
+}
+
+CompressedImage* loadCompressedTexture(const char* filename, bool mipmaps, bool compress, bool srgb)
+{
+	std::string cache_filename = getCompressedTextureFilename(filename);
+	CompressedImage* compressed = new CompressedImage();
+	if (getFileTime(cache_filename) >= getFileTime(filename) && compressed->loadDDS(cache_filename.c_str(), true) &&
+		(compressed->num_levels > 1) == mipmaps && (compressed->format != BC_RGBA8) == compress && compressed->srgb == srgb)
+		return compressed;
+
+	Image image;
+	if (!image.load(filename))
+	{
+		delete compressed;
+		return NULL;
+	}
+
+	long start_time = getTime();
+	eBCFormat format = compress ? chooseBCFormat(&image) : BC_RGBA8;
+	compressed->encode(&image, format, mipmaps, 1, srgb);
+	compressed->saveDDS(cache_filename.c_str());
+	std::cout << " + Encoded " << filename << " to " << getBCFormatName(format) << " in " << (getTime() - start_time) << "ms" << std::endl;
+	return compressed;
+}
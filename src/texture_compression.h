@@ -0,0 +1,83 @@
+#pragma once
+
+#include "utils.h"
+#include <vector>
+#include <string>
+
+//Block compression (BCn) of textures in the CPU, so they use 4-8 times less VRAM and upload faster.
+//The encoded mip chain is cached next to the image as <file>.dds, mapped in memory when loading it.
+//When compression is disabled the cache stores the uncompressed RGBA8 levels, so the mipmaps are not generated again
+
+#define TEXTURE_CACHE_VERSION 2 //increase it when the encoder changes to regenerate the caches
+
+//use SSE when the compiler targets it (always on x64)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define BC_USE_SSE
+#endif
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+	#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+#ifndef GL_COMPRESSED_RED_RGTC1
+	#define GL_COMPRESSED_RED_RGTC1 0x8DBB
+	#define GL_COMPRESSED_RG_RGTC2 0x8DBD
+#endif
+
+class Image;
+
+enum eBCFormat {
+	BC_NONE,
+	BC1, //RGB, 4 bits per pixel
+	BC3, //RGBA, 8 bits per pixel (BC1 color + BC4 alpha)
+	BC4, //R, 4 bits per pixel
+	BC5, //RG, 8 bits per pixel, for normalmaps (the shader reconstructs Z)
+	BC_RGBA8 //not compressed, 32 bits per pixel
+};
+
+//picks the format from the channels used: alpha -> BC3, normalmap -> BC5, grayscale -> BC4, otherwise BC1
+eBCFormat chooseBCFormat(Image* image);
+int getBCBlockSize(eBCFormat format); //in bytes, every block has 4x4 pixels (one pixel for BC_RGBA8)
+unsigned int getBCGLFormat(eBCFormat format); //0 for BC_RGBA8
+eBCFormat getBCFormatFromGL(unsigned int internal_format); //BC_RGBA8 if it is not a BCn format
+void setBCSwizzle(unsigned int target, eBCFormat format); //BC4 only has red, so it is read as gray (rgb) with alpha 1
+const char* getBCFormatName(eBCFormat format);
+
+//blocks of 4x4 pixels, rgba has 16 pixels of 4 bytes. Returns the squared error
+float encodeBC1Block(const unsigned char* rgba, unsigned char* output);
+float encodeBC4Block(const unsigned char* values, int stride, unsigned char* output); //values[i * stride]
+
+//all the levels of a compressed texture in a single buffer, it is the layout of the DDS data
+class CompressedImage
+{
+public:
+	eBCFormat format;
+	int width; //of the first level
+	int height;
+	int num_levels;
+	const unsigned char* data; //points to storage or to the mapped file
+
+	CompressedImage();
+
+	//mipmaps down to 1x1 if mipmaps is true (see mipmaps.h), srgb for colors, num_threads 0 means one per core
+	bool encode(Image* image, eBCFormat format, bool mipmaps, int num_threads = 1, bool srgb = false);
+	bool loadDDS(const char* filename, bool check_cache_version = false); //maps the file, nothing is copied
+	bool srgb; //the mipmaps were filtered as sRGB colors (stored in the cache)
+	bool saveDDS(const char* filename);
+
+	int getLevelWidth(int level) const { int w = width >> level; return w ? w : 1; }
+	int getLevelHeight(int level) const { int h = height >> level; return h ? h : 1; }
+	size_t getLevelSize(int level) const;
+	size_t getLevelOffset(int level) const;
+	size_t getSize() const { return getLevelOffset(num_levels); }
+
+private:
+	std::vector<unsigned char> storage;
+	MappedFile file;
+};
+
+std::string getCompressedTextureFilename(const char* filename);
+//returns the cached version of an image file, encoding and caching it if it is missing, older than the image or made
+//with other settings (BC_RGBA8 if compress is false). NULL if the image cannot be loaded.
+//It doesnt use GL so it can be called from the decoding threads
+CompressedImage* loadCompressedTexture(const char* filename, bool mipmaps = true, bool compress = true, bool srgb = false);
@@ -0,0 +1,253 @@
+#include "texture_streaming.h"
+
+#include "texture_compression.h"
+#include "mesh.h"
+#include "camera.h"
+#include "material.h"
+#include "includes.h"
+
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+bool TextureStreamer::enabled = true;
+size_t TextureStreamer::budget = 512 * 1024 * 1024; //512MB
+int TextureStreamer::initial_size = 64;
+int TextureStreamer::max_loads_per_frame = 8;
+float TextureStreamer::mip_bias = 0.0f;
+size_t TextureStreamer::memory_used = 0;
+size_t TextureStreamer::memory_requested = 0;
+int TextureStreamer::num_streamed = 0;
+int TextureStreamer::num_loading = 0;
+
+#define STREAMING_UNUSED_FRAMES 60 //textures not drawn for a second go back to the initial levels
+
+int TextureStreamer::getInitialLevel(int width, int height, int num_levels)
+{
+	int level = 0;
+	while (level < num_levels - 1 && std::max(width >> level, height >> level) > initial_size)
+		level++;
+	return level;
+}
+
+size_t TextureStreamer::getLevelsSize(Texture* texture, int first_level)
+{
+	//only the header of the image, to reuse the size of the levels
+	CompressedImage chain;
+	chain.format = getBCFormatFromGL(texture->internal_format);
+	chain.width = texture->source_width;
+	chain.height = texture->source_height;
+	chain.num_levels = texture->num_levels;
+	return chain.getSize() - chain.getLevelOffset(first_level);
+}
+
+void TextureStreamer::requestMaterial(GTR::Material* material, Mesh* mesh, const Matrix44& model, const BoundingBox& box, Camera* camera, float viewport_height)
+{
+	//world size of a pixel at the closest point of the box
+	float radius = box.halfsize.length();
+	float pixel_size;
+	if (camera->type == Camera::ORTHOGRAPHIC)
+		pixel_size = (camera->top - camera->bottom) / viewport_height;
+	else
+	{
+		float dist = std::max(camera->eye.distance(box.center) - radius, camera->near_plane);
+		pixel_size = 2.0f * dist * tanf(camera->fov * 0.5f * (float)DEG2RAD) / viewport_height;
+	}
+
+	//uvs per world unit, if the mesh does not know it assume the uvs cover the object once
+	float uvs_per_unit;
+	if (mesh->uv_density > 0.0f)
+	{
+		Matrix44 m = model;
+		float scale = std::max(std::max(m.rightVector().length(), m.topVector().length()), m.frontVector().length());
+		uvs_per_unit = mesh->uv_density / std::max(scale, 0.0001f);
+	}
+	else
+		uvs_per_unit = 1.0f / std::max(radius * 2.0f, 0.0001f);
+
+	float uvs_per_pixel = uvs_per_unit * pixel_size;
+	GTR::Sampler* samplers[] = { &material->color_texture, &material->emissive_texture, &material->opacity_texture,
+		&material->metallic_roughness_texture, &material->occlusion_texture, &material->normal_texture };
+	for (int i = 0; i < 6; ++i)
+		if (samplers[i]->texture)
+			requestTexture(samplers[i]->texture, uvs_per_pixel);
+}
+
+void TextureStreamer::requestTexture(Texture* texture, float uvs_per_pixel)
+{
+	if (!texture->streamed)
+		return;
+	float texels_per_pixel = uvs_per_pixel * std::max(texture->source_width, texture->source_height);
+	int level = (int)floorf(log2f(std::max(texels_per_pixel, 1.0f)) + mip_bias);
+	level = std::min(std::max(level, 0), texture->num_levels - 1);
+	if (texture->last_used_frame != Texture::frame)
+		texture->requested_level = level;
+	else
+		texture->requested_level = std::min(texture->requested_level, level);
+	texture->last_used_frame = Texture::frame;
+}
+
+struct sStreamState
+{
+	Texture* texture;
+	int level;
+};
+
+static bool lruSort(const sStreamState& a, const sStreamState& b)
+{
+	return a.texture->last_used_frame < b.texture->last_used_frame;
+}
+
+static bool detailSort(const sStreamState& a, const sStreamState& b)
+{
+	return a.level < b.level; //the finest first
+}
+
+void TextureStreamer::update()
+{
+	std::vector<sStreamState> states;
+	size_t total = 0;
+	memory_used = memory_requested = 0;
+	num_loading = 0;
+	for (auto it : Texture::sTexturesLoaded)
+	{
+		Texture* texture = it.second;
+		if (!texture->streamed || texture->loading)
+			continue;
+		if (!enabled && texture->resident_level == 0 && texture->streaming_level == -1)
+		{
+			texture->streamed = false; //back to a normal texture
+			continue;
+		}
+		if (texture->streaming_level != -1)
+			num_loading++;
+		memory_used += texture->gpu_memory;
+
+		sStreamState state;
+		state.texture = texture;
+		if (!enabled)
+			state.level = 0;
+		else if (Texture::frame - texture->last_used_frame > STREAMING_UNUSED_FRAMES)
+			state.level = getInitialLevel(texture->source_width, texture->source_height, texture->num_levels);
+		else
+		{
+			memory_requested += getLevelsSize(texture, texture->requested_level);
+			//levels are only dropped when not used or to fit the budget, so moving around does not reload them
+			state.level = std::min(texture->requested_level, texture->resident_level);
+		}
+		total += getLevelsSize(texture, state.level);
+		states.push_back(state);
+	}
+	num_streamed = (int)states.size();
+
+	if (enabled && budget && total > budget)
+	{
+		//first the ones not drawn this frame, the least recently used first
+		std::sort(states.begin(), states.end(), lruSort);
+		for (int i = 0; i < states.size() && total > budget; ++i)
+		{
+			sStreamState& state = states[i];
+			if (state.texture->last_used_frame == Texture::frame)
+				break;
+			int level = std::max(state.level, getInitialLevel(state.texture->source_width, state.texture->source_height, state.texture->num_levels));
+			total -= getLevelsSize(state.texture, state.level) - getLevelsSize(state.texture, level);
+			state.level = level;
+		}
+
+		//then a level less for the most detailed ones until it fits
+		std::sort(states.begin(), states.end(), detailSort);
+		bool changed = true;
+		while (total > budget && changed)
+		{
+			changed = false;
+			for (int i = 0; i < states.size() && total > budget; ++i)
+			{
+				sStreamState& state = states[i];
+				if (state.level >= state.texture->num_levels - 1)
+					continue;
+				total -= getLevelsSize(state.texture, state.level) - getLevelsSize(state.texture, state.level + 1);
+				state.level++;
+				changed = true;
+			}
+		}
+	}
+
+	//start loading the textures that changed, the ones used now first
+	std::sort(states.begin(), states.end(), lruSort);
+	int started = 0;
+	for (int i = (int)states.size() - 1; i >= 0 && started < max_loads_per_frame; --i)
+	{
+		sStreamState& state = states[i];
+		Texture* texture = state.texture;
+		if (state.level == texture->resident_level || texture->streaming_level != -1)
+			continue;
+		texture->streaming_level = state.level;
+		TextureDecodePool::addTask(new StreamTextureTask(texture, state.level));
+		started++;
+	}
+}
+
+void TextureStreamer::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Enabled", &enabled);
+	int budget_mb = (int)(budget / (1024 * 1024));
+	if (ImGui::SliderInt("Budget (MB)", &budget_mb, 0, 4096))
+		budget = (size_t)budget_mb * 1024 * 1024;
+	ImGui::SliderInt("Initial size", &initial_size, 1, 1024);
+	ImGui::SliderFloat("Mip bias", &mip_bias, -2.0f, 4.0f);
+	ImGui::Text("Streamed textures: %d (%d loading)", num_streamed, num_loading);
+	ImGui::Text("Resident: %d KB, requested: %d KB", (int)(memory_used / 1024), (int)(memory_requested / 1024));
+#endif
+}
+
+//*********************
+
+StreamTextureTask::StreamTextureTask(Texture* texture, int level)
+{
+	this->texture = texture;
+	this->level = level;
+	filename = texture->filename;
+	compress = texture->internal_format != GL_RGBA8;
+	srgb = texture->srgb;
+	compressed = NULL;
+	background = true;
+}
+
+void StreamTextureTask::onExecute()
+{
+	if (background)
+	{
+		//the cache is mapped, touching the levels here avoids reading the disk in the main thread
+		compressed = loadCompressedTexture(filename.c_str(), true, compress, srgb);
+		if (compressed && level < compressed->num_levels)
+		{
+			volatile unsigned char sum = 0;
+			for (size_t i = compressed->getLevelOffset(level); i < compressed->getSize(); i += 4096)
+				sum += compressed->data[i];
+		}
+
+		StreamTextureTask* upload_task = new StreamTextureTask(*this);
+		upload_task->background = false;
+		compressed = NULL;
+		TaskManager::foreground.addTask(upload_task, TASK_PRIORITY_LOW); //the texture can be used meanwhile
+		return;
+	}
+
+	//it could have been destroyed meanwhile
+	if (!TextureDecodePool::finish(texture, ticket))
+	{
+		delete compressed;
+		return;
+	}
+
+	texture->streaming_level = -1;
+	if (compressed && level < compressed->num_levels && compressed->num_levels == texture->num_levels)
+		texture->uploadCompressed(compressed, true, level);
+	else
+	{
+		std::cout << "Error streaming texture: " << filename << std::endl;
+		texture->streamed = false; //keeps the levels it has
+	}
+	delete compressed;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "texture.h"
+
+//Mip streaming: the textures loaded from a file keep in VRAM only the levels that the visible objects need.
+//Every frame the renderer asks for the finest level of every texture it draws (from the size of the object on screen and
+//the density of its uvs), then the streamer loads or drops levels from the DDS cache to keep the total under the budget.
+//The levels are read in the decoding threads and the texture is replaced in the main thread
+
+class Mesh;
+class Camera;
+class CompressedImage;
+namespace GTR { class Material; }
+
+class TextureStreamer {
+public:
+	static bool enabled; //only affects the textures loaded afterwards, disabling it restores the full chains
+	static size_t budget; //in bytes, for the levels of the streamed textures, 0 means no limit
+	static int initial_size; //the levels bigger than this are not uploaded until they are needed
+	static int max_loads_per_frame; //new streaming jobs per frame
+	static float mip_bias; //added to the requested levels, positive saves memory
+
+	//stats of the last update
+	static size_t memory_used; //resident levels
+	static size_t memory_requested; //what the visible objects asked for
+	static int num_streamed;
+	static int num_loading;
+
+	static int getInitialLevel(int width, int height, int num_levels);
+	static size_t getLevelsSize(Texture* texture, int first_level); //bytes of the chain from first_level
+
+	//asks for the levels needed to draw the mesh with the textures of the material (box is in world space)
+	static void requestMaterial(GTR::Material* material, Mesh* mesh, const Matrix44& model, const BoundingBox& box, Camera* camera, float viewport_height);
+	static void requestTexture(Texture* texture, float uvs_per_pixel);
+	static void update(); //once per frame after the requests, chooses the levels and starts the loads
+	static void renderInMenu();
+};
+
+//loads the levels of a streamed texture from the cache in the background and replaces the texture in the main thread
+//(it is the same task, it adds itself again to the foreground once read)
+class StreamTextureTask : public TextureDecodeTask {
+public:
+	std::string filename;
+	int level; //first level to upload
+	bool compress; //the settings of the cache, in case it has to be regenerated
+	bool srgb;
+	CompressedImage* compressed;
+	bool background;
+
+	StreamTextureTask(Texture* texture, int level);
+	void onExecute();
+};
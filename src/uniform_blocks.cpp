@@ -0,0 +1,113 @@
+#include "uniform_blocks.h"
+
+#include "camera.h"
+#include "scene.h"
+#include "shadowAtlas.h"
+
+#include <cstring>
+#include <cassert>
+
+//the shaders read them with std140, if these fail the structs dont match the blocks anymore
+static_assert(sizeof(sCameraBlock) == 144, "sCameraBlock doesnt match the CameraBlock");
+static_assert(sizeof(sLightsBlock) == 5 * 16 * MAX_BLOCK_LIGHTS + 64 * MAX_BLOCK_LIGHTS + 16, "sLightsBlock doesnt match the LightsBlock");
+static_assert(sizeof(sShadowAtlasBlock) == 16 * MAX_BLOCK_LIGHTS, "sShadowAtlasBlock doesnt match the ShadowAtlasBlock");
+
+int UniformBlocks::num_uploads = 0;
+int UniformBlocks::num_skipped = 0;
+GLuint UniformBlocks::buffers[NUM_UNIFORM_BLOCKS] = {};
+std::vector<unsigned char> UniformBlocks::last_data[NUM_UNIFORM_BLOCKS];
+
+const char* UniformBlocks::getName(int block)
+{
+	static const char* names[NUM_UNIFORM_BLOCKS] = { "CameraBlock", "LightsBlock", "ShadowAtlasBlock" };
+	assert(block >= 0 && block < NUM_UNIFORM_BLOCKS);
+	return names[block];
+}
+
+void UniformBlocks::bindToProgram(GLuint program)
+{
+	for (int i = 0; i < NUM_UNIFORM_BLOCKS; ++i)
+	{
+		GLuint index = glGetUniformBlockIndex(program, getName(i));
+		if (index != GL_INVALID_INDEX)
+			glUniformBlockBinding(program, index, i);
+	}
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void UniformBlocks::updateCamera(Camera* camera)
+{
+	sCameraBlock block;
+	block.viewprojection = camera->viewprojection_matrix;
+	block.inverse_viewprojection = camera->viewprojection_matrix;
+	block.inverse_viewprojection.inverse();
+	block.camera_position.set(camera->eye.x, camera->eye.y, camera->eye.z, 1.0f);
+	upload(CAMERA_BLOCK, &block, sizeof(block));
+}
+
+void UniformBlocks::updateLights(std::vector<GTR::LightEntity*>& lights, GTR::shadowAtlas* atlas)
+{
+	//value-initialized so the padding is zero too, the unused matrices are zero instead of identity
+	sLightsBlock block = sLightsBlock();
+	for (int i = 0; i < MAX_BLOCK_LIGHTS; ++i)
+		memset(block.shadow_vp[i].m, 0, sizeof(block.shadow_vp[i].m));
+	sShadowAtlasBlock atlas_block = sShadowAtlasBlock();
+
+	block.num_lights = (int)lights.size() < MAX_BLOCK_LIGHTS ? (int)lights.size() : MAX_BLOCK_LIGHTS;
+	for (int i = 0; i < block.num_lights; ++i)
+	{
+		GTR::LightEntity* light = lights[i];
+		Vector3 position = light->model.getTranslation();
+		Vector3 color = light->color * light->intensity;
+		block.position[i].set(position.x, position.y, position.z, light->max_distance);
+		block.color[i].set(color.x, color.y, color.z, 1.0f);
+		block.vector[i].set(light->lightDirection.x, light->lightDirection.y, light->lightDirection.z, 0.0f);
+		block.params[i].set(cos((float)(DEG2RAD * light->cone_angle)), light->cone_exp, light->shadow_bias, light->cone_angle);
+		block.flags[i][0] = (int)light->light_type;
+		block.flags[i][1] = light->cast_shadows ? 1 : 0;
+		if (light->has_shadow_map && light->cast_shadows)
+			block.shadow_vp[i] = light->shadow_cam->viewprojection_matrix;
+		if (light->shadowAtlasIndex != -1)
+		{
+			Vector3 tile = atlas->getTileInfo(light->shadowAtlasIndex);
+			atlas_block.info[i].set(tile.x, tile.y, tile.z, 0.0f);
+		}
+	}
+
+	upload(LIGHTS_BLOCK, &block, sizeof(block));
+	upload(SHADOW_ATLAS_BLOCK, &atlas_block, sizeof(atlas_block));
+}
+
+void UniformBlocks::upload(int block, const void* data, int size)
+{
+	std::vector<unsigned char>& last = last_data[block];
+	if ((int)last.size() == size && memcmp(&last[0], data, size) == 0)
+	{
+		num_skipped++;
+		return;
+	}
+	last.assign((const unsigned char*)data, (const unsigned char*)data + size);
+
+	if (!buffers[block])
+	{
+		glGenBuffers(1, &buffers[block]);
+		glBindBuffer(GL_UNIFORM_BUFFER, buffers[block]);
+		glBufferData(GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, block, buffers[block]); //the binding point stays, shaders refer to it
+	}
+	else
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, buffers[block]);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+	}
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	num_uploads++;
+	assert(glGetError() == GL_NO_ERROR);
+}
+
+void UniformBlocks::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("Uniform block uploads: %d (%d skipped, unchanged)", num_uploads, num_skipped);
+#endif
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "includes.h"
+#include "framework.h"
+#include <vector>
+
+//The data that is the same for every draw of a pass lives in std140 uniform blocks, so it is uploaded once per frame
+//(the lights) or per pass (the camera) instead of with every mesh. The structs must match the blocks in the shader
+//atlas (cameraBlock, lightsBlock and shadowAtlasBlock). std140 aligns vec3 and array elements to 16 bytes, so
+//everything is packed in vec4
+
+#define MAX_BLOCK_LIGHTS 8 //also in the constants of the shader atlas
+
+class Camera;
+namespace GTR {
+	class LightEntity;
+	class shadowAtlas;
+}
+
+enum eUniformBlock {
+	CAMERA_BLOCK, //the value is the binding point
+	LIGHTS_BLOCK,
+	SHADOW_ATLAS_BLOCK,
+	NUM_UNIFORM_BLOCKS
+};
+
+struct sCameraBlock {
+	Matrix44 viewprojection;
+	Matrix44 inverse_viewprojection;
+	Vector4 camera_position; //w unused
+};
+
+struct sLightsBlock {
+	Vector4 position[MAX_BLOCK_LIGHTS]; //w max distance
+	Vector4 color[MAX_BLOCK_LIGHTS]; //already multiplied by the intensity
+	Vector4 vector[MAX_BLOCK_LIGHTS];
+	Vector4 params[MAX_BLOCK_LIGHTS]; //cosine cutoff, cone exp, shadow bias, cone angle
+	int flags[MAX_BLOCK_LIGHTS][4]; //type, cast shadow
+	Matrix44 shadow_vp[MAX_BLOCK_LIGHTS];
+	int num_lights;
+	int padding[3];
+};
+
+struct sShadowAtlasBlock {
+	Vector4 info[MAX_BLOCK_LIGHTS]; //x, y and size of the tile in the atlas, from 0 to 1
+};
+
+class UniformBlocks {
+public:
+	//stats
+	static int num_uploads;
+	static int num_skipped; //the data was the same as the last upload
+
+	static const char* getName(int block); //as declared in the shaders
+	static void bindToProgram(GLuint program); //when a shader is linked
+	static void updateCamera(Camera* camera);
+	static void updateLights(std::vector<GTR::LightEntity*>& lights, GTR::shadowAtlas* atlas);
+
+	static void renderInMenu();
+
+private:
+	static GLuint buffers[NUM_UNIFORM_BLOCKS];
+	static std::vector<unsigned char> last_data[NUM_UNIFORM_BLOCKS];
+
+	static void upload(int block, const void* data, int size);
+};
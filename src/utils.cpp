@@ -4,17 +4,26 @@
 	#include <windows.h>
 #else
 	#include <sys/time.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
 #endif
+#include <sys/stat.h>
 
 #include "includes.h"
 
 #include "application.h"
 #include "camera.h"
 #include "shader.h"
+#include "jobs.h"
+#include "file_io.h"
 #include "mesh.h"
 
 #include "extra/stb_easy_font.h"
 
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
 long getTime()
 {
 	#ifdef WIN32
@@ -98,6 +107,13 @@ bool readFile(const std::string& filename, std::string& content)
 {
 	content.clear();
 
+	std::vector<unsigned char> prefetched;
+	if (FileIO::take(filename, prefetched))
+	{
+		content.assign(prefetched.begin(), prefetched.end());
+		return true;
+	}
+
 	long count = 0;
 
 	FILE *fp = fopen(filename.c_str(), "rb");
@@ -124,6 +140,8 @@ bool readFile(const std::string& filename, std::string& content)
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer)
 {
 	buffer.clear();
+	if (FileIO::take(filename, buffer))
+		return true;
 	FILE* fp = nullptr;
 	fp = fopen(filename.c_str(), "rb");
 	if (fp == nullptr)
@@ -137,6 +155,101 @@ bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer
 	return true;
 }
 
+long getFileTime(const std::string& filename)
+{
+	struct stat stbuffer;
+	if (stat(filename.c_str(), &stbuffer) != 0)
+		return 0;
+	return (long)stbuffer.st_mtime;
+}
+
+MappedFile::MappedFile()
+{
+	data = NULL;
+	size = 0;
+	file_handle = mapping_handle = NULL;
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+	//already in memory
+	if (FileIO::take(filename, buffer) && !buffer.empty())
+	{
+		data = &buffer[0];
+		size = buffer.size();
+		return true;
+	}
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		LARGE_INTEGER file_size;
+		GetFileSizeEx(file, &file_size);
+		HANDLE mapping = file_size.QuadPart ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+		void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+		if (view)
+		{
+			file_handle = file;
+			mapping_handle = mapping;
+			data = (const unsigned char*)view;
+			size = (size_t)file_size.QuadPart;
+			return true;
+		}
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+	}
+#else
+	int fd = ::open(filename, O_RDONLY);
+	if (fd != -1)
+	{
+		struct stat stbuffer;
+		void* view = MAP_FAILED;
+		if (fstat(fd, &stbuffer) == 0 && stbuffer.st_size)
+			view = mmap(NULL, stbuffer.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd); //the mapping keeps the file alive
+		if (view != MAP_FAILED)
+		{
+			mapping_handle = view;
+			data = (const unsigned char*)view;
+			size = (size_t)stbuffer.st_size;
+			return true;
+		}
+	}
+#endif
+	//fallback, read it
+	if (!readFileBin(filename, buffer) || buffer.empty())
+		return false;
+	data = &buffer[0];
+	size = buffer.size();
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifdef WIN32
+	if (mapping_handle)
+	{
+		UnmapViewOfFile(data);
+		CloseHandle(mapping_handle);
+		CloseHandle(file_handle);
+	}
+#else
+	if (mapping_handle)
+		munmap(mapping_handle, size);
+#endif
+	std::vector<unsigned char>().swap(buffer);
+	data = NULL;
+	size = 0;
+	file_handle = mapping_handle = NULL;
+}
+
 bool checkGLErrors()
 {
 	#ifndef _DEBUG
@@ -158,6 +271,11 @@ bool checkGLErrors()
 	return true;
 }
 
+void parallelFor(int count, const std::function<void(int)>& func, int num_threads)
+{
+	JobSystem::parallelFor(count, func, 1, num_threads);
+}
+
 void stdlog(std::string str)
 {
 	std::cout << str << std::endl;
@@ -308,8 +426,12 @@ std::string getGPUStats()
 	}
 
 	std::string str = "FPS: " + std::to_string(Application::instance->fps) + " DCS: " + std::to_string(Mesh::num_meshes_rendered) + " Tris: " + std::to_string(long(Mesh::num_triangles_rendered * 0.001)) + "Ks  VRAM: " + std::to_string(int((nTotalMemoryInKB-nCurAvailMemoryInKB) * 0.001)) + "MBs / " + std::to_string(int(nTotalMemoryInKB * 0.001)) + "MBs";
+	if (Mesh::num_clusters_tested)
+		str += " Clusters culled: " + std::to_string(Mesh::num_clusters_culled) + "/" + std::to_string(Mesh::num_clusters_tested);
 	Mesh::num_meshes_rendered = 0;
 	Mesh::num_triangles_rendered = 0;
+	Mesh::num_clusters_tested = 0;
+	Mesh::num_clusters_culled = 0;
 	return str;
 }
 
@@ -7,6 +7,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <functional>
 #include "extra/cJSON.h"
 
 
@@ -18,6 +19,29 @@ long getTime();
 float * snapshot();
 bool readFile(const std::string& filename, std::string& content);
 bool readFileBin(const std::string& filename, std::vector<unsigned char>& buffer);
+long getFileTime(const std::string& filename); //last modification, 0 if it doesnt exist
+
+//read only view of a whole file, mapped in memory when the platform allows it (otherwise it is read)
+class MappedFile
+{
+public:
+	const unsigned char* data;
+	size_t size;
+
+	MappedFile();
+	~MappedFile();
+
+	bool open(const char* filename);
+	void close();
+
+private:
+	void* file_handle;
+	void* mapping_handle;
+	std::vector<unsigned char> buffer; //when mapping is not possible
+};
+
+//calls func(i) for every i in [0,count) in the job workers (0 = all of them), returns once all are done (see jobs.h)
+void parallelFor(int count, const std::function<void(int)>& func, int num_threads = 0);
 
 //generic purposes fuctions
 void drawGrid();